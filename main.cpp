@@ -4,8 +4,11 @@
 
 int main() {
 
-    // 键值中的key用int型，如果用其他类型，需要自定义比较函数
-    // 而且如果修改key的类型，同时需要修改skipList.load_file函数
+    // 键值中的key用int型，如果用其他类型，通过模板参数Compare指定比较函数，
+    // Serializer指定key和value的序列化方式（见skiplist/codec.h）
+    // 跳表本身不做任何输出，错误信息交给日志钩子（见skiplist/logging.h）
+    set_log_sink(stderr_log_sink);
+
     SkipList<int, std::string> skipList(6);
 	skipList.load_file(); 
 
@@ -15,14 +18,16 @@ int main() {
 
     // skipList.load_file();
 
-    skipList.search_element(9);
-    skipList.search_element(18);
+    std::cout << "search 9: " << (skipList.search_element(9) ? "found" : "not found") << std::endl;
+    std::cout << "search 18: " << (skipList.search_element(18) ? "found" : "not found") << std::endl;
 
 
     skipList.display_list();
 
-    skipList.delete_element(3);
-    skipList.delete_element(7);
+    if (skipList.delete_element(3) == 0)
+        std::cout << "deleted 3" << std::endl;
+    if (skipList.delete_element(7) == 0)
+        std::cout << "deleted 7" << std::endl;
 
     std::cout << "skipList size:" << skipList.size() << std::endl;
 
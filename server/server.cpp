@@ -0,0 +1,187 @@
+/*
+ * @file        : server.cpp
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : The network server, a tSkipList, a ShardedStore or an LsmStore served over RESP,
+ *                see skiplist/server.h. It runs until SIGINT or SIGTERM.
+ *
+ *                make server
+ *                ./bin/server --port=6379 --threads=4 --shards=8
+ *                redis-benchmark -p 6379 -t get,set -P 16 -c 50 -n 1000000
+ *
+ *                A single list replicates, see skiplist/replication.h, the primary needs a log:
+ *
+ *                ./bin/server --wal=store/wal --replicate-port=7379
+ *                ./bin/server --port=6380 --replica-of=127.0.0.1:7379
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <pthread.h>
+#include "../skiplist/lsm.h"
+#include "../skiplist/replication.h"
+#include "../skiplist/shardedstore.h"
+#include "../skiplist/server.h"
+#include "../skiplist/tskiplist.h"
+
+/**
+ * @struct Options
+ * @brief The command line.
+ */
+struct Options {
+    std::string bind;
+    int port;
+    int threads;
+    size_t shards;
+    size_t budget;
+    int max_level;
+    std::string wal;
+    std::string lsm;
+    Compression compression;
+    int replicate_port;
+    std::string replica_of;
+
+    Options() : bind("127.0.0.1"), port(6379), threads(0), shards(0), budget(0), max_level(16),
+                compression(Compression::None), replicate_port(0) {}
+};
+
+typedef tSkipList<std::string, std::string> List;
+
+/**
+ * @brief Only a single list replicates, its log has the one sequence of changes.
+ */
+template <typename Store>
+static bool start_replication(Store&, const Options& opt, std::shared_ptr<void>&) {
+    if (opt.replicate_port == 0 && opt.replica_of.empty())
+        return true;
+    fprintf(stderr, "replication needs a single list, without --shards and --lsm\n");
+    return false;
+}
+
+/**
+ * @brief To start the ReplicationServer or the Replica the options ask for, kept in role.
+ */
+static bool start_replication(List& list, const Options& opt, std::shared_ptr<void>& role) {
+    if (opt.replicate_port != 0) {
+        std::shared_ptr<ReplicationServer<List> > primary(
+            new ReplicationServer<List>(list, opt.replicate_port, opt.bind));
+        role = primary;
+        return primary->start();
+    }
+    if (!opt.replica_of.empty()) {
+        std::string::size_type colon = opt.replica_of.rfind(':');
+        int port = colon == std::string::npos ? 0 : atoi(opt.replica_of.c_str() + colon + 1);
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "replica-of must be host:port\n");
+            return false;
+        }
+        std::shared_ptr<Replica<List> > replica(new Replica<List>(list, opt.replica_of.substr(0, colon), port));
+        role = replica;
+        replica->start();
+    }
+    return true;
+}
+
+/**
+ * @brief To serve store until SIGINT or SIGTERM, the signals must be blocked already.
+ */
+template <typename Store>
+static int serve(Store& store, const Options& opt, sigset_t& signals) {
+    if (opt.budget != 0)
+        store.set_memory_budget(opt.budget);
+    store.set_compression(opt.compression);
+    if (!opt.wal.empty() && !store.open_wal(opt.wal, SyncPolicy::Interval))
+        return 1;
+    store.start_expiry();
+
+    // the replication stops after the server, the store outlives both
+    std::shared_ptr<void> replication;
+    if (!start_replication(store, opt, replication))
+        return 1;
+    Server<Store> server(store, opt.port, opt.threads, opt.bind);
+    server.set_read_only(!opt.replica_of.empty());
+    if (!server.start())
+        return 1;
+    fprintf(stderr, "server: listening on %s:%d\n", opt.bind.c_str(), opt.port);
+    int sig = 0;
+    sigwait(&signals, &sig);
+    fprintf(stderr, "server: signal %d, shutting down\n", sig);
+    server.stop();
+    server.wait();
+    store.stop_expiry();
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string::size_type eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--bind")
+            opt.bind = val;
+        else if (name == "--port")
+            opt.port = atoi(val.c_str());
+        else if (name == "--threads")
+            opt.threads = atoi(val.c_str());
+        else if (name == "--shards")
+            opt.shards = strtoull(val.c_str(), nullptr, 10);
+        else if (name == "--budget")
+            opt.budget = strtoull(val.c_str(), nullptr, 10);
+        else if (name == "--max-level")
+            opt.max_level = atoi(val.c_str());
+        else if (name == "--wal")
+            opt.wal = val;
+        else if (name == "--lsm")
+            opt.lsm = val;
+        else if (name == "--compress" && (val == "lz4" || val == "none"))
+            opt.compression = val == "lz4" ? Compression::Lz4 : Compression::None;
+        else if (name == "--replicate-port")
+            opt.replicate_port = atoi(val.c_str());
+        else if (name == "--replica-of")
+            opt.replica_of = val;
+        else {
+            fprintf(stderr, "usage: %s [--bind=127.0.0.1] [--port=6379] [--threads=N] [--shards=N]\n"
+                            "       [--budget=bytes] [--max-level=16] [--wal=path] [--lsm=dir] [--compress=none|lz4]\n"
+                            "       [--replicate-port=port] [--replica-of=host:port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.port <= 0 || opt.port > 65535 || opt.max_level <= 0 || opt.max_level > kSnapshotMaxLevel
+        || opt.replicate_port < 0 || opt.replicate_port > 65535) {
+        fprintf(stderr, "ports must be 1 to 65535 and max-level 1 to %d\n", kSnapshotMaxLevel);
+        return 1;
+    }
+    if (opt.replicate_port != 0 && (opt.wal.empty() || !opt.replica_of.empty())) {
+        fprintf(stderr, "replicate-port needs --wal and can not be combined with --replica-of\n");
+        return 1;
+    }
+    set_log_sink(stderr_log_sink);
+
+    // the signals go to sigwait, no event loop thread is interrupted by them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    // --lsm keeps the data in the runs of dir, --budget is then the size of a memtable
+    if (!opt.lsm.empty()) {
+        LsmStore<std::string, std::string> store(opt.lsm, opt.max_level);
+        if (!store.open())
+            return 1;
+        return serve(store, opt, signals);
+    }
+    // --shards=0 serves one tSkipList, more spread the keys over that many
+    if (opt.shards == 0) {
+        tSkipList<std::string, std::string> list(opt.max_level);
+        return serve(list, opt, signals);
+    }
+    ShardedStore<std::string, std::string> store(opt.max_level, opt.shards);
+    return serve(store, opt, signals);
+}
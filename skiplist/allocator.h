@@ -0,0 +1,206 @@
+/*
+ * @file        : allocator.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the node allocators of the skip lists. A node and its
+ *                forward array are one allocation whose size only depends on the tower height,
+ *                so NodeArena keeps one slab size class per level and frees all slabs at once.
+ */
+
+#ifndef SKIP_LIST_ALLOCATOR_H
+#define SKIP_LIST_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+
+/**
+ * @struct HeapBytes
+ * @brief The bytes a key or value owns outside its node, for the memory budget of tSkipList.
+ * Types that own memory other than std::string specialize it, a Slice owns none.
+ */
+template <typename T, typename Enable = void>
+struct HeapBytes {
+    static size_t of(const T&) { return 0; }
+};
+
+template <>
+struct HeapBytes<std::string> {
+    static size_t of(const std::string& s) {
+        // a short string is stored inside the object
+        const char* p = s.data();
+        const char* self = reinterpret_cast<const char*>(&s);
+        if (p >= self && p < self + sizeof(s))
+            return 0;
+        return s.capacity() + 1;
+    }
+};
+
+/**
+ * @struct NullMutex
+ * @brief A mutex that does nothing, for allocators only used by a single thread.
+ */
+struct NullMutex {
+    void lock() {}
+    void unlock() {}
+};
+
+/**
+ * @class HeapAllocator
+ * @brief The HeapAllocator class hands every node to the global operator new.
+ */
+class HeapAllocator {
+public:
+    // nodes must be deallocated one by one
+    static const bool kBulkRelease = false;
+
+    explicit HeapAllocator(int) {}
+
+    void* allocate(int, size_t bytes) { return ::operator new(bytes); }
+
+    void deallocate(void* p, int, size_t) { ::operator delete(p); }
+
+    size_t allocated_bytes() const { return 0; }
+};
+
+/**
+ * @class NodeArena
+ * @brief The NodeArena class is a slab allocator with one size class per tower height.
+ * Freed nodes go to the free list of their class, slabs are only returned on destruction.
+ * Mutex guards each size class, use std::mutex if several threads allocate.
+ */
+template <typename Mutex = NullMutex>
+class NodeArena {
+public:
+    // destroying the arena frees every node it ever handed out
+    static const bool kBulkRelease = true;
+
+    /**
+     * @brief Constructor for NodeArena.
+     * @param max_level The highest tower height that will be allocated.
+     * @param slab_size Upper bound of the bytes taken from the heap at once by a size class.
+     */
+    explicit NodeArena(int max_level, size_t slab_size = 64 * 1024);
+
+    /**
+     * @brief Deconstructor for NodeArena.
+     * To free every slab at once.
+     */
+    ~NodeArena();
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    /**
+     * @brief To allocate a node of the given level, bytes must be the same for every call
+     * with this level.
+     */
+    void* allocate(int level, size_t bytes);
+
+    /**
+     * @brief To return a node to the free list of its level.
+     */
+    void deallocate(void* p, int level, size_t bytes);
+
+    /**
+     * @return The bytes taken from the heap so far.
+     */
+    size_t allocated_bytes() const;
+
+private:
+    struct FreeChunk {
+        FreeChunk* next;
+    };
+
+    struct SizeClass {
+        Mutex mtx;
+        FreeChunk* free_list;
+        char* cursor;
+        char* limit;
+        size_t next_slab;
+        std::vector<char*> slabs;
+        size_t bytes;
+
+        SizeClass() : free_list(nullptr), cursor(nullptr), limit(nullptr), next_slab(0), bytes(0) {}
+    };
+
+    static size_t round_up(size_t bytes) {
+        const size_t align = alignof(std::max_align_t);
+        return (bytes + align - 1) / align * align;
+    }
+
+    const int _classes;
+    const size_t _slab_size;
+    std::unique_ptr<SizeClass[]> _size_classes;
+};
+
+
+template <typename Mutex>
+NodeArena<Mutex>::NodeArena(int max_level, size_t slab_size)
+    : _classes(max_level + 1), _slab_size(slab_size), _size_classes(new SizeClass[max_level + 1]) {
+}
+
+template <typename Mutex>
+NodeArena<Mutex>::~NodeArena() {
+    for (int i = 0; i < _classes; ++i) {
+        for (char* slab : _size_classes[i].slabs)
+            ::operator delete(slab);
+    }
+}
+
+template <typename Mutex>
+void* NodeArena<Mutex>::allocate(int level, size_t bytes) {
+    SizeClass& sc = _size_classes[level];
+    size_t chunk = round_up(bytes < sizeof(FreeChunk) ? sizeof(FreeChunk) : bytes);
+
+    std::lock_guard<Mutex> lock(sc.mtx);
+    if (sc.free_list != nullptr) {
+        FreeChunk* p = sc.free_list;
+        sc.free_list = p->next;
+        return p;
+    }
+    if (sc.cursor == nullptr || sc.cursor + chunk > sc.limit) {
+        // tall towers are rare, so a class starts with a few chunks and doubles up to _slab_size
+        size_t slab = sc.next_slab == 0 ? chunk * 16 : sc.next_slab;
+        if (slab < chunk)
+            slab = chunk;
+        sc.next_slab = std::max(slab, std::min(slab * 2, _slab_size));
+
+        char* mem = static_cast<char*>(::operator new(slab));
+        sc.slabs.push_back(mem);
+        sc.bytes += slab;
+        sc.cursor = mem;
+        sc.limit = mem + slab;
+    }
+    void* p = sc.cursor;
+    sc.cursor += chunk;
+    return p;
+}
+
+template <typename Mutex>
+void NodeArena<Mutex>::deallocate(void* p, int level, size_t) {
+    SizeClass& sc = _size_classes[level];
+    std::lock_guard<Mutex> lock(sc.mtx);
+    FreeChunk* chunk = static_cast<FreeChunk*>(p);
+    chunk->next = sc.free_list;
+    sc.free_list = chunk;
+}
+
+template <typename Mutex>
+size_t NodeArena<Mutex>::allocated_bytes() const {
+    size_t total = 0;
+    for (int i = 0; i < _classes; ++i) {
+        std::lock_guard<Mutex> lock(_size_classes[i].mtx);
+        total += _size_classes[i].bytes;
+    }
+    return total;
+}
+
+
+#endif //SKIP_LIST_ALLOCATOR_H
@@ -0,0 +1,214 @@
+/*
+ * @file        : bloom.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the blocked Bloom filters of an LsmStore, which let a lookup
+ *                of an absent key skip a run or a memtable without searching it. A key sets k
+ *                bits in one 64 byte block chosen by its hash, so a probe is one cache line
+ *                whatever k is, at the cost of a slightly higher false positive rate than a
+ *                classic filter of the same size, about 1% at 10 bits per key.
+ *
+ *                filter : u32 probes | u32 block count | block...
+ *                block  : 64 bytes, bit b is bit b % 8 of byte b / 8
+ *
+ *                Keys are hashed from their encoded bytes, see Codec, so keys that are equal
+ *                under the Compare of the store must have the same encoding.
+ */
+
+#ifndef SKIP_LIST_BLOOM_H
+#define SKIP_LIST_BLOOM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+static const size_t kBloomBlockBytes = 64;
+
+/**
+ * @return The 64 bit hash of n bytes, a splitmix64 finalizer over 8 byte words.
+ */
+inline uint64_t hash_bytes(const char* p, size_t n) {
+    auto mix = [](uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    };
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(n);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = mix(h ^ word);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, n);
+    return mix(h ^ tail ^ (static_cast<uint64_t>(n) << 56));
+}
+
+/**
+ * @return The bits a key sets for bits_per_key bits of filter per key, k = ln 2 * bits.
+ */
+inline uint32_t bloom_probes(unsigned bits_per_key) {
+    uint32_t k = (bits_per_key * 69 + 50) / 100;
+    return k < 1 ? 1 : (k > 12 ? 12 : k);
+}
+
+/**
+ * @return The blocks of a filter of keys keys at bits_per_key, at least one.
+ */
+inline size_t bloom_blocks(size_t keys, unsigned bits_per_key) {
+    size_t bits = keys * bits_per_key;
+    size_t blocks = (bits + kBloomBlockBytes * 8 - 1) / (kBloomBlockBytes * 8);
+    return blocks == 0 ? 1 : blocks;
+}
+
+/**
+ * @brief To visit the bits of hash in its block, fn(bit) with 0 <= bit < 512 for every probe.
+ * The block comes from the high half of the hash, the bits from remixing the low half.
+ * @return The block of hash among blocks.
+ */
+template <typename Fn>
+inline size_t bloom_probe(uint64_t hash, size_t blocks, uint32_t probes, Fn fn) {
+    size_t block = static_cast<size_t>(((hash >> 32) * static_cast<uint64_t>(blocks)) >> 32);
+    uint32_t a = static_cast<uint32_t>(hash);
+    for (uint32_t i = 0; i < probes; ++i) {
+        fn(block, a >> 23);
+        a *= 0x9E3779B9u;
+    }
+    return block;
+}
+
+/**
+ * @brief To build the filter of hashes, the key count is known once the run is written.
+ */
+inline void build_bloom_filter(const std::vector<uint64_t>& hashes, unsigned bits_per_key, std::string& out) {
+    uint32_t probes = bloom_probes(bits_per_key);
+    size_t blocks = bloom_blocks(hashes.size(), bits_per_key);
+    size_t start = out.size();
+    char head[8];
+    for (int i = 0; i < 4; ++i) {
+        head[i] = static_cast<char>((probes >> (8 * i)) & 0xFF);
+        head[4 + i] = static_cast<char>((static_cast<uint32_t>(blocks) >> (8 * i)) & 0xFF);
+    }
+    out.append(head, 8);
+    out.append(blocks * kBloomBlockBytes, '\0');
+    char* bits = &out[start + 8];
+    for (uint64_t hash : hashes) {
+        bloom_probe(hash, blocks, probes, [bits](size_t block, uint32_t bit) {
+            bits[block * kBloomBlockBytes + bit / 8] |= static_cast<char>(1 << (bit % 8));
+        });
+    }
+}
+
+/**
+ * @class BloomFilter
+ * @brief The BloomFilter class is used to probe a filter in the bytes of a run.
+ */
+class BloomFilter {
+public:
+    BloomFilter() : _bits(nullptr), _blocks(0), _probes(0) {}
+
+    /**
+     * @brief To use the n bytes at p as a filter, they must outlive it.
+     * @return False if they are not one.
+     */
+    bool init(const char* p, size_t n) {
+        if (n < 8)
+            return false;
+        const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+        uint32_t probes = static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8)
+                        | (static_cast<uint32_t>(u[2]) << 16) | (static_cast<uint32_t>(u[3]) << 24);
+        uint32_t blocks = static_cast<uint32_t>(u[4]) | (static_cast<uint32_t>(u[5]) << 8)
+                        | (static_cast<uint32_t>(u[6]) << 16) | (static_cast<uint32_t>(u[7]) << 24);
+        if (probes == 0 || probes > 32 || blocks == 0 || n - 8 != static_cast<size_t>(blocks) * kBloomBlockBytes)
+            return false;
+        _bits = reinterpret_cast<const unsigned char*>(p + 8);
+        _blocks = blocks;
+        _probes = probes;
+        return true;
+    }
+
+    /**
+     * @return True if there is no filter, every key may be there.
+     */
+    bool empty() const { return _bits == nullptr; }
+
+    /**
+     * @return False if the key of hash is certainly not in the run.
+     */
+    bool may_contain(uint64_t hash) const {
+        if (_bits == nullptr)
+            return true;
+        bool all = true;
+        const unsigned char* bits = _bits;
+        bloom_probe(hash, _blocks, _probes, [bits, &all](size_t block, uint32_t bit) {
+            all = all && (bits[block * kBloomBlockBytes + bit / 8] & (1u << (bit % 8))) != 0;
+        });
+        return all;
+    }
+
+private:
+    const unsigned char* _bits;
+    size_t _blocks;
+    uint32_t _probes;
+};
+
+/**
+ * @class AtomicBloomFilter
+ * @brief The AtomicBloomFilter class is used as the filter of a memtable, which writers add
+ * to while readers probe it. Bits are only ever set, with relaxed fetch_or: a reader that
+ * comes after a write, through whatever makes it come after, sees its bits. Keys beyond the
+ * expected ones only raise the false positive rate.
+ */
+class AtomicBloomFilter {
+public:
+    AtomicBloomFilter(size_t expected_keys, unsigned bits_per_key)
+        : _blocks(bloom_blocks(expected_keys, bits_per_key)), _probes(bloom_probes(bits_per_key)),
+          _words(new std::atomic<uint64_t>[_blocks * kWordsPerBlock]) {
+        for (size_t i = 0; i < _blocks * kWordsPerBlock; ++i)
+            _words[i].store(0, std::memory_order_relaxed);
+    }
+
+    AtomicBloomFilter(const AtomicBloomFilter&) = delete;
+    AtomicBloomFilter& operator=(const AtomicBloomFilter&) = delete;
+
+    void add(uint64_t hash) {
+        std::atomic<uint64_t>* words = _words.get();
+        bloom_probe(hash, _blocks, _probes, [words](size_t block, uint32_t bit) {
+            std::atomic<uint64_t>& word = words[block * kWordsPerBlock + bit / 64];
+            uint64_t mask = 1ull << (bit % 64);
+            // most bits of a busy filter are set already, a load is cheaper than the fetch_or
+            if ((word.load(std::memory_order_relaxed) & mask) == 0)
+                word.fetch_or(mask, std::memory_order_relaxed);
+        });
+    }
+
+    bool may_contain(uint64_t hash) const {
+        bool all = true;
+        const std::atomic<uint64_t>* words = _words.get();
+        bloom_probe(hash, _blocks, _probes, [words, &all](size_t block, uint32_t bit) {
+            all = all && (words[block * kWordsPerBlock + bit / 64].load(std::memory_order_relaxed) & (1ull << (bit % 64))) != 0;
+        });
+        return all;
+    }
+
+    /**
+     * @return The bytes of the filter.
+     */
+    size_t bytes() const { return _blocks * kBloomBlockBytes; }
+
+private:
+    static const size_t kWordsPerBlock = kBloomBlockBytes / 8;
+
+    const size_t _blocks;
+    const uint32_t _probes;
+    std::unique_ptr<std::atomic<uint64_t>[]> _words;
+};
+
+
+#endif //SKIP_LIST_BLOOM_H
@@ -0,0 +1,187 @@
+/*
+ * @file        : codec.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the Codec template, which turns keys and values into the
+ *                bytes stored by the binary snapshot format and back. Arithmetic types are
+ *                stored as their host (little endian) representation, strings as raw bytes.
+ *                A Slice decodes to a reference into the input instead of a copy.
+ *
+ *                The lists take a serializer policy such as RecordCodec, which names the codec
+ *                of the keys and the one of the values, so other types only need their Codec.
+ */
+
+#ifndef SKIP_LIST_CODEC_H
+#define SKIP_LIST_CODEC_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include "slice.h"
+
+
+/**
+ * @struct Codec
+ * @brief Serializer of T. Specialize it to store other types in a snapshot.
+ * encode appends the bytes of a value to out, decode rebuilds a value from exactly n bytes
+ * and returns false if they are not a valid encoding. kZeroCopy is set if the decoded value
+ * still points into the input bytes.
+ */
+template <typename T, typename Enable = void>
+struct Codec;
+
+template <typename T>
+struct Codec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    static const bool kZeroCopy = false;
+
+    static void encode(const T& v, std::string& out) {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    static bool decode(const char* p, size_t n, T& out) {
+        if (n != sizeof(T))
+            return false;
+        memcpy(&out, p, sizeof(T));
+        return true;
+    }
+};
+
+template <>
+struct Codec<std::string> {
+    static const bool kZeroCopy = false;
+
+    static void encode(const std::string& v, std::string& out) {
+        out.append(v);
+    }
+
+    static bool decode(const char* p, size_t n, std::string& out) {
+        out.assign(p, n);
+        return true;
+    }
+};
+
+template <>
+struct Codec<Slice> {
+    static const bool kZeroCopy = true;
+
+    static void encode(const Slice& v, std::string& out) {
+        out.append(v.data(), v.size());
+    }
+
+    static bool decode(const char* p, size_t n, Slice& out) {
+        out = Slice(p, n);
+        return true;
+    }
+};
+
+/**
+ * @struct RecordCodec
+ * @brief The default serializer policy of the lists, Codec of the key and of the value type.
+ * A policy only needs the Key and Value members, e.g. a composite key brings its own codec:
+ * struct PointCodecs { typedef PointCodec Key; typedef Codec<std::string> Value; };
+ */
+template <typename K, typename V>
+struct RecordCodec {
+    typedef Codec<K> Key;
+    typedef Codec<V> Value;
+};
+
+namespace codec_detail {
+
+template <typename T>
+auto read(std::istream& in, T& out, int) -> decltype(in >> out, bool()) {
+    return static_cast<bool>(in >> out) && (in >> std::ws).eof();
+}
+
+template <typename T>
+bool read(std::istream&, T&, long) {
+    return false;
+}
+
+template <typename T>
+auto write(std::ostream& os, const T& v, int) -> decltype(os << v, void()) {
+    os << v;
+}
+
+template <typename T>
+void write(std::ostream& os, const T&, long) {
+    os << "<" << sizeof(T) << " bytes>";
+}
+
+} // namespace codec_detail
+
+/**
+ * @brief To parse a key or value of the old key:value text format.
+ * Integers and floating point numbers are parsed in place, other types with operator>>, a
+ * type without it has no text format.
+ * @return False if text is not a complete value of T.
+ */
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value, bool>::type
+parse_text(const std::string& text, T& out) {
+    std::istringstream in(text);
+    return codec_detail::read(in, out, 0);
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value, bool>::type
+parse_text(const std::string& text, T& out) {
+    char* end = NULL;
+    errno = 0;
+    if (std::is_signed<T>::value) {
+        long long v = strtoll(text.c_str(), &end, 10);
+        out = static_cast<T>(v);
+        if (static_cast<long long>(out) != v)
+            return false;
+    } else {
+        unsigned long long v = strtoull(text.c_str(), &end, 10);
+        out = static_cast<T>(v);
+        if (static_cast<unsigned long long>(out) != v)
+            return false;
+    }
+    return errno == 0 && end != text.c_str() && *end == '\0';
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+parse_text(const std::string& text, T& out) {
+    char* end = NULL;
+    out = static_cast<T>(strtold(text.c_str(), &end));
+    return end != text.c_str() && *end == '\0';
+}
+
+inline bool parse_text(const std::string& text, std::string& out) {
+    out = text;
+    return true;
+}
+
+/**
+ * @struct Printable
+ * @brief To print keys and values in the messages of the lists, types without operator<<
+ * are printed as their size.
+ */
+template <typename T>
+struct Printable {
+    const T& value;
+};
+
+template <typename T>
+Printable<T> printable(const T& value) {
+    return Printable<T>{value};
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const Printable<T>& p) {
+    codec_detail::write(os, p.value, 0);
+    return os;
+}
+
+
+#endif //SKIP_LIST_CODEC_H
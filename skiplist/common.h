@@ -0,0 +1,50 @@
+/*
+ * @file        : common.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the definitions shared by every skip list engine, such as
+ *                the default store and log files and the text format delimiter.
+ */
+
+#ifndef SKIP_LIST_COMMON_H
+#define SKIP_LIST_COMMON_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define STORE_FILE "store/dumpFile"
+#define WAL_FILE "store/wal"
+
+static const std::string delimiter = ":";
+
+/**
+ * @return Milliseconds since the Unix epoch, the clock of the expiry of elements.
+ * It is the wall clock, so an expiry still means the same time after a restart.
+ */
+inline uint64_t wall_clock_ms() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * @brief To order a batch by key for the finger search of the batch calls.
+ * @param less The order of the keys of the list.
+ * @return The indexes of items sorted by key_of(item), equal keys keep their order.
+ */
+template <typename T, typename KeyOf, typename Less>
+std::vector<size_t> sorted_order(const std::vector<T>& items, KeyOf key_of, const Less& less) {
+    std::vector<size_t> order(items.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return less(key_of(items[a]), key_of(items[b]));
+    });
+    return order;
+}
+
+#endif //SKIP_LIST_COMMON_H
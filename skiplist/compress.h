@@ -0,0 +1,224 @@
+/*
+ * @file        : compress.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the block compression of the snapshots and of the write-ahead
+ *                log, see snapshot.h and wal.h. Blocks are compressed one by one, so every block
+ *                can be inflated on its own and in any order, by as many threads as there are.
+ *
+ *                Lz4 is the LZ4 block format: sequences of a token, literals and a match that
+ *                copies earlier output, without the frame around them.
+ *
+ *                sequence : u8 token | [literal length...] | literals | u16 offset | [match length...]
+ *
+ *                The high nibble of the token is the literal count, the low one the match length
+ *                minus 4, a nibble of 15 is continued by bytes that are added until one is not
+ *                255. The last sequence has literals only and ends the block, it holds at least
+ *                the last 5 bytes, and no match starts in the last 12 bytes.
+ */
+
+#ifndef SKIP_LIST_COMPRESS_H
+#define SKIP_LIST_COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief The compression of the blocks a writer produces.
+ * None: blocks are stored as they are.
+ * Lz4: blocks that shrink by at least an eighth are stored as LZ4 blocks.
+ */
+enum class Compression { None, Lz4 };
+
+static const size_t kLz4MinMatch = 4;
+static const size_t kLz4LastLiterals = 5;
+static const size_t kLz4MatchLimit = 12;
+static const int kLz4HashBits = 12;
+
+/**
+ * @return The most bytes lz4_compress writes for n bytes.
+ */
+inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+namespace lz4_detail {
+
+inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - kLz4HashBits);
+}
+
+/**
+ * @brief To write the continuation bytes of a length of 15 or more.
+ */
+inline unsigned char* put_length(unsigned char* op, size_t length) {
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = static_cast<unsigned char>(length);
+    return op;
+}
+
+/**
+ * @brief To read the continuation bytes of a nibble of 15 into length.
+ * @return False if the input ends first.
+ */
+inline bool get_length(const unsigned char*& ip, const unsigned char* end, size_t& length) {
+    unsigned char b;
+    do {
+        if (ip >= end)
+            return false;
+        b = *ip++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+} // namespace lz4_detail
+
+/**
+ * @brief To compress n bytes of src into dst, which holds lz4_bound(n) bytes.
+ * Matches are found greedily with a hash table of the last position of every 4 byte prefix.
+ * @return The bytes written to dst.
+ */
+inline size_t lz4_compress(const char* src, size_t n, char* dst) {
+    using namespace lz4_detail;
+    const unsigned char* const base = reinterpret_cast<const unsigned char*>(src);
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+    size_t anchor = 0;
+    if (n > kLz4MatchLimit) {
+        std::vector<uint32_t> table(static_cast<size_t>(1) << kLz4HashBits, 0);
+        const size_t match_start_limit = n - kLz4MatchLimit;
+        const size_t match_end_limit = n - kLz4LastLiterals;
+        size_t ip = 1;
+        table[hash(read32(base))] = 0;
+        while (ip <= match_start_limit) {
+            uint32_t h = hash(read32(base + ip));
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(ip);
+            if (ip - candidate > 65535 || read32(base + candidate) != read32(base + ip)) {
+                // skip faster through bytes that do not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            // a match may start in the literals before it
+            while (ip > anchor && candidate > 0 && base[ip - 1] == base[candidate - 1]) {
+                ip--;
+                candidate--;
+            }
+            size_t length = kLz4MinMatch;
+            while (ip + length < match_end_limit && base[ip + length] == base[candidate + length])
+                length++;
+
+            size_t literals = ip - anchor;
+            unsigned char* token = op++;
+            *token = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+            if (literals >= 15)
+                op = put_length(op, literals - 15);
+            memcpy(op, base + anchor, literals);
+            op += literals;
+            size_t offset = ip - candidate;
+            *op++ = static_cast<unsigned char>(offset & 0xFF);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            size_t extra = length - kLz4MinMatch;
+            *token |= static_cast<unsigned char>(extra < 15 ? extra : 15);
+            if (extra >= 15)
+                op = put_length(op, extra - 15);
+
+            ip += length;
+            anchor = ip;
+            // the positions inside the match are not hashed, the one before its end is
+            if (ip <= match_start_limit)
+                table[hash(read32(base + ip - 2))] = static_cast<uint32_t>(ip - 2);
+        }
+    }
+    size_t literals = n - anchor;
+    *op++ = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    memcpy(op, base + anchor, literals);
+    op += literals;
+    return static_cast<size_t>(op - reinterpret_cast<unsigned char*>(dst));
+}
+
+/**
+ * @brief To inflate the n bytes of an LZ4 block at src into the raw bytes at dst.
+ * Every length and offset is checked, damaged input fails instead of writing out of dst.
+ * @return False unless src inflates to exactly raw bytes.
+ */
+inline bool lz4_decompress(const char* src, size_t n, char* dst, size_t raw) {
+    using namespace lz4_detail;
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* const end = ip + n;
+    unsigned char* const out = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* op = out;
+    unsigned char* const out_end = out + raw;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(ip, end, literals))
+            return false;
+        if (literals > static_cast<size_t>(end - ip) || literals > static_cast<size_t>(out_end - op))
+            return false;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = static_cast<size_t>(ip[0]) | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - out))
+            return false;
+        size_t length = token & 15;
+        if (length == 15 && !get_length(ip, end, length))
+            return false;
+        length += kLz4MinMatch;
+        if (length > static_cast<size_t>(out_end - op))
+            return false;
+        const unsigned char* match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            // the match overlaps the bytes it writes, a run of a short pattern
+            for (size_t i = 0; i < length; ++i)
+                *op++ = match[i];
+        }
+    }
+    return op == out_end;
+}
+
+/**
+ * @brief To compress n bytes with compression and append them to out.
+ * @return False if nothing was appended: no compression or the bytes do not shrink by an
+ * eighth, they are better stored as they are.
+ */
+inline bool compress_block(Compression compression, const char* src, size_t n, std::string& out) {
+    if (compression != Compression::Lz4 || n == 0)
+        return false;
+    size_t start = out.size();
+    out.resize(start + lz4_bound(n));
+    size_t size = lz4_compress(src, n, &out[start]);
+    if (size > n - n / 8) {
+        out.resize(start);
+        return false;
+    }
+    out.resize(start + size);
+    return true;
+}
+
+
+#endif //SKIP_LIST_COMPRESS_H
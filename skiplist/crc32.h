@@ -0,0 +1,70 @@
+/*
+ * @file        : crc32.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the CRC-32C (Castagnoli) checksum used by the on-disk
+ *                formats. The SSE4.2 crc32 instruction is used when the build enables it,
+ *                otherwise a table driven implementation.
+ */
+
+#ifndef SKIP_LIST_CRC32_H
+#define SKIP_LIST_CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+
+/**
+ * @struct Crc32cTable
+ * @brief Lookup table of the reflected CRC-32C polynomial.
+ */
+struct Crc32cTable {
+    uint32_t entries[256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+            entries[i] = crc;
+        }
+    }
+};
+
+/**
+ * @brief To extend the checksum crc with n bytes of data.
+ * crc32c(0, data, n) is the checksum of data alone.
+ */
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    while (n >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        --n;
+    }
+#else
+    static const Crc32cTable table;
+    while (n > 0) {
+        crc = table.entries[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        --n;
+    }
+#endif
+    return ~crc;
+}
+
+
+#endif //SKIP_LIST_CRC32_H
@@ -0,0 +1,313 @@
+/*
+ * @file        : epoch.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the declaration of the EpochManager class, which implements
+ *                epoch based reclamation. Readers pin the current epoch without blocking, and
+ *                retired objects are only freed once every pinned thread has moved past the
+ *                epoch in which they were unlinked.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/**
+ * @class EpochManager
+ * @brief The EpochManager class is used to defer freeing of shared objects.
+ * Every thread owns a slot holding the epoch it has pinned (0 when idle) and a limbo list
+ * of retired objects. Pinning is one store and one fence, there is no read-modify-write.
+ */
+class EpochManager {
+public:
+    typedef void (*Deleter)(void* obj, void* ctx);
+
+    /**
+     * @class Guard
+     * @brief RAII pin of the current epoch. Guards may be nested in the same thread.
+     */
+    class Guard {
+    public:
+        explicit Guard(EpochManager& manager) : _manager(&manager) { _manager->enter(); }
+        Guard(Guard&& other) : _manager(other._manager) { other._manager = nullptr; }
+        ~Guard() {
+            if (_manager != nullptr)
+                _manager->leave();
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    private:
+        EpochManager* _manager;
+    };
+
+    /**
+     * @brief Constructor for EpochManager.
+     * To register the manager so exiting threads can hand back their slots.
+     */
+    EpochManager();
+
+    /**
+     * @brief Deconstructor for EpochManager.
+     * To free every object still waiting in a limbo list. No thread may be pinned.
+     */
+    ~EpochManager();
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    /**
+     * @brief To pin the current epoch for the lifetime of the returned guard.
+     */
+    Guard pin() { return Guard(*this); }
+
+    /**
+     * @brief To retire an object that is no longer reachable from the shared structure.
+     * fn(obj, ctx) is called once no pinned thread can still hold a reference to it.
+     */
+    void retire(void* obj, Deleter fn, void* ctx);
+
+private:
+    struct Retired {
+        void* obj;
+        Deleter fn;
+        void* ctx;
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Slot {
+        // pinned epoch, 0 if the owner thread is not inside a guard
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> in_use;
+        // only touched by the owner thread
+        int depth;
+        unsigned retire_count;
+        std::deque<Retired> limbo;
+
+        Slot() : epoch(0), in_use(false), depth(0), retire_count(0) {}
+    };
+
+    /**
+     * @brief Per thread bookkeeping, used to release the slots when the thread exits.
+     */
+    struct ThreadState {
+        struct CacheEntry {
+            uint64_t id;
+            Slot* slot;
+        };
+        static const int kCacheSize = 4;
+
+        CacheEntry cache[kCacheSize];
+        int next_victim;
+        std::vector<std::pair<uint64_t, Slot*> > owned;
+
+        ThreadState() : next_victim(0) {
+            for (int i = 0; i < kCacheSize; ++i)
+                cache[i] = CacheEntry{0, nullptr};
+        }
+        ~ThreadState();
+    };
+
+    static const int kMaxSlots = 256;
+    static const unsigned kCollectInterval = 64;
+
+    void enter();
+    void leave();
+    Slot* local_slot();
+    Slot* acquire_slot();
+    void release_slot(Slot*);
+    void try_advance();
+    void collect(std::deque<Retired>&, uint64_t);
+
+    static std::mutex& registry_mutex();
+    static std::unordered_map<uint64_t, EpochManager*>& registry();
+    static ThreadState& thread_state();
+
+    // unique, never reused manager id
+    const uint64_t _id;
+
+    // global epoch, starts at 1 since 0 marks an idle slot. Padded rather than aligned: an
+    // over-aligned member would make a heap allocated list misaligned before C++17
+    char _pad_before[64];
+    std::atomic<uint64_t> _global_epoch;
+    char _pad_after[64];
+
+    // kMaxSlots slots on their own cache lines, allocated aligned by the constructor
+    Slot* _slots;
+
+    // objects left behind by threads which exited before they could be freed
+    std::mutex _orphan_mutex;
+    std::deque<Retired> _orphans;
+};
+
+
+inline std::mutex& EpochManager::registry_mutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
+inline std::unordered_map<uint64_t, EpochManager*>& EpochManager::registry() {
+    static std::unordered_map<uint64_t, EpochManager*> managers;
+    return managers;
+}
+
+inline EpochManager::ThreadState& EpochManager::thread_state() {
+    static thread_local ThreadState state;
+    return state;
+}
+
+inline EpochManager::ThreadState::~ThreadState() {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    for (auto& entry : owned) {
+        auto it = registry().find(entry.first);
+        if (it != registry().end())
+            it->second->release_slot(entry.second);
+    }
+}
+
+inline uint64_t next_epoch_manager_id() {
+    static std::atomic<uint64_t> id(0);
+    return ++id;
+}
+
+inline EpochManager::EpochManager() : _id(next_epoch_manager_id()), _global_epoch(1) {
+    void* mem = nullptr;
+    if (posix_memalign(&mem, alignof(Slot), sizeof(Slot) * kMaxSlots) != 0)
+        throw std::bad_alloc();
+    _slots = static_cast<Slot*>(mem);
+    for (int i = 0; i < kMaxSlots; ++i)
+        new (&_slots[i]) Slot();
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry()[_id] = this;
+}
+
+inline EpochManager::~EpochManager() {
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().erase(_id);
+    }
+    for (int i = 0; i < kMaxSlots; ++i) {
+        for (auto& r : _slots[i].limbo)
+            r.fn(r.obj, r.ctx);
+        _slots[i].limbo.clear();
+    }
+    for (auto& r : _orphans)
+        r.fn(r.obj, r.ctx);
+    _orphans.clear();
+    for (int i = 0; i < kMaxSlots; ++i)
+        _slots[i].~Slot();
+    free(_slots);
+}
+
+inline void EpochManager::enter() {
+    Slot* slot = local_slot();
+    if (slot->depth++ == 0) {
+        slot->epoch.store(_global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        // the pin must be visible before any shared pointer is read
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+inline void EpochManager::leave() {
+    Slot* slot = local_slot();
+    if (--slot->depth == 0)
+        slot->epoch.store(0, std::memory_order_release);
+}
+
+inline void EpochManager::retire(void* obj, Deleter fn, void* ctx) {
+    Slot* slot = local_slot();
+    slot->limbo.push_back(Retired{obj, fn, ctx, _global_epoch.load(std::memory_order_acquire)});
+    if (++slot->retire_count % kCollectInterval == 0) {
+        try_advance();
+        collect(slot->limbo, _global_epoch.load(std::memory_order_acquire));
+    }
+}
+
+inline EpochManager::Slot* EpochManager::local_slot() {
+    ThreadState& state = thread_state();
+    for (int i = 0; i < ThreadState::kCacheSize; ++i) {
+        if (state.cache[i].id == _id)
+            return state.cache[i].slot;
+    }
+    Slot* slot = nullptr;
+    for (auto& entry : state.owned) {
+        if (entry.first == _id) {
+            slot = entry.second;
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        slot = acquire_slot();
+        state.owned.emplace_back(_id, slot);
+    }
+    state.cache[state.next_victim] = ThreadState::CacheEntry{_id, slot};
+    state.next_victim = (state.next_victim + 1) % ThreadState::kCacheSize;
+    return slot;
+}
+
+inline EpochManager::Slot* EpochManager::acquire_slot() {
+    for (int i = 0; i < kMaxSlots; ++i) {
+        bool expected = false;
+        if (!_slots[i].in_use.load(std::memory_order_relaxed)
+            && _slots[i].in_use.compare_exchange_strong(expected, true)) {
+            return &_slots[i];
+        }
+    }
+    throw std::runtime_error("EpochManager: too many threads");
+}
+
+inline void EpochManager::release_slot(Slot* slot) {
+    {
+        std::lock_guard<std::mutex> lock(_orphan_mutex);
+        for (auto& r : slot->limbo)
+            _orphans.push_back(r);
+    }
+    slot->limbo.clear();
+    slot->depth = 0;
+    slot->retire_count = 0;
+    slot->epoch.store(0, std::memory_order_relaxed);
+    slot->in_use.store(false, std::memory_order_release);
+}
+
+inline void EpochManager::try_advance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = _global_epoch.load(std::memory_order_relaxed);
+    for (int i = 0; i < kMaxSlots; ++i) {
+        if (!_slots[i].in_use.load(std::memory_order_acquire))
+            continue;
+        uint64_t pinned = _slots[i].epoch.load(std::memory_order_acquire);
+        // a thread still pinned in an older epoch may hold references from it
+        if (pinned != 0 && pinned != epoch)
+            return;
+    }
+    _global_epoch.compare_exchange_strong(epoch, epoch + 1);
+
+    if (_orphan_mutex.try_lock()) {
+        collect(_orphans, _global_epoch.load(std::memory_order_acquire));
+        _orphan_mutex.unlock();
+    }
+}
+
+inline void EpochManager::collect(std::deque<Retired>& limbo, uint64_t epoch) {
+    // objects retired in epoch e are unreachable for every thread once the epoch is e + 2
+    while (!limbo.empty() && limbo.front().epoch + 2 <= epoch) {
+        Retired r = limbo.front();
+        limbo.pop_front();
+        r.fn(r.obj, r.ctx);
+    }
+}
+
+
+#endif //EPOCH_H
@@ -0,0 +1,953 @@
+/*
+ * @file        : fatskiplist.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the declaration of the FatSkipList class, a skip list
+ *                whose nodes hold a sorted run of up to kNodeKeys keys instead of one. The keys
+ *                of a node are one contiguous array and the values a second one, so a lookup
+ *                walks a short index and then searches a few cache lines of keys.
+ */
+
+#ifndef FAT_SKIP_LIST_H
+#define FAT_SKIP_LIST_H
+
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "allocator.h"
+#include "codec.h"
+#include "levels.h"
+#include "logging.h"
+#include "keysearch.h"
+#include "snapshot.h"
+
+/**
+ * @struct FatNode
+ * @brief The FatNode struct is used to manage the fat nodes of the skip list.
+ * One allocation holds the node, its forward array, the key array and the value array in
+ * this order. low is a copy of keys[0], the index compares against it without touching the
+ * key array.
+ */
+template<typename K, typename V>
+struct FatNode {
+    // keys of a node, about four cache lines of small keys
+    static const int kCapacity = sizeof(K) >= 32 ? 8 : static_cast<int>(256 / sizeof(K));
+
+    K low;
+    int count;
+    int node_level;
+    FatNode<K, V> **forward;
+    K *keys;
+    V *values;
+
+    /**
+     * @brief Constructor for FatNode.
+     * To initialze the data structures, the memory must hold size_of(level) bytes.
+     */
+    explicit FatNode(int level) : low(), count(0), node_level(level) {
+        char *p = reinterpret_cast<char*>(this + 1);
+        forward = reinterpret_cast<FatNode<K, V>**>(p);
+        for (int i = 0; i <= level; ++i)
+            forward[i] = NULL;
+        keys = reinterpret_cast<K*>(p + keys_offset(level));
+        values = reinterpret_cast<V*>(p + values_offset(level));
+        for (int i = 0; i < kCapacity; ++i) {
+            new (keys + i) K();
+            new (values + i) V();
+        }
+    }
+
+    ~FatNode() {
+        for (int i = 0; i < kCapacity; ++i) {
+            keys[i].~K();
+            values[i].~V();
+        }
+    }
+
+    /**
+     * @return The bytes of a node of the level together with its arrays.
+     */
+    static size_t size_of(int level) {
+        return sizeof(FatNode<K, V>) + values_offset(level) + sizeof(V) * kCapacity;
+    }
+
+private:
+    static size_t align_up(size_t bytes, size_t align) {
+        return (bytes + align - 1) / align * align;
+    }
+
+    static size_t keys_offset(int level) {
+        return align_up(sizeof(FatNode<K, V>*) * (level + 1), alignof(K));
+    }
+
+    static size_t values_offset(int level) {
+        return align_up(keys_offset(level) + sizeof(K) * kCapacity, alignof(V));
+    }
+};
+
+/**
+ * @class FatSkipList
+ * @brief The FatSkipList class is used to manage a skip list of fat nodes.
+ * Level 0 is the chain of nodes in key order and the levels above index them by low. A
+ * full node is split in two, except at the tail where appending keys start a new node, and
+ * an empty node is unlinked. It is not thread safe, like SkipList.
+ */
+template <typename K, typename V, typename Compare = std::less<K>,
+          typename Serializer = RecordCodec<K, V>, typename Alloc = NodeArena<> >
+class FatSkipList {
+    using SkipNode = FatNode<K, V>;
+    using KeyCodec = typename Serializer::Key;
+    using ValueCodec = typename Serializer::Value;
+public:
+    static const int kNodeKeys = SkipNode::kCapacity;
+
+    /**
+     * @brief Constructor for FatSkipList.
+     * To initialze the data structures.
+     * The highest level is capped at kSnapshotMaxLevel, the most a snapshot record holds.
+     * @param compare The order of the keys.
+     */
+    FatSkipList(int, const Compare& compare = Compare());
+
+    /**
+     * @brief Deconstructor for FatSkipList.
+     * To free every node.
+     */
+    ~FatSkipList();
+
+    /**
+     * @return The number of elements in the skip list.
+     */
+    int size();
+
+    /**
+     * @brief To choose the levels of the nodes created from now on, see levels.h.
+     * The nodes already in the list keep their levels.
+     * @param branching 1/p, a node reaches the next level with probability 1/branching.
+     * @param expected_elements To cap the levels for about this many keys, 0 for max_level.
+     */
+    void set_level_distribution(unsigned branching, size_t expected_elements = 0);
+
+    /**
+     * @brief To insert an element, the value is copied into the node.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, const V&);
+
+    /**
+     * @brief To insert an element, the value is moved into the node.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, V&&);
+
+    /**
+     * @brief To insert an element whose value is made from args and moved into its slot.
+     * @return 0 if succeeds, 1 if key exists, args are then left untouched.
+     */
+    template <typename... Args>
+    int emplace(const K& key, Args&&... args);
+
+    /**
+     * @brief To insert an element, or to assign value to the element of key if it exists.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int insert_or_assign(const K& key, M&& value);
+
+    /**
+     * @brief To change the value of key in place, read-modify-write without a delete and an
+     * insert. fn is called with a V& and must not call into the list.
+     * @return True if found, False if not found.
+     */
+    template <typename Fn>
+    bool update(const K& key, Fn fn);
+
+    /**
+     * @brief To display the skip list node by node.
+     */
+    void display_list();
+
+    /**
+     * @brief To search element by its key.
+     * @return True if found, False if not found.
+     */
+    bool search_element(const K&);
+
+    /**
+     * @brief To search element by its key.
+     * @param value_out Set to the value if found.
+     * @return True if found, False if not found.
+     */
+    bool search_element(const K&, V&);
+
+    /**
+     * @brief To delete element by its key.
+     * If not found, do nothing.
+     * @return 0 if succeeds, 1 if not found.
+     */
+    int delete_element(const K&);
+
+    /**
+     * @brief To search a batch of keys.
+     * The keys are visited in sorted order and every search starts from the path of the
+     * previous key, so keys that share a node only pay for the search within it.
+     * @param values Resized to the number of keys, values[i] is set if found[i].
+     * @return The number of keys found.
+     */
+    int multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found);
+
+    /**
+     * @brief To insert a batch of elements, searched like multi_get.
+     * @return The number of inserted elements, keys that exist are skipped.
+     */
+    int multi_insert(const std::vector<std::pair<K, V> >& elements);
+
+    /**
+     * @brief To delete a batch of keys, searched like multi_get.
+     * @return The number of deleted elements.
+     */
+    int multi_delete(const std::vector<K>& keys);
+
+    /**
+     * @brief To insert a range of key-value pairs sorted by key.
+     * An empty list is built by filling nodes to three quarters, which leaves room for later
+     * inserts, a list with elements gets a multi_insert.
+     * @return The number of inserted elements.
+     */
+    template <typename InputIt>
+    int bulk_load(InputIt first, InputIt last);
+
+    /**
+     * @class Iterator
+     * @brief The Iterator class is used to walk the elements in key order.
+     * It points into the list, any insert or delete invalidates it.
+     */
+    class Iterator {
+    public:
+        explicit Iterator(FatSkipList* list) : _list(list), _node(NULL), _pos(0) {}
+
+        /**
+         * @return True if the iterator is on an element.
+         */
+        bool valid() const { return _node != NULL; }
+
+        const K& key() const { return _node->keys[_pos]; }
+        const V& value() const { return _node->values[_pos]; }
+
+        /**
+         * @brief To move to the first element.
+         */
+        void seek_to_first();
+
+        /**
+         * @brief To move to the first element whose key is not less than key.
+         */
+        void seek(const K& key);
+
+        /**
+         * @brief To move to the next element, the iterator must be valid.
+         */
+        void next();
+
+    private:
+        FatSkipList* _list;
+        SkipNode* _node;
+        int _pos;
+    };
+
+    /**
+     * @return An iterator that is not on any element yet, seek it first.
+     */
+    Iterator new_iterator();
+
+    /**
+     * @brief To collect the elements with lo <= key < hi in key order.
+     * @param limit Maximum number of elements, 0 for no limit.
+     */
+    std::vector<std::pair<K, V> > range(const K& lo, const K& hi, size_t limit = 0);
+
+    /**
+     * @brief To dump the skip list to the file as a binary snapshot, see snapshot.h.
+     * The records get tower heights as SkipList would draw them, so the snapshot loads into
+     * every engine.
+     * @return True if the snapshot was completely written.
+     */
+    bool dump_file(const std::string& path = STORE_FILE);
+
+    /**
+     * @brief To load the skip list from a binary snapshot, see SkipList::load_file.
+     * @return True if the whole file was loaded.
+     */
+    bool load_file(const std::string& path = STORE_FILE, bool use_mmap = false);
+
+private:
+    /**
+     * @brief To order keys by Compare, equal keys are the ones neither is less than.
+     */
+    bool less(const K& a, const K& b) const { return _compare(a, b); }
+    bool equal(const K& a, const K& b) const { return !_compare(a, b) && !_compare(b, a); }
+
+    /**
+     * @brief To allocate and construct an empty node.
+     */
+    SkipNode* create_node(int);
+
+    /**
+     * @brief To destroy a node and give its memory back to the allocator.
+     */
+    void destroy_node(SkipNode *);
+
+    /**
+     * @brief To fill update[i] with the last node whose low is less than key on every level i.
+     */
+    void find_path(const K& key, SkipNode** update);
+
+    /**
+     * @brief To move the path of a smaller key in update to the path of key, see
+     * SkipList::finger_path.
+     */
+    void finger_path(const K& key, SkipNode** update);
+
+    /**
+     * @return The node whose keys cover key, the first node if key is less than all keys,
+     * NULL if the list is empty.
+     */
+    SkipNode* find_node(const K& key);
+
+    /**
+     * @return The node that key belongs to after the path of find_path.
+     */
+    SkipNode* node_at(SkipNode** update, const K& key);
+
+    /**
+     * @return The index of the first of count keys that is not less than key, see keysearch.h.
+     */
+    int search_node(const K* keys, int count, const K& key) const;
+
+    /**
+     * @brief To insert an element after the path in update, or to assign its value if assign
+     * and key exists.
+     * @return 0 if inserted, 1 if key exists.
+     */
+    template <typename... Args>
+    int insert_at(SkipNode** update, const K& key, bool assign, Args&&... args);
+
+    /**
+     * @brief To delete key after the path in update.
+     * @return True if key was found.
+     */
+    bool delete_at(SkipNode** update, const K& key);
+
+    /**
+     * @brief To insert key at pos of node, the node must not be full.
+     */
+    template <typename T>
+    static void insert_into(SkipNode* node, int pos, const K& key, T&& value);
+
+    /**
+     * @brief To split a full node, the new node is linked after it.
+     * @param update The path of find_path for a key of the node.
+     * @param append To start the new node empty, for keys arriving in increasing order.
+     * @return The new node.
+     */
+    SkipNode* split(SkipNode** update, SkipNode* node, bool append);
+
+    /**
+     * @brief To link a node after the path of its low.
+     * @param prev The node it follows at level 0, above its level the path in update.
+     */
+    void link(SkipNode** update, SkipNode* prev, SkipNode* node);
+
+    /**
+     * @brief To append a node at the tail, tail[i] is the last node of level i.
+     */
+    void append_node(SkipNode** tail, SkipNode* node);
+
+    /**
+     * @brief To clear a node and the next nodes iteratively.
+     * Nothing is walked if the allocator frees all nodes at once and they need no destructor.
+     */
+    void clear(SkipNode *);
+
+    /**
+     * @return The level of a new node, from 0 to _max_level.
+     */
+    int get_random_level();
+
+    // Maximum level of the skip list
+    const int _max_level;
+
+    // order of the keys
+    Compare _compare;
+
+    // memory of the nodes
+    Alloc _allocator;
+
+    // levels of the new nodes
+    LevelGenerator _levels;
+
+    // current level of skip list
+    int _skip_list_level;
+
+    // pointer to header node, it holds no keys
+    SkipNode *_header;
+
+    // mapped snapshots that keys or values of the list point into
+    std::vector<std::unique_ptr<MappedFile> > _mappings;
+
+    // skiplist current element count
+    int _element_count;
+};
+
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+FatSkipList<K, V, Compare, Serializer, Alloc>::FatSkipList(int max_level, const Compare& compare) : _max_level(snapshot_max_level(max_level)), _compare(compare), _allocator(_max_level), _levels(_max_level), _skip_list_level(0), _element_count(0) {
+    this->_header = create_node(_max_level);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+FatSkipList<K, V, Compare, Serializer, Alloc>::~FatSkipList() {
+    clear(_header->forward[0]);
+    destroy_node(_header);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::size() {
+    return _element_count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::set_level_distribution(unsigned branching, size_t expected_elements) {
+    // the levels are drawn per node, and a node holds half to all of kNodeKeys keys
+    _levels.configure(branching, expected_elements * 2 / kNodeKeys);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, const V& value) {
+    return emplace(key, value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, V&& value) {
+    return emplace(key, std::move(value));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::emplace(const K& key, Args&&... args) {
+    SkipNode *update[_max_level+1];
+    find_path(key, update);
+    return insert_at(update, key, false, std::forward<Args>(args)...);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename M>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::insert_or_assign(const K& key, M&& value) {
+    SkipNode *update[_max_level+1];
+    find_path(key, update);
+    return insert_at(update, key, true, std::forward<M>(value));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename Fn>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::update(const K& key, Fn fn) {
+    SkipNode *node = find_node(key);
+    if (node == NULL)
+        return false;
+    int pos = search_node(node->keys, node->count, key);
+    if (pos < node->count && equal(node->keys[pos], key)) {
+        fn(node->values[pos]);
+        return true;
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::insert_at(SkipNode** update, const K& key, bool assign, Args&&... args) {
+    SkipNode *node = node_at(update, key);
+    if (node == NULL) {
+        node = create_node(get_random_level());
+        insert_into(node, 0, key, V(std::forward<Args>(args)...));
+        link(update, _header, node);
+        _element_count ++;
+        return 0;
+    }
+
+    int pos = search_node(node->keys, node->count, key);
+    if (pos < node->count && equal(node->keys[pos], key)) {
+        if (assign)
+            node->values[pos] = V(std::forward<Args>(args)...);
+        else
+            SKIPLIST_LOG(Debug, "key: " << printable(key) << ", exists");
+        return 1;
+    }
+
+    if (node->count == kNodeKeys) {
+        bool append = pos == kNodeKeys && node->forward[0] == NULL;
+        SkipNode *right = split(update, node, append);
+        if (append || pos > node->count) {
+            pos -= node->count;
+            node = right;
+        }
+    }
+    insert_into(node, pos, key, V(std::forward<Args>(args)...));
+    _element_count ++;
+    return 0;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename T>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::insert_into(SkipNode* node, int pos, const K& key, T&& value) {
+    std::move_backward(node->keys + pos, node->keys + node->count, node->keys + node->count + 1);
+    std::move_backward(node->values + pos, node->values + node->count, node->values + node->count + 1);
+    node->keys[pos] = key;
+    node->values[pos] = std::forward<T>(value);
+    node->count++;
+    if (pos == 0)
+        node->low = key;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename FatSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* FatSkipList<K, V, Compare, Serializer, Alloc>::split(SkipNode** update, SkipNode* node, bool append) {
+    SkipNode *right = create_node(get_random_level());
+    if (!append) {
+        // the upper half moves, the key to insert then goes to whichever half covers it
+        int half = node->count / 2;
+        std::move(node->keys + half, node->keys + node->count, right->keys);
+        std::move(node->values + half, node->values + node->count, right->values);
+        right->count = node->count - half;
+        right->low = right->keys[0];
+        node->count = half;
+    }
+    link(update, node, right);
+    return right;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::link(SkipNode** update, SkipNode* prev, SkipNode* node) {
+    if (node->node_level > _skip_list_level)
+        _skip_list_level = node->node_level;
+    for (int i = 0; i <= node->node_level; i++) {
+        SkipNode *before = i <= prev->node_level ? prev : update[i];
+        node->forward[i] = before->forward[i];
+        before->forward[i] = node;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::find_path(const K& key, SkipNode** update) {
+    SkipNode *current = this->_header;
+
+    for (int i = _max_level; i > _skip_list_level; i--) {
+        update[i] = _header;
+    }
+
+    for (int i = _skip_list_level; i >= 0; i--) {
+        while (current->forward[i] != NULL && less(current->forward[i]->low, key)) {
+            current = current->forward[i];
+        }
+        update[i] = current;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::finger_path(const K& key, SkipNode** update) {
+
+    // the old path stays valid above the first level where it does not have to move
+    int level = 0;
+    while (level < _skip_list_level && update[level]->forward[level] != NULL
+           && less(update[level]->forward[level]->low, key)) {
+        level++;
+    }
+
+    SkipNode *current = update[level];
+    for (int i = level; i >= 0; i--) {
+        // the old path may be further right than the node coming down
+        if (update[i] != _header && (current == _header || less(current->low, update[i]->low))) {
+            current = update[i];
+        }
+        while (current->forward[i] != NULL && less(current->forward[i]->low, key)) {
+            current = current->forward[i];
+        }
+        update[i] = current;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename FatSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* FatSkipList<K, V, Compare, Serializer, Alloc>::node_at(SkipNode** update, const K& key) {
+    SkipNode *next = update[0]->forward[0];
+    if (update[0] == _header || (next != NULL && equal(next->low, key)))
+        return next;
+    return update[0];
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename FatSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* FatSkipList<K, V, Compare, Serializer, Alloc>::find_node(const K& key) {
+    SkipNode *current = _header;
+    for (int i = _skip_list_level; i >= 0; i--) {
+        while (current->forward[i] != NULL && !less(key, current->forward[i]->low)) {
+            current = current->forward[i];
+        }
+    }
+    return current == _header ? _header->forward[0] : current;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::search_node(const K* keys, int count, const K& key) const {
+    return KeySearch<K, Compare>::lower_bound(keys, count, key, _compare);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::display_list() {
+
+    std::cout << "\n*****Fat Skip List*****"<<"\n";
+    for (int i = 0; i <= _skip_list_level; i++) {
+        SkipNode *node = this->_header->forward[i];
+        std::cout << "Level " << i << ": ";
+        while (node != NULL) {
+            if (i == 0) {
+                std::cout << "[";
+                for (int j = 0; j < node->count; j++)
+                    std::cout << printable(node->keys[j]) << ":" << printable(node->values[j]) << ";";
+                std::cout << "]";
+            } else {
+                std::cout << printable(node->low) << ";";
+            }
+            node = node->forward[i];
+        }
+        std::cout << std::endl;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::search_element(const K& key) {
+    V value;
+    return search_element(key, value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::search_element(const K& key, V& value_out) {
+    SkipNode *node = find_node(key);
+    if (node == NULL)
+        return false;
+    int pos = search_node(node->keys, node->count, key);
+    if (pos < node->count && equal(node->keys[pos], key)) {
+        value_out = node->values[pos];
+        return true;
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::delete_element(const K& key) {
+    SkipNode *update[_max_level+1];
+    find_path(key, update);
+    return delete_at(update, key) ? 0 : 1;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::delete_at(SkipNode** update, const K& key) {
+    SkipNode *node = node_at(update, key);
+    if (node == NULL)
+        return false;
+    int pos = search_node(node->keys, node->count, key);
+    if (pos == node->count || !equal(node->keys[pos], key))
+        return false;
+
+    std::move(node->keys + pos + 1, node->keys + node->count, node->keys + pos);
+    std::move(node->values + pos + 1, node->values + node->count, node->values + pos);
+    node->count--;
+    _element_count --;
+    if (node->count > 0) {
+        node->low = node->keys[0];
+        return true;
+    }
+
+    // key was the low of the node, so update is the path in front of it
+    for (int i = 0; i <= node->node_level; i++) {
+        if (update[i]->forward[i] != node)
+            break;
+        update[i]->forward[i] = node->forward[i];
+    }
+    while (_skip_list_level > 0 && _header->forward[_skip_list_level] == NULL) {
+        _skip_list_level --;
+    }
+    destroy_node(node);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+        finger_path(keys[idx], update);
+        SkipNode *node = node_at(update, keys[idx]);
+        if (node == NULL)
+            continue;
+        int pos = search_node(node->keys, node->count, keys[idx]);
+        if (pos < node->count && equal(node->keys[pos], keys[idx])) {
+            values[idx] = node->values[pos];
+            found[idx] = true;
+            count++;
+        }
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::multi_insert(const std::vector<std::pair<K, V> >& elements) {
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    for (size_t idx : sorted_order(elements, [](const std::pair<K, V>& e) -> const K& { return e.first; }, _compare)) {
+        finger_path(elements[idx].first, update);
+        if (insert_at(update, elements[idx].first, false, elements[idx].second) == 0)
+            count++;
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::multi_delete(const std::vector<K>& keys) {
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+        finger_path(keys[idx], update);
+        if (delete_at(update, keys[idx]))
+            count++;
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename InputIt>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::bulk_load(InputIt first, InputIt last) {
+    if (_header->forward[0] != NULL) {
+        std::vector<std::pair<K, V> > elements(first, last);
+        return multi_insert(elements);
+    }
+
+    SkipNode *tail[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        tail[i] = _header;
+
+    int count = 0;
+    const int fill = kNodeKeys * 3 / 4 > 0 ? kNodeKeys * 3 / 4 : 1;
+    for (; first != last; ++first) {
+        SkipNode *node = tail[0];
+        // appending is only valid while the keys keep growing
+        if (node != _header && !less(node->keys[node->count - 1], first->first)) {
+            std::vector<std::pair<K, V> > rest(first, last);
+            return count + multi_insert(rest);
+        }
+        if (node == _header || node->count == fill) {
+            node = create_node(get_random_level());
+            append_node(tail, node);
+        }
+        insert_into(node, node->count, first->first, first->second);
+        _element_count ++;
+        count++;
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::append_node(SkipNode** tail, SkipNode* node) {
+    for (int i = 0; i <= node->node_level; i++) {
+        tail[i]->forward[i] = node;
+        tail[i] = node;
+    }
+    if (node->node_level > _skip_list_level)
+        _skip_list_level = node->node_level;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename FatSkipList<K, V, Compare, Serializer, Alloc>::Iterator FatSkipList<K, V, Compare, Serializer, Alloc>::new_iterator() {
+    return Iterator(this);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek_to_first() {
+    _node = _list->_header->forward[0];
+    _pos = 0;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek(const K& key) {
+    _node = _list->find_node(key);
+    if (_node == NULL)
+        return;
+    _pos = _list->search_node(_node->keys, _node->count, key);
+    if (_pos == _node->count) {
+        _node = _node->forward[0];
+        _pos = 0;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::Iterator::next() {
+    if (++_pos == _node->count) {
+        _node = _node->forward[0];
+        _pos = 0;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<std::pair<K, V> > FatSkipList<K, V, Compare, Serializer, Alloc>::range(const K& lo, const K& hi, size_t limit) {
+    std::vector<std::pair<K, V> > out;
+    Iterator it(this);
+    for (it.seek(lo); it.valid() && less(it.key(), hi); it.next()) {
+        if (limit != 0 && out.size() >= limit)
+            break;
+        out.emplace_back(it.key(), it.value());
+    }
+    return out;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::dump_file(const std::string& path) {
+
+    SKIPLIST_LOG(Info, "dump_file");
+    SnapshotWriter writer;
+    if (!writer.open(path))
+        return false;
+
+    std::string key;
+    std::string value;
+    int max_level = 0;
+    // the records get the levels of a SkipList of one key per node
+    LevelGenerator levels(_max_level, _levels.branching(), _element_count);
+    for (SkipNode *node = _header->forward[0]; node != NULL; node = node->forward[0]) {
+        for (int i = 0; i < node->count; i++) {
+            int level = levels.level();
+            max_level = std::max(max_level, level);
+            key.clear();
+            value.clear();
+            KeyCodec::encode(node->keys[i], key);
+            ValueCodec::encode(node->values[i], value);
+            if (!writer.add(level, key, value))
+                return false;
+        }
+    }
+    return writer.finish(_element_count, max_level);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool FatSkipList<K, V, Compare, Serializer, Alloc>::load_file(const std::string& path, bool use_mmap) {
+
+    SKIPLIST_LOG(Info, "load_file");
+    // a snapshot dumped by several threads is read segment by segment, and the deltas of a
+    // checkpoint are applied on top of them, see SnapshotManifest
+    std::vector<std::string> files(1, path);
+    SnapshotManifest manifest;
+    if (is_manifest_file(path)) {
+        if (!read_manifest(path, manifest)) {
+            SKIPLIST_LOG(Error, "load_file: bad manifest " << path);
+            return false;
+        }
+        files = manifest.segments;
+    }
+
+    // records arrive in key order, so an empty list is filled by bulk_load
+    const bool zero_copy = KeyCodec::kZeroCopy || ValueCodec::kZeroCopy;
+    std::vector<std::pair<K, V> > elements;
+    SnapshotRecord record;
+    K key;
+    V value;
+    const uint64_t now = wall_clock_ms();
+    files.insert(files.end(), manifest.deltas.begin(), manifest.deltas.end());
+    for (size_t i = 0; i < files.size(); ++i) {
+        // the deltas come after the segments and change the elements loaded by then
+        bool delta = i >= files.size() - manifest.deltas.size();
+        if (delta && !elements.empty()) {
+            bulk_load(elements.begin(), elements.end());
+            elements.clear();
+        }
+        SnapshotReader reader;
+        if (!reader.open(files[i], use_mmap || zero_copy, zero_copy)) {
+            SKIPLIST_LOG(Error, "load_file: " << reader.error());
+            return false;
+        }
+        while (reader.next(record)) {
+            // elements of a tSkipList that expired meanwhile, the others are kept without expiry
+            bool gone = record.deleted || (record.expire_at != 0 && record.expire_at <= now);
+            if (gone && !delta)
+                continue;
+            if (!KeyCodec::decode(record.key, record.key_size, key)
+                || (!gone && !ValueCodec::decode(record.value, record.value_size, value))) {
+                SKIPLIST_LOG(Error, "load_file: bad record");
+                return false;
+            }
+            if (!delta)
+                elements.emplace_back(key, value);
+            else if (gone)
+                delete_element(key);
+            else
+                insert_or_assign(key, value);
+        }
+        if (zero_copy)
+            _mappings.push_back(reader.release_mapping());
+        if (!reader.ok()) {
+            SKIPLIST_LOG(Error, "load_file: " << reader.error());
+            return false;
+        }
+    }
+    bulk_load(elements.begin(), elements.end());
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename FatSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* FatSkipList<K, V, Compare, Serializer, Alloc>::create_node(int level) {
+    void *mem = _allocator.allocate(level, SkipNode::size_of(level));
+    return new (mem) SkipNode(level);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::destroy_node(SkipNode * node) {
+    int level = node->node_level;
+    node->~SkipNode();
+    _allocator.deallocate(node, level, SkipNode::size_of(level));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void FatSkipList<K, V, Compare, Serializer, Alloc>::clear(SkipNode * cur)
+{
+    if (Alloc::kBulkRelease && std::is_trivially_destructible<K>::value && std::is_trivially_destructible<V>::value)
+        return;
+    while (cur != NULL) {
+        SkipNode *next = cur->forward[0];
+        destroy_node(cur);
+        cur = next;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int FatSkipList<K, V, Compare, Serializer, Alloc>::get_random_level(){
+
+    return _levels.level();
+};
+
+
+#endif //FAT_SKIP_LIST_H
@@ -0,0 +1,251 @@
+/*
+ * @file        : keysearch.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains KeySearch, the search of a sorted key array of a fat node.
+ *                Signed 32 and 64 bit integers, float and double keys are compared a vector at
+ *                a time with AVX2, SSE or NEON, every other key type uses std::lower_bound.
+ *
+ *                The instruction set is chosen at compile time: x86-64 has SSE2 by default,
+ *                64 bit integers need SSE4.2 and the wide paths AVX2, e.g. -march=native.
+ *                NEON is used on AArch64.
+ */
+
+#ifndef SKIP_LIST_KEY_SEARCH_H
+#define SKIP_LIST_KEY_SEARCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+namespace keysearch {
+
+enum Lanes { kScalar, kInt32, kInt64, kFloat, kDouble };
+
+/**
+ * @brief The vector routine of a key type, kScalar if there is none.
+ */
+template <typename K>
+struct LanesOf : std::integral_constant<int,
+    std::is_floating_point<K>::value
+        ? (sizeof(K) == 4 ? kFloat : sizeof(K) == 8 ? kDouble : kScalar)
+        : (std::is_integral<K>::value && std::is_signed<K>::value
+              ? (sizeof(K) == 4 ? kInt32 : sizeof(K) == 8 ? kInt64 : kScalar)
+              : kScalar)> {};
+
+/**
+ * The prefix functions compare every whole vector of keys with key and count the keys that
+ * are less than key, without a branch on the result: a true lane is -1 and is subtracted
+ * from a vector of counters. The keys are sorted, so the count is the lower bound unless
+ * every vector was less, then the keys after the last whole vector are left to the caller.
+ * -1 means there is no vector routine in this build.
+ */
+
+#if defined(__AVX2__)
+inline int sum_lanes32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+inline int sum_lanes64(__m256i v) {
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+    return _mm_cvtsi128_si32(s);
+}
+#elif defined(__SSE2__)
+inline int sum_lanes32(__m128i s) {
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+inline int sum_lanes64(__m128i s) {
+    s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+inline int prefix_less(const int32_t* keys, int count, int32_t key) {
+#if defined(__AVX2__)
+    const __m256i k = _mm256_set1_epi32(key);
+    __m256i less = _mm256_setzero_si256();
+    for (int i = 0; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        less = _mm256_sub_epi32(less, _mm256_cmpgt_epi32(k, v));
+    }
+    return sum_lanes32(less);
+#elif defined(__SSE2__)
+    const __m128i k = _mm_set1_epi32(key);
+    __m128i less = _mm_setzero_si128();
+    for (int i = 0; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        less = _mm_sub_epi32(less, _mm_cmplt_epi32(v, k));
+    }
+    return sum_lanes32(less);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const int32x4_t k = vdupq_n_s32(key);
+    uint32x4_t less = vdupq_n_u32(0);
+    for (int i = 0; i + 4 <= count; i += 4)
+        less = vsubq_u32(less, vcltq_s32(vld1q_s32(keys + i), k));
+    return static_cast<int>(vaddvq_u32(less));
+#else
+    (void)keys; (void)count; (void)key;
+    return -1;
+#endif
+}
+
+inline int prefix_less(const int64_t* keys, int count, int64_t key) {
+#if defined(__AVX2__)
+    const __m256i k = _mm256_set1_epi64x(key);
+    __m256i less = _mm256_setzero_si256();
+    for (int i = 0; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        less = _mm256_sub_epi64(less, _mm256_cmpgt_epi64(k, v));
+    }
+    return sum_lanes64(less);
+#elif defined(__SSE4_2__)
+    const __m128i k = _mm_set1_epi64x(key);
+    __m128i less = _mm_setzero_si128();
+    for (int i = 0; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        less = _mm_sub_epi64(less, _mm_cmpgt_epi64(k, v));
+    }
+    return sum_lanes64(less);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const int64x2_t k = vdupq_n_s64(key);
+    uint64x2_t less = vdupq_n_u64(0);
+    for (int i = 0; i + 2 <= count; i += 2)
+        less = vsubq_u64(less, vcltq_s64(vld1q_s64(keys + i), k));
+    return static_cast<int>(vaddvq_u64(less));
+#else
+    (void)keys; (void)count; (void)key;
+    return -1;
+#endif
+}
+
+inline int prefix_less(const float* keys, int count, float key) {
+#if defined(__AVX2__)
+    const __m256 k = _mm256_set1_ps(key);
+    __m256i less = _mm256_setzero_si256();
+    for (int i = 0; i + 8 <= count; i += 8)
+        less = _mm256_sub_epi32(less, _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(keys + i), k, _CMP_LT_OQ)));
+    return sum_lanes32(less);
+#elif defined(__SSE2__)
+    const __m128 k = _mm_set1_ps(key);
+    __m128i less = _mm_setzero_si128();
+    for (int i = 0; i + 4 <= count; i += 4)
+        less = _mm_sub_epi32(less, _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(keys + i), k)));
+    return sum_lanes32(less);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const float32x4_t k = vdupq_n_f32(key);
+    uint32x4_t less = vdupq_n_u32(0);
+    for (int i = 0; i + 4 <= count; i += 4)
+        less = vsubq_u32(less, vcltq_f32(vld1q_f32(keys + i), k));
+    return static_cast<int>(vaddvq_u32(less));
+#else
+    (void)keys; (void)count; (void)key;
+    return -1;
+#endif
+}
+
+inline int prefix_less(const double* keys, int count, double key) {
+#if defined(__AVX2__)
+    const __m256d k = _mm256_set1_pd(key);
+    __m256i less = _mm256_setzero_si256();
+    for (int i = 0; i + 4 <= count; i += 4)
+        less = _mm256_sub_epi64(less, _mm256_castpd_si256(_mm256_cmp_pd(_mm256_loadu_pd(keys + i), k, _CMP_LT_OQ)));
+    return sum_lanes64(less);
+#elif defined(__SSE2__)
+    const __m128d k = _mm_set1_pd(key);
+    __m128i less = _mm_setzero_si128();
+    for (int i = 0; i + 2 <= count; i += 2)
+        less = _mm_sub_epi64(less, _mm_castpd_si128(_mm_cmplt_pd(_mm_loadu_pd(keys + i), k)));
+    return sum_lanes64(less);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const float64x2_t k = vdupq_n_f64(key);
+    uint64x2_t less = vdupq_n_u64(0);
+    for (int i = 0; i + 2 <= count; i += 2)
+        less = vsubq_u64(less, vcltq_f64(vld1q_f64(keys + i), k));
+    return static_cast<int>(vaddvq_u64(less));
+#else
+    (void)keys; (void)count; (void)key;
+    return -1;
+#endif
+}
+
+/**
+ * @brief To view the keys as the lane type of their routine, int and long long keys share
+ * the routines of int32_t and int64_t.
+ */
+template <typename K>
+int prefix_less(const K* keys, int count, K key, std::integral_constant<int, kInt32>) {
+    return prefix_less(reinterpret_cast<const int32_t*>(keys), count, static_cast<int32_t>(key));
+}
+
+template <typename K>
+int prefix_less(const K* keys, int count, K key, std::integral_constant<int, kInt64>) {
+    return prefix_less(reinterpret_cast<const int64_t*>(keys), count, static_cast<int64_t>(key));
+}
+
+template <typename K>
+int prefix_less(const K* keys, int count, K key, std::integral_constant<int, kFloat>) {
+    return prefix_less(reinterpret_cast<const float*>(keys), count, static_cast<float>(key));
+}
+
+template <typename K>
+int prefix_less(const K* keys, int count, K key, std::integral_constant<int, kDouble>) {
+    return prefix_less(reinterpret_cast<const double*>(keys), count, static_cast<double>(key));
+}
+
+template <typename K>
+int prefix_less(const K*, int, K, std::integral_constant<int, kScalar>) {
+    return -1;
+}
+
+} // namespace keysearch
+
+/**
+ * @struct KeySearch
+ * @brief The KeySearch struct is used to find a key in the keys of a node sorted by Compare.
+ */
+template <typename K, typename Compare = std::less<K>, typename Enable = void>
+struct KeySearch {
+    /**
+     * @return The index of the first of count keys that is not less than key.
+     */
+    static int lower_bound(const K* keys, int count, const K& key, const Compare& compare = Compare()) {
+        return static_cast<int>(std::lower_bound(keys, keys + count, key, compare) - keys);
+    }
+};
+
+/**
+ * @brief Arithmetic keys in their natural order are compared a vector at a time, a NaN key
+ * has no order and is not supported.
+ */
+template <typename K>
+struct KeySearch<K, std::less<K>, typename std::enable_if<std::is_arithmetic<K>::value>::type> {
+    static int lower_bound(const K* keys, int count, K key, const std::less<K>& = std::less<K>()) {
+        int i = keysearch::prefix_less(keys, count, key,
+                                       std::integral_constant<int, keysearch::LanesOf<K>::value>());
+        if (i < 0)
+            return static_cast<int>(std::lower_bound(keys, keys + count, key) - keys);
+        // keys[i] is not less than key, or less than one vector of keys is left
+        while (i < count && keys[i] < key)
+            i++;
+        return i;
+    }
+};
+
+
+#endif //SKIP_LIST_KEY_SEARCH_H
@@ -0,0 +1,119 @@
+/*
+ * @file        : levels.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains LevelGenerator, the random level of a new node.
+ *                Every thread draws from its own xorshift64* state, so inserts do not meet on the
+ *                lock of rand(), and one 64 bit word gives the whole level: a node climbs a level
+ *                for every group of log2(1/p) zero bits at the bottom of the word.
+ *
+ *                p is 1/2, 1/4, 1/8 ... per list, 1/4 by default: it halves the pointers of 1/2
+ *                for a search that is only a little longer. The levels may also be capped at
+ *                log_{1/p} of the expected element count, levels above it barely ever get a node
+ *                and only make every search start higher.
+ */
+
+#ifndef SKIP_LIST_LEVELS_H
+#define SKIP_LIST_LEVELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+
+/**
+ * @return The next word of the xorshift64* state of the calling thread.
+ */
+inline uint64_t thread_random() {
+    static thread_local uint64_t state = (static_cast<uint64_t>(std::random_device()()) << 32
+                                          | std::random_device()()) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @return The number of zero bits below the lowest one bit, word must not be 0.
+ */
+inline int trailing_zeros(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int n = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * @class LevelGenerator
+ * @brief The LevelGenerator class is used to draw the levels of new nodes, 0 with probability
+ * 1 - p, and level i with probability p^i (1 - p), up to the cap.
+ */
+class LevelGenerator {
+public:
+    /**
+     * @param max_level The highest level of the list.
+     * @param branching 1/p, rounded down to a power of two from 2 to 2^16.
+     * @param expected_elements To cap the levels at log_{1/p} of it, 0 for no cap below max_level.
+     */
+    explicit LevelGenerator(int max_level, unsigned branching = 4, size_t expected_elements = 0)
+        : _max_level(max_level) {
+        configure(branching, expected_elements);
+    }
+
+    /**
+     * @brief To change p and the cap, see the constructor. It must not overlap level().
+     */
+    void configure(unsigned branching, size_t expected_elements = 0) {
+        _shift = 1;
+        while (_shift < 16 && (2u << _shift) <= branching)
+            _shift++;
+        _cap = _max_level;
+        if (expected_elements > 1) {
+            // ceil(log2(n)) / log2(1/p), rounded up
+            int bits = 64 - leading_zeros(static_cast<uint64_t>(expected_elements - 1));
+            int cap = (bits + _shift - 1) / _shift;
+            if (cap < _cap)
+                _cap = cap;
+        }
+    }
+
+    /**
+     * @return A random level from 0 to cap().
+     */
+    int level() const {
+        // the top bit bounds the count, a zero word is as good as any other
+        int level = trailing_zeros(thread_random() | (1ULL << 63)) / _shift;
+        return level < _cap ? level : _cap;
+    }
+
+    /**
+     * @return The highest level level() returns.
+     */
+    int cap() const { return _cap; }
+
+    /**
+     * @return 1/p.
+     */
+    unsigned branching() const { return 1u << _shift; }
+
+private:
+    static int leading_zeros(uint64_t word) {
+        int n = 0;
+        for (uint64_t bit = 1ULL << 63; bit != 0 && !(word & bit); bit >>= 1)
+            n++;
+        return n;
+    }
+
+    int _max_level;
+    int _shift;
+    int _cap;
+};
+
+
+#endif //SKIP_LIST_LEVELS_H
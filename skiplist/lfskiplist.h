@@ -0,0 +1,500 @@
+/*
+ * @file        : lfskiplist.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the declaration of the lfSkipList class, a lock free
+ *                variant of tSkipList with the same interface. Forward pointers are atomic,
+ *                deletion marks the low bit of a node's forward pointers before unlinking it,
+ *                and unlinked nodes are freed through epoch based reclamation.
+ */
+
+#ifndef LOCK_FREE_SKIP_LIST_H
+#define LOCK_FREE_SKIP_LIST_H
+
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <fstream>
+#include <atomic>
+#include "common.h"
+#include "codec.h"
+#include "levels.h"
+#include "logging.h"
+#include "epoch.h"
+
+
+/**
+ * @struct LockFreeNode
+ * @brief The LockFreeNode struct is used to manage lock free nodes in the skip list.
+ * forward[i] holds the next node at level i, its low bit is set once the node is deleted.
+ */
+template<typename K, typename V>
+struct LockFreeNode {
+    K key;
+    V value;
+    int node_level;
+    std::atomic<uintptr_t> *forward;
+
+    // set by the inserter once it stopped linking, and by the deleter once it unlinked the node
+    std::atomic<int> state;
+
+    /**
+     * @brief Constructor for LockFreeNode.
+     * To initialze the data structures.
+     */
+    LockFreeNode(K k, V v, int level) : key(k), value(v), node_level(level), state(0) {
+        forward = new std::atomic<uintptr_t>[level + 1];
+        for (int i = 0; i <= level; ++i)
+            forward[i].store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Deconstructor for LockFreeNode.
+     * To free the array of pointers.
+     */
+    ~LockFreeNode() {
+        delete[] forward;
+    }
+};
+
+/**
+ * @class lfSkipList
+ * @brief The lfSkipList class is used to manage the lock free skip list.
+ */
+template <typename K, typename V>
+class lfSkipList {
+    using SkipNode = LockFreeNode<K, V>;
+public:
+    /**
+     * @brief Constructor for lfSkipList.
+     * To initialze the data structures.
+     */
+    lfSkipList(int);
+
+    /**
+     * @brief Deconstructor for lfSkipList.
+     * To free every node. No other thread may use the list.
+     */
+    ~lfSkipList();
+
+    /**
+     * @return The number of elements in the skip node.
+     */
+    int size();
+
+    /**
+     * @brief To choose the levels of the nodes inserted from now on, see levels.h.
+     * Call it before the list is shared by threads, the nodes already in the list keep their levels.
+     * @param branching 1/p, a node reaches the next level with probability 1/branching.
+     * @param expected_elements To cap the levels at log_branching of it, 0 for max_level.
+     */
+    void set_level_distribution(unsigned branching, size_t expected_elements = 0);
+
+    /**
+     * @brief To insert an element.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(K, V);
+
+    /**
+     * @brief To search element by its key. Never blocks and never writes shared memory.
+     * @param value_out To retrive the value.
+     * @return True if found, False if not found.
+     */
+    bool search_element(K, V&);
+
+    /**
+     * @brief To delete element by its key.
+     * If not found, do nothing.
+     * @return 0 if succeeds, 1 if not found.
+     */
+    int delete_element(K);
+
+    /**
+     * @brief To dump the skip list to the file.
+     */
+    void dump_file();
+
+    /**
+     * @brief To load the skip list from the file.
+     */
+    void load_file();
+
+private:
+    static const int kLinked = 1;
+    static const int kUnlinked = 2;
+
+    static bool is_marked(uintptr_t p) { return (p & 1) != 0; }
+    static uintptr_t unmarked(uintptr_t p) { return p & ~static_cast<uintptr_t>(1); }
+    static SkipNode* get_node(uintptr_t p) { return reinterpret_cast<SkipNode*>(unmarked(p)); }
+
+    /**
+     * @brief To locate the predecessors and successors of key at every level.
+     * Marked nodes met on the way are unlinked. If pass_equal is set, nodes equal to key are
+     * passed as well, so that every marked node with this key gets unlinked.
+     * @return True if an unmarked node with key is linked at level 0.
+     */
+    bool find(const K& key, SkipNode** preds, SkipNode** succs, bool pass_equal);
+
+    /**
+     * @brief To record that one side of the insert / delete handshake is done.
+     * The side finishing last retires the node.
+     */
+    void finish(SkipNode*, int flag);
+
+    /**
+     * @brief To free a node once the epoch manager proved it unreachable.
+     */
+    static void reclaim(void* node, void* ctx);
+
+    /**
+     * @brief To free every node in level 0, iteratively.
+     */
+    void clear(SkipNode *);
+
+    /**
+     * @return The level of a new node, from 0 to _max_level.
+     */
+    int get_random_level();
+
+    /**
+     * @brief To parse the str into key and value.
+     */
+    void string_to_kv(const std::string& str, std::string* key, std::string* value);
+
+    /**
+     * @brief To check if the string is a k-v pair.
+     */
+    bool is_valid_string(const std::string& str);
+
+    // Maximum level of the skip list
+    const int _max_level;
+
+    // levels of the new nodes
+    LevelGenerator _levels;
+
+    // current level of skip list, only grows
+    std::atomic<int> _skip_list_level;
+
+    // pointer to header node
+    SkipNode * _header;
+
+    // file operator
+    std::mutex _file_mutex;
+    std::ofstream _file_writer;
+    std::ifstream _file_reader;
+
+    // skiplist current element count
+    std::atomic<int> _element_count;
+
+    // deferred reclamation of deleted nodes, destroyed first
+    EpochManager _epoch;
+};
+
+
+template<typename K, typename V>
+lfSkipList<K, V>::lfSkipList(int max_level) : _max_level(max_level), _levels(max_level), _skip_list_level(0), _element_count(0) {
+    // create header node and initialize key and value to null
+    K k = K();
+    V v = V();
+    this->_header = new SkipNode(k, v, _max_level);
+};
+
+template<typename K, typename V>
+lfSkipList<K, V>::~lfSkipList() {
+
+    if (_file_writer.is_open()) {
+        _file_writer.close();
+    }
+    if (_file_reader.is_open()) {
+        _file_reader.close();
+    }
+
+    // nodes still linked at level 0 have not been retired yet
+    clear(get_node(_header->forward[0].load()));
+    delete(_header);
+}
+
+template<typename K, typename V>
+int lfSkipList<K, V>::size() {
+    return _element_count;
+}
+
+template<typename K, typename V>
+void lfSkipList<K, V>::set_level_distribution(unsigned branching, size_t expected_elements) {
+    _levels.configure(branching, expected_elements);
+}
+
+template<typename K, typename V>
+bool lfSkipList<K, V>::find(const K& key, SkipNode** preds, SkipNode** succs, bool pass_equal) {
+retry:
+    SkipNode *pred = _header;
+    SkipNode *current = NULL;
+
+    for (int i = _skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+        current = get_node(pred->forward[i].load(std::memory_order_acquire));
+        while (current != NULL) {
+            uintptr_t succ = current->forward[i].load(std::memory_order_acquire);
+
+            // current is deleted, unlink it at this level
+            while (is_marked(succ)) {
+                uintptr_t expected = reinterpret_cast<uintptr_t>(current);
+                if (!pred->forward[i].compare_exchange_strong(expected, unmarked(succ),
+                                                              std::memory_order_acq_rel)) {
+                    goto retry;
+                }
+                current = get_node(succ);
+                if (current == NULL)
+                    break;
+                succ = current->forward[i].load(std::memory_order_acquire);
+            }
+            if (current == NULL)
+                break;
+
+            if (current->key < key || (pass_equal && !(key < current->key))) {
+                pred = current;
+                current = get_node(succ);
+            } else {
+                break;
+            }
+        }
+        preds[i] = pred;
+        succs[i] = current;
+    }
+    return current != NULL && current->key == key;
+}
+
+template<typename K, typename V>
+int lfSkipList<K, V>::insert_element(const K key, const V value) {
+    // Generate a random level for node
+    int random_level = get_random_level();
+
+    int level = _skip_list_level.load(std::memory_order_relaxed);
+    while (random_level > level
+           && !_skip_list_level.compare_exchange_weak(level, random_level)) {
+    }
+
+    EpochManager::Guard guard(_epoch);
+
+    SkipNode *preds[_max_level+1];
+    SkipNode *succs[_max_level+1];
+    memset(preds, 0, sizeof(SkipNode*)*(_max_level+1));
+    memset(succs, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    SkipNode *inserted_node = NULL;
+    while (true) {
+        if (find(key, preds, succs, false)) {
+            delete inserted_node;
+            return 1;
+        }
+        if (inserted_node == NULL)
+            inserted_node = new SkipNode(key, value, random_level);
+        for (int i = 0; i <= random_level; i++)
+            inserted_node->forward[i].store(reinterpret_cast<uintptr_t>(succs[i]), std::memory_order_relaxed);
+
+        // linking level 0 is the linearization point of the insert
+        uintptr_t expected = reinterpret_cast<uintptr_t>(succs[0]);
+        if (preds[0]->forward[0].compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(inserted_node),
+                                                         std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+    _element_count ++;
+
+    // link the upper levels, giving up as soon as the node gets deleted
+    for (int i = 1; i <= random_level; i++) {
+        while (true) {
+            uintptr_t expected = reinterpret_cast<uintptr_t>(succs[i]);
+            if (preds[i]->forward[i].compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(inserted_node),
+                                                             std::memory_order_acq_rel)) {
+                break;
+            }
+            find(key, preds, succs, false);
+
+            uintptr_t next = inserted_node->forward[i].load(std::memory_order_acquire);
+            if (is_marked(next))
+                goto linked;
+            if (!inserted_node->forward[i].compare_exchange_strong(next, reinterpret_cast<uintptr_t>(succs[i]),
+                                                                   std::memory_order_acq_rel)) {
+                goto linked;
+            }
+        }
+    }
+
+linked:
+    // a deleter may have unlinked the node before the last level was linked
+    if (is_marked(inserted_node->forward[0].load(std::memory_order_acquire)))
+        find(key, preds, succs, true);
+    finish(inserted_node, kLinked);
+    return 0;
+}
+
+template<typename K, typename V>
+bool lfSkipList<K, V>::search_element(K key, V& value_out) {
+    EpochManager::Guard guard(_epoch);
+
+    SkipNode *pred = _header;
+    SkipNode *current = NULL;
+
+    // start from highest level of skip list, stepping over deleted nodes
+    for (int i = _skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+        current = get_node(pred->forward[i].load(std::memory_order_acquire));
+        while (current != NULL) {
+            uintptr_t succ = current->forward[i].load(std::memory_order_acquire);
+            if (is_marked(succ)) {
+                current = get_node(succ);
+            } else if (current->key < key) {
+                pred = current;
+                current = get_node(succ);
+            } else {
+                break;
+            }
+        }
+    }
+
+    // if current node have key equal to searched key, we get it
+    if (current != NULL && current->key == key) {
+        value_out = current->value;
+        return true;
+    }
+    return false;
+}
+
+template<typename K, typename V>
+int lfSkipList<K, V>::delete_element(K key) {
+    EpochManager::Guard guard(_epoch);
+
+    SkipNode *preds[_max_level+1];
+    SkipNode *succs[_max_level+1];
+    memset(preds, 0, sizeof(SkipNode*)*(_max_level+1));
+    memset(succs, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    if (!find(key, preds, succs, false))
+        return 1;
+
+    SkipNode *victim = succs[0];
+
+    // mark the upper levels first, so inserters stop linking them
+    for (int i = victim->node_level; i > 0; i--) {
+        uintptr_t next = victim->forward[i].load(std::memory_order_acquire);
+        while (!is_marked(next)
+               && !victim->forward[i].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel)) {
+        }
+    }
+
+    // marking level 0 is the linearization point, only one deleter wins it
+    uintptr_t next = victim->forward[0].load(std::memory_order_acquire);
+    while (true) {
+        if (is_marked(next))
+            return 1;
+        if (victim->forward[0].compare_exchange_weak(next, next | 1, std::memory_order_acq_rel))
+            break;
+    }
+    _element_count --;
+
+    find(key, preds, succs, true);
+    finish(victim, kUnlinked);
+    return 0;
+}
+
+template<typename K, typename V>
+void lfSkipList<K, V>::finish(SkipNode* node, int flag) {
+    int other = (flag == kLinked) ? kUnlinked : kLinked;
+    if (node->state.fetch_or(flag, std::memory_order_acq_rel) & other)
+        _epoch.retire(node, &lfSkipList<K, V>::reclaim, this);
+}
+
+template<typename K, typename V>
+void lfSkipList<K, V>::reclaim(void* node, void*) {
+    delete static_cast<SkipNode*>(node);
+}
+
+template<typename K, typename V>
+void lfSkipList<K, V>::dump_file() {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    EpochManager::Guard guard(_epoch);
+    _file_writer.open(STORE_FILE);
+
+    SkipNode *node = get_node(this->_header->forward[0].load(std::memory_order_acquire));
+    while (node != NULL) {
+        uintptr_t next = node->forward[0].load(std::memory_order_acquire);
+        if (!is_marked(next))
+            _file_writer << node->key << ":" << node->value << "\n";
+        node = get_node(next);
+    }
+
+    _file_writer.flush();
+    _file_writer.close();
+    return ;
+}
+
+template<typename K, typename V>
+void lfSkipList<K, V>::load_file() {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    _file_reader.open(STORE_FILE);
+    std::string line;
+    std::string key;
+    std::string value;
+    while (getline(_file_reader, line)) {
+        key.clear();
+        value.clear();
+        string_to_kv(line, &key, &value);
+        if (key.empty() || value.empty()) {
+            continue;
+        }
+        K k;
+        V v;
+        if (!parse_text(key, k) || !parse_text(value, v)) {
+            SKIPLIST_LOG(Error, "load_file: bad line " << line);
+            continue;
+        }
+        insert_element(k, v);
+    }
+    _file_reader.close();
+    return;
+}
+
+template <typename K, typename V>
+void lfSkipList<K, V>::clear(SkipNode * cur)
+{
+    while (cur != NULL) {
+        SkipNode *next = get_node(cur->forward[0].load(std::memory_order_relaxed));
+        delete(cur);
+        cur = next;
+    }
+}
+
+template<typename K, typename V>
+int lfSkipList<K, V>::get_random_level(){
+
+    return _levels.level();
+};
+
+template<typename K, typename V>
+void lfSkipList<K, V>::string_to_kv(const std::string& str, std::string* key, std::string* value) {
+
+    if(!is_valid_string(str)) {
+        return;
+    }
+    *key = str.substr(0, str.find(delimiter));
+    *value = str.substr(str.find(delimiter)+1, str.length());
+}
+
+template<typename K, typename V>
+bool lfSkipList<K, V>::is_valid_string(const std::string& str) {
+
+    if (str.empty()) {
+        return false;
+    }
+    if (str.find(delimiter) == std::string::npos) {
+        return false;
+    }
+    return true;
+}
+
+
+#endif //LOCK_FREE_SKIP_LIST_H
@@ -0,0 +1,74 @@
+/*
+ * @file        : logging.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the logging hook of the skip lists. Messages go to a sink
+ *                the application installs with set_log_sink, there is none by default, so the
+ *                lists do no I/O of their own.
+ *
+ *                SKIPLIST_LOG_LEVEL is the lowest level compiled in, 0 Debug to 3 Error, the
+ *                messages below it are removed at compile time together with their formatting,
+ *                e.g. -DSKIPLIST_LOG_LEVEL=0 for every insert and delete. The default keeps the
+ *                warnings and errors.
+ */
+
+#ifndef SKIP_LIST_LOGGING_H
+#define SKIP_LIST_LOGGING_H
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#ifndef SKIPLIST_LOG_LEVEL
+#define SKIPLIST_LOG_LEVEL 2
+#endif
+
+enum class LogLevel { Debug = 0, Info = 1, Warn = 2, Error = 3 };
+
+/**
+ * @brief A sink receives the level and the formatted message, it may be called by many
+ * threads at once and from inside the locks of a list.
+ */
+typedef void (*LogSink)(LogLevel level, const std::string& message);
+
+/**
+ * @return The installed sink, NULL if messages are dropped.
+ */
+inline LogSink& log_sink() {
+    static LogSink sink = NULL;
+    return sink;
+}
+
+/**
+ * @brief To install a sink, NULL drops the messages again.
+ * Install it before the lists are shared between threads.
+ */
+inline void set_log_sink(LogSink sink) {
+    log_sink() = sink;
+}
+
+/**
+ * @brief A sink writing every message as a line to std::cerr.
+ */
+inline void stderr_log_sink(LogLevel level, const std::string& message) {
+    static const char* const names[] = { "debug", "info", "warn", "error" };
+    std::cerr << "[" << names[static_cast<int>(level)] << "] " << message << '\n';
+}
+
+/**
+ * @brief To log a message of level Debug, Info, Warn or Error, message is a chain of <<
+ * operands, e.g. SKIPLIST_LOG(Error, "load_file: bad line " << line).
+ * It is only formatted if a sink is installed.
+ */
+#define SKIPLIST_LOG(level, message)                                                    \
+    do {                                                                                \
+        if (static_cast<int>(LogLevel::level) >= SKIPLIST_LOG_LEVEL && log_sink()) {   \
+            std::ostringstream log_stream_;                                             \
+            log_stream_ << message;                                                     \
+            log_sink()(LogLevel::level, log_stream_.str());                             \
+        }                                                                               \
+    } while (0)
+
+
+#endif //SKIP_LIST_LOGGING_H
@@ -0,0 +1,1441 @@
+/*
+ * @file        : lsm.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the declaration of the LsmStore class, which makes tSkipList
+ *                the memtable of a log structured merge tree, so a store can hold many times
+ *                more than fits in memory. Writes go to the active memtable. Once it reaches its
+ *                size it is frozen, a new one takes its place, and a background thread flushes
+ *                the frozen one to a sorted run on disk, an SSTable, see sstable.h. Reads look at
+ *                the memtables and then at the runs, newest first, so the newest version of a key
+ *                wins and a tombstone hides the older ones.
+ *
+ *                The runs are size tiered: a flush makes a run of tier 0, and once there are
+ *                enough runs of a tier a second thread merges them into one run of the next tier,
+ *                dropping the versions that are shadowed, and the tombstones and expired elements
+ *                if the merge reaches the oldest run.
+ *
+ *                Every run and memtable has a Bloom filter of its keys, see bloom.h, so a read
+ *                of a key that is absent, or only in an old run, skips the others after one
+ *                probe instead of a search.
+ *
+ *                The directory of the store holds the runs <id>.sst and the manifest LSM, which
+ *                lists them from the newest to the oldest:
+ *
+ *                manifest : magic "KVLSM\0\0\0" | u32 version | u64 next id | u32 run count
+ *                           | run... | u32 crc32c
+ *                run      : u64 id | u32 tier
+ */
+
+#ifndef SKIP_LIST_LSM_H
+#define SKIP_LIST_LSM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "bloom.h"
+#include "codec.h"
+#include "common.h"
+#include "logging.h"
+#include "snapshot.h"
+#include "sstable.h"
+#include "tskiplist.h"
+#include "wal.h"
+
+
+// bytes of the active memtable after which it is frozen
+static const size_t kLsmMemtableBytes = 64 << 20;
+
+// payload bytes of the blocks of a run, the unit a lookup reads
+static const size_t kLsmBlockSize = 4096;
+
+// frozen memtables waiting for their flush after which the writers wait too
+static const size_t kLsmMaxFrozen = 2;
+
+// runs of a tier that are merged into one run of the next tier
+static const size_t kLsmTierRuns = 4;
+
+// bits per key of the Bloom filters of the runs and memtables
+static const unsigned kLsmBloomBits = 10;
+
+// memtable bytes per key the filter of a memtable is sized for, a node with its key and value
+static const size_t kLsmFilterEntryBytes = 64;
+
+static const char kLsmManifestMagic[8] = {'K', 'V', 'L', 'S', 'M', '\0', '\0', '\0'};
+static const uint32_t kLsmManifestVersion = 1;
+
+/**
+ * @struct LsmEntry
+ * @brief The value of a key in a memtable, with the expiry and tombstone of the LSM.
+ * The memtable never deletes a node, a deleted key keeps a tombstone that hides its older
+ * versions in the runs until a merge drops them.
+ */
+template <typename V>
+struct LsmEntry {
+    V value;
+    // wall clock milliseconds after which the element is gone, 0 if it never expires
+    uint64_t expire_at;
+    bool deleted;
+
+    LsmEntry() : value(), expire_at(0), deleted(false) {}
+
+    template <typename M>
+    LsmEntry(M&& v, uint64_t expire, bool tombstone = false)
+        : value(std::forward<M>(v)), expire_at(expire), deleted(tombstone) {}
+};
+
+template <typename V>
+struct HeapBytes<LsmEntry<V>, void> {
+    static size_t of(const LsmEntry<V>& entry) { return HeapBytes<V>::of(entry.value); }
+};
+
+/**
+ * @struct LsmEntryCodec
+ * @brief The codec of an LsmEntry in the write-ahead log of a memtable:
+ * u8 flags (1 deleted, 2 expires) | [u64 expiry] | value.
+ */
+template <typename V, typename ValueCodec>
+struct LsmEntryCodec {
+    static const bool kZeroCopy = ValueCodec::kZeroCopy;
+
+    static void encode(const LsmEntry<V>& entry, std::string& out) {
+        out.push_back(static_cast<char>((entry.deleted ? 1 : 0) | (entry.expire_at != 0 ? 2 : 0)));
+        if (entry.expire_at != 0)
+            put_fixed64(out, entry.expire_at);
+        if (!entry.deleted)
+            ValueCodec::encode(entry.value, out);
+    }
+
+    static bool decode(const char* p, size_t n, LsmEntry<V>& out) {
+        if (n < 1)
+            return false;
+        int flags = static_cast<unsigned char>(p[0]);
+        p += 1;
+        n -= 1;
+        out.deleted = (flags & 1) != 0;
+        out.expire_at = 0;
+        if (flags & 2) {
+            if (n < 8)
+                return false;
+            out.expire_at = get_fixed64(p);
+            p += 8;
+            n -= 8;
+        }
+        return out.deleted ? n == 0 : ValueCodec::decode(p, n, out.value);
+    }
+};
+
+/**
+ * @struct LsmRecordCodec
+ * @brief The serializer policy of the memtables, the keys of Serializer and LsmEntryCodec.
+ */
+template <typename V, typename Serializer>
+struct LsmRecordCodec {
+    typedef typename Serializer::Key Key;
+    typedef LsmEntryCodec<V, typename Serializer::Value> Value;
+};
+
+/**
+ * @class LsmStore
+ * @brief The LsmStore class is used to keep a sorted store on disk behind tSkipList memtables.
+ * Writers only touch the active memtable and do not read the runs first, except for the
+ * calls whose result depends on the older versions, insert_element, emplace and
+ * delete_element. Frozen memtables and runs never change, readers take the current set of
+ * them without a lock and keep it for the whole read, so a flush or a merge never waits for
+ * them. Keys and values of a Slice point into the memtables and the mappings of the runs,
+ * which are then kept until the store is destroyed.
+ * Call open, and open_wal if the memtables must survive a crash, before the store is shared
+ * between threads.
+ */
+template <typename K, typename V, typename Compare = std::less<K>, typename Serializer = RecordCodec<K, V> >
+class LsmStore {
+    using Entry = LsmEntry<V>;
+    using List = tSkipList<K, Entry, Compare, LsmRecordCodec<V, Serializer> >;
+    using KeyCodec = typename Serializer::Key;
+    using ValueCodec = typename Serializer::Value;
+    static const bool kZeroCopy = KeyCodec::kZeroCopy || ValueCodec::kZeroCopy;
+
+    /**
+     * @struct Memtable
+     * @brief A memtable and the id of its log and of the run it is flushed to. Writers add the
+     * hash of their key to the filter before they write the list.
+     */
+    struct Memtable {
+        const uint64_t id;
+        List list;
+        // NULL if the store has no filters
+        std::unique_ptr<AtomicBloomFilter> filter;
+
+        Memtable(uint64_t i, int max_level, const Compare& compare, size_t bytes, unsigned bloom_bits)
+            : id(i), list(max_level, compare),
+              filter(bloom_bits == 0 ? nullptr : new AtomicBloomFilter(bytes / kLsmFilterEntryBytes, bloom_bits)) {}
+
+        bool may_contain(uint64_t hash) const { return !filter || filter->may_contain(hash); }
+
+        void add(uint64_t hash) {
+            if (filter)
+                filter->add(hash);
+        }
+
+        size_t memory_usage() { return list.memory_usage() + (filter ? filter->bytes() : 0); }
+    };
+
+    /**
+     * @struct Table
+     * @brief A run on disk, with the decoded last keys of its blocks to search them by Compare.
+     */
+    struct Table {
+        const uint64_t id;
+        const unsigned tier;
+        SSTable file;
+        std::vector<K> last_keys;
+
+        Table(uint64_t i, unsigned t) : id(i), tier(t) {}
+    };
+
+    /**
+     * @struct View
+     * @brief The memtables and runs of the store at one moment, every list newest first.
+     * A view is never changed once it is installed, a change installs a new one.
+     */
+    struct View {
+        std::shared_ptr<Memtable> active;
+        std::vector<std::shared_ptr<Memtable> > frozen;
+        std::vector<std::shared_ptr<Table> > tables;
+    };
+
+    /**
+     * @class TableIterator
+     * @brief The TableIterator class is used to walk the records of a run, tombstones included.
+     */
+    class TableIterator {
+    public:
+        TableIterator(const LsmStore* store, const Table* table)
+            : _store(store), _table(table), _block(0), _valid(false), _failed(false) {}
+
+        bool valid() const { return _valid; }
+
+        /**
+         * @return True if a damaged block or record cut the walk short since the last seek.
+         */
+        bool failed() const { return _failed; }
+        const K& key() const { return _key; }
+        const Entry& entry() const { return _entry; }
+
+        void seek_to_first();
+        void seek(const K& key);
+        void next() { step(); }
+
+    private:
+        /**
+         * @brief To start reading block i, past the last block if it is damaged.
+         */
+        void open_block(size_t i);
+
+        /**
+         * @brief To read the next record into key and entry, from the next block at the end.
+         */
+        void step();
+
+        const LsmStore* _store;
+        const Table* _table;
+        size_t _block;
+        SSTableBlock _cursor;
+        bool _valid;
+        bool _failed;
+        K _key;
+        Entry _entry;
+    };
+
+    /**
+     * @class Merger
+     * @brief The Merger class is used to merge memtables and runs into one walk in key order.
+     * Sources are added newest first, of the versions of a key the one of the newest source
+     * wins and the others are skipped. Tombstones and expired elements are returned too.
+     */
+    class Merger {
+    public:
+        explicit Merger(const LsmStore* store) : _store(store), _valid(false) {}
+        Merger(Merger&&) = default;
+
+        void add(typename List::Iterator&& it) { _mems.push_back(std::move(it)); }
+        void add(const Table* table) { _tables.push_back(TableIterator(_store, table)); }
+
+        bool valid() const { return _valid; }
+        const K& key() const { return _key; }
+        const Entry& entry() const { return _entry; }
+
+        /**
+         * @return True if a run was cut short, the walk then misses the rest of it.
+         */
+        bool failed() const;
+
+        void seek_to_first();
+        void seek(const K& key);
+        void next() { settle(); }
+
+    private:
+        /**
+         * @brief To take the smallest key of the sources and move every source past it.
+         */
+        void settle();
+
+        const LsmStore* _store;
+        std::vector<typename List::Iterator> _mems;
+        std::vector<TableIterator> _tables;
+        bool _valid;
+        K _key;
+        Entry _entry;
+    };
+public:
+    /**
+     * @brief Constructor for LsmStore.
+     * @param dir The directory of the runs and the manifest, created by open if missing.
+     * @param compare The order of the keys.
+     */
+    LsmStore(const std::string& dir, int max_level = 16, const Compare& compare = Compare());
+
+    /**
+     * @brief Deconstructor for LsmStore.
+     * To flush the memtables and stop the background threads.
+     */
+    ~LsmStore();
+
+    LsmStore(const LsmStore&) = delete;
+    LsmStore& operator=(const LsmStore&) = delete;
+
+    /**
+     * @brief To open the runs listed by the manifest of the directory, files of a flush or a
+     * merge that did not finish are removed.
+     * @return False if the manifest or a run is damaged.
+     */
+    bool open();
+
+    /**
+     * @brief To log the writes of every memtable from now on, memtable id to <path>-<id>, see
+     * tSkipList::open_wal. The logs of memtables that were not flushed before a crash are
+     * replayed into frozen memtables first, which are flushed in the background. The log of a
+     * memtable is removed once its run is in the manifest. Call it after open and before
+     * the first write, the active memtable is replaced.
+     * @return True if every log was replayed and the new one opened.
+     */
+    bool open_wal(const std::string& path = WAL_FILE, SyncPolicy policy = SyncPolicy::Always, int interval_ms = 100);
+
+    /**
+     * @brief To choose the bytes of the active memtable after which it is frozen and flushed.
+     * Up to kLsmMaxFrozen frozen memtables wait for their flush on top of it, writers wait once
+     * that many are behind.
+     * @param bytes The size of a memtable, 0 for kLsmMemtableBytes.
+     */
+    void set_memory_budget(size_t bytes);
+
+    /**
+     * @brief To choose the bits per key of the Bloom filters of the memtables and runs made
+     * from now on, 0 for none. The false positive rate is about 1% at 10 bits.
+     */
+    void set_bloom_bits(unsigned bits_per_key);
+
+    /**
+     * @brief To compress the large records of the memtable logs opened from now on, see
+     * tSkipList::set_compression. The runs are not compressed, a lookup reads its one block
+     * straight from the mapping.
+     */
+    void set_compression(Compression compression);
+
+    /**
+     * @brief To choose how many runs of a tier are merged into one run of the next tier.
+     * Fewer runs mean less runs for a read to look at, more mean less rewriting of the data.
+     */
+    void set_tier_runs(size_t runs);
+
+    /**
+     * @return The bytes of all memtables and their filters, see tSkipList::memory_usage.
+     */
+    size_t memory_usage();
+
+    /**
+     * @return The number of versions in the memtables and runs, tombstones included, an upper
+     * bound of the number of elements until the merges catch up.
+     */
+    int size();
+
+    /**
+     * @return The number of runs on disk.
+     */
+    size_t table_count();
+
+    /**
+     * @brief To insert an element.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, const V&);
+    int insert_element(const K&, V&&);
+
+    /**
+     * @brief To insert an element whose value is constructed from args.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    template <typename... Args>
+    int emplace(const K& key, Args&&... args);
+
+    /**
+     * @brief To write value to key without reading the older versions.
+     * @return 1 if the active memtable had key, 0 otherwise.
+     */
+    template <typename M>
+    int insert_or_assign(const K& key, M&& value);
+
+    /**
+     * @brief To write value to key like insert_or_assign, the element expires ttl_ms
+     * milliseconds from now. Reads skip it and the merge into the oldest run drops it.
+     * @param ttl_ms Milliseconds to live, 0 for no expiry.
+     */
+    template <typename M>
+    int put(const K& key, M&& value, uint64_t ttl_ms);
+
+    /**
+     * @brief To search element by its key, in the memtables and then in the runs.
+     * @return True if found, False if not found.
+     */
+    bool search_element(const K&, V&);
+
+    /**
+     * @brief To delete element by its key, a tombstone is written if it is found.
+     * @return 0 if succeeds, 1 if not found.
+     */
+    int delete_element(const K&);
+
+    /**
+     * @brief To search a batch of keys in one view of the store.
+     * @param values Resized to the number of keys, values[i] is set if found[i].
+     * @return The number of keys found.
+     */
+    int multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found);
+
+    /**
+     * @brief To freeze the active memtable and wait until every frozen memtable is on disk.
+     * @return False if a flush failed.
+     */
+    bool flush();
+
+    /**
+     * @brief Expired elements are skipped by reads and dropped by merges, there is no sweeper.
+     * @return True.
+     */
+    bool start_expiry(int interval_ms = 100, size_t max_nodes = 1024);
+    void stop_expiry();
+
+    /**
+     * @class Iterator
+     * @brief The Iterator class is used to walk the elements in key order.
+     * It merges one tSkipList::Iterator per memtable and one cursor per run of the view it
+     * was made with. The runs of the view stay as they are, while writers go on in the
+     * memtables, see tSkipList::Iterator.
+     */
+    class Iterator {
+    public:
+        explicit Iterator(LsmStore* store);
+        Iterator(Iterator&&) = default;
+
+        /**
+         * @return True if the iterator is on an element.
+         */
+        bool valid() const { return _merger.valid(); }
+
+        const K& key() const { return _merger.key(); }
+        const V& value() const { return _merger.entry().value; }
+
+        /**
+         * @brief To move to the first element.
+         */
+        void seek_to_first();
+
+        /**
+         * @brief To move to the first element whose key is not less than key.
+         */
+        void seek(const K& key);
+
+        /**
+         * @brief To move to the next element, the iterator must be valid.
+         */
+        void next();
+
+    private:
+        /**
+         * @brief To move past the tombstones and expired elements.
+         */
+        void skip_dead();
+
+        std::shared_ptr<View> _view;
+        Merger _merger;
+    };
+
+    /**
+     * @return An iterator that is not on any element yet, seek it first.
+     */
+    Iterator new_iterator();
+
+private:
+    /**
+     * @brief To order keys by Compare, equal keys are the ones neither is less than.
+     */
+    bool less(const K& a, const K& b) const { return _compare(a, b); }
+
+    /**
+     * @return True unless the entry is a tombstone or expired at now.
+     */
+    static bool live(const Entry& entry, uint64_t now) {
+        return !entry.deleted && (entry.expire_at == 0 || now < entry.expire_at);
+    }
+
+    /**
+     * @brief To decode a record of a run.
+     */
+    static bool decode_record(const SnapshotRecord& record, K& key, Entry& entry);
+
+    /**
+     * @return The view installed last.
+     */
+    std::shared_ptr<View> view() const { return std::atomic_load(&_view); }
+
+    /**
+     * @brief To install a new view, called with _mutex held.
+     */
+    void install(const std::shared_ptr<View>& next) { std::atomic_store(&_view, next); }
+
+    /**
+     * @return The hash of the encoding of key, the one the filters hold.
+     */
+    static uint64_t key_hash(const K& key) {
+        std::string bytes;
+        KeyCodec::encode(key, bytes);
+        return hash_bytes(bytes.data(), bytes.size());
+    }
+
+    /**
+     * @brief To find the newest version of key in the view, skipping the memtables and runs
+     * whose filter does not have hash.
+     * @return True if a memtable or run has key, entry may be a tombstone though.
+     */
+    bool lookup(const View& view, const K& key, uint64_t hash, Entry& entry) const;
+
+    /**
+     * @brief To find key in the one block of the run that may hold it.
+     */
+    bool table_get(const Table& table, const K& key, uint64_t hash, Entry& entry) const;
+
+    /**
+     * @brief To write entry to the active memtable, and to freeze it if it is full.
+     */
+    int write(const K& key, Entry&& entry);
+
+    /**
+     * @brief To write entry to the active memtable if key has no live version.
+     * @return 0 if written, 1 if key exists.
+     */
+    int insert_absent(const K& key, Entry&& entry);
+
+    /**
+     * @brief To move the active memtable to the frozen ones and start a new one, waiting for
+     * room if kLsmMaxFrozen memtables are frozen already.
+     * @param only_if_full To keep the active memtable unless it reached its size, else unless
+     * it is empty.
+     */
+    void freeze(bool only_if_full);
+
+    /**
+     * @return A new memtable with its log if the store has one, NULL if the log failed.
+     */
+    std::shared_ptr<Memtable> new_memtable(uint64_t id);
+
+    /**
+     * @brief To write the records of source to the run id.
+     * @param bottom To drop the tombstones and expired elements, nothing older can be shadowed.
+     * @param table Set to the opened run, NULL if no record was left.
+     * @return False if the run could not be written.
+     */
+    bool write_table(uint64_t id, unsigned tier, Merger& source, bool bottom, std::shared_ptr<Table>& table);
+
+    /**
+     * @return The run id opened with its index, NULL if it is damaged.
+     */
+    std::shared_ptr<Table> open_table(uint64_t id, unsigned tier);
+
+    /**
+     * @brief To write the manifest listing tables, called with _mutex held.
+     */
+    bool write_manifest(const std::vector<std::shared_ptr<Table> >& tables);
+
+    /**
+     * @brief To find the run of the lowest tier with at least _tier_runs tables.
+     * Tiers do not decrease from the newest run to the oldest, so the tables of a tier are
+     * next to each other and their merge can take their place.
+     * @return True if [first, last) of view.tables are to be merged.
+     */
+    bool compaction_group(const View& view, size_t& first, size_t& last) const;
+
+    /**
+     * @brief To flush the frozen memtables, oldest first, on a background thread.
+     */
+    void flush_loop();
+
+    /**
+     * @brief To merge the runs of a full tier on a background thread.
+     */
+    void compact_loop();
+
+    /**
+     * @return The ids of the memtable logs below _wal_path in increasing order.
+     */
+    std::vector<uint64_t> log_ids() const;
+
+    std::string table_path(uint64_t id) const { return _dir + "/" + std::to_string(id) + ".sst"; }
+    std::string log_path(uint64_t id) const { return _wal_path + "-" + std::to_string(id); }
+
+    // the directory of the runs and the manifest
+    const std::string _dir;
+
+    const int _max_level;
+
+    Compare _compare;
+
+    // the size after which the active memtable is frozen
+    std::atomic<size_t> _memtable_bytes;
+
+    // runs of a tier that are merged
+    std::atomic<size_t> _tier_runs;
+
+    // bits per key of the filters of new memtables and runs
+    std::atomic<unsigned> _bloom_bits;
+
+    // compression of the logs of new memtables
+    std::atomic<Compression> _compression;
+
+    // writers hold it shared while they write to _active, freeze holds it to replace _active
+    std::shared_timed_mutex _gate;
+    std::shared_ptr<Memtable> _active;
+
+    // guards everything below, and the installs of _view
+    std::mutex _mutex;
+    std::condition_variable _cond;
+
+    // read without _mutex through view()
+    std::shared_ptr<View> _view;
+
+    // the next id of a memtable or run
+    uint64_t _next_id;
+
+    // the logs of the memtables, empty if there are none
+    std::string _wal_path;
+    SyncPolicy _wal_policy;
+    int _wal_interval;
+
+    // flushes that failed so far, flush returns once one more failed
+    uint64_t _flush_errors;
+
+    // memtables and runs dropped from the views while their keys and values may still be
+    // referenced, only kept if K or V is zero copy
+    std::vector<std::shared_ptr<void> > _retired;
+
+    bool _stop;
+    std::thread _flusher;
+    std::thread _compactor;
+};
+
+
+template<typename K, typename V, typename Compare, typename Serializer>
+LsmStore<K, V, Compare, Serializer>::LsmStore(const std::string& dir, int max_level, const Compare& compare)
+    : _dir(dir), _max_level(max_level), _compare(compare), _memtable_bytes(kLsmMemtableBytes),
+      _tier_runs(kLsmTierRuns), _bloom_bits(kLsmBloomBits), _compression(Compression::None), _view(new View()), _next_id(1), _wal_policy(SyncPolicy::Always),
+      _wal_interval(100), _flush_errors(0), _stop(false) {
+    _active = new_memtable(_next_id++);
+    _view->active = _active;
+    _flusher = std::thread(&LsmStore::flush_loop, this);
+    _compactor = std::thread(&LsmStore::compact_loop, this);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+LsmStore<K, V, Compare, Serializer>::~LsmStore() {
+    if (!flush())
+        SKIPLIST_LOG(Error, "LsmStore: memtables of " << _dir << " not flushed at close");
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cond.notify_all();
+    _flusher.join();
+    _compactor.join();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::open() {
+    if (::mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        SKIPLIST_LOG(Error, "LsmStore: can not create " << _dir);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::shared_ptr<View> next(new View(*_view));
+
+    std::string path = _dir + "/LSM";
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        std::string data;
+        bool ok = ::fstat(fd, &st) == 0 && st.st_size >= 24 && st.st_size < (1 << 24);
+        if (ok) {
+            data.resize(static_cast<size_t>(st.st_size));
+            ok = read_fully(fd, &data[0], data.size());
+        }
+        ::close(fd);
+        ok = ok && memcmp(data.data(), kLsmManifestMagic, sizeof(kLsmManifestMagic)) == 0
+             && get_fixed32(data.data() + 8) == kLsmManifestVersion
+             && crc32c(0, data.data(), data.size() - 4) == get_fixed32(data.data() + data.size() - 4)
+             && data.size() == 28 + 12 * static_cast<size_t>(get_fixed32(data.data() + 20));
+        if (!ok) {
+            SKIPLIST_LOG(Error, "LsmStore: damaged manifest " << path);
+            return false;
+        }
+        _next_id = std::max(_next_id, get_fixed64(data.data() + 12));
+        uint32_t count = get_fixed32(data.data() + 20);
+        next->tables.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            const char* p = data.data() + 24 + 12 * i;
+            std::shared_ptr<Table> table = open_table(get_fixed64(p), get_fixed32(p + 8));
+            if (!table)
+                return false;
+            _next_id = std::max(_next_id, table->id + 1);
+            next->tables.push_back(table);
+        }
+    }
+
+    // runs that never made it into the manifest
+    if (DIR* d = ::opendir(_dir.c_str())) {
+        while (struct dirent* entry = ::readdir(d)) {
+            std::string name = entry->d_name;
+            std::string::size_type dot = name.find('.');
+            if (dot == 0 || dot == std::string::npos || name.find_first_not_of("0123456789") != dot
+                || (name.compare(dot, std::string::npos, ".sst") != 0 && name.compare(dot, std::string::npos, ".sst.tmp") != 0))
+                continue;
+            uint64_t id = strtoull(name.c_str(), nullptr, 10);
+            bool listed = false;
+            for (const auto& table : next->tables)
+                listed = listed || (table->id == id && name.size() == dot + 4);
+            if (!listed)
+                ::unlink((_dir + "/" + name).c_str());
+        }
+        ::closedir(d);
+    }
+
+    // the memtable made by the constructor may have the id of a run
+    std::shared_ptr<Memtable> fresh = new_memtable(_next_id++);
+    if (!fresh)
+        return false;
+    next->active = fresh;
+    {
+        std::unique_lock<std::shared_timed_mutex> gate(_gate);
+        _active = fresh;
+        install(next);
+    }
+    _cond.notify_all();
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::open_wal(const std::string& path, SyncPolicy policy, int interval_ms) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wal_path = path;
+    _wal_policy = policy;
+    _wal_interval = interval_ms;
+    std::shared_ptr<View> next(new View(*_view));
+
+    // the logs of memtables a crash left behind, newer than every run, oldest first
+    for (uint64_t id : log_ids()) {
+        std::shared_ptr<Memtable> mem = new_memtable(id);
+        if (!mem)
+            return false;
+        _next_id = std::max(_next_id, id + 1);
+        if (mem->list.size() == 0) {
+            WriteAheadLog(log_path(id)).remove_segments_before(UINT64_MAX);
+            continue;
+        }
+        next->frozen.insert(next->frozen.begin(), mem);
+    }
+
+    std::shared_ptr<Memtable> fresh = new_memtable(_next_id++);
+    if (!fresh)
+        return false;
+    next->active = fresh;
+    {
+        std::unique_lock<std::shared_timed_mutex> gate(_gate);
+        _active = fresh;
+        install(next);
+    }
+    _cond.notify_all();
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::set_memory_budget(size_t bytes) {
+    _memtable_bytes.store(bytes == 0 ? kLsmMemtableBytes : bytes, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::set_bloom_bits(unsigned bits_per_key) {
+    _bloom_bits.store(bits_per_key, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::set_compression(Compression compression) {
+    _compression.store(compression, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::set_tier_runs(size_t runs) {
+    _tier_runs.store(runs < 2 ? 2 : runs, std::memory_order_relaxed);
+    _cond.notify_all();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+size_t LsmStore<K, V, Compare, Serializer>::memory_usage() {
+    std::shared_ptr<View> v = view();
+    size_t bytes = v->active->memory_usage();
+    for (const auto& mem : v->frozen)
+        bytes += mem->memory_usage();
+    return bytes;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::size() {
+    std::shared_ptr<View> v = view();
+    uint64_t count = static_cast<uint64_t>(v->active->list.size());
+    for (const auto& mem : v->frozen)
+        count += static_cast<uint64_t>(mem->list.size());
+    for (const auto& table : v->tables)
+        count += table->file.count();
+    return static_cast<int>(count);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+size_t LsmStore<K, V, Compare, Serializer>::table_count() {
+    return view()->tables.size();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::insert_element(const K& key, const V& value) {
+    return insert_absent(key, Entry(value, 0));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::insert_element(const K& key, V&& value) {
+    return insert_absent(key, Entry(std::move(value), 0));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+template <typename... Args>
+int LsmStore<K, V, Compare, Serializer>::emplace(const K& key, Args&&... args) {
+    return insert_absent(key, Entry(V(std::forward<Args>(args)...), 0));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+template <typename M>
+int LsmStore<K, V, Compare, Serializer>::insert_or_assign(const K& key, M&& value) {
+    return write(key, Entry(std::forward<M>(value), 0));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+template <typename M>
+int LsmStore<K, V, Compare, Serializer>::put(const K& key, M&& value, uint64_t ttl_ms) {
+    uint64_t expire_at = ttl_ms == 0 ? 0 : wall_clock_ms() + ttl_ms;
+    return write(key, Entry(std::forward<M>(value), expire_at));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::search_element(const K& key, V& value_out) {
+    std::shared_ptr<View> v = view();
+    Entry entry;
+    if (!lookup(*v, key, key_hash(key), entry) || !live(entry, wall_clock_ms()))
+        return false;
+    value_out = std::move(entry.value);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::delete_element(const K& key) {
+    bool full;
+    uint64_t hash = key_hash(key);
+    {
+        // _active is the active memtable of the view while the gate is held
+        std::shared_lock<std::shared_timed_mutex> gate(_gate);
+        Entry entry;
+        if (!lookup(*view(), key, hash, entry) || !live(entry, wall_clock_ms()))
+            return 1;
+        _active->add(hash);
+        _active->list.insert_or_assign(key, Entry(V(), 0, true));
+        full = _active->list.memory_usage() >= _memtable_bytes.load(std::memory_order_relaxed);
+    }
+    if (full)
+        freeze(true);
+    return 0;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+    std::shared_ptr<View> v = view();
+    uint64_t now = wall_clock_ms();
+    int count = 0;
+    Entry entry;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (lookup(*v, keys[i], key_hash(keys[i]), entry) && live(entry, now)) {
+            values[i] = std::move(entry.value);
+            found[i] = true;
+            count++;
+        }
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::flush() {
+    freeze(false);
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t errors = _flush_errors;
+    while (!_view->frozen.empty() && _flush_errors == errors)
+        _cond.wait(lock);
+    return _view->frozen.empty();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::start_expiry(int, size_t) {
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::stop_expiry() {
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::write(const K& key, Entry&& entry) {
+    bool full;
+    int ret;
+    uint64_t hash = key_hash(key);
+    {
+        std::shared_lock<std::shared_timed_mutex> gate(_gate);
+        _active->add(hash);
+        ret = _active->list.insert_or_assign(key, std::move(entry));
+        full = _active->list.memory_usage() >= _memtable_bytes.load(std::memory_order_relaxed);
+    }
+    if (full)
+        freeze(true);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+int LsmStore<K, V, Compare, Serializer>::insert_absent(const K& key, Entry&& entry) {
+    bool full;
+    int ret = 0;
+    uint64_t hash = key_hash(key);
+    {
+        // the active memtable can not be frozen between the lookup and the write
+        std::shared_lock<std::shared_timed_mutex> gate(_gate);
+        uint64_t now = wall_clock_ms();
+        Entry found;
+        if (lookup(*view(), key, hash, found) && live(found, now))
+            return 1;
+        _active->add(hash);
+        if (_active->list.emplace(key, entry) != 0) {
+            // a dead version in the memtable, or a writer that came in since the lookup
+            bool replaced = false;
+            _active->list.update(key, [&](Entry& current) {
+                if (!live(current, now)) {
+                    current = std::move(entry);
+                    replaced = true;
+                }
+            });
+            ret = replaced ? 0 : 1;
+        }
+        full = _active->list.memory_usage() >= _memtable_bytes.load(std::memory_order_relaxed);
+    }
+    if (full)
+        freeze(true);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::lookup(const View& view, const K& key, uint64_t hash, Entry& entry) const {
+    if (view.active->may_contain(hash) && view.active->list.search_element(key, entry))
+        return true;
+    for (const auto& mem : view.frozen) {
+        if (mem->may_contain(hash) && mem->list.search_element(key, entry))
+            return true;
+    }
+    for (const auto& table : view.tables) {
+        if (table_get(*table, key, hash, entry))
+            return true;
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::table_get(const Table& table, const K& key, uint64_t hash, Entry& entry) const {
+    if (!table.file.may_contain(hash))
+        return false;
+    // the first block whose last key is not less than key is the only one that may hold it
+    auto it = std::lower_bound(table.last_keys.begin(), table.last_keys.end(), key, _compare);
+    if (it == table.last_keys.end())
+        return false;
+    SSTableBlock block;
+    if (!table.file.read_block(static_cast<size_t>(it - table.last_keys.begin()), block)) {
+        SKIPLIST_LOG(Error, "LsmStore: block checksum mismatch in " << table.file.path());
+        return false;
+    }
+    SnapshotRecord record;
+    K record_key;
+    while (block.next(record)) {
+        if (!KeyCodec::decode(record.key, record.key_size, record_key))
+            return false;
+        if (less(record_key, key))
+            continue;
+        if (less(key, record_key))
+            return false;
+        return decode_record(record, record_key, entry);
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::decode_record(const SnapshotRecord& record, K& key, Entry& entry) {
+    if (!KeyCodec::decode(record.key, record.key_size, key))
+        return false;
+    entry.deleted = record.deleted;
+    entry.expire_at = record.expire_at;
+    return record.deleted || ValueCodec::decode(record.value, record.value_size, entry.value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::freeze(bool only_if_full) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_view->frozen.size() >= kLsmMaxFrozen && !_stop)
+        _cond.wait(lock);
+    // another writer may have frozen it meanwhile
+    if (only_if_full ? _active->list.memory_usage() < _memtable_bytes.load(std::memory_order_relaxed)
+                     : _active->list.size() == 0)
+        return;
+
+    // the next memtable and its log are made before the writers are held off
+    std::shared_ptr<Memtable> fresh = new_memtable(_next_id++);
+    if (!fresh) {
+        SKIPLIST_LOG(Error, "LsmStore: can not open the log of a memtable, " << _wal_path);
+        return;
+    }
+    std::shared_ptr<View> next(new View(*_view));
+    next->frozen.insert(next->frozen.begin(), _active);
+    next->active = fresh;
+    {
+        std::unique_lock<std::shared_timed_mutex> gate(_gate);
+        _active = fresh;
+        install(next);
+    }
+    _cond.notify_all();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+std::shared_ptr<typename LsmStore<K, V, Compare, Serializer>::Memtable> LsmStore<K, V, Compare, Serializer>::new_memtable(uint64_t id) {
+    std::shared_ptr<Memtable> mem = std::make_shared<Memtable>(id, _max_level, _compare,
+        _memtable_bytes.load(std::memory_order_relaxed), _bloom_bits.load(std::memory_order_relaxed));
+    mem->list.set_compression(_compression.load(std::memory_order_relaxed));
+    if (!_wal_path.empty() && !mem->list.open_wal(log_path(id), _wal_policy, _wal_interval))
+        return std::shared_ptr<Memtable>();
+    // the replay of the log went around the filter
+    if (mem->filter && mem->list.size() != 0) {
+        auto it = mem->list.new_iterator();
+        for (it.seek_to_first(); it.valid(); it.next())
+            mem->add(key_hash(it.key()));
+    }
+    return mem;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::write_table(uint64_t id, unsigned tier, Merger& source, bool bottom, std::shared_ptr<Table>& table) {
+    table.reset();
+    SnapshotWriter writer(kLsmBlockSize);
+    writer.index_blocks(_bloom_bits.load(std::memory_order_relaxed));
+    if (!writer.open(table_path(id)))
+        return false;
+    uint64_t now = wall_clock_ms();
+    uint64_t count = 0;
+    std::string key;
+    std::string value;
+    for (source.seek_to_first(); source.valid(); source.next()) {
+        const Entry& entry = source.entry();
+        if (bottom && !live(entry, now))
+            continue;
+        key.clear();
+        KeyCodec::encode(source.key(), key);
+        bool ok;
+        if (entry.deleted) {
+            ok = writer.add_deleted(key);
+        } else {
+            value.clear();
+            ValueCodec::encode(entry.value, value);
+            // a run is not rebuilt into a list, the level of its records means nothing
+            ok = writer.add(0, key, value, entry.expire_at);
+        }
+        if (!ok)
+            return false;
+        count++;
+    }
+    // the writer drops its file if finish is not called, a run without the rest of a damaged
+    // source must not replace it
+    if (source.failed()) {
+        SKIPLIST_LOG(Error, "LsmStore: a source of run " << id << " is damaged, the sources are kept");
+        return false;
+    }
+    if (count == 0)
+        return true;
+    if (!writer.finish(count, 0))
+        return false;
+    table = open_table(id, tier);
+    if (!table) {
+        ::unlink(table_path(id).c_str());
+        return false;
+    }
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+std::shared_ptr<typename LsmStore<K, V, Compare, Serializer>::Table> LsmStore<K, V, Compare, Serializer>::open_table(uint64_t id, unsigned tier) {
+    std::shared_ptr<Table> table = std::make_shared<Table>(id, tier);
+    if (!table->file.open(table_path(id))) {
+        SKIPLIST_LOG(Error, "LsmStore: " << table->file.error());
+        return std::shared_ptr<Table>();
+    }
+    table->last_keys.resize(table->file.block_count());
+    for (size_t i = 0; i < table->last_keys.size(); ++i) {
+        Slice last = table->file.last_key(i);
+        if (!KeyCodec::decode(last.data(), last.size(), table->last_keys[i])) {
+            SKIPLIST_LOG(Error, "LsmStore: bad key in the index of " << table->file.path());
+            return std::shared_ptr<Table>();
+        }
+    }
+    return table;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::write_manifest(const std::vector<std::shared_ptr<Table> >& tables) {
+    std::string data(kLsmManifestMagic, sizeof(kLsmManifestMagic));
+    put_fixed32(data, kLsmManifestVersion);
+    put_fixed64(data, _next_id);
+    put_fixed32(data, static_cast<uint32_t>(tables.size()));
+    for (const auto& table : tables) {
+        put_fixed64(data, table->id);
+        put_fixed32(data, table->tier);
+    }
+    put_fixed32(data, crc32c(0, data.data(), data.size()));
+    return replace_file(_dir + "/LSM", data);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::compaction_group(const View& view, size_t& first, size_t& last) const {
+    const size_t runs = _tier_runs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < view.tables.size(); i = last) {
+        last = i;
+        while (last < view.tables.size() && view.tables[last]->tier == view.tables[i]->tier)
+            last++;
+        if (last - i >= runs) {
+            first = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::flush_loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        if (_view->frozen.empty()) {
+            if (_stop)
+                return;
+            _cond.wait(lock);
+            continue;
+        }
+        // the oldest frozen memtable is newer than every run, only the runs are older
+        std::shared_ptr<Memtable> mem = _view->frozen.back();
+        bool bottom = _view->tables.empty();
+        lock.unlock();
+
+        Merger source(this);
+        source.add(mem->list.new_iterator());
+        std::shared_ptr<Table> table;
+        bool ok = write_table(mem->id, 0, source, bottom, table);
+
+        lock.lock();
+        if (ok) {
+            std::shared_ptr<View> next(new View(*_view));
+            next->frozen.pop_back();
+            if (table)
+                next->tables.insert(next->tables.begin(), table);
+            ok = write_manifest(next->tables);
+            if (ok) {
+                install(next);
+                if (kZeroCopy)
+                    _retired.push_back(mem);
+                if (!_wal_path.empty())
+                    WriteAheadLog(log_path(mem->id)).remove_segments_before(UINT64_MAX);
+            } else if (table) {
+                ::unlink(table->file.path().c_str());
+            }
+        }
+        if (!ok) {
+            _flush_errors++;
+            SKIPLIST_LOG(Error, "LsmStore: flush of memtable " << mem->id << " to " << _dir << " failed");
+            _cond.notify_all();
+            if (_stop)
+                return;
+            _cond.wait_for(lock, std::chrono::seconds(1));
+            continue;
+        }
+        _cond.notify_all();
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::compact_loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop) {
+        size_t first = 0;
+        size_t last = 0;
+        if (!compaction_group(*_view, first, last)) {
+            _cond.wait(lock);
+            continue;
+        }
+        // runs are only added in front while the merge runs, the group stays where it is
+        std::vector<std::shared_ptr<Table> > group(_view->tables.begin() + first, _view->tables.begin() + last);
+        bool bottom = last == _view->tables.size();
+        uint64_t id = _next_id++;
+        lock.unlock();
+
+        Merger source(this);
+        for (const auto& table : group)
+            source.add(table.get());
+        std::shared_ptr<Table> merged;
+        bool ok = write_table(id, group.front()->tier + 1, source, bottom, merged);
+
+        lock.lock();
+        if (ok) {
+            std::shared_ptr<View> next(new View(*_view));
+            auto pos = std::find(next->tables.begin(), next->tables.end(), group.front());
+            pos = next->tables.erase(pos, pos + group.size());
+            if (merged)
+                next->tables.insert(pos, merged);
+            ok = write_manifest(next->tables);
+            if (ok) {
+                install(next);
+                // readers of older views keep the mappings, the files can go
+                for (const auto& table : group) {
+                    ::unlink(table->file.path().c_str());
+                    if (kZeroCopy)
+                        _retired.push_back(table);
+                }
+            } else if (merged) {
+                ::unlink(merged->file.path().c_str());
+            }
+        }
+        if (!ok) {
+            SKIPLIST_LOG(Error, "LsmStore: merge of " << group.size() << " runs of " << _dir << " failed");
+            _cond.wait_for(lock, std::chrono::seconds(1));
+        }
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+std::vector<uint64_t> LsmStore<K, V, Compare, Serializer>::log_ids() const {
+    std::vector<uint64_t> ids;
+    std::string::size_type slash = _wal_path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : _wal_path.substr(0, slash);
+    std::string prefix = (slash == std::string::npos ? _wal_path : _wal_path.substr(slash + 1)) + "-";
+    DIR* d = ::opendir(dir.c_str());
+    if (d == nullptr)
+        return ids;
+    // segments are named <path>-<id>.<segment>
+    while (struct dirent* entry = ::readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        std::string::size_type dot = name.find_first_not_of("0123456789", prefix.size());
+        if (dot == prefix.size() || dot == std::string::npos || name[dot] != '.'
+            || dot + 1 == name.size() || name.find_first_not_of("0123456789", dot + 1) != std::string::npos)
+            continue;
+        ids.push_back(strtoull(name.c_str() + prefix.size(), nullptr, 10));
+    }
+    ::closedir(d);
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::TableIterator::seek_to_first() {
+    _failed = false;
+    open_block(0);
+    step();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::TableIterator::seek(const K& key) {
+    auto it = std::lower_bound(_table->last_keys.begin(), _table->last_keys.end(), key, _store->_compare);
+    _failed = false;
+    open_block(static_cast<size_t>(it - _table->last_keys.begin()));
+    step();
+    while (_valid && _store->less(_key, key))
+        step();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::TableIterator::open_block(size_t i) {
+    _block = i;
+    _cursor = SSTableBlock();
+    if (i < _table->file.block_count() && !_table->file.read_block(i, _cursor)) {
+        SKIPLIST_LOG(Error, "LsmStore: block checksum mismatch in " << _table->file.path());
+        _block = _table->file.block_count();
+        _failed = true;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::TableIterator::step() {
+    SnapshotRecord record;
+    while (!_cursor.next(record)) {
+        if (!_cursor.complete()) {
+            SKIPLIST_LOG(Error, "LsmStore: malformed block in " << _table->file.path());
+            _failed = true;
+        }
+        if (_failed || _block + 1 >= _table->file.block_count()) {
+            _block = _table->file.block_count();
+            _valid = false;
+            return;
+        }
+        open_block(_block + 1);
+    }
+    _valid = decode_record(record, _key, _entry);
+    if (!_valid) {
+        SKIPLIST_LOG(Error, "LsmStore: bad record in " << _table->file.path());
+        _failed = true;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+bool LsmStore<K, V, Compare, Serializer>::Merger::failed() const {
+    for (const auto& it : _tables) {
+        if (it.failed())
+            return true;
+    }
+    return false;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Merger::seek_to_first() {
+    for (auto& it : _mems)
+        it.seek_to_first();
+    for (auto& it : _tables)
+        it.seek_to_first();
+    settle();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Merger::seek(const K& key) {
+    for (auto& it : _mems)
+        it.seek(key);
+    for (auto& it : _tables)
+        it.seek(key);
+    settle();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Merger::settle() {
+    // source i is _mems[i] or _tables[i - _mems.size()], a lower i is newer
+    const size_t mems = _mems.size();
+    const size_t sources = mems + _tables.size();
+    auto valid = [&](size_t i) { return i < mems ? _mems[i].valid() : _tables[i - mems].valid(); };
+    auto key = [&](size_t i) -> const K& { return i < mems ? _mems[i].key() : _tables[i - mems].key(); };
+
+    size_t best = sources;
+    for (size_t i = 0; i < sources; ++i) {
+        if (valid(i) && (best == sources || _store->less(key(i), key(best))))
+            best = i;
+    }
+    _valid = best != sources;
+    if (!_valid)
+        return;
+    _key = key(best);
+    _entry = best < mems ? _mems[best].value() : _tables[best - mems].entry();
+    // every source is on a key not less than _key, the ones on _key move on
+    for (size_t i = 0; i < sources; ++i) {
+        if (!valid(i) || _store->less(_key, key(i)))
+            continue;
+        if (i < mems)
+            _mems[i].next();
+        else
+            _tables[i - mems].next();
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+LsmStore<K, V, Compare, Serializer>::Iterator::Iterator(LsmStore* store) : _view(store->view()), _merger(store) {
+    _merger.add(_view->active->list.new_iterator());
+    for (const auto& mem : _view->frozen)
+        _merger.add(mem->list.new_iterator());
+    for (const auto& table : _view->tables)
+        _merger.add(table.get());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Iterator::seek_to_first() {
+    _merger.seek_to_first();
+    skip_dead();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Iterator::seek(const K& key) {
+    _merger.seek(key);
+    skip_dead();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Iterator::next() {
+    _merger.next();
+    skip_dead();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+void LsmStore<K, V, Compare, Serializer>::Iterator::skip_dead() {
+    uint64_t now = wall_clock_ms();
+    while (_merger.valid() && !live(_merger.entry(), now))
+        _merger.next();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer>
+typename LsmStore<K, V, Compare, Serializer>::Iterator LsmStore<K, V, Compare, Serializer>::new_iterator() {
+    return Iterator(this);
+}
+
+
+#endif //SKIP_LIST_LSM_H
@@ -0,0 +1,443 @@
+/*
+ * @file        : metrics.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the Metrics class, the operation counters, latency
+ *                histograms and lock wait times of a skip list, and Stats, a copy of them that
+ *                can be written in the Prometheus text format.
+ *
+ *                The first kSlots threads own a cache line aligned slot each and count with
+ *                plain relaxed stores, the threads after them share one more slot and count
+ *                with atomic adds.
+ *                Every SKIPLIST_METRICS_SAMPLE-th operation of a thread is timed, the others
+ *                read no clock. SKIPLIST_METRICS=0 compiles all of it out.
+ */
+
+#ifndef SKIP_LIST_METRICS_H
+#define SKIP_LIST_METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef SKIPLIST_METRICS
+#define SKIPLIST_METRICS 1
+#endif
+
+#ifndef SKIPLIST_METRICS_SAMPLE
+#define SKIPLIST_METRICS_SAMPLE 16
+#endif
+
+
+/**
+ * @class LatencyHistogram
+ * @brief HDR style buckets of nanoseconds: exact below 8, then 8 buckets per power of two,
+ * so a bucket is at most 12.5% wider than its lower bound.
+ */
+class LatencyHistogram {
+public:
+    static const int kSubBits = 3;
+    static const int kMaxExponent = 39;
+    static const int kBuckets = (kMaxExponent - kSubBits + 2) << kSubBits;
+
+    /**
+     * @return The bucket of ns, values above 2^40 ns go to the last one.
+     */
+    static int bucket_of(uint64_t ns) {
+        if (ns < (1u << kSubBits))
+            return static_cast<int>(ns);
+        int exponent = 63 - __builtin_clzll(ns);
+        if (exponent > kMaxExponent)
+            return kBuckets - 1;
+        int sub = static_cast<int>(ns >> (exponent - kSubBits)) & ((1 << kSubBits) - 1);
+        return ((exponent - kSubBits + 1) << kSubBits) + sub;
+    }
+
+    /**
+     * @return The highest value of the bucket.
+     */
+    static uint64_t upper_bound(int bucket) {
+        if (bucket < (1 << kSubBits))
+            return bucket;
+        int exponent = (bucket >> kSubBits) + kSubBits - 1;
+        uint64_t sub = bucket & ((1 << kSubBits) - 1);
+        uint64_t width = uint64_t(1) << (exponent - kSubBits);
+        return (((1 << kSubBits) + sub) << (exponent - kSubBits)) + width - 1;
+    }
+
+    LatencyHistogram() : _buckets(static_cast<size_t>(kBuckets), 0), _count(0), _sum(0) {}
+
+    void add(int bucket, uint64_t count) {
+        _buckets[bucket] += count;
+        _count += count;
+    }
+
+    void add_sum(uint64_t ns) { _sum += ns; }
+
+    /**
+     * @return The value that q of the samples are not above, 0 if there are none.
+     */
+    uint64_t percentile(double q) const {
+        if (_count == 0)
+            return 0;
+        // the rank of the sample, counted from 0
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * _count));
+        rank = rank == 0 ? 0 : std::min(rank, _count) - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            seen += _buckets[i];
+            if (seen > rank)
+                return upper_bound(i);
+        }
+        return upper_bound(kBuckets - 1);
+    }
+
+    uint64_t count() const { return _count; }
+    uint64_t sum() const { return _sum; }
+
+private:
+    std::vector<uint64_t> _buckets;
+    uint64_t _count;
+    uint64_t _sum;
+};
+
+/**
+ * @struct Stats
+ * @brief The Stats struct is a copy of the metrics of a list taken by stats().
+ * The counters of concurrent threads are read one by one, not at one instant.
+ */
+struct Stats {
+    enum Op { kGet, kPut, kDelete, kScan, kOps };
+
+    // calls per operation, and the ones that found their key, or inserted it for kPut
+    uint64_t ops[kOps];
+    uint64_t hits[kOps];
+
+    // latency of the timed calls, see SKIPLIST_METRICS_SAMPLE
+    LatencyHistogram latency[kOps];
+
+    // node lock acquisitions that had to wait, and the time they waited
+    uint64_t lock_waits;
+    uint64_t lock_wait_ns;
+
+    // current level of the skip list and the number of nodes of every level
+    int level;
+    std::vector<uint64_t> level_nodes;
+
+    // bytes of the nodes with their forward arrays, not counting what keys and values own
+    size_t node_bytes;
+
+    // tSkipList only: the bytes counted against its memory budget and the elements it evicted
+    size_t memory_bytes;
+    uint64_t evictions;
+
+    Stats() : lock_waits(0), lock_wait_ns(0), level(0), node_bytes(0), memory_bytes(0), evictions(0) {
+        for (int i = 0; i < kOps; ++i)
+            ops[i] = hits[i] = 0;
+    }
+
+    /**
+     * @return The share of the calls of op that hit, 0 if there were none.
+     */
+    double hit_ratio(Op op) const { return ops[op] == 0 ? 0 : double(hits[op]) / ops[op]; }
+
+    /**
+     * @brief To write the stats in the Prometheus text exposition format.
+     * @param prefix The prefix of the metric names.
+     * @param labels Extra labels of every sample, e.g. shard="0", empty for none.
+     */
+    std::string prometheus(const std::string& prefix = "skiplist", const std::string& labels = "") const;
+};
+
+/**
+ * @class Metrics
+ * @brief The Metrics class is used to count the operations of one list.
+ */
+class Metrics {
+public:
+    typedef Stats::Op Op;
+    static const int kSlots = 8;
+    static const int kLevels = 64;
+
+    Metrics();
+    ~Metrics();
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    /**
+     * @return The start of a timed call, 0 if this call of the thread is not timed.
+     */
+    uint64_t start();
+
+    /**
+     * @brief To count a call of op.
+     * @param start The value start() returned for the call.
+     */
+    void record(Op op, bool hit, uint64_t start);
+
+    /**
+     * @brief To count delta nodes of level, levels above kLevels - 1 are counted there.
+     */
+    void add_nodes(int level, int64_t delta);
+
+    /**
+     * @brief To add the wait of a node lock acquisition that could not be taken at once.
+     */
+    void add_lock_wait(uint64_t ns);
+
+    /**
+     * @brief To add the counters to stats, level and node_bytes are left to the list.
+     */
+    void collect(Stats& stats) const;
+
+    /**
+     * @return Nanoseconds of a monotonic clock.
+     */
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> ops[Stats::kOps];
+        std::atomic<uint64_t> hits[Stats::kOps];
+        std::atomic<uint64_t> sum_ns[Stats::kOps];
+        std::atomic<uint64_t> latency[Stats::kOps][LatencyHistogram::kBuckets];
+        std::atomic<uint64_t> lock_waits;
+        std::atomic<uint64_t> lock_wait_ns;
+        std::atomic<int64_t> level_nodes[kLevels];
+
+        Slot();
+    };
+
+    /**
+     * @return The slot of the calling thread.
+     * @param shared Set if other threads add to the slot too.
+     */
+    Slot& local_slot(bool& shared);
+
+    // kSlots owned slots and the shared one on their own cache lines, allocated aligned by
+    // the constructor
+    Slot* _slots;
+};
+
+
+namespace metrics_detail {
+
+/**
+ * @brief The thread numbers assign the slots, in the order threads first count.
+ */
+inline unsigned thread_number() {
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned number = next.fetch_add(1, std::memory_order_relaxed);
+    return number;
+}
+
+/**
+ * @brief To add n to counter, with a read-modify-write only if other threads add to it.
+ */
+template <typename T>
+void add(std::atomic<T>& counter, T n, bool shared) {
+    if (shared)
+        counter.fetch_add(n, std::memory_order_relaxed);
+    else
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline unsigned& sample_tick() {
+    static thread_local unsigned tick = 0;
+    return tick;
+}
+
+template <typename T>
+void write_sample(std::ostringstream& out, const std::string& name, const std::string& labels,
+                  const std::string& extra, T value) {
+    out << name;
+    if (!labels.empty() || !extra.empty()) {
+        out << "{" << labels;
+        if (!labels.empty() && !extra.empty())
+            out << ",";
+        out << extra << "}";
+    }
+    out << " " << value << "\n";
+}
+
+} // namespace metrics_detail
+
+inline Metrics::Slot::Slot() {
+    for (int i = 0; i < Stats::kOps; ++i) {
+        ops[i].store(0, std::memory_order_relaxed);
+        hits[i].store(0, std::memory_order_relaxed);
+        sum_ns[i].store(0, std::memory_order_relaxed);
+        for (int b = 0; b < LatencyHistogram::kBuckets; ++b)
+            latency[i][b].store(0, std::memory_order_relaxed);
+    }
+    lock_waits.store(0, std::memory_order_relaxed);
+    lock_wait_ns.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < kLevels; ++i)
+        level_nodes[i].store(0, std::memory_order_relaxed);
+}
+
+inline Metrics::Metrics() : _slots(NULL) {
+#if SKIPLIST_METRICS
+    void* mem = NULL;
+    if (posix_memalign(&mem, alignof(Slot), sizeof(Slot) * (kSlots + 1)) != 0)
+        throw std::bad_alloc();
+    _slots = static_cast<Slot*>(mem);
+    for (int i = 0; i <= kSlots; ++i)
+        new (&_slots[i]) Slot();
+#endif
+}
+
+inline Metrics::~Metrics() {
+    if (_slots == NULL)
+        return;
+    for (int i = 0; i <= kSlots; ++i)
+        _slots[i].~Slot();
+    free(_slots);
+}
+
+inline Metrics::Slot& Metrics::local_slot(bool& shared) {
+    unsigned number = metrics_detail::thread_number();
+    shared = number >= static_cast<unsigned>(kSlots);
+    return _slots[shared ? kSlots : number];
+}
+
+inline uint64_t Metrics::start() {
+#if SKIPLIST_METRICS
+    if (++metrics_detail::sample_tick() % SKIPLIST_METRICS_SAMPLE == 0)
+        return now();
+#endif
+    return 0;
+}
+
+inline void Metrics::record(Op op, bool hit, uint64_t start) {
+#if SKIPLIST_METRICS
+    using metrics_detail::add;
+    bool shared;
+    Slot& slot = local_slot(shared);
+    add<uint64_t>(slot.ops[op], 1, shared);
+    if (hit)
+        add<uint64_t>(slot.hits[op], 1, shared);
+    if (start != 0) {
+        uint64_t ns = now() - start;
+        add<uint64_t>(slot.sum_ns[op], ns, shared);
+        add<uint64_t>(slot.latency[op][LatencyHistogram::bucket_of(ns)], 1, shared);
+    }
+#else
+    (void)op; (void)hit; (void)start;
+#endif
+}
+
+inline void Metrics::add_nodes(int level, int64_t delta) {
+#if SKIPLIST_METRICS
+    if (level >= kLevels)
+        level = kLevels - 1;
+    bool shared;
+    Slot& slot = local_slot(shared);
+    metrics_detail::add<int64_t>(slot.level_nodes[level], delta, shared);
+#else
+    (void)level; (void)delta;
+#endif
+}
+
+inline void Metrics::add_lock_wait(uint64_t ns) {
+#if SKIPLIST_METRICS
+    bool shared;
+    Slot& slot = local_slot(shared);
+    metrics_detail::add<uint64_t>(slot.lock_waits, 1, shared);
+    metrics_detail::add<uint64_t>(slot.lock_wait_ns, ns, shared);
+#else
+    (void)ns;
+#endif
+}
+
+inline void Metrics::collect(Stats& stats) const {
+    if (_slots == NULL)
+        return;
+    std::vector<int64_t> levels(kLevels, 0);
+    for (int s = 0; s <= kSlots; ++s) {
+        const Slot& slot = _slots[s];
+        for (int i = 0; i < Stats::kOps; ++i) {
+            stats.ops[i] += slot.ops[i].load(std::memory_order_relaxed);
+            stats.hits[i] += slot.hits[i].load(std::memory_order_relaxed);
+            stats.latency[i].add_sum(slot.sum_ns[i].load(std::memory_order_relaxed));
+            for (int b = 0; b < LatencyHistogram::kBuckets; ++b) {
+                uint64_t count = slot.latency[i][b].load(std::memory_order_relaxed);
+                if (count != 0)
+                    stats.latency[i].add(b, count);
+            }
+        }
+        stats.lock_waits += slot.lock_waits.load(std::memory_order_relaxed);
+        stats.lock_wait_ns += slot.lock_wait_ns.load(std::memory_order_relaxed);
+        // a node may be counted by the slot of its inserter and uncounted by another
+        for (int i = 0; i < kLevels; ++i)
+            levels[i] += slot.level_nodes[i].load(std::memory_order_relaxed);
+    }
+    int top = kLevels - 1;
+    while (top > 0 && levels[top] <= 0)
+        top--;
+    stats.level_nodes.assign(top + 1, 0);
+    for (int i = 0; i <= top; ++i)
+        stats.level_nodes[i] = levels[i] > 0 ? levels[i] : 0;
+}
+
+inline std::string Stats::prometheus(const std::string& prefix, const std::string& labels) const {
+    static const char* const names[] = { "get", "put", "delete", "scan" };
+    std::ostringstream out;
+    using metrics_detail::write_sample;
+
+    out << "# TYPE " << prefix << "_ops_total counter\n";
+    for (int i = 0; i < kOps; ++i)
+        write_sample(out, prefix + "_ops_total", labels, std::string("op=\"") + names[i] + "\"", ops[i]);
+    out << "# TYPE " << prefix << "_hits_total counter\n";
+    for (int i = 0; i < kOps; ++i)
+        write_sample(out, prefix + "_hits_total", labels, std::string("op=\"") + names[i] + "\"", hits[i]);
+
+    out << "# TYPE " << prefix << "_latency_seconds summary\n";
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    for (int i = 0; i < kOps; ++i) {
+        std::string op = std::string("op=\"") + names[i] + "\"";
+        for (double q : quantiles) {
+            std::ostringstream extra;
+            extra << op << ",quantile=\"" << q << "\"";
+            write_sample(out, prefix + "_latency_seconds", labels, extra.str(), latency[i].percentile(q) * 1e-9);
+        }
+        write_sample(out, prefix + "_latency_seconds_sum", labels, op, latency[i].sum() * 1e-9);
+        write_sample(out, prefix + "_latency_seconds_count", labels, op, latency[i].count());
+    }
+
+    out << "# TYPE " << prefix << "_lock_waits_total counter\n";
+    write_sample(out, prefix + "_lock_waits_total", labels, "", lock_waits);
+    out << "# TYPE " << prefix << "_lock_wait_seconds_total counter\n";
+    write_sample(out, prefix + "_lock_wait_seconds_total", labels, "", lock_wait_ns * 1e-9);
+
+    out << "# TYPE " << prefix << "_level gauge\n";
+    write_sample(out, prefix + "_level", labels, "", level);
+    out << "# TYPE " << prefix << "_level_nodes gauge\n";
+    for (size_t i = 0; i < level_nodes.size(); ++i) {
+        std::ostringstream extra;
+        extra << "level=\"" << i << "\"";
+        write_sample(out, prefix + "_level_nodes", labels, extra.str(), level_nodes[i]);
+    }
+    out << "# TYPE " << prefix << "_node_bytes gauge\n";
+    write_sample(out, prefix + "_node_bytes", labels, "", node_bytes);
+    out << "# TYPE " << prefix << "_memory_bytes gauge\n";
+    write_sample(out, prefix + "_memory_bytes", labels, "", memory_bytes);
+    out << "# TYPE " << prefix << "_evictions_total counter\n";
+    write_sample(out, prefix + "_evictions_total", labels, "", evictions);
+    return out.str();
+}
+
+
+#endif //SKIP_LIST_METRICS_H
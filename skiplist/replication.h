@@ -0,0 +1,799 @@
+/*
+ * @file        : replication.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the ReplicationServer and Replica classes, the replication
+ *                of a tSkipList to other processes by streaming its write-ahead log, see wal.h.
+ *
+ *                The primary keeps the batches its log wrote last in a backlog of bounded size.
+ *                A replica connects to the replication port and says where it stopped:
+ *
+ *                hello   : magic "KVREPL01" | u64 replication id | u64 next lsn
+ *
+ *                If the id is the one of the primary and the backlog still holds the next lsn,
+ *                the primary answers continue and streams the backlog from there. Otherwise the
+ *                replica bootstraps: the primary exports a snapshot, see export_snapshot, sends
+ *                it and streams the backlog from the lsn the snapshot covers.
+ *
+ *                continue: u8 kReplContinue | u64 id
+ *                full    : u8 kReplFull | u64 id | u64 lsn | u64 snapshot bytes | snapshot
+ *                batch   : u8 kReplBatch | u64 last lsn | u32 bytes | records as the log wrote them
+ *                ping    : u8 kReplPing | u64 last lsn of the primary, sent while it is idle
+ *
+ *                A replica applies the batches in the order of the log, so it is the list of the
+ *                primary as it was a few batches ago, and reconnects with the id and lsn it has,
+ *                so a short disconnect costs the batches it missed instead of a snapshot. A
+ *                replica that falls behind the whole backlog is dropped and bootstraps again.
+ *                While a snapshot is exported and sent the batches after it are pinned, so a
+ *                bootstrap under a heavy write load grows the backlog instead of failing.
+ */
+
+#ifndef SKIP_LIST_REPLICATION_H
+#define SKIP_LIST_REPLICATION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "logging.h"
+#include "wal.h"
+
+
+static const char kReplMagic[8] = {'K', 'V', 'R', 'E', 'P', 'L', '0', '1'};
+
+enum ReplFrame : uint8_t {
+    kReplContinue = 1,
+    kReplFull = 2,
+    kReplBatch = 3,
+    kReplPing = 4
+};
+
+// bytes of batches the primary keeps for replicas that reconnect or lag
+static const size_t kReplBacklogBytes = 64 * 1024 * 1024;
+// a ping is sent after this long without a batch, a replica gives up after kReplTimeoutMs
+static const int kReplPingMs = 1000;
+static const int kReplTimeoutMs = 5000;
+// the answer to a hello may wait for a snapshot of the whole list
+static const int kReplSyncTimeoutMs = 600 * 1000;
+
+namespace repl_detail {
+
+inline bool send_all(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t w = ::send(fd, data, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        data += w;
+        n -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, char* data, size_t n) {
+    while (n > 0) {
+        ssize_t r = ::recv(fd, data, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        data += r;
+        n -= static_cast<size_t>(r);
+    }
+    return true;
+}
+
+inline void set_timeout(int fd, int ms) {
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+inline void set_nodelay(int fd) {
+    int on = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+} // namespace repl_detail
+
+/**
+ * @class ReplicationServer
+ * @brief The ReplicationServer class is used to stream the log of a primary to its replicas.
+ * Store is a tSkipList with a write-ahead log open, it must outlive the server. Every replica
+ * gets a thread of its own, there are only a few of them.
+ */
+template <typename Store>
+class ReplicationServer {
+public:
+    /**
+     * @param store The list to replicate.
+     * @param port The TCP port the replicas connect to.
+     * @param address The IPv4 address to listen on.
+     * @param backlog_bytes The bytes of batches kept for replicas that reconnect or lag.
+     * @param snapshot_path Base path of the snapshots a bootstrap sends, removed once sent.
+     */
+    ReplicationServer(Store& store, int port, const std::string& address = "127.0.0.1",
+                      size_t backlog_bytes = kReplBacklogBytes,
+                      const std::string& snapshot_path = STORE_FILE ".replica");
+
+    /**
+     * @brief Deconstructor for ReplicationServer.
+     * To stop listening to the log and to close every replica.
+     */
+    ~ReplicationServer() { stop(); }
+
+    ReplicationServer(const ReplicationServer&) = delete;
+    ReplicationServer& operator=(const ReplicationServer&) = delete;
+
+    /**
+     * @brief To listen to the log of the store and for replicas.
+     * @return False if the store has no log or the socket could not be opened.
+     */
+    bool start();
+
+    /**
+     * @brief To stop, a replica that bootstraps is waited for until its snapshot is written.
+     */
+    void stop();
+
+    /**
+     * @return The id replicas reconnect with, new for every server.
+     */
+    uint64_t replication_id() const { return _id; }
+
+    /**
+     * @return The number of connected replicas.
+     */
+    size_t replicas();
+
+    /**
+     * @return The lsn of the last batch in the backlog.
+     */
+    uint64_t last_lsn();
+
+private:
+    /**
+     * @struct Batch
+     * @brief One batch of the log, shared with the threads that send it.
+     */
+    struct Batch {
+        uint64_t last_lsn;
+        std::shared_ptr<const std::string> bytes;
+    };
+
+    /**
+     * @struct Peer
+     * @brief A connected replica and its thread.
+     */
+    struct Peer {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> done;
+
+        explicit Peer(int fd) : fd(fd), done(false) {}
+    };
+
+    /**
+     * @brief The listener of the log, to append a batch to the backlog.
+     */
+    void on_batch(const char* data, size_t size, uint64_t last_lsn);
+
+    void accept_loop();
+
+    /**
+     * @brief To answer the hello of a replica and stream the backlog to it until it fails.
+     */
+    void serve(int fd);
+
+    /**
+     * @brief To send a snapshot of the store to fd.
+     * @param next Set to the first lsn the snapshot does not cover.
+     * @param pin Set to the pinned lsn the batches are kept from, see unpin.
+     */
+    bool bootstrap(int fd, uint64_t id, uint64_t& next, uint64_t& pin);
+
+    /**
+     * @brief To send the batches from the one holding next on, and pings while there are none.
+     * The pin is released once the batch holding next is taken.
+     * @return False once the replica is gone, lags behind the backlog or the server stops.
+     */
+    bool stream(int fd, uint64_t next, uint64_t& pin);
+
+    /**
+     * @brief To release pin unless it is 0, called with _mutex held.
+     */
+    void unpin(uint64_t& pin) {
+        if (pin != 0)
+            _pins.erase(_pins.find(pin));
+        pin = 0;
+    }
+
+    /**
+     * @brief To join the threads of the replicas that are gone, called with _mutex held.
+     */
+    void reap();
+
+    Store& _store;
+    const int _port;
+    const std::string _address;
+    const size_t _backlog_bytes;
+    const std::string _snapshot_path;
+    const uint64_t _id;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    // the batches with every record from _first_lsn to _last_lsn, in the order of the log
+    std::deque<Batch> _backlog;
+    size_t _bytes;
+    uint64_t _first_lsn;
+    uint64_t _last_lsn;
+    bool _stop;
+    // the first lsn of every bootstrap in flight, no batch at or after one is dropped
+    std::multiset<uint64_t> _pins;
+    uint64_t _snapshots;
+    std::list<std::unique_ptr<Peer> > _peers;
+
+    int _listen_fd;
+    std::thread _acceptor;
+};
+
+/**
+ * @class Replica
+ * @brief The Replica class is used to keep a list in sync with the list of a primary.
+ * A background thread connects, bootstraps from a snapshot if it has to, applies the batches
+ * it is streamed and reconnects whenever the connection breaks. Store is a tSkipList with
+ * owning keys and values, it must outlive the replica and is only written to by the replica,
+ * reads may go on meanwhile. While it bootstraps the list is cleared and loaded again.
+ */
+template <typename Store>
+class Replica {
+public:
+    /**
+     * @param store The list to keep a copy.
+     * @param host The host of the primary, a name or an address.
+     * @param port The replication port of the primary.
+     * @param snapshot_path Where the snapshot of a bootstrap is received, it stays there.
+     */
+    Replica(Store& store, const std::string& host, int port,
+            const std::string& snapshot_path = STORE_FILE ".replica");
+
+    /**
+     * @brief Deconstructor for Replica.
+     * To stop the thread and close the connection.
+     */
+    ~Replica() { stop(); }
+
+    Replica(const Replica&) = delete;
+    Replica& operator=(const Replica&) = delete;
+
+    /**
+     * @brief To start the thread, it retries until the primary can be reached.
+     */
+    void start();
+
+    /**
+     * @brief To stop the thread, a start later continues from the lsn the list is at.
+     */
+    void stop();
+
+    /**
+     * @return True while the replica is connected and in sync with the stream.
+     */
+    bool connected() const { return _connected.load(std::memory_order_acquire); }
+
+    /**
+     * @return The lsn of the last change of the primary applied to the list.
+     */
+    uint64_t applied_lsn() const { return _applied.load(std::memory_order_acquire); }
+
+    /**
+     * @return The last lsn the primary reported, applied_lsn() is at most that far behind.
+     */
+    uint64_t primary_lsn() const { return _primary_lsn.load(std::memory_order_acquire); }
+
+    /**
+     * @return The number of bootstraps from a snapshot.
+     */
+    uint64_t full_syncs() const { return _full_syncs.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+
+    /**
+     * @return The socket connected to the primary, -1 if it failed.
+     */
+    int connect_primary();
+
+    /**
+     * @brief To sync over one connection until it breaks.
+     */
+    void sync(int fd);
+
+    /**
+     * @brief To receive a snapshot of bytes bytes and to replace the list by it.
+     */
+    bool load_snapshot(int fd, uint64_t bytes);
+
+    Store& _store;
+    const std::string _host;
+    const int _port;
+    const std::string _snapshot_path;
+
+    // the primary the list is a copy of, 0 until the first bootstrap, only used by the thread
+    uint64_t _id;
+    std::atomic<uint64_t> _applied;
+    std::atomic<uint64_t> _primary_lsn;
+    std::atomic<uint64_t> _full_syncs;
+    std::atomic<bool> _connected;
+
+    // _fd is shut down by stop to end a blocked read
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stop;
+    int _fd;
+    std::thread _thread;
+};
+
+
+template <typename Store>
+ReplicationServer<Store>::ReplicationServer(Store& store, int port, const std::string& address,
+                                            size_t backlog_bytes, const std::string& snapshot_path)
+    : _store(store), _port(port), _address(address), _backlog_bytes(backlog_bytes),
+      _snapshot_path(snapshot_path),
+      _id((static_cast<uint64_t>(std::random_device()()) << 32 | std::random_device()()) | 1),
+      _bytes(0), _first_lsn(1), _last_lsn(0), _stop(false), _snapshots(0), _listen_fd(-1) {}
+
+template <typename Store>
+bool ReplicationServer<Store>::start() {
+    if (!_store.set_log_listener([this](const char* data, size_t size, uint64_t last_lsn) {
+            on_batch(data, size, last_lsn);
+        })) {
+        SKIPLIST_LOG(Error, "replication: the store has no write-ahead log");
+        return false;
+    }
+    // the records up to lsn may have been written before the listener was set, every later
+    // one reaches the backlog
+    uint64_t lsn = _store.log_lsn();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _first_lsn = lsn + 1;
+        _last_lsn = std::max(_last_lsn, lsn);
+    }
+
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(_port));
+    int on = 1;
+    if (fd >= 0)
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || ::inet_pton(AF_INET, _address.c_str(), &addr.sin_addr) != 1
+        || ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0
+        || ::listen(fd, 16) < 0) {
+        SKIPLIST_LOG(Error, "replication: cannot listen on " << _address << ":" << _port
+                     << ": " << strerror(errno));
+        if (fd >= 0)
+            ::close(fd);
+        _store.set_log_listener(WalListener());
+        return false;
+    }
+    _listen_fd = fd;
+    _acceptor = std::thread(&ReplicationServer::accept_loop, this);
+    SKIPLIST_LOG(Info, "replication: listening on " << _address << ":" << _port);
+    return true;
+}
+
+template <typename Store>
+void ReplicationServer<Store>::stop() {
+    if (_listen_fd < 0)
+        return;
+    // no batch is handed to on_batch once the listener is replaced
+    _store.set_log_listener(WalListener());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        for (auto& peer : _peers) {
+            if (peer->fd >= 0)
+                ::shutdown(peer->fd, SHUT_RDWR);
+        }
+    }
+    _cond.notify_all();
+    _acceptor.join();
+    for (auto& peer : _peers)
+        peer->thread.join();
+    _peers.clear();
+    ::close(_listen_fd);
+    _listen_fd = -1;
+}
+
+template <typename Store>
+size_t ReplicationServer<Store>::replicas() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t n = 0;
+    for (auto& peer : _peers)
+        n += !peer->done.load(std::memory_order_acquire);
+    return n;
+}
+
+template <typename Store>
+uint64_t ReplicationServer<Store>::last_lsn() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _last_lsn;
+}
+
+template <typename Store>
+void ReplicationServer<Store>::on_batch(const char* data, size_t size, uint64_t last_lsn) {
+    Batch batch;
+    batch.last_lsn = last_lsn;
+    batch.bytes = std::make_shared<const std::string>(data, size);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _backlog.push_back(std::move(batch));
+        _bytes += size;
+        _last_lsn = last_lsn;
+        // the newest batch stays even if it alone is over the limit
+        while (_bytes > _backlog_bytes && _backlog.size() > 1
+               && (_pins.empty() || _backlog.front().last_lsn < *_pins.begin())) {
+            _first_lsn = _backlog.front().last_lsn + 1;
+            _bytes -= _backlog.front().bytes->size();
+            _backlog.pop_front();
+        }
+    }
+    _cond.notify_all();
+}
+
+template <typename Store>
+void ReplicationServer<Store>::accept_loop() {
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stop)
+                return;
+            reap();
+        }
+        struct pollfd p;
+        p.fd = _listen_fd;
+        p.events = POLLIN;
+        if (::poll(&p, 1, 100) <= 0)
+            continue;
+        int fd = ::accept4(_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        repl_detail::set_nodelay(fd);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop) {
+            ::close(fd);
+            return;
+        }
+        _peers.emplace_back(new Peer(fd));
+        Peer* peer = _peers.back().get();
+        peer->thread = std::thread([this, peer] {
+            serve(peer->fd);
+            // closed under the lock, so stop never shuts down a descriptor that was reused
+            std::lock_guard<std::mutex> lock(_mutex);
+            ::close(peer->fd);
+            peer->fd = -1;
+            peer->done.store(true, std::memory_order_release);
+        });
+    }
+}
+
+template <typename Store>
+void ReplicationServer<Store>::reap() {
+    for (auto it = _peers.begin(); it != _peers.end();) {
+        if ((*it)->done.load(std::memory_order_acquire)) {
+            (*it)->thread.join();
+            it = _peers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+template <typename Store>
+void ReplicationServer<Store>::serve(int fd) {
+    repl_detail::set_timeout(fd, kReplTimeoutMs);
+    char hello[24];
+    if (!repl_detail::recv_all(fd, hello, sizeof(hello)) || memcmp(hello, kReplMagic, sizeof(kReplMagic)) != 0) {
+        SKIPLIST_LOG(Warn, "replication: bad hello from a replica");
+        return;
+    }
+    uint64_t id = get_fixed64(hello + 8);
+    uint64_t next = get_fixed64(hello + 16);
+    bool partial;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        partial = id == _id && next >= _first_lsn && next <= _last_lsn + 1;
+    }
+    bool ok;
+    uint64_t pin = 0;
+    if (partial) {
+        std::string reply(1, static_cast<char>(kReplContinue));
+        put_fixed64(reply, _id);
+        ok = repl_detail::send_all(fd, reply.data(), reply.size());
+        SKIPLIST_LOG(Info, "replication: replica continues from lsn " << next);
+    } else {
+        ok = bootstrap(fd, _id, next, pin);
+    }
+    if (ok)
+        stream(fd, next, pin);
+    std::lock_guard<std::mutex> lock(_mutex);
+    unpin(pin);
+}
+
+template <typename Store>
+bool ReplicationServer<Store>::bootstrap(int fd, uint64_t id, uint64_t& next, uint64_t& pin) {
+    std::string path;
+    {
+        // the snapshot covers at least the records handed to on_batch so far
+        std::lock_guard<std::mutex> lock(_mutex);
+        path = _snapshot_path + "." + std::to_string(++_snapshots);
+        pin = _last_lsn + 1;
+        _pins.insert(pin);
+    }
+    uint64_t lsn = 0;
+    bool ok = _store.export_snapshot(path, lsn);
+    int file = ok ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    ::unlink(path.c_str());
+    struct stat st;
+    if (file < 0 || ::fstat(file, &st) != 0) {
+        SKIPLIST_LOG(Error, "replication: cannot write the snapshot " << path);
+        if (file >= 0)
+            ::close(file);
+        return false;
+    }
+    std::string header(1, static_cast<char>(kReplFull));
+    put_fixed64(header, id);
+    put_fixed64(header, lsn);
+    put_fixed64(header, static_cast<uint64_t>(st.st_size));
+    ok = repl_detail::send_all(fd, header.data(), header.size());
+    off_t offset = 0;
+    while (ok && offset < st.st_size) {
+        ssize_t n = ::sendfile(fd, file, &offset, static_cast<size_t>(st.st_size - offset));
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+    }
+    ::close(file);
+    if (ok)
+        SKIPLIST_LOG(Info, "replication: replica bootstrapped up to lsn " << lsn << " with "
+                     << st.st_size << " bytes");
+    next = lsn + 1;
+    return ok;
+}
+
+template <typename Store>
+bool ReplicationServer<Store>::stream(int fd, uint64_t next, uint64_t& pin) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        if (_stop)
+            return false;
+        if (next < _first_lsn) {
+            SKIPLIST_LOG(Warn, "replication: a replica lags behind the backlog at lsn " << next);
+            return false;
+        }
+        std::string frame;
+        std::shared_ptr<const std::string> bytes;
+        // the first batch whose records reach next, its older records are skipped by the replica
+        auto it = std::lower_bound(_backlog.begin(), _backlog.end(), next,
+                                   [](const Batch& b, uint64_t lsn) { return b.last_lsn < lsn; });
+        if (it != _backlog.end()) {
+            unpin(pin);
+            bytes = it->bytes;
+            next = it->last_lsn + 1;
+            frame.push_back(static_cast<char>(kReplBatch));
+            put_fixed64(frame, it->last_lsn);
+            put_fixed32(frame, static_cast<uint32_t>(bytes->size()));
+        } else if (_cond.wait_for(lock, std::chrono::milliseconds(kReplPingMs)) == std::cv_status::no_timeout) {
+            continue;
+        } else {
+            frame.push_back(static_cast<char>(kReplPing));
+            put_fixed64(frame, _last_lsn);
+        }
+        lock.unlock();
+        bool ok = repl_detail::send_all(fd, frame.data(), frame.size())
+                  && (!bytes || repl_detail::send_all(fd, bytes->data(), bytes->size()));
+        lock.lock();
+        if (!ok)
+            return false;
+    }
+}
+
+template <typename Store>
+Replica<Store>::Replica(Store& store, const std::string& host, int port, const std::string& snapshot_path)
+    : _store(store), _host(host), _port(port), _snapshot_path(snapshot_path), _id(0), _applied(0),
+      _primary_lsn(0), _full_syncs(0), _connected(false), _stop(false), _fd(-1) {}
+
+template <typename Store>
+void Replica<Store>::start() {
+    if (_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = false;
+    }
+    _thread = std::thread(&Replica::run, this);
+}
+
+template <typename Store>
+void Replica<Store>::stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+        if (_fd >= 0)
+            ::shutdown(_fd, SHUT_RDWR);
+    }
+    _cond.notify_all();
+    if (_thread.joinable())
+        _thread.join();
+}
+
+template <typename Store>
+void Replica<Store>::run() {
+    int backoff_ms = 100;
+    for (;;) {
+        int fd = connect_primary();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stop) {
+                if (fd >= 0)
+                    ::close(fd);
+                return;
+            }
+            _fd = fd;
+        }
+        if (fd >= 0) {
+            sync(fd);
+            _connected.store(false, std::memory_order_release);
+            std::lock_guard<std::mutex> lock(_mutex);
+            ::close(fd);
+            _fd = -1;
+            backoff_ms = 100;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_cond.wait_for(lock, std::chrono::milliseconds(backoff_ms), [this] { return _stop; }))
+            return;
+        backoff_ms = std::min(backoff_ms * 2, kReplPingMs * 2);
+    }
+}
+
+template <typename Store>
+int Replica<Store>::connect_primary() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    if (::getaddrinfo(_host.c_str(), std::to_string(_port).c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(res);
+    if (fd >= 0)
+        repl_detail::set_nodelay(fd);
+    return fd;
+}
+
+template <typename Store>
+void Replica<Store>::sync(int fd) {
+    std::string hello(kReplMagic, sizeof(kReplMagic));
+    put_fixed64(hello, _id);
+    put_fixed64(hello, _applied.load(std::memory_order_relaxed) + 1);
+    repl_detail::set_timeout(fd, kReplSyncTimeoutMs);
+    char head[25];
+    if (!repl_detail::send_all(fd, hello.data(), hello.size()) || !repl_detail::recv_all(fd, head, 9))
+        return;
+    if (head[0] == kReplFull) {
+        if (!repl_detail::recv_all(fd, head + 9, 16))
+            return;
+        _id = 0;
+        if (!load_snapshot(fd, get_fixed64(head + 17)))
+            return;
+        _applied.store(get_fixed64(head + 9), std::memory_order_release);
+        _full_syncs.fetch_add(1, std::memory_order_relaxed);
+    } else if (head[0] != kReplContinue || get_fixed64(head + 1) != _id) {
+        SKIPLIST_LOG(Error, "replication: bad answer from " << _host << ":" << _port);
+        return;
+    }
+    _id = get_fixed64(head + 1);
+    _connected.store(true, std::memory_order_release);
+    SKIPLIST_LOG(Info, "replication: in sync with " << _host << ":" << _port << " from lsn "
+                 << applied_lsn());
+
+    repl_detail::set_timeout(fd, kReplTimeoutMs);
+    std::string batch;
+    for (;;) {
+        if (!repl_detail::recv_all(fd, head, 9))
+            return;
+        uint64_t lsn = get_fixed64(head + 1);
+        if (head[0] == kReplPing) {
+            _primary_lsn.store(std::max(lsn, applied_lsn()), std::memory_order_release);
+            continue;
+        }
+        if (head[0] != kReplBatch || !repl_detail::recv_all(fd, head + 9, 4))
+            return;
+        batch.resize(get_fixed32(head + 9));
+        if (!repl_detail::recv_all(fd, &batch[0], batch.size()))
+            return;
+        uint64_t applied = _applied.load(std::memory_order_relaxed);
+        if (!_store.apply_log(batch.data(), batch.size(), applied)) {
+            // a list that missed part of a batch is no copy any more, the next connect bootstraps
+            SKIPLIST_LOG(Error, "replication: damaged batch up to lsn " << lsn);
+            _id = 0;
+            return;
+        }
+        _applied.store(applied, std::memory_order_release);
+        _primary_lsn.store(std::max(lsn, _primary_lsn.load(std::memory_order_relaxed)), std::memory_order_release);
+    }
+}
+
+template <typename Store>
+bool Replica<Store>::load_snapshot(int fd, uint64_t bytes) {
+    std::string tmp = _snapshot_path + ".tmp";
+    int file = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) {
+        SKIPLIST_LOG(Error, "replication: cannot create " << tmp);
+        return false;
+    }
+    std::unique_ptr<char[]> buf(new char[kWalBufferSize]);
+    bool ok = true;
+    while (ok && bytes > 0) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(bytes, kWalBufferSize));
+        ok = repl_detail::recv_all(fd, buf.get(), n) && ::write(file, buf.get(), n) == static_cast<ssize_t>(n);
+        bytes -= n;
+    }
+    ok = ::close(file) == 0 && ok && ::rename(tmp.c_str(), _snapshot_path.c_str()) == 0;
+    if (!ok) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+
+    // the elements the primary no longer has must go, the snapshot upserts the rest
+    if (_store.size() != 0) {
+        auto it = _store.new_iterator();
+        for (it.seek_to_first(); it.valid(); it.next())
+            _store.delete_element(it.key());
+    }
+    if (!_store.load_file(_snapshot_path)) {
+        SKIPLIST_LOG(Error, "replication: cannot load the snapshot " << _snapshot_path);
+        return false;
+    }
+    return true;
+}
+
+
+#endif //SKIP_LIST_REPLICATION_H
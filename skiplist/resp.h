@@ -0,0 +1,292 @@
+/*
+ * @file        : resp.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains RespParser and RespWriter, the Redis serialization protocol
+ *                (RESP2) of the network server, see server.h.
+ *
+ *                A request is an array of bulk strings, *2\r\n$3\r\nGET\r\n$1\r\nk\r\n, or an
+ *                inline command, GET k\r\n, as redis-cli and redis-benchmark send them. Replies
+ *                are simple strings, errors, integers, bulk strings and arrays.
+ */
+
+#ifndef SKIP_LIST_RESP_H
+#define SKIP_LIST_RESP_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "slice.h"
+
+
+/**
+ * @class RespParser
+ * @brief The RespParser class is used to split the bytes read from a connection into requests.
+ * The arguments of a request are slices of the buffer, they are valid until the next call of
+ * next or consume.
+ */
+class RespParser {
+public:
+    enum Result { kRequest, kIncomplete, kError };
+
+    static const size_t kMaxArgs = 1024 * 1024;
+    static const size_t kMaxBulk = 512 * 1024 * 1024;
+    static const size_t kMaxInline = 64 * 1024;
+
+    RespParser() : _pos(0) {}
+
+    /**
+     * @brief To append bytes read from the connection.
+     */
+    void feed(const char* data, size_t size) { _in.append(data, size); }
+
+    /**
+     * @brief To parse the next request that is complete in the buffer.
+     * @param args Set to the arguments of the request, the command first.
+     * @return kRequest, kIncomplete if more bytes are needed, kError if the bytes are no RESP,
+     * see error().
+     */
+    Result next(std::vector<Slice>& args) {
+        // empty lines, blank inline lines and empty arrays between requests are skipped like
+        // Redis does, in a loop: a client may send any number of them
+        while (true) {
+            args.clear();
+            while (_pos + 1 < _in.size() && _in[_pos] == '\r' && _in[_pos + 1] == '\n')
+                _pos += 2;
+            if (_pos >= _in.size())
+                return kIncomplete;
+            Result result = _in[_pos] == '*' ? parse_array(args) : parse_inline(args);
+            if (result != kRequest || !args.empty())
+                return result;
+        }
+    }
+
+    /**
+     * @brief To drop the bytes of the parsed requests, their slices are invalid afterwards.
+     */
+    void consume() {
+        _in.erase(0, _pos);
+        _pos = 0;
+    }
+
+    /**
+     * @return The bytes waiting in the buffer, parsed or not.
+     */
+    size_t buffered() const { return _in.size(); }
+
+    const std::string& error() const { return _error; }
+
+private:
+    /**
+     * @brief To read the line at p up to \r\n.
+     * @return The position after \r\n, 0 if the line is not complete.
+     */
+    size_t line_end(size_t p) const {
+        size_t cr = _in.find('\r', p);
+        if (cr == std::string::npos || cr + 1 >= _in.size())
+            return 0;
+        return cr + 2;
+    }
+
+    /**
+     * @brief To read the integer of the line starting at p + 1, after the type byte.
+     */
+    bool parse_length(size_t p, size_t end, long long& value) const {
+        const char* first = _in.data() + p + 1;
+        const char* last = _in.data() + end - 2;
+        if (first == last || _in[end - 1] != '\n')
+            return false;
+        char* stop = NULL;
+        errno = 0;
+        value = strtoll(first, &stop, 10);
+        return errno == 0 && stop == last;
+    }
+
+    /**
+     * @brief To parse the array at _pos, and the inline request at _pos for parse_inline.
+     * @return kRequest with no arguments for an empty one, see next.
+     */
+    Result parse_array(std::vector<Slice>& args) {
+        size_t p = _pos;
+        size_t end = line_end(p);
+        if (end == 0)
+            return _in.size() - p > kMaxInline ? fail("too big array header") : kIncomplete;
+        long long count;
+        if (!parse_length(p, end, count) || count > static_cast<long long>(kMaxArgs))
+            return fail("invalid multibulk length");
+        p = end;
+        for (long long i = 0; i < count; ++i) {
+            if (p >= _in.size())
+                return kIncomplete;
+            if (_in[p] != '$')
+                return fail("expected '$'");
+            end = line_end(p);
+            if (end == 0)
+                return _in.size() - p > kMaxInline ? fail("too big bulk header") : kIncomplete;
+            long long size;
+            if (!parse_length(p, end, size) || size < 0 || size > static_cast<long long>(kMaxBulk))
+                return fail("invalid bulk length");
+            if (_in.size() < end + size + 2)
+                return kIncomplete;
+            if (_in[end + size] != '\r' || _in[end + size + 1] != '\n')
+                return fail("expected CRLF after bulk");
+            args.push_back(Slice(_in.data() + end, static_cast<size_t>(size)));
+            p = end + size + 2;
+        }
+        _pos = p;
+        return kRequest;
+    }
+
+    Result parse_inline(std::vector<Slice>& args) {
+        size_t nl = _in.find('\n', _pos);
+        if (nl == std::string::npos)
+            return _in.size() - _pos > kMaxInline ? fail("too big inline request") : kIncomplete;
+        size_t end = nl > _pos && _in[nl - 1] == '\r' ? nl - 1 : nl;
+        size_t p = _pos;
+        while (p < end) {
+            while (p < end && (_in[p] == ' ' || _in[p] == '\t'))
+                p++;
+            size_t start = p;
+            while (p < end && _in[p] != ' ' && _in[p] != '\t')
+                p++;
+            if (p > start)
+                args.push_back(Slice(_in.data() + start, p - start));
+        }
+        _pos = nl + 1;
+        return kRequest;
+    }
+
+    Result fail(const char* message) {
+        _error = std::string("Protocol error: ") + message;
+        return kError;
+    }
+
+    std::string _in;
+    size_t _pos;
+    std::string _error;
+};
+
+/**
+ * @class RespWriter
+ * @brief The RespWriter class is used to collect the replies of a connection until they are
+ * written with one writev.
+ * Small replies are appended to a shared chunk, a big bulk string keeps its own chunk so it is
+ * moved instead of copied.
+ */
+class RespWriter {
+public:
+    static const size_t kOwnChunk = 4096;
+
+    RespWriter() : _offset(0), _bytes(0) {}
+
+    void simple(const char* s) { put("+"); put(s); put("\r\n"); }
+    void error(const std::string& s) { put("-"); put(s.data(), s.size()); put("\r\n"); }
+    void integer(long long v) { header(':', v); }
+    void array(size_t n) { header('*', static_cast<long long>(n)); }
+    void null() { put("$-1\r\n"); }
+
+    void bulk(const char* data, size_t size) {
+        header('$', static_cast<long long>(size));
+        put(data, size);
+        put("\r\n");
+    }
+
+    void bulk(const Slice& s) { bulk(s.data(), s.size()); }
+
+    void bulk(std::string&& s) {
+        if (s.size() < kOwnChunk) {
+            bulk(s.data(), s.size());
+            return;
+        }
+        header('$', static_cast<long long>(s.size()));
+        _bytes += s.size();
+        _chunks.push_back(std::move(s));
+        // the next small reply starts a new shared chunk behind it
+        _chunks.push_back(std::string());
+        put("\r\n");
+    }
+
+    /**
+     * @return The bytes not written yet.
+     */
+    size_t pending() const { return _bytes; }
+
+    /**
+     * @brief To write as much as the socket takes with one writev.
+     * @return False if the connection failed, a full socket is no failure.
+     */
+    bool flush(int fd) {
+        while (_bytes > 0) {
+            struct iovec iov[kMaxIov];
+            int n = 0;
+            for (size_t i = 0; i < _chunks.size() && n < kMaxIov; ++i) {
+                size_t skip = i == 0 ? _offset : 0;
+                if (_chunks[i].size() == skip)
+                    continue;
+                iov[n].iov_base = const_cast<char*>(_chunks[i].data() + skip);
+                iov[n].iov_len = _chunks[i].size() - skip;
+                n++;
+            }
+            ssize_t written = ::writev(fd, iov, n);
+            if (written < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            drop(static_cast<size_t>(written));
+            // a short write means the socket buffer is full
+            if (n < kMaxIov && _bytes > 0)
+                return true;
+        }
+        return true;
+    }
+
+private:
+    static const int kMaxIov = 64;
+
+    void put(const char* s) { put(s, strlen(s)); }
+
+    void put(const char* data, size_t size) {
+        if (_chunks.empty())
+            _chunks.push_back(std::string());
+        _chunks.back().append(data, size);
+        _bytes += size;
+    }
+
+    void header(char type, long long v) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%c%lld\r\n", type, v);
+        put(buf, static_cast<size_t>(n));
+    }
+
+    /**
+     * @brief To drop the written bytes from the front of the chunks.
+     */
+    void drop(size_t written) {
+        _bytes -= written;
+        size_t i = 0;
+        written += _offset;
+        // the last chunk stays while it has bytes, replies are appended to it
+        while (i < _chunks.size() && written >= _chunks[i].size()
+               && (i + 1 < _chunks.size() || _bytes == 0)) {
+            written -= _chunks[i].size();
+            i++;
+        }
+        _chunks.erase(_chunks.begin(), _chunks.begin() + i);
+        _offset = written;
+        if (_chunks.empty())
+            _offset = 0;
+    }
+
+    std::vector<std::string> _chunks;
+    size_t _offset;
+    size_t _bytes;
+};
+
+
+#endif //SKIP_LIST_RESP_H
@@ -0,0 +1,675 @@
+/*
+ * @file        : server.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the Server class, a network front-end that speaks RESP (see
+ *                resp.h), so redis-cli, redis-benchmark and the Redis client libraries can drive
+ *                a tSkipList or a ShardedStore with string keys and values.
+ *
+ *                Every event loop thread owns an epoll instance and a listening socket of its
+ *                own on the same port (SO_REUSEPORT), the kernel spreads the connections over
+ *                them and a connection never leaves its thread. A loop reads everything a
+ *                socket has, runs every complete request in it, and only after all the events
+ *                of an epoll_wait are handled writes each connection's replies with one writev,
+ *                so a pipeline of requests costs one read and one write.
+ *
+ *                GET, MGET, SET [EX s | PX ms] [NX], DEL, EXISTS, SCAN cursor [MATCH p] [COUNT n],
+ *                DBSIZE, PING, ECHO, QUIT, and COMMAND and CONFIG GET answered empty for clients
+ *                that probe the server when they connect. A read only server, such as one in
+ *                front of a replica (see replication.h), answers SET and DEL with READONLY.
+ */
+
+#ifndef SKIP_LIST_SERVER_H
+#define SKIP_LIST_SERVER_H
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <fnmatch.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "logging.h"
+#include "resp.h"
+
+/**
+ * @class Server
+ * @brief The Server class is used to serve a Store over TCP.
+ * Store is tSkipList<std::string, std::string> or ShardedStore<std::string, std::string>, it
+ * must outlive the server.
+ */
+template <typename Store>
+class Server {
+public:
+    /**
+     * @param store The store to serve.
+     * @param port The TCP port.
+     * @param threads The number of event loops, 0 for one per core.
+     * @param address The IPv4 address to listen on.
+     */
+    Server(Store& store, int port, int threads = 0, const std::string& address = "127.0.0.1");
+
+    /**
+     * @brief Deconstructor for Server.
+     * To stop the loops and close every connection.
+     */
+    ~Server();
+
+    /**
+     * @brief To open the listening sockets and start the event loops.
+     * @return False if a socket could not be opened, nothing is started then.
+     */
+    bool start();
+
+    /**
+     * @brief To stop the event loops, it may be called from any thread, a signal handler too.
+     */
+    void stop();
+
+    /**
+     * @brief To wait until the event loops have stopped.
+     */
+    void wait();
+
+    /**
+     * @return The number of open connections.
+     */
+    size_t connections() const { return _connections.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief To refuse the writes of clients, the store may still be written by others.
+     */
+    void set_read_only(bool read_only) { _read_only.store(read_only, std::memory_order_relaxed); }
+
+private:
+    // replies above it stop the reading of the connection until the client reads them
+    static const size_t kMaxOutput = 4 * 1024 * 1024;
+    static const size_t kReadSize = 16 * 1024;
+    // reads per event, the rest waits for the next epoll_wait so no connection starves another
+    static const int kReadsPerEvent = 16;
+    static const size_t kMaxCursors = 64;
+    static const int kMaxEvents = 256;
+
+    /**
+     * @struct Connection
+     * @brief The state of one client, it only ever belongs to one loop.
+     */
+    struct Connection {
+        int fd;
+        RespParser in;
+        RespWriter out;
+        bool pending;
+        bool closing;
+        // the events epoll reports for the socket now
+        uint32_t events;
+        // SCAN cursors, the id handed to the client and the key the scan goes on from
+        std::map<uint64_t, std::string> cursors;
+        uint64_t next_cursor;
+
+        explicit Connection(int fd) : fd(fd), pending(false), closing(false), events(EPOLLIN),
+                                      next_cursor(1) {}
+    };
+
+    /**
+     * @struct Loop
+     * @brief One event loop thread with its epoll instance, listening socket and wake up event.
+     */
+    struct Loop {
+        int epoll_fd;
+        int listen_fd;
+        int wake_fd;
+        std::thread thread;
+        std::unordered_map<int, std::unique_ptr<Connection> > clients;
+
+        Loop() : epoll_fd(-1), listen_fd(-1), wake_fd(-1) {}
+    };
+
+    /**
+     * @return The listening socket, -1 if it failed.
+     */
+    int open_listener();
+
+    void run(Loop& loop);
+    void accept_all(Loop& loop);
+
+    /**
+     * @brief To read what the socket has and run the complete requests in it.
+     * @return False if the connection is finished.
+     */
+    bool on_readable(Connection& c);
+
+    /**
+     * @brief To write the replies of c and to watch the socket for what is left.
+     * @return False if the connection is finished.
+     */
+    bool flush(Loop& loop, Connection& c);
+
+    void watch(Loop& loop, Connection& c, uint32_t events);
+    void close_connection(Loop& loop, int fd);
+    void close_clients(Loop& loop);
+    void close_loop(Loop& loop);
+
+    /**
+     * @brief To run one request and append its reply to c.out.
+     */
+    void execute(Connection& c, const std::vector<Slice>& args);
+
+    void cmd_get(Connection& c, const std::vector<Slice>& args);
+    void cmd_mget(Connection& c, const std::vector<Slice>& args);
+    void cmd_set(Connection& c, const std::vector<Slice>& args);
+    void cmd_del(Connection& c, const std::vector<Slice>& args);
+    void cmd_exists(Connection& c, const std::vector<Slice>& args);
+    void cmd_scan(Connection& c, const std::vector<Slice>& args);
+
+    static bool is(const Slice& arg, const char* name) {
+        return arg.size() == strlen(name) && strncasecmp(arg.data(), name, arg.size()) == 0;
+    }
+
+    /**
+     * @brief To read a non-negative integer argument.
+     */
+    static bool to_number(const Slice& arg, uint64_t& value) {
+        if (arg.size() == 0 || arg.size() > 19)
+            return false;
+        value = 0;
+        for (size_t i = 0; i < arg.size(); ++i) {
+            if (arg.data()[i] < '0' || arg.data()[i] > '9')
+                return false;
+            value = value * 10 + (arg.data()[i] - '0');
+        }
+        return true;
+    }
+
+    Store& _store;
+    int _port;
+    std::string _address;
+    std::vector<std::unique_ptr<Loop> > _loops;
+    std::atomic<size_t> _connections;
+    std::atomic<bool> _read_only;
+};
+
+template <typename Store>
+Server<Store>::Server(Store& store, int port, int threads, const std::string& address)
+    : _store(store), _port(port), _address(address), _connections(0), _read_only(false) {
+    if (threads <= 0)
+        threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads <= 0)
+        threads = 1;
+    for (int i = 0; i < threads; ++i)
+        _loops.emplace_back(new Loop());
+}
+
+template <typename Store>
+Server<Store>::~Server() {
+    stop();
+    wait();
+    for (auto& loop : _loops)
+        close_loop(*loop);
+}
+
+template <typename Store>
+int Server<Store>::open_listener() {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(_port));
+    if (::inet_pton(AF_INET, _address.c_str(), &addr.sin_addr) != 1
+        || ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0
+        || ::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+template <typename Store>
+bool Server<Store>::start() {
+    // a client that goes away must fail the writev, not kill the process
+    ::signal(SIGPIPE, SIG_IGN);
+    for (auto& loop : _loops) {
+        loop->listen_fd = open_listener();
+        loop->epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+        loop->wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        bool ok = loop->listen_fd >= 0 && loop->epoll_fd >= 0 && loop->wake_fd >= 0;
+        if (ok) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = loop->listen_fd;
+            ok = ::epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) == 0;
+            ev.data.fd = loop->wake_fd;
+            ok = ok && ::epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == 0;
+        }
+        if (!ok) {
+            SKIPLIST_LOG(Error, "server: cannot listen on " << _address << ":" << _port
+                         << ": " << strerror(errno));
+            for (auto& l : _loops)
+                close_loop(*l);
+            return false;
+        }
+    }
+    for (auto& loop : _loops) {
+        Loop* l = loop.get();
+        loop->thread = std::thread([this, l] { run(*l); });
+    }
+    SKIPLIST_LOG(Info, "server: listening on " << _address << ":" << _port << " with "
+                 << _loops.size() << " event loops");
+    return true;
+}
+
+template <typename Store>
+void Server<Store>::stop() {
+    // write(2) is async-signal-safe, the loop closes its connections itself
+    uint64_t one = 1;
+    for (auto& loop : _loops) {
+        if (loop->wake_fd >= 0 && ::write(loop->wake_fd, &one, sizeof(one)) < 0) {
+            // the counter is only full if stop was called very often, the loop wakes anyway
+        }
+    }
+}
+
+template <typename Store>
+void Server<Store>::wait() {
+    for (auto& loop : _loops) {
+        if (loop->thread.joinable())
+            loop->thread.join();
+    }
+}
+
+template <typename Store>
+void Server<Store>::close_clients(Loop& loop) {
+    for (auto& client : loop.clients)
+        ::close(client.first);
+    _connections.fetch_sub(loop.clients.size(), std::memory_order_relaxed);
+    loop.clients.clear();
+}
+
+template <typename Store>
+void Server<Store>::close_loop(Loop& loop) {
+    close_clients(loop);
+    int* fds[] = {&loop.listen_fd, &loop.epoll_fd, &loop.wake_fd};
+    for (int* fd : fds) {
+        if (*fd >= 0)
+            ::close(*fd);
+        *fd = -1;
+    }
+}
+
+template <typename Store>
+void Server<Store>::run(Loop& loop) {
+    struct epoll_event events[kMaxEvents];
+    std::vector<int> pending;
+    for (;;) {
+        int n = ::epoll_wait(loop.epoll_fd, events, kMaxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            SKIPLIST_LOG(Error, "server: epoll_wait: " << strerror(errno));
+            break;
+        }
+        bool stopping = false;
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == loop.wake_fd) {
+                stopping = true;
+                continue;
+            }
+            if (fd == loop.listen_fd) {
+                accept_all(loop);
+                continue;
+            }
+            auto it = loop.clients.find(fd);
+            if (it == loop.clients.end())
+                continue;
+            Connection& c = *it->second;
+            bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+            if (alive && (events[i].events & EPOLLIN))
+                alive = on_readable(c);
+            if (alive && (events[i].events & EPOLLOUT))
+                c.pending = true;
+            if (!alive)
+                close_connection(loop, fd);
+            else if (c.pending)
+                pending.push_back(fd);
+        }
+        // one writev per connection for all the requests read in this round
+        for (int fd : pending) {
+            auto it = loop.clients.find(fd);
+            if (it == loop.clients.end() || !it->second->pending)
+                continue;
+            it->second->pending = false;
+            if (!flush(loop, *it->second))
+                close_connection(loop, fd);
+        }
+        pending.clear();
+        if (stopping)
+            break;
+    }
+    // the sockets of the loop stay open until the server is destroyed, stop may still write
+    close_clients(loop);
+}
+
+template <typename Store>
+void Server<Store>::accept_all(Loop& loop) {
+    for (;;) {
+        int fd = ::accept4(loop.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                SKIPLIST_LOG(Warn, "server: accept: " << strerror(errno));
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (::epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            ::close(fd);
+            continue;
+        }
+        loop.clients[fd].reset(new Connection(fd));
+        _connections.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+template <typename Store>
+void Server<Store>::close_connection(Loop& loop, int fd) {
+    // closing the socket also removes it from the epoll set
+    ::close(fd);
+    loop.clients.erase(fd);
+    _connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+template <typename Store>
+bool Server<Store>::on_readable(Connection& c) {
+    char buf[kReadSize];
+    for (int reads = 0; reads < kReadsPerEvent; ++reads) {
+        ssize_t n = ::read(c.fd, buf, sizeof(buf));
+        if (n > 0) {
+            c.in.feed(buf, static_cast<size_t>(n));
+            if (static_cast<size_t>(n) < sizeof(buf))
+                break;
+            continue;
+        }
+        if (n == 0)
+            return false;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        return false;
+    }
+    std::vector<Slice> args;
+    for (;;) {
+        if (c.closing)
+            break;
+        RespParser::Result r = c.in.next(args);
+        if (r == RespParser::kIncomplete)
+            break;
+        if (r == RespParser::kError) {
+            c.out.error("ERR " + c.in.error());
+            c.closing = true;
+            break;
+        }
+        execute(c, args);
+    }
+    c.in.consume();
+    c.pending = c.pending || c.out.pending() > 0 || c.closing;
+    return true;
+}
+
+template <typename Store>
+void Server<Store>::watch(Loop& loop, Connection& c, uint32_t events) {
+    if (events == c.events)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = c.fd;
+    if (::epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, c.fd, &ev) == 0)
+        c.events = events;
+}
+
+template <typename Store>
+bool Server<Store>::flush(Loop& loop, Connection& c) {
+    if (!c.out.flush(c.fd))
+        return false;
+    if (c.out.pending() == 0) {
+        if (c.closing)
+            return false;
+        watch(loop, c, EPOLLIN);
+        return true;
+    }
+    // the socket is full: write the rest when it drains, and read no more requests
+    // while too many replies are waiting
+    watch(loop, c, c.out.pending() > kMaxOutput || c.closing ? EPOLLOUT : EPOLLIN | EPOLLOUT);
+    return true;
+}
+
+template <typename Store>
+void Server<Store>::execute(Connection& c, const std::vector<Slice>& args) {
+    const Slice& cmd = args[0];
+    size_t argc = args.size();
+    if ((is(cmd, "set") || is(cmd, "del")) && _read_only.load(std::memory_order_relaxed))
+        c.out.error("READONLY You can't write against a read only replica.");
+    else if (is(cmd, "get") && argc == 2)
+        cmd_get(c, args);
+    else if (is(cmd, "set") && argc >= 3)
+        cmd_set(c, args);
+    else if (is(cmd, "del") && argc >= 2)
+        cmd_del(c, args);
+    else if (is(cmd, "mget") && argc >= 2)
+        cmd_mget(c, args);
+    else if (is(cmd, "exists") && argc >= 2)
+        cmd_exists(c, args);
+    else if (is(cmd, "scan") && argc >= 2)
+        cmd_scan(c, args);
+    else if (is(cmd, "ping") && argc <= 2) {
+        if (argc == 2)
+            c.out.bulk(args[1]);
+        else
+            c.out.simple("PONG");
+    } else if (is(cmd, "echo") && argc == 2)
+        c.out.bulk(args[1]);
+    else if (is(cmd, "dbsize") && argc == 1)
+        c.out.integer(_store.size());
+    else if (is(cmd, "quit")) {
+        c.out.simple("OK");
+        c.closing = true;
+    } else if (is(cmd, "command") || (is(cmd, "config") && argc >= 2 && is(args[1], "get")))
+        c.out.array(0);
+    else if (is(cmd, "get") || is(cmd, "set") || is(cmd, "del") || is(cmd, "mget")
+             || is(cmd, "exists") || is(cmd, "scan") || is(cmd, "ping") || is(cmd, "echo")
+             || is(cmd, "dbsize"))
+        c.out.error("ERR wrong number of arguments for '" + cmd.to_string() + "' command");
+    else
+        c.out.error("ERR unknown command '" + cmd.to_string() + "'");
+}
+
+template <typename Store>
+void Server<Store>::cmd_get(Connection& c, const std::vector<Slice>& args) {
+    std::string value;
+    if (_store.search_element(args[1].to_string(), value))
+        c.out.bulk(std::move(value));
+    else
+        c.out.null();
+}
+
+template <typename Store>
+void Server<Store>::cmd_mget(Connection& c, const std::vector<Slice>& args) {
+    std::vector<std::string> keys;
+    keys.reserve(args.size() - 1);
+    for (size_t i = 1; i < args.size(); ++i)
+        keys.push_back(args[i].to_string());
+    std::vector<std::string> values;
+    std::vector<bool> found;
+    _store.multi_get(keys, values, found);
+    c.out.array(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (found[i])
+            c.out.bulk(std::move(values[i]));
+        else
+            c.out.null();
+    }
+}
+
+template <typename Store>
+void Server<Store>::cmd_set(Connection& c, const std::vector<Slice>& args) {
+    uint64_t ttl_ms = 0;
+    bool nx = false;
+    for (size_t i = 3; i < args.size(); ++i) {
+        bool has_value = i + 1 < args.size();
+        uint64_t n = 0;
+        if (is(args[i], "nx")) {
+            nx = true;
+        } else if ((is(args[i], "ex") || is(args[i], "px")) && has_value && ttl_ms == 0) {
+            if (!to_number(args[i + 1], n) || n == 0) {
+                c.out.error("ERR invalid expire time in 'set' command");
+                return;
+            }
+            ttl_ms = is(args[i], "ex") ? n * 1000 : n;
+            i++;
+        } else {
+            c.out.error("ERR syntax error");
+            return;
+        }
+    }
+    std::string key = args[1].to_string();
+    if (nx) {
+        // emplace inserts without an expiry, NX with a TTL has no single call on the store
+        if (ttl_ms != 0) {
+            c.out.error("ERR NX with EX or PX is not supported");
+            return;
+        }
+        if (_store.emplace(key, args[2].to_string()) == 0)
+            c.out.simple("OK");
+        else
+            c.out.null();
+        return;
+    }
+    _store.put(key, args[2].to_string(), ttl_ms);
+    c.out.simple("OK");
+}
+
+template <typename Store>
+void Server<Store>::cmd_del(Connection& c, const std::vector<Slice>& args) {
+    long long deleted = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (_store.delete_element(args[i].to_string()) == 0)
+            deleted++;
+    }
+    c.out.integer(deleted);
+}
+
+template <typename Store>
+void Server<Store>::cmd_exists(Connection& c, const std::vector<Slice>& args) {
+    long long found = 0;
+    std::string value;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (_store.search_element(args[i].to_string(), value))
+            found++;
+    }
+    c.out.integer(found);
+}
+
+template <typename Store>
+void Server<Store>::cmd_scan(Connection& c, const std::vector<Slice>& args) {
+    uint64_t cursor = 0;
+    if (!to_number(args[1], cursor)) {
+        c.out.error("ERR invalid cursor");
+        return;
+    }
+    std::string pattern;
+    uint64_t count = 10;
+    for (size_t i = 2; i < args.size(); i += 2) {
+        if (i + 1 >= args.size()) {
+            c.out.error("ERR syntax error");
+            return;
+        }
+        if (is(args[i], "match")) {
+            pattern = args[i + 1].to_string();
+        } else if (is(args[i], "count")) {
+            if (!to_number(args[i + 1], count) || count == 0) {
+                c.out.error("ERR value is not an integer or out of range");
+                return;
+            }
+        } else {
+            c.out.error("ERR syntax error");
+            return;
+        }
+    }
+
+    // a scan goes on from the key the previous call stopped at, cursors the client dropped
+    // are forgotten oldest first, an unknown cursor ends the scan like Redis does
+    std::string from;
+    if (cursor != 0) {
+        auto it = c.cursors.find(cursor);
+        if (it == c.cursors.end()) {
+            c.out.array(2);
+            c.out.bulk("0", 1);
+            c.out.array(0);
+            return;
+        }
+        from = std::move(it->second);
+        c.cursors.erase(it);
+    }
+
+    std::vector<std::string> keys;
+    uint64_t next = 0;
+    {
+        auto it = _store.new_iterator();
+        if (cursor == 0)
+            it.seek_to_first();
+        else
+            it.seek(from);
+        // COUNT bounds the elements visited, not the keys returned
+        for (uint64_t visited = 0; it.valid() && visited < count; ++visited, it.next()) {
+            if (pattern.empty() || ::fnmatch(pattern.c_str(), it.key().c_str(), 0) == 0)
+                keys.push_back(it.key());
+        }
+        if (it.valid()) {
+            next = c.next_cursor++;
+            c.cursors[next] = it.key();
+            if (c.cursors.size() > kMaxCursors)
+                c.cursors.erase(c.cursors.begin());
+        }
+    }
+
+    std::string reply_cursor = std::to_string(next);
+    c.out.array(2);
+    c.out.bulk(reply_cursor.data(), reply_cursor.size());
+    c.out.array(keys.size());
+    for (std::string& key : keys)
+        c.out.bulk(std::move(key));
+}
+
+
+#endif //SKIP_LIST_SERVER_H
@@ -0,0 +1,676 @@
+/*
+ * @file        : shardedstore.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the declaration of the ShardedStore class, which spreads
+ *                the keys over several independent tSkipList shards, so that writers on
+ *                different shards never meet on the same _header or top level nodes.
+ */
+
+#ifndef SHARDED_STORE_H
+#define SHARDED_STORE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "common.h"
+#include "tskiplist.h"
+
+/**
+ * @brief How the keys are assigned to the shards.
+ * Hash: by a hash of the key, scans merge every shard.
+ * Range: by split keys, a scan visits the shards in order.
+ */
+enum class Partition { Hash, Range };
+
+/**
+ * @class ShardedStore
+ * @brief The ShardedStore class is used to partition the keys over several tSkipList.
+ * Every shard dumps to, loads from and logs to its own file, shard_path(path, i), and they
+ * do so in parallel. A store must be loaded with the shard count and splits it was dumped
+ * with.
+ */
+template <typename K, typename V, typename Hash = std::hash<K> >
+class ShardedStore {
+    using Shard = tSkipList<K, V>;
+public:
+    /**
+     * @brief Constructor for a hash partitioned ShardedStore.
+     * @param shards The number of shards, 0 for one per core.
+     */
+    explicit ShardedStore(int max_level, size_t shards = 0);
+
+    /**
+     * @brief Constructor for a range partitioned ShardedStore.
+     * @param splits Sorted keys, shard i holds splits[i-1] <= key < splits[i], so there is
+     * one shard more than splits.
+     */
+    ShardedStore(int max_level, const std::vector<K>& splits);
+
+    /**
+     * @return The number of shards.
+     */
+    size_t shard_count() const;
+
+    /**
+     * @return The shard that holds key.
+     */
+    size_t shard_of(const K& key) const;
+
+    /**
+     * @return The shard i.
+     */
+    Shard& shard(size_t i);
+
+    /**
+     * @return The number of elements in all shards.
+     */
+    int size();
+
+    /**
+     * @brief To choose the levels of the new nodes of every shard, see tSkipList.
+     * @param expected_elements The elements of the whole store, split evenly between the shards.
+     */
+    void set_level_distribution(unsigned branching, size_t expected_elements = 0);
+
+    /**
+     * @brief To bound the memory of the store, every shard gets an even share of bytes and
+     * evicts on its own, see tSkipList::set_memory_budget.
+     * @param bytes The budget of the whole store, 0 for none.
+     */
+    void set_memory_budget(size_t bytes);
+
+    /**
+     * @return The bytes of all shards counted against the budget.
+     */
+    size_t memory_usage();
+
+    /**
+     * @brief To insert an element.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, const V&);
+    int insert_element(const K&, V&&);
+
+    /**
+     * @brief To insert an element whose value is constructed from args, see tSkipList::emplace.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    template <typename... Args>
+    int emplace(const K& key, Args&&... args);
+
+    /**
+     * @brief To insert an element, or to assign value to the element of key if it exists.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int insert_or_assign(const K& key, M&& value);
+
+    /**
+     * @brief To insert or assign an element that expires ttl_ms from now, see tSkipList::put.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int put(const K& key, M&& value, uint64_t ttl_ms);
+
+    /**
+     * @brief To change the value of key in place, see tSkipList::update.
+     * @return True if found, False if not found.
+     */
+    template <typename Fn>
+    bool update(const K& key, Fn fn);
+
+    /**
+     * @brief To search element by its key.
+     * @return True if found, False if not found.
+     */
+    bool search_element(const K&, V&);
+
+    /**
+     * @brief To delete element by its key.
+     * If not found, do nothing.
+     * @return 0 if succeeds, 1 if not found.
+     */
+    int delete_element(const K&);
+
+    /**
+     * @brief To search a batch of keys, each shard gets one tSkipList::multi_get.
+     * @return The number of keys found.
+     */
+    int multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found);
+
+    /**
+     * @brief To insert a batch of elements, each shard gets one tSkipList::multi_insert.
+     * @return The number of inserted elements.
+     */
+    int multi_insert(const std::vector<std::pair<K, V> >& elements);
+
+    /**
+     * @brief To delete a batch of keys, each shard gets one tSkipList::multi_delete.
+     * @return The number of deleted elements.
+     */
+    int multi_delete(const std::vector<K>& keys);
+
+    /**
+     * @brief To sweep max_nodes nodes of every shard, see tSkipList::expire_step.
+     * @return The number of reclaimed elements.
+     */
+    size_t expire_step(size_t max_nodes);
+
+    /**
+     * @brief To start the background sweeper of every shard, see tSkipList::start_expiry.
+     * @return False if one was running already.
+     */
+    bool start_expiry(int interval_ms = 100, size_t max_nodes = 1024);
+
+    /**
+     * @brief To stop the background sweepers.
+     */
+    void stop_expiry();
+
+    /**
+     * @class Iterator
+     * @brief The Iterator class is used to walk the elements of all shards in key order.
+     * It merges one tSkipList::Iterator per shard and has the same rules. A consistent
+     * iterator reads a snapshot of every shard, all of one point in time, see
+     * tSkipList::snapshot_all. The writers of all shards are held off only while the
+     * snapshots are taken.
+     */
+    class Iterator {
+    public:
+        Iterator(ShardedStore* store, bool consistent);
+
+        /**
+         * @return True if the iterator is on an element.
+         */
+        bool valid() const { return !_heap.empty(); }
+
+        const K& key() const { return _its[_heap.front()].key(); }
+        const V& value() const { return _its[_heap.front()].value(); }
+
+        /**
+         * @brief To move to the first element.
+         */
+        void seek_to_first();
+
+        /**
+         * @brief To move to the first element whose key is not less than key.
+         */
+        void seek(const K& key);
+
+        /**
+         * @brief To move to the next element, the iterator must be valid.
+         */
+        void next();
+
+    private:
+        /**
+         * @brief To order the heap by key, smallest first.
+         */
+        struct Later {
+            const Iterator* it;
+            bool operator()(size_t a, size_t b) const { return it->_its[b].key() < it->_its[a].key(); }
+        };
+
+        /**
+         * @brief To rebuild the heap from the shard iterators that are on an element.
+         */
+        void rebuild();
+
+        // of a consistent iterator, read by _its
+        std::vector<typename Shard::Snapshot> _snapshots;
+        std::vector<typename Shard::Iterator> _its;
+        std::vector<size_t> _heap;
+    };
+
+    /**
+     * @return An iterator that is not on any element yet, seek it first.
+     * @param consistent To read a snapshot of every shard.
+     */
+    Iterator new_iterator(bool consistent = false);
+
+    /**
+     * @brief To collect the elements with lo <= key < hi in key order.
+     * @param limit Maximum number of elements, 0 for no limit.
+     * @param consistent To scan a snapshot of every shard, see Iterator.
+     */
+    std::vector<std::pair<K, V> > range(const K& lo, const K& hi, size_t limit = 0, bool consistent = false);
+
+    /**
+     * @brief To share threads among the shards for their dumps and loads, which run in
+     * parallel already, see tSkipList::set_snapshot_threads.
+     * @param threads 0 for one per core.
+     */
+    void set_snapshot_threads(unsigned threads);
+
+    /**
+     * @brief To compress the snapshots and logs of every shard, see tSkipList::set_compression.
+     */
+    void set_compression(Compression compression);
+
+    /**
+     * @brief To dump every shard to shard_path(path, i) in parallel.
+     * @return True if every snapshot was completely written.
+     */
+    bool dump_file(const std::string& path = STORE_FILE);
+
+    /**
+     * @brief To checkpoint every shard to shard_path(path, i) in parallel, see
+     * tSkipList::checkpoint.
+     * @return True if every checkpoint was completely written.
+     */
+    bool checkpoint(const std::string& path = STORE_FILE);
+
+    /**
+     * @brief To choose when the checkpoints of the shards compact their deltas, see
+     * tSkipList::set_checkpoint_compaction.
+     */
+    void set_checkpoint_compaction(size_t max_deltas, unsigned max_percent);
+
+    /**
+     * @brief To load every shard from shard_path(path, i) in parallel.
+     * @return True if every file was loaded.
+     */
+    bool load_file(const std::string& path = STORE_FILE, bool use_mmap = false);
+
+    /**
+     * @brief To open the write-ahead log of every shard at shard_path(path, i), the logs
+     * are replayed in parallel. See tSkipList::open_wal.
+     */
+    bool open_wal(const std::string& path = WAL_FILE, SyncPolicy policy = SyncPolicy::Always, int interval_ms = 100);
+
+    /**
+     * @return The file of shard i for path.
+     */
+    static std::string shard_path(const std::string& path, size_t i);
+
+private:
+    /**
+     * @brief To run fn(i) for every shard i on its own thread.
+     * @return True if every call returned true.
+     */
+    template <typename Fn>
+    bool parallel(Fn fn);
+
+    /**
+     * @brief To create count shards.
+     */
+    void create_shards(int max_level, size_t count);
+
+    // partitioning of the keys
+    const Partition _partition;
+
+    // split keys of Partition::Range
+    std::vector<K> _splits;
+
+    // hash of Partition::Hash
+    Hash _hash;
+
+    // the shards, each one a complete skip list
+    std::vector<std::unique_ptr<Shard> > _shards;
+};
+
+
+template<typename K, typename V, typename Hash>
+ShardedStore<K, V, Hash>::ShardedStore(int max_level, size_t shards) : _partition(Partition::Hash) {
+    if (shards == 0)
+        shards = std::max(1u, std::thread::hardware_concurrency());
+    create_shards(max_level, shards);
+}
+
+template<typename K, typename V, typename Hash>
+ShardedStore<K, V, Hash>::ShardedStore(int max_level, const std::vector<K>& splits)
+    : _partition(Partition::Range), _splits(splits) {
+    std::sort(_splits.begin(), _splits.end());
+    create_shards(max_level, _splits.size() + 1);
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::create_shards(int max_level, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        _shards.emplace_back(new Shard(max_level));
+    set_snapshot_threads(0);
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::set_snapshot_threads(unsigned threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned share = std::max<unsigned>(1, threads / static_cast<unsigned>(_shards.size()));
+    for (auto& shard : _shards)
+        shard->set_snapshot_threads(share);
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::set_compression(Compression compression) {
+    for (auto& shard : _shards)
+        shard->set_compression(compression);
+}
+
+template<typename K, typename V, typename Hash>
+size_t ShardedStore<K, V, Hash>::shard_count() const {
+    return _shards.size();
+}
+
+template<typename K, typename V, typename Hash>
+size_t ShardedStore<K, V, Hash>::shard_of(const K& key) const {
+    if (_partition == Partition::Range)
+        return std::upper_bound(_splits.begin(), _splits.end(), key) - _splits.begin();
+    // std::hash of an integer is the integer, mix it so strided keys still spread
+    uint64_t h = static_cast<uint64_t>(_hash(key)) * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>((h >> 32) % _shards.size());
+}
+
+template<typename K, typename V, typename Hash>
+typename ShardedStore<K, V, Hash>::Shard& ShardedStore<K, V, Hash>::shard(size_t i) {
+    return *_shards[i];
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::size() {
+    int count = 0;
+    for (auto& shard : _shards)
+        count += shard->size();
+    return count;
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::set_level_distribution(unsigned branching, size_t expected_elements) {
+    for (auto& shard : _shards)
+        shard->set_level_distribution(branching, expected_elements / _shards.size());
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::set_memory_budget(size_t bytes) {
+    // a budget below one byte per shard would mean none
+    size_t share = bytes == 0 ? 0 : std::max<size_t>(1, bytes / _shards.size());
+    for (auto& shard : _shards)
+        shard->set_memory_budget(share);
+}
+
+template<typename K, typename V, typename Hash>
+size_t ShardedStore<K, V, Hash>::memory_usage() {
+    size_t bytes = 0;
+    for (auto& shard : _shards)
+        bytes += shard->memory_usage();
+    return bytes;
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::insert_element(const K& key, const V& value) {
+    return _shards[shard_of(key)]->insert_element(key, value);
+}
+
+template <typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::insert_element(const K& key, V&& value) {
+    return _shards[shard_of(key)]->insert_element(key, std::move(value));
+}
+
+template <typename K, typename V, typename Hash>
+template <typename... Args>
+int ShardedStore<K, V, Hash>::emplace(const K& key, Args&&... args) {
+    return _shards[shard_of(key)]->emplace(key, std::forward<Args>(args)...);
+}
+
+template <typename K, typename V, typename Hash>
+template <typename M>
+int ShardedStore<K, V, Hash>::insert_or_assign(const K& key, M&& value) {
+    return _shards[shard_of(key)]->insert_or_assign(key, std::forward<M>(value));
+}
+
+template<typename K, typename V, typename Hash>
+template <typename M>
+int ShardedStore<K, V, Hash>::put(const K& key, M&& value, uint64_t ttl_ms) {
+    return _shards[shard_of(key)]->put(key, std::forward<M>(value), ttl_ms);
+}
+
+template <typename K, typename V, typename Hash>
+template <typename Fn>
+bool ShardedStore<K, V, Hash>::update(const K& key, Fn fn) {
+    return _shards[shard_of(key)]->update(key, std::move(fn));
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::search_element(const K& key, V& value_out) {
+    return _shards[shard_of(key)]->search_element(key, value_out);
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::delete_element(const K& key) {
+    return _shards[shard_of(key)]->delete_element(key);
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+
+    std::vector<std::vector<size_t> > owned(_shards.size());
+    for (size_t i = 0; i < keys.size(); ++i)
+        owned[shard_of(keys[i])].push_back(i);
+
+    int count = 0;
+    std::vector<K> shard_keys;
+    std::vector<V> shard_values;
+    std::vector<bool> shard_found;
+    for (size_t s = 0; s < _shards.size(); ++s) {
+        if (owned[s].empty())
+            continue;
+        shard_keys.clear();
+        for (size_t i : owned[s])
+            shard_keys.push_back(keys[i]);
+        count += _shards[s]->multi_get(shard_keys, shard_values, shard_found);
+        for (size_t j = 0; j < owned[s].size(); ++j) {
+            if (shard_found[j]) {
+                values[owned[s][j]] = shard_values[j];
+                found[owned[s][j]] = true;
+            }
+        }
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::multi_insert(const std::vector<std::pair<K, V> >& elements) {
+    std::vector<std::vector<std::pair<K, V> > > owned(_shards.size());
+    for (const auto& e : elements)
+        owned[shard_of(e.first)].push_back(e);
+
+    int count = 0;
+    for (size_t s = 0; s < _shards.size(); ++s) {
+        if (!owned[s].empty())
+            count += _shards[s]->multi_insert(owned[s]);
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Hash>
+int ShardedStore<K, V, Hash>::multi_delete(const std::vector<K>& keys) {
+    std::vector<std::vector<K> > owned(_shards.size());
+    for (const K& key : keys)
+        owned[shard_of(key)].push_back(key);
+
+    int count = 0;
+    for (size_t s = 0; s < _shards.size(); ++s) {
+        if (!owned[s].empty())
+            count += _shards[s]->multi_delete(owned[s]);
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Hash>
+size_t ShardedStore<K, V, Hash>::expire_step(size_t max_nodes) {
+    size_t count = 0;
+    for (auto& shard : _shards)
+        count += shard->expire_step(max_nodes);
+    return count;
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::start_expiry(int interval_ms, size_t max_nodes) {
+    bool started = true;
+    for (auto& shard : _shards)
+        started = shard->start_expiry(interval_ms, max_nodes) && started;
+    return started;
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::stop_expiry() {
+    for (auto& shard : _shards)
+        shard->stop_expiry();
+}
+
+template<typename K, typename V, typename Hash>
+ShardedStore<K, V, Hash>::Iterator::Iterator(ShardedStore* store, bool consistent) {
+    _its.reserve(store->_shards.size());
+    if (!consistent) {
+        for (auto& shard : store->_shards)
+            _its.push_back(shard->new_iterator(false));
+        return;
+    }
+    std::vector<Shard*> shards;
+    for (auto& shard : store->_shards)
+        shards.push_back(shard.get());
+    _snapshots = Shard::snapshot_all(shards);
+    for (size_t i = 0; i < shards.size(); ++i)
+        _its.push_back(shards[i]->new_iterator(_snapshots[i]));
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::Iterator::seek_to_first() {
+    for (auto& it : _its)
+        it.seek_to_first();
+    rebuild();
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::Iterator::seek(const K& key) {
+    for (auto& it : _its)
+        it.seek(key);
+    rebuild();
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::Iterator::next() {
+    std::pop_heap(_heap.begin(), _heap.end(), Later{this});
+    size_t i = _heap.back();
+    _its[i].next();
+    if (_its[i].valid())
+        std::push_heap(_heap.begin(), _heap.end(), Later{this});
+    else
+        _heap.pop_back();
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::Iterator::rebuild() {
+    _heap.clear();
+    for (size_t i = 0; i < _its.size(); ++i) {
+        if (_its[i].valid())
+            _heap.push_back(i);
+    }
+    std::make_heap(_heap.begin(), _heap.end(), Later{this});
+}
+
+template<typename K, typename V, typename Hash>
+typename ShardedStore<K, V, Hash>::Iterator ShardedStore<K, V, Hash>::new_iterator(bool consistent) {
+    return Iterator(this, consistent);
+}
+
+template<typename K, typename V, typename Hash>
+std::vector<std::pair<K, V> > ShardedStore<K, V, Hash>::range(const K& lo, const K& hi, size_t limit, bool consistent) {
+    std::vector<std::pair<K, V> > out;
+    if (_partition == Partition::Range) {
+        // the shards hold consecutive key ranges, no merge is needed
+        size_t first = shard_of(lo);
+        size_t end = first + 1;
+        while (end < _shards.size() && _splits[end - 1] < hi)
+            end++;
+        std::vector<typename Shard::Snapshot> snapshots;
+        if (consistent) {
+            std::vector<Shard*> shards;
+            for (size_t s = first; s < end; ++s)
+                shards.push_back(_shards[s].get());
+            snapshots = Shard::snapshot_all(shards);
+        }
+        for (size_t s = first; s < end; ++s) {
+            size_t left = limit == 0 ? 0 : limit - out.size();
+            std::vector<std::pair<K, V> > part = consistent ? _shards[s]->range(lo, hi, left, snapshots[s - first])
+                                                            : _shards[s]->range(lo, hi, left);
+            out.insert(out.end(), part.begin(), part.end());
+            if (limit != 0 && out.size() >= limit)
+                break;
+        }
+        return out;
+    }
+
+    Iterator it(this, consistent);
+    for (it.seek(lo); it.valid() && it.key() < hi; it.next()) {
+        if (limit != 0 && out.size() >= limit)
+            break;
+        out.emplace_back(it.key(), it.value());
+    }
+    return out;
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::dump_file(const std::string& path) {
+    return parallel([this, &path](size_t i) {
+        return _shards[i]->dump_file(shard_path(path, i));
+    });
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::checkpoint(const std::string& path) {
+    return parallel([this, &path](size_t i) {
+        return _shards[i]->checkpoint(shard_path(path, i));
+    });
+}
+
+template<typename K, typename V, typename Hash>
+void ShardedStore<K, V, Hash>::set_checkpoint_compaction(size_t max_deltas, unsigned max_percent) {
+    for (auto& shard : _shards)
+        shard->set_checkpoint_compaction(max_deltas, max_percent);
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::load_file(const std::string& path, bool use_mmap) {
+    return parallel([this, &path, use_mmap](size_t i) {
+        return _shards[i]->load_file(shard_path(path, i), use_mmap);
+    });
+}
+
+template<typename K, typename V, typename Hash>
+bool ShardedStore<K, V, Hash>::open_wal(const std::string& path, SyncPolicy policy, int interval_ms) {
+    return parallel([this, &path, policy, interval_ms](size_t i) {
+        return _shards[i]->open_wal(shard_path(path, i), policy, interval_ms);
+    });
+}
+
+template<typename K, typename V, typename Hash>
+std::string ShardedStore<K, V, Hash>::shard_path(const std::string& path, size_t i) {
+    return path + "-" + std::to_string(i);
+}
+
+template<typename K, typename V, typename Hash>
+template <typename Fn>
+bool ShardedStore<K, V, Hash>::parallel(Fn fn) {
+    std::vector<std::future<bool> > results;
+    for (size_t i = 0; i < _shards.size(); ++i)
+        results.push_back(std::async(std::launch::async, fn, i));
+    bool ok = true;
+    for (auto& result : results) {
+        if (!result.get())
+            ok = false;
+    }
+    return ok;
+}
+
+
+#endif //SHARDED_STORE_H
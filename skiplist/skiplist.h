@@ -11,21 +11,29 @@
 #ifndef SKIP_LIST_H
 #define SKIP_LIST_H
 
-
-#define STORE_FILE "store/dumpFile"
-
-std::string delimiter = ":";
-
 #include <iostream> 
 #include <cstdlib>
+#include <functional>
 #include <cmath>
 #include <cstring>
 #include <fstream>
-
+#include <memory>
+#include <vector>
+#include <new>
+#include <type_traits>
+#include "common.h"
+#include "allocator.h"
+#include "codec.h"
+#include "levels.h"
+#include "logging.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "wal.h"
 
 /**
  * @struct Node
  * @brief The Node struct is used to manage nodes in the skip list.
+ * The forward array is stored right behind the node, in the same allocation.
  */
 template<typename K, typename V> 
 struct Node {
@@ -36,36 +44,43 @@ struct Node {
     
     /**
      * @brief Constructor for Node.
-     * To initialze the data structures.
+     * To initialze the data structures, the memory must hold size_of(level) bytes.
+     * The value is constructed from args in place.
      */
-    Node(K k, V v, int level) : key(k), value(v), node_level(level) {
-        forward = new Node<K, V>*[level + 1];
+    template <typename... Args>
+    Node(int level, const K& k, Args&&... args) : key(k), value(std::forward<Args>(args)...), node_level(level) {
+        forward = reinterpret_cast<Node<K, V>**>(this + 1);
         for (int i = 0; i <= level; ++i)
             forward[i] = NULL;
     }
 
     /**
-     * @brief Deconstructor for Node.
-     * To free the array of pointers.
+     * @return The bytes of a node of the level together with its forward array.
      */
-    ~Node() {
-        delete[] forward;  
+    static size_t size_of(int level) {
+        return sizeof(Node<K, V>) + sizeof(Node<K, V>*) * (level + 1);
     }
 };
 
 /**
  * @class SkipList
  * @brief The SkipList class is used to manage the skip list.
+ * Alloc provides the memory of the nodes, see allocator.h.
  */
-template <typename K, typename V> 
+template <typename K, typename V, typename Compare = std::less<K>,
+          typename Serializer = RecordCodec<K, V>, typename Alloc = NodeArena<> > 
 class SkipList {
     using SkipNode = Node<K, V>;
+    using KeyCodec = typename Serializer::Key;
+    using ValueCodec = typename Serializer::Value;
 public: 
     /**
      * @brief Constructor for SkipList.
      * To initialze the data structures.
+     * The highest level is capped at kSnapshotMaxLevel, the most a snapshot record holds.
+     * @param compare The order of the keys.
      */
-    SkipList(int);
+    SkipList(int, const Compare& compare = Compare());
 
     /**
      * @brief Deconstructor for MutexNode.
@@ -79,10 +94,51 @@ public:
     int size();
 
     /**
-     * @brief To insert an element.
+     * @brief To take a copy of the counters of the list, see metrics.h.
+     */
+    Stats stats();
+
+    /**
+     * @brief To choose the levels of the nodes inserted from now on, see levels.h.
+     * The nodes already in the list keep their levels.
+     * @param branching 1/p, a node reaches the next level with probability 1/branching.
+     * @param expected_elements To cap the levels at log_branching of it, 0 for max_level.
+     */
+    void set_level_distribution(unsigned branching, size_t expected_elements = 0);
+
+    /**
+     * @brief To insert an element, the value is copied into the node.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, const V&);
+
+    /**
+     * @brief To insert an element, the value is moved into the node.
      * @return 0 if succeeds, 1 if key exists.
      */
-    int insert_element(K, V);
+    int insert_element(const K&, V&&);
+
+    /**
+     * @brief To insert an element whose value is constructed in the node from args.
+     * @return 0 if succeeds, 1 if key exists, args are then left untouched.
+     */
+    template <typename... Args>
+    int emplace(const K& key, Args&&... args);
+
+    /**
+     * @brief To insert an element, or to assign value to the element of key if it exists.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int insert_or_assign(const K& key, M&& value);
+
+    /**
+     * @brief To change the value of key in place, read-modify-write without a delete and an
+     * insert. fn is called with a V& and must not call into the list.
+     * @return True if found, False if not found.
+     */
+    template <typename Fn>
+    bool update(const K& key, Fn fn);
 
     /**
      * @brief To display the skip list element by element.
@@ -93,33 +149,196 @@ public:
      * @brief To search element by its key.
      * @return True if found, False if not found.
      */
-    bool search_element(K);
+    bool search_element(const K&);
     
     /**
      * @brief To delete element by its key.
      * If not found, do nothing.
+     * @return 0 if succeeds, 1 if not found.
+     */
+    int delete_element(const K&);
+
+    /**
+     * @brief To search a batch of keys.
+     * The keys are visited in sorted order and every search starts from the path of the
+     * previous key, so close keys only pay for the distance between them.
+     * @param values Resized to the number of keys, values[i] is set if found[i].
+     * @return The number of keys found.
+     */
+    int multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found);
+
+    /**
+     * @brief To insert a batch of elements, searched like multi_get.
+     * The write-ahead log is synced once for the whole batch.
+     * @return The number of inserted elements, keys that exist are skipped.
      */
-    void delete_element(K);
+    int multi_insert(const std::vector<std::pair<K, V> >& elements);
+
+    /**
+     * @brief To delete a batch of keys, searched like multi_get.
+     * @return The number of deleted elements.
+     */
+    int multi_delete(const std::vector<K>& keys);
+
+    /**
+     * @brief To insert a range of key-value pairs sorted by key.
+     * An empty list is built by appending to the tail of every level, a list with elements
+     * gets a multi_insert.
+     * @return The number of inserted elements.
+     */
+    template <typename InputIt>
+    int bulk_load(InputIt first, InputIt last);
+
+    /**
+     * @class Iterator
+     * @brief The Iterator class is used to walk the elements in key order.
+     * It points into the list, deleting the element it is on invalidates it.
+     */
+    class Iterator {
+    public:
+        explicit Iterator(SkipList* list) : _list(list), _node(NULL) {}
+
+        /**
+         * @return True if the iterator is on an element.
+         */
+        bool valid() const { return _node != NULL; }
+
+        const K& key() const { return _node->key; }
+        const V& value() const { return _node->value; }
+
+        /**
+         * @brief To move to the first element.
+         */
+        void seek_to_first();
+
+        /**
+         * @brief To move to the first element whose key is not less than key.
+         */
+        void seek(const K& key);
+
+        /**
+         * @brief To move to the next element, the iterator must be valid.
+         */
+        void next();
+
+    private:
+        SkipList* _list;
+        SkipNode* _node;
+    };
+
+    /**
+     * @return An iterator that is not on any element yet, seek it first.
+     */
+    Iterator new_iterator();
+
+    /**
+     * @brief To collect the elements with lo <= key < hi in key order.
+     * @param limit Maximum number of elements, 0 for no limit.
+     */
+    std::vector<std::pair<K, V> > range(const K& lo, const K& hi, size_t limit = 0);
     
     /**
-     * @brief To dump the skip list to the file.
+     * @brief To dump the skip list to the file as a binary snapshot, see snapshot.h.
+     * @param path The file, replaced atomically once the snapshot is complete.
+     * @return True if the snapshot was completely written.
      */
-    void dump_file();
+    bool dump_file(const std::string& path = STORE_FILE);
     
     /**
      * @brief To load the skip list from the file.
+     * A snapshot is appended in one linear pass if the list is empty, files in the old
+     * key:value text format are still read.
+     * @param use_mmap To map the snapshot instead of reading it. It is always mapped if K or
+     * V is a Slice, those keys and values then point into the mapping, which is kept until
+     * the list is destroyed.
+     * @param path The snapshot or text file.
+     * @return True if the whole file was loaded.
+     */
+    bool load_file(const std::string& path = STORE_FILE, bool use_mmap = false);
+
+    /**
+     * @brief To log every insert and delete to a write-ahead log from now on.
+     * The existing segments are replayed first, so call it after load_file: the log holds the
+     * changes made after the last dump, which removes the segments it covers.
+     * @return True if the log was replayed and a new segment opened.
      */
-    void load_file();
+    bool open_wal(const std::string& path = WAL_FILE, SyncPolicy policy = SyncPolicy::Always, int interval_ms = 100);
 
 private:    
     /**
-     * @brief To clear a node and the next nodes recursively.
+     * @brief To order keys by Compare, equal keys are the ones neither is less than.
+     */
+    bool less(const K& a, const K& b) const { return _compare(a, b); }
+    bool equal(const K& a, const K& b) const { return !_compare(a, b) && !_compare(b, a); }
+
+    /**
+     * @brief To allocate and construct a node with its forward array, the value from args.
+     */
+    template <typename... Args>
+    SkipNode* create_node(int, const K&, Args&&...);
+
+    /**
+     * @brief To destroy a node and give its memory back to the allocator.
+     */
+    void destroy_node(SkipNode *);
+
+    /**
+     * @brief To fill update[i] with the last node before key on every level i.
+     */
+    void find_path(const K& key, SkipNode** update);
+
+    /**
+     * @brief To move the path of a smaller key in update to the path of key.
+     * It climbs while the old path has to move right, then comes down from there.
+     */
+    void finger_path(const K& key, SkipNode** update);
+
+    /**
+     * @brief To insert an element after the path in update, its value constructed from args.
+     * @param lsn Set to the log record of the insert, if logged.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    template <typename... Args>
+    int insert_at(SkipNode** update, const K& key, uint64_t& lsn, Args&&... args);
+
+    /**
+     * @brief To delete the element after the path in update.
+     * @param lsn Set to the log record of the delete, if logged.
+     * @return True if the key was found.
+     */
+    bool delete_at(SkipNode** update, const K& key, uint64_t& lsn);
+
+    /**
+     * @brief To append a change to the write-ahead log, if any.
+     * @return The log record, 0 if not logged.
+     */
+    uint64_t log_append(uint8_t op, const K& key, const V* value);
+
+    /**
+     * @brief To wait until the log record lsn is durable, 0 is no record.
+     */
+    void log_commit(uint64_t lsn);
+
+    /**
+     * @brief To load the old key:value text format.
+     */
+    bool load_text_file(const std::string& path);
+
+    /**
+     * @brief To load a single snapshot file, see load_file.
+     * @param delta If the file is a delta of a checkpoint: its records replace the elements of
+     * their keys and its tombstones delete them, see SnapshotManifest.
+     */
+    bool load_snapshot(const std::string& path, bool use_mmap, bool delta);
+
+    /**
+     * @brief To clear a node and the next nodes iteratively.
+     * Nothing is walked if the allocator frees all nodes at once and they need no destructor.
      */
     void clear(SkipNode *);
 
     /**
-     * @brief Deconstructor for MutexNode.
-     * To free the array of pointers.
+     * @return The level of a new node, from 0 to _max_level.
      */
     int get_random_level();
 
@@ -136,130 +355,250 @@ private:
     // Maximum level of the skip list 
     const int _max_level;
 
+    // order of the keys
+    Compare _compare;
+
+    // memory of the nodes
+    Alloc _allocator;
+
+    // levels of the new nodes
+    LevelGenerator _levels;
+
     // current level of skip list 
     int _skip_list_level;
 
     // pointer to header node 
     SkipNode *_header;
 
-    // file operator
-    std::ofstream _file_writer;
+    // file operator of the text format
     std::ifstream _file_reader;
 
+    // mapped snapshots that keys or values of the list point into
+    std::vector<std::unique_ptr<MappedFile> > _mappings;
+
+    // log of the changes since the last dump, NULL if not opened
+    std::unique_ptr<WriteAheadLog> _wal;
+
     // skiplist current element count
     int _element_count;
+
+    // operation counters, nodes per level and latency
+    Metrics _metrics;
 };
 
 
-template<typename K, typename V> 
-SkipList<K, V>::SkipList(int max_level) : _max_level(max_level), _skip_list_level(0), _element_count(0){
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+SkipList<K, V, Compare, Serializer, Alloc>::SkipList(int max_level, const Compare& compare) : _max_level(snapshot_max_level(max_level)), _compare(compare), _allocator(_max_level), _levels(_max_level), _skip_list_level(0), _element_count(0){
     // create header node and initialize key and value to null
-    K k;
-    V v;
-    this->_header = new SkipNode(k, v, _max_level);
+    this->_header = create_node(_max_level, K());
+    // the header is not a node of the list
+    _metrics.add_nodes(_max_level, -1);
 };
 
-template<typename K, typename V> 
-SkipList<K, V>::~SkipList() {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+SkipList<K, V, Compare, Serializer, Alloc>::~SkipList() {
 
-    if (_file_writer.is_open()) {
-        _file_writer.close();
-    }
     if (_file_reader.is_open()) {
         _file_reader.close();
     }
 
-    //递归删除跳表链条
-    if(_header->forward[0]!=nullptr){
-        clear(_header->forward[0]);
-    }
-    delete(_header);
+    //删除跳表链条
+    clear(_header->forward[0]);
+    destroy_node(_header);
 }
 
-template<typename K, typename V> 
-int SkipList<K, V>::size() { 
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::size() { 
     return _element_count;
 }
 
-template<typename K, typename V>
-int SkipList<K, V>::insert_element(const K key, const V value) {
-    SkipNode *current = this->_header;
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+Stats SkipList<K, V, Compare, Serializer, Alloc>::stats() {
+    Stats stats;
+    _metrics.collect(stats);
+    stats.level = _skip_list_level;
+    stats.node_bytes = SkipNode::size_of(_max_level);
+    for (size_t i = 0; i < stats.level_nodes.size(); i++)
+        stats.node_bytes += stats.level_nodes[i] * SkipNode::size_of(static_cast<int>(i));
+    return stats;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::set_level_distribution(unsigned branching, size_t expected_elements) {
+    _levels.configure(branching, expected_elements);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, const V& value) {
+    return emplace(key, value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, V&& value) {
+    return emplace(key, std::move(value));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int SkipList<K, V, Compare, Serializer, Alloc>::emplace(const K& key, Args&&... args) {
 
     // create update array and initialize it 
     // update is array which put node that the node->forward[i] should be operated later
+    uint64_t start = _metrics.start();
     SkipNode *update[_max_level+1];
-    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));  
+    find_path(key, update);
 
-    // start form highest level of skip list 
-    for(int i = _skip_list_level; i >= 0; i--) {
-        while(current->forward[i] != NULL && current->forward[i]->key < key) {
-            current = current->forward[i]; 
+    uint64_t lsn = 0;
+    int ret = insert_at(update, key, lsn, std::forward<Args>(args)...);
+    log_commit(lsn);
+    _metrics.record(Stats::kPut, ret == 0, start);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename M>
+int SkipList<K, V, Compare, Serializer, Alloc>::insert_or_assign(const K& key, M&& value) {
+    uint64_t start = _metrics.start();
+    SkipNode *update[_max_level+1];
+    find_path(key, update);
+
+    uint64_t lsn = 0;
+    int ret = 1;
+    SkipNode *current = update[0]->forward[0];
+    if (current != NULL && equal(current->key, key)) {
+        current->value = std::forward<M>(value);
+        lsn = log_append(kWalPut, key, &current->value);
+    } else {
+        ret = insert_at(update, key, lsn, std::forward<M>(value));
+    }
+    log_commit(lsn);
+    _metrics.record(Stats::kPut, ret == 0, start);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename Fn>
+bool SkipList<K, V, Compare, Serializer, Alloc>::update(const K& key, Fn fn) {
+    uint64_t start = _metrics.start();
+    SkipNode *current = _header;
+    for (int i = _skip_list_level; i >= 0; i--) {
+        while (current->forward[i] != NULL && less(current->forward[i]->key, key)) {
+            current = current->forward[i];
         }
-        update[i] = current;
     }
+    current = current->forward[0];
+    if (current == NULL || !equal(current->key, key)) {
+        _metrics.record(Stats::kPut, false, start);
+        return false;
+    }
+
+    fn(current->value);
+    log_commit(log_append(kWalPut, key, &current->value));
+    _metrics.record(Stats::kPut, true, start);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int SkipList<K, V, Compare, Serializer, Alloc>::insert_at(SkipNode** update, const K& key, uint64_t& lsn, Args&&... args) {
 
     // reached level 0 and forward pointer to right node, which is desired to insert key.
-    current = current->forward[0];
+    SkipNode *current = update[0]->forward[0];
 
     // if current node have key equal to searched key, we get it
-    if (current != NULL && current->key == key) {
-        std::cout << "key: " << key << ", exists" << std::endl;
+    if (current != NULL && equal(current->key, key)) {
+        SKIPLIST_LOG(Debug, "key: " << printable(key) << ", exists");
         return 1;
     }
 
     // if current is NULL that means we have reached to end of the level 
     // if current's key is not equal to key that means we have to insert node between update[0] and current node 
-    if (current == NULL || current->key != key ) {
-        
-        // Generate a random level for node
-        int random_level = get_random_level();
-
-        // If random level is greater thar skip list's current level, initialize update value with pointer to header
-        if (random_level > _skip_list_level) {
-            for (int i = _skip_list_level+1; i < random_level+1; i++) {
-                update[i] = _header;
-            }
-            _skip_list_level = random_level;
+    // Generate a random level for node
+    int random_level = get_random_level();
+
+    // levels above the list's level are already _header in update
+    if (random_level > _skip_list_level) {
+        _skip_list_level = random_level;
+    }
+
+    // create new node with random level generated 
+    SkipNode* inserted_node = create_node(random_level, key, std::forward<Args>(args)...);
+    
+    // insert node 
+    for (int i = 0; i <= random_level; i++) {
+        inserted_node->forward[i] = update[i]->forward[i];
+        update[i]->forward[i] = inserted_node;
+    }
+    SKIPLIST_LOG(Debug, "Successfully inserted key:" << printable(key) << ", value:" << printable(inserted_node->value));
+    _element_count ++;
+    lsn = log_append(kWalPut, key, &inserted_node->value);
+    return 0;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::find_path(const K& key, SkipNode** update) {
+    SkipNode *current = this->_header;
+
+    for (int i = _max_level; i > _skip_list_level; i--) {
+        update[i] = _header;
+    }
+
+    // start form highest level of skip list 
+    for (int i = _skip_list_level; i >= 0; i--) {
+        while (current->forward[i] != NULL && less(current->forward[i]->key, key)) {
+            current = current->forward[i]; 
         }
+        update[i] = current;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::finger_path(const K& key, SkipNode** update) {
+
+    // the old path stays valid above the first level where it does not have to move
+    int level = 0;
+    while (level < _skip_list_level && update[level]->forward[level] != NULL
+           && less(update[level]->forward[level]->key, key)) {
+        level++;
+    }
 
-        // create new node with random level generated 
-        SkipNode* inserted_node = new SkipNode(key, value, random_level);
-        
-        // insert node 
-        for (int i = 0; i <= random_level; i++) {
-            inserted_node->forward[i] = update[i]->forward[i];
-            update[i]->forward[i] = inserted_node;
+    SkipNode *current = update[level];
+    for (int i = level; i >= 0; i--) {
+        // the old path may be further right than the node coming down
+        if (update[i] != _header && (current == _header || less(current->key, update[i]->key))) {
+            current = update[i];
         }
-        std::cout << "Successfully inserted key:" << key << ", value:" << value << std::endl;
-        _element_count ++;
+        while (current->forward[i] != NULL && less(current->forward[i]->key, key)) {
+            current = current->forward[i];
+        }
+        update[i] = current;
     }
-    return 0;
 }
 
-template<typename K, typename V> 
-void SkipList<K, V>::display_list() {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::display_list() {
 
     std::cout << "\n*****Skip List*****"<<"\n"; 
     for (int i = 0; i <= _skip_list_level; i++) {
         SkipNode *node = this->_header->forward[i]; 
         std::cout << "Level " << i << ": ";
         while (node != NULL) {
-            std::cout << node->key << ":" << node->value << ";";
+            std::cout << printable(node->key) << ":" << printable(node->value) << ";";
             node = node->forward[i];
         }
         std::cout << std::endl;
     }
 }
 
-template<typename K, typename V> 
-bool SkipList<K, V>::search_element(K key) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::search_element(const K& key) {
 
-    std::cout << "search_element-----------------" << std::endl;
+    uint64_t start = _metrics.start();
     SkipNode *current = _header;
 
     // start from highest level of skip list
     for (int i = _skip_list_level; i >= 0; i--) {
-        while (current->forward[i] && current->forward[i]->key < key) {
+        while (current->forward[i] && less(current->forward[i]->key, key)) {
             current = current->forward[i];
         }
     }
@@ -268,77 +607,387 @@ bool SkipList<K, V>::search_element(K key) {
     current = current->forward[0];
 
     // if current node have key equal to searched key, we get it
-    if (current and current->key == key) {
-        std::cout << "Found key: " << key << ", value: " << current->value << std::endl;
+    if (current and equal(current->key, key)) {
+        SKIPLIST_LOG(Debug, "Found key: " << printable(key) << ", value: " << printable(current->value));
+        _metrics.record(Stats::kGet, true, start);
         return true;
     }
 
-    std::cout << "Not Found Key:" << key << std::endl;
+    SKIPLIST_LOG(Debug, "Not Found Key:" << printable(key));
+    _metrics.record(Stats::kGet, false, start);
     return false;
 }
 
-template<typename K, typename V> 
-void SkipList<K, V>::delete_element(K key) {
-    SkipNode *current = this->_header; 
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::delete_element(const K& key) {
+    uint64_t start = _metrics.start();
     SkipNode *update[_max_level+1];
-    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+    find_path(key, update);
 
-    // start from highest level of skip list
-    for (int i = _skip_list_level; i >= 0; i--) {
-        while (current->forward[i] !=NULL && current->forward[i]->key < key) {
-            current = current->forward[i];
+    uint64_t lsn = 0;
+    bool found = delete_at(update, key, lsn);
+    log_commit(lsn);
+    _metrics.record(Stats::kDelete, found, start);
+    return found ? 0 : 1;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::delete_at(SkipNode** update, const K& key, uint64_t& lsn) {
+    SkipNode *current = update[0]->forward[0];
+    if (current == NULL || !equal(current->key, key)) {
+        return false;
+    }
+
+    // start for lowest level and delete the current node of each level
+    for (int i = 0; i <= _skip_list_level; i++) {
+
+        // if at level i, next node is not target node, break the loop.
+        if (update[i]->forward[i] != current) 
+            break;
+
+        update[i]->forward[i] = current->forward[i];
+    }
+
+    // Remove levels which have no elements
+    while (_skip_list_level > 0 && _header->forward[_skip_list_level] == 0) {
+        _skip_list_level --; 
+    }
+
+    SKIPLIST_LOG(Debug, "Successfully deleted key "<< printable(key));
+    destroy_node(current);
+    _element_count --;
+    lsn = log_append(kWalDelete, key, NULL);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+        finger_path(keys[idx], update);
+        SkipNode *node = update[0]->forward[0];
+        bool hit = node != NULL && equal(node->key, keys[idx]);
+        if (hit) {
+            values[idx] = node->value;
+            found[idx] = true;
+            count++;
         }
-        update[i] = current;
+        _metrics.record(Stats::kGet, hit, 0);
     }
+    return count;
+}
 
-    current = current->forward[0];
-    if (current != NULL && current->key == key) {
-       
-        // start for lowest level and delete the current node of each level
-        for (int i = 0; i <= _skip_list_level; i++) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::multi_insert(const std::vector<std::pair<K, V> >& elements) {
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    uint64_t lsn = 0;
+    for (size_t idx : sorted_order(elements, [](const std::pair<K, V>& e) -> const K& { return e.first; }, _compare)) {
+        finger_path(elements[idx].first, update);
+        bool inserted = insert_at(update, elements[idx].first, lsn, elements[idx].second) == 0;
+        if (inserted)
+            count++;
+        _metrics.record(Stats::kPut, inserted, 0);
+    }
+    log_commit(lsn);
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::multi_delete(const std::vector<K>& keys) {
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+
+    int count = 0;
+    uint64_t lsn = 0;
+    for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+        finger_path(keys[idx], update);
+        bool deleted = delete_at(update, keys[idx], lsn);
+        if (deleted)
+            count++;
+        _metrics.record(Stats::kDelete, deleted, 0);
+    }
+    log_commit(lsn);
+    return count;
+}
 
-            // if at level i, next node is not target node, break the loop.
-            if (update[i]->forward[i] != current) 
-                break;
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename InputIt>
+int SkipList<K, V, Compare, Serializer, Alloc>::bulk_load(InputIt first, InputIt last) {
+    if (_header->forward[0] != NULL) {
+        std::vector<std::pair<K, V> > elements(first, last);
+        return multi_insert(elements);
+    }
 
-            update[i]->forward[i] = current->forward[i];
+    // tail[i] is the last node of level i
+    SkipNode *tail[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        tail[i] = _header;
+
+    int count = 0;
+    uint64_t lsn = 0;
+    for (; first != last; ++first) {
+        const K& key = first->first;
+        const V& value = first->second;
+
+        // appending is only valid while the keys keep growing
+        if (tail[0] != _header && !less(tail[0]->key, key)) {
+            std::vector<std::pair<K, V> > rest(first, last);
+            log_commit(lsn);
+            return count + multi_insert(rest);
+        }
+        int level = get_random_level();
+        SkipNode *node = create_node(level, key, value);
+        for (int i = 0; i <= level; i++) {
+            tail[i]->forward[i] = node;
+            tail[i] = node;
         }
+        if (level > _skip_list_level)
+            _skip_list_level = level;
+        _element_count ++;
+        lsn = log_append(kWalPut, key, &value);
+        count++;
+    }
+    log_commit(lsn);
+    return count;
+}
 
-        // Remove levels which have no elements
-        while (_skip_list_level > 0 && _header->forward[_skip_list_level] == 0) {
-            _skip_list_level --; 
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename SkipList<K, V, Compare, Serializer, Alloc>::Iterator SkipList<K, V, Compare, Serializer, Alloc>::new_iterator() {
+    return Iterator(this);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek_to_first() {
+    _node = _list->_header->forward[0];
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek(const K& key) {
+    SkipNode *current = _list->_header;
+    for (int i = _list->_skip_list_level; i >= 0; i--) {
+        while (current->forward[i] != NULL && _list->less(current->forward[i]->key, key)) {
+            current = current->forward[i];
         }
+    }
+    _node = current->forward[0];
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::Iterator::next() {
+    _node = _node->forward[0];
+}
 
-        std::cout << "Successfully deleted key "<< key << std::endl;
-        delete current;
-        _element_count --;
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<std::pair<K, V> > SkipList<K, V, Compare, Serializer, Alloc>::range(const K& lo, const K& hi, size_t limit) {
+    uint64_t start = _metrics.start();
+    std::vector<std::pair<K, V> > out;
+    Iterator it(this);
+    for (it.seek(lo); it.valid() && less(it.key(), hi); it.next()) {
+        if (limit != 0 && out.size() >= limit)
+            break;
+        out.emplace_back(it.key(), it.value());
     }
-    return;
+    _metrics.record(Stats::kScan, !out.empty(), start);
+    return out;
 }
 
-template<typename K, typename V> 
-void SkipList<K, V>::dump_file() {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::dump_file(const std::string& path) {
 
-    std::cout << "dump_file-----------------" << std::endl;
-    _file_writer.open(STORE_FILE);
-    SkipNode *node = this->_header->forward[0]; 
+    SKIPLIST_LOG(Info, "dump_file");
+    SnapshotWriter writer;
+    if (!writer.open(path))
+        return false;
+
+    // changes from here on go to a new segment, the older ones are covered by the snapshot
+    uint64_t segment = _wal ? _wal->rotate() : 0;
 
+    std::string key;
+    std::string value;
+    SkipNode *node = this->_header->forward[0]; 
     while (node != NULL) {
-        _file_writer << node->key << ":" << node->value << "\n";
-        std::cout << node->key << ":" << node->value << ";\n";
+        key.clear();
+        value.clear();
+        KeyCodec::encode(node->key, key);
+        ValueCodec::encode(node->value, value);
+        if (!writer.add(node->node_level, key, value))
+            return false;
         node = node->forward[0];
     }
+    if (!writer.finish(_element_count, _skip_list_level))
+        return false;
+    if (_wal)
+        _wal->remove_segments_before(segment);
+    return true;
+}
 
-    _file_writer.flush();
-    _file_writer.close();
-    return ;
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::load_file(const std::string& path, bool use_mmap) {
+
+    SKIPLIST_LOG(Info, "load_file");
+    if (is_manifest_file(path)) {
+        // a snapshot dumped by several threads, its segments are in key order, and the deltas
+        // of a checkpoint on top of them, see SnapshotManifest
+        SnapshotManifest manifest;
+        if (!read_manifest(path, manifest)) {
+            SKIPLIST_LOG(Error, "load_file: bad manifest " << path);
+            return false;
+        }
+        for (const std::string& segment : manifest.segments) {
+            if (!load_snapshot(segment, use_mmap, false))
+                return false;
+        }
+        for (const std::string& delta : manifest.deltas) {
+            if (!load_snapshot(delta, use_mmap, true))
+                return false;
+        }
+        return true;
+    }
+    if (!is_snapshot_file(path))
+        return load_text_file(path);
+    return load_snapshot(path, use_mmap, false);
 }
 
-template<typename K, typename V> 
-void SkipList<K, V>::load_file() {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::load_snapshot(const std::string& path, bool use_mmap, bool delta) {
+    // zero copy types must reference the mapping, there is no buffer that outlives the load
+    const bool zero_copy = KeyCodec::kZeroCopy || ValueCodec::kZeroCopy;
+    SnapshotReader reader;
+    if (!reader.open(path, use_mmap || zero_copy, zero_copy)) {
+        SKIPLIST_LOG(Error, "load_file: " << reader.error());
+        return false;
+    }
 
-    _file_reader.open(STORE_FILE);
-    std::cout << "load_file-----------------" << std::endl;
+    // tail[i] is the last node of level i, records arrive in key order and are appended
+    // behind the elements already there as long as their keys are greater
+    SkipNode *tail[_max_level+1];
+    SkipNode *last = _header;
+    for (int i = _max_level; i >= 0; i--) {
+        while (last->forward[i] != NULL)
+            last = last->forward[i];
+        tail[i] = last;
+    }
+    bool append = true;
+
+    SnapshotRecord record;
+    K key;
+    V value;
+    const uint64_t now = wall_clock_ms();
+    while (reader.next(record)) {
+        // elements of a tSkipList that expired meanwhile, the others are kept without expiry;
+        // in a delta they still delete the element of the base
+        bool gone = record.deleted || (record.expire_at != 0 && record.expire_at <= now);
+        if (gone && !delta)
+            continue;
+        if (!KeyCodec::decode(record.key, record.key_size, key)
+            || (!gone && !ValueCodec::decode(record.value, record.value_size, value))) {
+            SKIPLIST_LOG(Error, "load_file: bad record");
+            return false;
+        }
+
+        // appending is only valid while the keys keep growing
+        if (append && (tail[0] == _header || less(tail[0]->key, key))) {
+            if (gone)
+                continue;
+            int level = record.level > _max_level ? _max_level : record.level;
+            SkipNode *node = create_node(level, key, value);
+            for (int i = 0; i <= level; i++) {
+                tail[i]->forward[i] = node;
+                tail[i] = node;
+            }
+            if (level > _skip_list_level)
+                _skip_list_level = level;
+            _element_count ++;
+        } else {
+            append = false;
+            if (gone)
+                delete_element(key);
+            else if (delta)
+                insert_or_assign(key, value);
+            else
+                insert_element(key, value);
+        }
+    }
+    if (zero_copy)
+        _mappings.push_back(reader.release_mapping());
+    if (!reader.ok()) {
+        SKIPLIST_LOG(Error, "load_file: " << reader.error());
+        return false;
+    }
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::open_wal(const std::string& path, SyncPolicy policy, int interval_ms) {
+
+    std::unique_ptr<WriteAheadLog> wal(new WriteAheadLog(path, policy, interval_ms));
+    // _wal is still NULL, the replayed changes are not logged again
+    bool ok = wal->replay([this](uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size) {
+        K key;
+        V value;
+        if (!KeyCodec::decode(k, k_size, key))
+            return false;
+        if (op == kWalDelete) {
+            delete_element(key);
+            return true;
+        }
+        if (op != kWalPut || !ValueCodec::decode(v, v_size, value))
+            return false;
+        // a put of a key that exists is an assignment, replay is an upsert
+        insert_or_assign(key, std::move(value));
+        return true;
+    }, KeyCodec::kZeroCopy || ValueCodec::kZeroCopy);
+    if (KeyCodec::kZeroCopy || ValueCodec::kZeroCopy) {
+        std::vector<std::unique_ptr<MappedFile> > mappings = wal->release_mappings();
+        for (auto& mapping : mappings)
+            _mappings.push_back(std::move(mapping));
+    }
+    if (!ok) {
+        SKIPLIST_LOG(Error, "open_wal: damaged log " << path);
+        return false;
+    }
+    if (!wal->open()) {
+        SKIPLIST_LOG(Error, "open_wal: can not open " << path);
+        return false;
+    }
+    _wal = std::move(wal);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+uint64_t SkipList<K, V, Compare, Serializer, Alloc>::log_append(uint8_t op, const K& key, const V* value) {
+    if (!_wal)
+        return 0;
+    std::string k;
+    std::string v;
+    KeyCodec::encode(key, k);
+    if (value != NULL)
+        ValueCodec::encode(*value, v);
+    return _wal->append(op, k, v);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::log_commit(uint64_t lsn) {
+    if (lsn != 0 && !_wal->commit(lsn))
+        SKIPLIST_LOG(Error, "log_commit: write-ahead log failed");
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::load_text_file(const std::string& path) {
+
+    _file_reader.open(path);
     std::string line;
     std::string* key = new std::string();
     std::string* value = new std::string();
@@ -347,37 +996,56 @@ void SkipList<K, V>::load_file() {
         if (key->empty() || value->empty()) {
             continue;
         }
-        // Define key as int type
-        insert_element(stoi(*key), *value);
-        std::cout << "key:" << *key << "value:" << *value << std::endl;
+        K k;
+        V v;
+        if (!parse_text(*key, k) || !parse_text(*value, v)) {
+            SKIPLIST_LOG(Error, "load_file: bad line " << line);
+            continue;
+        }
+        insert_element(k, v);
     }
     delete key;
     delete value;
     _file_reader.close();
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+typename SkipList<K, V, Compare, Serializer, Alloc>::SkipNode* SkipList<K, V, Compare, Serializer, Alloc>::create_node(int level, const K& k, Args&&... args) {
+    void *mem = _allocator.allocate(level, SkipNode::size_of(level));
+    _metrics.add_nodes(level, 1);
+    return new (mem) SkipNode(level, k, std::forward<Args>(args)...);
 }
 
-template <typename K, typename V>
-void SkipList<K, V>::clear(SkipNode * cur)
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::destroy_node(SkipNode * node) {
+    int level = node->node_level;
+    node->~SkipNode();
+    _allocator.deallocate(node, level, SkipNode::size_of(level));
+    _metrics.add_nodes(level, -1);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::clear(SkipNode * cur)
 {
-    if(cur->forward[0]!=nullptr){
-        clear(cur->forward[0]);
+    if (Alloc::kBulkRelease && std::is_trivially_destructible<SkipNode>::value)
+        return;
+    while (cur != NULL) {
+        SkipNode *next = cur->forward[0];
+        destroy_node(cur);
+        cur = next;
     }
-    delete(cur);
 }
 
-template<typename K, typename V>
-int SkipList<K, V>::get_random_level(){
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int SkipList<K, V, Compare, Serializer, Alloc>::get_random_level(){
 
-    int k = 1;
-    while (rand() % 2) {
-        k++;
-    }
-    k = (k < _max_level) ? k : _max_level;
-    return k;
+    return _levels.level();
 };
 
-template<typename K, typename V>
-void SkipList<K, V>::string_to_kv(const std::string& str, std::string* key, std::string* value) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void SkipList<K, V, Compare, Serializer, Alloc>::string_to_kv(const std::string& str, std::string* key, std::string* value) {
 
     if(!is_valid_string(str)) {
         return;
@@ -386,8 +1054,8 @@ void SkipList<K, V>::string_to_kv(const std::string& str, std::string* key, std:
     *value = str.substr(str.find(delimiter)+1, str.length());
 }
 
-template<typename K, typename V>
-bool SkipList<K, V>::is_valid_string(const std::string& str) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool SkipList<K, V, Compare, Serializer, Alloc>::is_valid_string(const std::string& str) {
 
     if (str.empty()) {
         return false;
@@ -0,0 +1,64 @@
+/*
+ * @file        : slice.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the Slice class, a non-owning reference to bytes. A skip
+ *                list of Slice keys or values loaded from a memory mapped snapshot points into
+ *                the mapping instead of copying every key and value into a std::string.
+ */
+
+#ifndef SKIP_LIST_SLICE_H
+#define SKIP_LIST_SLICE_H
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+
+/**
+ * @class Slice
+ * @brief The Slice class is used to reference bytes owned by someone else.
+ * The bytes must outlive the Slice: the list keeps its snapshot mappings alive, bytes of
+ * slices inserted by the caller are the caller's business.
+ */
+class Slice {
+public:
+    Slice() : _data(""), _size(0) {}
+    Slice(const char* data, size_t size) : _data(data), _size(size) {}
+    Slice(const char* str) : _data(str), _size(strlen(str)) {}
+    Slice(const std::string& str) : _data(str.data()), _size(str.size()) {}
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    std::string to_string() const { return std::string(_data, _size); }
+
+    /**
+     * @return <0, 0 or >0 like memcmp, shorter slices order first on a common prefix.
+     */
+    int compare(const Slice& other) const {
+        size_t n = _size < other._size ? _size : other._size;
+        int r = n == 0 ? 0 : memcmp(_data, other._data, n);
+        if (r == 0)
+            r = _size < other._size ? -1 : (_size > other._size ? 1 : 0);
+        return r;
+    }
+
+private:
+    const char* _data;
+    size_t _size;
+};
+
+inline bool operator<(const Slice& a, const Slice& b) { return a.compare(b) < 0; }
+inline bool operator==(const Slice& a, const Slice& b) { return a.size() == b.size() && a.compare(b) == 0; }
+inline bool operator!=(const Slice& a, const Slice& b) { return !(a == b); }
+
+inline std::ostream& operator<<(std::ostream& os, const Slice& s) {
+    return os.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+
+#endif //SKIP_LIST_SLICE_H
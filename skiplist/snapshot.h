@@ -0,0 +1,885 @@
+/*
+ * @file        : snapshot.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the SnapshotWriter and SnapshotReader classes, which write
+ *                and read the versioned binary snapshot of a skip list.
+ *
+ *                header : magic "KVSNAP\0\0" | u32 version | u32 block size
+ *                block  : u32 payload bytes | u32 record count | payload | u32 crc32c
+ *                packed : u32 raw bytes | compressed records, the payload of a compressed block
+ *                record : u8 level | [u64 expiry] | u32 key bytes | key | u32 value bytes | value
+ *                end    : u32 0
+ *                footer : u64 record count | u32 max level | u32 block count | u32 crc32c
+ *                         | magic "KVSNEND\0"
+ *
+ *                Records are written in key order together with the level of their node, so
+ *                a list can be rebuilt by appending every record at its tail. The top bit of
+ *                the level is set if an expiry follows, the wall clock milliseconds after which
+ *                the element is gone, see tSkipList::put. The bit below it marks a tombstone,
+ *                a key deleted since the base of a delta, see SnapshotManifest, which has
+ *                neither a level nor an expiry. That leaves six bits, a list that dumps to a
+ *                snapshot has at most kSnapshotMaxLevel levels, see snapshot_max_level. Integers are
+ *                little endian. The file is written next to its path and renamed into place,
+ *                so a snapshot which is still mapped by a reader is never modified.
+ *
+ *                A snapshot written with a Compression, see compress.h, has version 2 and the
+ *                top bit of the record count of every compressed block set. The crc covers the
+ *                compressed bytes, a block is checked before it is inflated. Blocks that do not
+ *                shrink are stored as they are.
+ *
+ *                A snapshot dumped by several threads is a manifest at the path that lists one
+ *                snapshot file per key range, see SnapshotManifest. The manifest of a checkpoint
+ *                also lists the deltas written since its base. An SSTable of an LsmStore is a
+ *                snapshot with a block index behind its footer, see sstable.h.
+ */
+
+#ifndef SKIP_LIST_SNAPSHOT_H
+#define SKIP_LIST_SNAPSHOT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bloom.h"
+#include "compress.h"
+#include "crc32.h"
+#include "uring.h"
+
+
+static const char kSnapshotMagic[8] = {'K', 'V', 'S', 'N', 'A', 'P', '\0', '\0'};
+static const char kSnapshotEndMagic[8] = {'K', 'V', 'S', 'N', 'E', 'N', 'D', '\0'};
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotCompressedVersion = 2;
+static const uint32_t kSnapshotCompressed = 0x80000000u;
+static const size_t kSnapshotHeaderSize = 16;
+static const size_t kSnapshotFooterSize = 28;
+static const int kSnapshotExpires = 0x80;
+static const int kSnapshotDeleted = 0x40;
+static const int kSnapshotMaxLevel = 0x3f;
+static const char kSnapshotIndexMagic[8] = {'K', 'V', 'S', 'N', 'I', 'D', 'X', '\0'};
+static const size_t kSnapshotIndexTrailerSize = 24;
+
+inline void put_fixed32(std::string& out, uint32_t v) {
+    char buf[4];
+    for (int i = 0; i < 4; ++i)
+        buf[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+    out.append(buf, 4);
+}
+
+inline void put_fixed64(std::string& out, uint64_t v) {
+    put_fixed32(out, static_cast<uint32_t>(v));
+    put_fixed32(out, static_cast<uint32_t>(v >> 32));
+}
+
+inline uint32_t get_fixed32(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8)
+         | (static_cast<uint32_t>(u[2]) << 16) | (static_cast<uint32_t>(u[3]) << 24);
+}
+
+inline uint64_t get_fixed64(const char* p) {
+    return static_cast<uint64_t>(get_fixed32(p)) | (static_cast<uint64_t>(get_fixed32(p + 4)) << 32);
+}
+
+/**
+ * @brief To write n bytes to fd, retrying short writes.
+ */
+inline bool write_fully(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t written = ::write(fd, data, n);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        n -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+/**
+ * @brief To read n bytes from fd, retrying short reads.
+ */
+inline bool read_fully(int fd, char* data, size_t n) {
+    while (n > 0) {
+        ssize_t got = ::read(fd, data, n);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (got == 0)
+            return false;
+        data += got;
+        n -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+/**
+ * @brief To make a rename in the directory of path durable.
+ */
+inline void sync_parent_dir(const std::string& path) {
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+/**
+ * @brief To replace the file at path by data, durably: data goes to a file next to path,
+ * which is synced and renamed into place.
+ */
+inline bool replace_file(const std::string& path, const std::string& data) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = write_fully(fd, data.data(), data.size()) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    sync_parent_dir(path);
+    return true;
+}
+
+/**
+ * @return max_level capped at the highest level a snapshot record can hold, the lists pass it
+ * through so that every node they build can be dumped.
+ */
+inline int snapshot_max_level(int max_level) {
+    return max_level < kSnapshotMaxLevel ? max_level : kSnapshotMaxLevel;
+}
+
+/**
+ * @struct SnapshotRecord
+ * @brief One record of a snapshot, the bytes point into the reader's block buffer or mapping.
+ */
+struct SnapshotRecord {
+    int level;
+    // a tombstone of a delta, it has no value
+    bool deleted;
+    uint64_t expire_at;
+    const char* key;
+    uint32_t key_size;
+    const char* value;
+    uint32_t value_size;
+};
+
+/**
+ * @brief To parse the record at p of a block that ends at end, p is moved past it.
+ * @return False if the record is truncated, or is a tombstone with a level or an expiry.
+ */
+inline bool parse_snapshot_record(const char*& p, const char* end, SnapshotRecord& record) {
+    if (end - p < 5)
+        return false;
+    record.level = static_cast<unsigned char>(p[0]);
+    record.expire_at = 0;
+    p += 1;
+    if (record.level & kSnapshotExpires) {
+        if (end - p < 12)
+            return false;
+        record.level &= ~kSnapshotExpires;
+        record.expire_at = get_fixed64(p);
+        p += 8;
+    }
+    record.deleted = (record.level & kSnapshotDeleted) != 0;
+    record.level &= ~kSnapshotDeleted;
+    if (record.deleted && (record.level != 0 || record.expire_at != 0))
+        return false;
+    record.key_size = get_fixed32(p);
+    p += 4;
+    if (static_cast<size_t>(end - p) < static_cast<size_t>(record.key_size) + 4)
+        return false;
+    record.key = p;
+    p += record.key_size;
+    record.value_size = get_fixed32(p);
+    p += 4;
+    if (static_cast<size_t>(end - p) < record.value_size)
+        return false;
+    record.value = p;
+    p += record.value_size;
+    return true;
+}
+
+/**
+ * @class SnapshotWriter
+ * @brief The SnapshotWriter class is used to write a snapshot block by block.
+ * Closed blocks go to the disk through an AsyncFile, see uring.h, while the next ones are
+ * still being filled. With index_blocks the snapshot gets a block index behind its footer,
+ * which makes it an SSTable, see sstable.h.
+ */
+class SnapshotWriter {
+public:
+    /**
+     * @brief Constructor for SnapshotWriter.
+     * @param block_size Payload bytes after which a block is closed.
+     */
+    explicit SnapshotWriter(size_t block_size = 64 * 1024)
+        : _fd(-1), _block_size(block_size), _compression(Compression::None), _block_records(0),
+          _records(0), _blocks(0), _indexed(false), _bloom_bits(0), _offset(0) {}
+
+    /**
+     * @brief Deconstructor for SnapshotWriter.
+     * To drop the temporary file if finish was not called.
+     */
+    ~SnapshotWriter() {
+        if (_fd >= 0) {
+            _file.drain();
+            ::close(_fd);
+            ::unlink(_tmp_path.c_str());
+        }
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    /**
+     * @brief To compress the blocks with compression, call it before open.
+     */
+    void set_compression(Compression compression) {
+        _compression = compression;
+    }
+
+    /**
+     * @brief To start a snapshot which replaces path once finished.
+     */
+    bool open(const std::string& path) {
+        _path = path;
+        _tmp_path = path + ".tmp";
+        _fd = ::open(_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0)
+            return false;
+        _file.attach(_fd);
+        std::string header(kSnapshotMagic, sizeof(kSnapshotMagic));
+        // an uncompressed snapshot stays readable by the readers of version 1
+        put_fixed32(header, _compression == Compression::None ? kSnapshotVersion : kSnapshotCompressedVersion);
+        put_fixed32(header, static_cast<uint32_t>(_block_size));
+        _offset = header.size();
+        return _file.write(header.data(), header.size());
+    }
+
+    /**
+     * @brief To write the last key, offset and size of every block to an index behind the
+     * footer, call it before the first record is added.
+     * @param bloom_bits_per_key To end the index with a Bloom filter of the keys, see bloom.h,
+     * 0 for none.
+     */
+    void index_blocks(unsigned bloom_bits_per_key = 0) {
+        _indexed = true;
+        _bloom_bits = bloom_bits_per_key;
+    }
+
+    /**
+     * @brief To append a record, records must be added in key order.
+     * @param level From 0 to kSnapshotMaxLevel, the bits above it are flags.
+     * @param expire_at Wall clock milliseconds after which the element is gone, 0 for never.
+     */
+    bool add(int level, const std::string& key, const std::string& value, uint64_t expire_at = 0) {
+        if (level < 0 || level > kSnapshotMaxLevel)
+            return false;
+        if (expire_at != 0) {
+            _block.push_back(static_cast<char>(level | kSnapshotExpires));
+            put_fixed64(_block, expire_at);
+        } else {
+            _block.push_back(static_cast<char>(level));
+        }
+        put_fixed32(_block, static_cast<uint32_t>(key.size()));
+        _block.append(key);
+        put_fixed32(_block, static_cast<uint32_t>(value.size()));
+        _block.append(value);
+        if (_indexed)
+            index_key(key);
+        _block_records++;
+        _records++;
+        if (_block.size() >= _block_size)
+            return flush_block();
+        return true;
+    }
+
+    /**
+     * @brief To append the tombstone of a deleted key, in key order like add.
+     */
+    bool add_deleted(const std::string& key) {
+        _block.push_back(static_cast<char>(kSnapshotDeleted));
+        put_fixed32(_block, static_cast<uint32_t>(key.size()));
+        _block.append(key);
+        put_fixed32(_block, 0);
+        if (_indexed)
+            index_key(key);
+        _block_records++;
+        _records++;
+        if (_block.size() >= _block_size)
+            return flush_block();
+        return true;
+    }
+
+    /**
+     * @brief To close the last block, write the footer and move the file into place.
+     * @param count Number of records, checked against the number added.
+     */
+    bool finish(uint64_t count, int max_level) {
+        if (_fd < 0 || count != _records || !flush_block())
+            return false;
+        std::string tail;
+        put_fixed32(tail, 0);
+        std::string footer;
+        put_fixed64(footer, _records);
+        put_fixed32(footer, static_cast<uint32_t>(max_level));
+        put_fixed32(footer, _blocks);
+        put_fixed32(footer, crc32c(0, footer.data(), footer.size()));
+        footer.append(kSnapshotEndMagic, sizeof(kSnapshotEndMagic));
+        tail.append(footer);
+        if (_indexed) {
+            std::string index;
+            put_fixed32(index, _blocks);
+            index.append(_index);
+            if (_bloom_bits != 0) {
+                std::string filter;
+                build_bloom_filter(_hashes, _bloom_bits, filter);
+                put_fixed32(index, static_cast<uint32_t>(filter.size()));
+                index.append(filter);
+            }
+            std::string trailer;
+            put_fixed64(trailer, _offset + tail.size());
+            put_fixed32(trailer, static_cast<uint32_t>(index.size()));
+            put_fixed32(trailer, crc32c(0, index.data(), index.size()));
+            trailer.append(kSnapshotIndexMagic, sizeof(kSnapshotIndexMagic));
+            tail.append(index);
+            tail.append(trailer);
+        }
+        if (!_file.write(tail.data(), tail.size()) || !_file.sync(false))
+            return false;
+        ::close(_fd);
+        _fd = -1;
+        if (::rename(_tmp_path.c_str(), _path.c_str()) != 0)
+            return false;
+        sync_parent_dir(_path);
+        return true;
+    }
+
+private:
+    void index_key(const std::string& key) {
+        _last_key = key;
+        if (_bloom_bits != 0)
+            _hashes.push_back(hash_bytes(key.data(), key.size()));
+    }
+
+    bool flush_block() {
+        if (_block_records == 0)
+            return true;
+        uint32_t count = _block_records;
+        _packed.clear();
+        put_fixed32(_packed, static_cast<uint32_t>(_block.size()));
+        if (compress_block(_compression, _block.data(), _block.size(), _packed)) {
+            _block.swap(_packed);
+            count |= kSnapshotCompressed;
+        }
+        std::string head;
+        put_fixed32(head, static_cast<uint32_t>(_block.size()));
+        put_fixed32(head, count);
+        uint32_t crc = crc32c(0, head.data() + 4, 4);
+        crc = crc32c(crc, _block.data(), _block.size());
+        std::string trailer;
+        put_fixed32(trailer, crc);
+        if (_indexed) {
+            put_fixed32(_index, static_cast<uint32_t>(_last_key.size()));
+            _index.append(_last_key);
+            put_fixed64(_index, _offset);
+            put_fixed32(_index, static_cast<uint32_t>(head.size() + _block.size() + trailer.size()));
+        }
+        _offset += head.size() + _block.size() + trailer.size();
+        // the block is copied into the writer's buffers, the walk goes on while they are written
+        bool ok = _file.write(head.data(), head.size())
+               && _file.write(_block.data(), _block.size())
+               && _file.write(trailer.data(), trailer.size());
+        _block.clear();
+        _block_records = 0;
+        _blocks++;
+        return ok;
+    }
+
+    int _fd;
+    AsyncFile _file;
+    std::string _path;
+    std::string _tmp_path;
+    const size_t _block_size;
+    Compression _compression;
+    std::string _block;
+    // the compressed block, swapped with _block if it is smaller
+    std::string _packed;
+    uint32_t _block_records;
+    uint64_t _records;
+    uint32_t _blocks;
+    // the block index of index_blocks with the key hashes of its filter, and the file offset
+    // of the next block
+    bool _indexed;
+    unsigned _bloom_bits;
+    std::string _last_key;
+    std::string _index;
+    std::vector<uint64_t> _hashes;
+    uint64_t _offset;
+};
+
+/**
+ * @class MappedFile
+ * @brief The MappedFile class is used to map a whole file read only.
+ * The mapping is shared, so processes mapping the same snapshot share its page cache, and it
+ * stays valid when the file is replaced by rename.
+ */
+class MappedFile {
+public:
+    MappedFile() : _data(nullptr), _size(0) {}
+
+    ~MappedFile() {
+        if (_data != nullptr)
+            ::munmap(const_cast<char*>(_data), _size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        _data = static_cast<const char*>(p);
+        _size = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    /**
+     * @brief To tell the kernel how the mapping is going to be read.
+     */
+    void advise(int advice) {
+        if (_data != nullptr)
+            ::madvise(const_cast<char*>(_data), _size, advice);
+    }
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+    /**
+     * @return n bytes that live as long as the mapping, for what is inflated from it.
+     */
+    char* hold(size_t n) {
+        _held.emplace_back(new char[n == 0 ? 1 : n]);
+        return _held.back().get();
+    }
+
+private:
+    const char* _data;
+    size_t _size;
+    std::vector<std::unique_ptr<char[]> > _held;
+};
+
+/**
+ * @class SnapshotReader
+ * @brief The SnapshotReader class is used to read a snapshot record by record.
+ * Every block is checked against its crc before any of its records is returned. The file is
+ * either read block by block into a buffer, or mapped, in which case records point straight
+ * into the mapping. The records of a compressed block point into the block it is inflated to,
+ * which is only valid until the next block unless the reader was opened to keep its records.
+ */
+class SnapshotReader {
+public:
+    SnapshotReader() : _fd(-1), _keep(false), _offset(0), _block_data(nullptr), _block_size(0), _pos(0),
+                       _block_records(0), _records(0), _blocks(0), _count(0), _max_level(0),
+                       _done(false) {}
+
+    ~SnapshotReader() {
+        if (_fd >= 0)
+            ::close(_fd);
+    }
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    /**
+     * @brief To open a snapshot and check its header.
+     * @param mapped To map the file instead of reading it.
+     * @param keep_records To keep every record valid as long as the mapping, see
+     * release_mapping, for zero copy keys and values. The file is mapped and compressed
+     * blocks are inflated into memory the mapping holds.
+     */
+    bool open(const std::string& path, bool mapped = false, bool keep_records = false) {
+        _keep = keep_records;
+        if (mapped || keep_records) {
+            _mapping.reset(new MappedFile());
+            if (!_mapping->open(path))
+                return fail("can not map " + path);
+            _mapping->advise(MADV_SEQUENTIAL);
+        } else {
+            _fd = ::open(path.c_str(), O_RDONLY);
+            if (_fd < 0)
+                return fail("can not open " + path);
+        }
+        char header[kSnapshotHeaderSize];
+        if (!read_bytes(header, sizeof(header)) || memcmp(header, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0)
+            return fail("not a snapshot");
+        uint32_t version = get_fixed32(header + 8);
+        if (version != kSnapshotVersion && version != kSnapshotCompressedVersion)
+            return fail("unsupported snapshot version");
+        return true;
+    }
+
+    /**
+     * @brief To read the next record.
+     * @return False at the end of the snapshot or on error, see ok().
+     */
+    bool next(SnapshotRecord& record) {
+        while (_block_records == 0) {
+            if (_done || !ok() || !read_block())
+                return false;
+        }
+        const char* p = _block_data + _pos;
+        if (!parse_snapshot_record(p, _block_data + _block_size, record))
+            return fail("malformed record");
+        _pos = p - _block_data;
+        _block_records--;
+        _records++;
+        return true;
+    }
+
+    /**
+     * @return True unless the file is damaged or was not fully read.
+     */
+    bool ok() const { return _error.empty(); }
+
+    const std::string& error() const { return _error; }
+
+    /**
+     * @return Record count and max level from the footer, valid once next returned false.
+     */
+    uint64_t count() const { return _count; }
+    int max_level() const { return _max_level; }
+
+    /**
+     * @brief To take over the mapping, records keep pointing into it.
+     * @return NULL if the file was not mapped.
+     */
+    std::unique_ptr<MappedFile> release_mapping() {
+        if (_mapping)
+            _mapping->advise(MADV_NORMAL);
+        return std::move(_mapping);
+    }
+
+private:
+    bool fail(const std::string& msg) {
+        if (_error.empty())
+            _error = msg;
+        return false;
+    }
+
+    /**
+     * @brief To copy the next n bytes of the file to out.
+     */
+    bool read_bytes(char* out, size_t n) {
+        const char* p = fetch(n);
+        if (p == nullptr)
+            return false;
+        memcpy(out, p, n);
+        return true;
+    }
+
+    /**
+     * @return The next n bytes of the file, from the mapping or read into _buffer.
+     */
+    const char* fetch(size_t n) {
+        if (_mapping) {
+            if (_mapping->size() - _offset < n)
+                return nullptr;
+            const char* p = _mapping->data() + _offset;
+            _offset += n;
+            return p;
+        }
+        _buffer.resize(n);
+        if (n > 0 && !read_fully(_fd, &_buffer[0], n))
+            return nullptr;
+        return _buffer.data();
+    }
+
+    bool read_block() {
+        char head[8];
+        if (!read_bytes(head, 4))
+            return fail("truncated snapshot");
+        uint32_t size = get_fixed32(head);
+        if (size == 0)
+            return read_footer();
+        if (!read_bytes(head + 4, 4))
+            return fail("truncated snapshot");
+        // payload and crc in one fetch, a second one would reuse the buffer of the payload
+        const char* payload = fetch(static_cast<size_t>(size) + 4);
+        if (payload == nullptr)
+            return fail("truncated snapshot");
+        _block_data = payload;
+        _block_size = size;
+        uint32_t crc = crc32c(0, head + 4, 4);
+        crc = crc32c(crc, _block_data, _block_size);
+        if (crc != get_fixed32(payload + size))
+            return fail("block checksum mismatch");
+        _block_records = get_fixed32(head + 4);
+        if (_block_records & kSnapshotCompressed) {
+            _block_records &= ~kSnapshotCompressed;
+            if (size < 4)
+                return fail("bad compressed block");
+            uint32_t raw = get_fixed32(payload);
+            char* out;
+            if (_keep) {
+                out = _mapping->hold(raw);
+            } else {
+                _inflated.resize(raw);
+                out = &_inflated[0];
+            }
+            if (!lz4_decompress(payload + 4, size - 4, out, raw))
+                return fail("bad compressed block");
+            _block_data = out;
+            _block_size = raw;
+        }
+        _pos = 0;
+        _blocks++;
+        return true;
+    }
+
+    bool read_footer() {
+        char footer[kSnapshotFooterSize];
+        if (!read_bytes(footer, sizeof(footer)))
+            return fail("truncated footer");
+        if (crc32c(0, footer, 16) != get_fixed32(footer + 16)
+            || memcmp(footer + 20, kSnapshotEndMagic, sizeof(kSnapshotEndMagic)) != 0)
+            return fail("footer checksum mismatch");
+        _count = get_fixed64(footer);
+        _max_level = static_cast<int>(get_fixed32(footer + 8));
+        if (_count != _records || get_fixed32(footer + 12) != _blocks)
+            return fail("record count mismatch");
+        _done = true;
+        return false;
+    }
+
+    int _fd;
+    std::unique_ptr<MappedFile> _mapping;
+    bool _keep;
+    size_t _offset;
+    std::string _buffer;
+    // the last compressed block unless the records are kept
+    std::string _inflated;
+    const char* _block_data;
+    size_t _block_size;
+    size_t _pos;
+    uint32_t _block_records;
+    uint64_t _records;
+    uint32_t _blocks;
+    uint64_t _count;
+    int _max_level;
+    bool _done;
+    std::string _error;
+};
+
+/**
+ * @return True if path starts with the snapshot magic, false for the old text format.
+ */
+inline bool is_snapshot_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    char magic[sizeof(kSnapshotMagic)];
+    bool match = read_fully(fd, magic, sizeof(magic)) && memcmp(magic, kSnapshotMagic, sizeof(magic)) == 0;
+    ::close(fd);
+    return match;
+}
+
+/**
+ * @struct SnapshotManifest
+ * @brief The segments of a snapshot that was dumped by several threads, one key range each.
+ * The manifest is at the path of the snapshot and lists the segment files in key order:
+ *
+ * manifest : magic "KVSNMAN\0" | u32 version | u64 generation | u32 segment count
+ *            | segment... | u32 delta count | delta... | u32 crc32c
+ * segment  : u32 name bytes | name | u64 record count
+ * delta    : u32 name bytes | name | u64 record count
+ *
+ * Every segment is a snapshot of its own named <path>.part<generation>-<i>, in the directory of
+ * the manifest. A dump writes the segments of the next generation and then renames the new
+ * manifest into place, so a crash leaves the last complete snapshot intact.
+ *
+ * The segments are the base of a checkpoint, see tSkipList::checkpoint. Every later checkpoint
+ * writes the keys changed since the one before to a delta <path>.delta<generation>-<i>, a
+ * snapshot whose records replace the elements of their keys and whose tombstones delete
+ * them, and renames a manifest with one more delta into place. The deltas are applied in
+ * order on top of the base. Version 1 manifests have no delta count.
+ */
+struct SnapshotManifest {
+    uint64_t generation;
+    // the paths of the segments, read_manifest prefixes the directory of the manifest
+    std::vector<std::string> segments;
+    std::vector<uint64_t> records;
+    // the paths of the deltas in the order they were written
+    std::vector<std::string> deltas;
+    std::vector<uint64_t> delta_records;
+
+    SnapshotManifest() : generation(0) {}
+};
+
+static const char kManifestMagic[8] = {'K', 'V', 'S', 'N', 'M', 'A', 'N', '\0'};
+static const uint32_t kManifestVersion = 2;
+
+/**
+ * @return The path of segment i of generation of the snapshot at path.
+ */
+inline std::string snapshot_segment_path(const std::string& path, uint64_t generation, size_t i) {
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".part%llu-%03zu", static_cast<unsigned long long>(generation), i);
+    return path + suffix;
+}
+
+/**
+ * @return The path of delta i on top of the base of generation of the snapshot at path.
+ */
+inline std::string snapshot_delta_path(const std::string& path, uint64_t generation, size_t i) {
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".delta%llu-%03zu", static_cast<unsigned long long>(generation), i);
+    return path + suffix;
+}
+
+/**
+ * @return True if path starts with the manifest magic.
+ */
+inline bool is_manifest_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    char magic[sizeof(kManifestMagic)];
+    bool match = read_fully(fd, magic, sizeof(magic)) && memcmp(magic, kManifestMagic, sizeof(magic)) == 0;
+    ::close(fd);
+    return match;
+}
+
+/**
+ * @brief To read the manifest at path.
+ * @return False if it is missing or damaged.
+ */
+inline bool read_manifest(const std::string& path, SnapshotManifest& manifest) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    std::string data;
+    bool ok = ::fstat(fd, &st) == 0 && st.st_size >= 28 && st.st_size < (1 << 24);
+    if (ok) {
+        data.resize(static_cast<size_t>(st.st_size));
+        ok = read_fully(fd, &data[0], data.size());
+    }
+    ::close(fd);
+    if (!ok || memcmp(data.data(), kManifestMagic, sizeof(kManifestMagic)) != 0)
+        return false;
+    uint32_t version = get_fixed32(data.data() + 8);
+    if ((version != 1 && version != kManifestVersion)
+        || crc32c(0, data.data(), data.size() - 4) != get_fixed32(data.data() + data.size() - 4))
+        return false;
+
+    std::string::size_type slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    manifest.generation = get_fixed64(data.data() + 12);
+    manifest.segments.clear();
+    manifest.records.clear();
+    manifest.deltas.clear();
+    manifest.delta_records.clear();
+    size_t pos = 20;
+    const size_t end = data.size() - 4;
+    // the segments, then the deltas, each a count and its files
+    auto read_files = [&](std::vector<std::string>& files, std::vector<uint64_t>& records) {
+        if (end - pos < 4)
+            return false;
+        uint32_t count = get_fixed32(data.data() + pos);
+        pos += 4;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - pos < 4)
+                return false;
+            uint32_t size = get_fixed32(data.data() + pos);
+            pos += 4;
+            if (end - pos < static_cast<size_t>(size) + 8)
+                return false;
+            files.push_back(dir + data.substr(pos, size));
+            pos += size;
+            records.push_back(get_fixed64(data.data() + pos));
+            pos += 8;
+        }
+        return true;
+    };
+    if (!read_files(manifest.segments, manifest.records))
+        return false;
+    if (version != 1 && !read_files(manifest.deltas, manifest.delta_records))
+        return false;
+    return pos == end;
+}
+
+/**
+ * @brief To replace the snapshot at path by the manifest, its segments must be durable.
+ * Only the file names of the segments are written, they must be next to path.
+ */
+inline bool write_manifest(const std::string& path, const SnapshotManifest& manifest) {
+    std::string data(kManifestMagic, sizeof(kManifestMagic));
+    put_fixed32(data, kManifestVersion);
+    put_fixed64(data, manifest.generation);
+    auto put_files = [&data](const std::vector<std::string>& files, const std::vector<uint64_t>& records) {
+        put_fixed32(data, static_cast<uint32_t>(files.size()));
+        for (size_t i = 0; i < files.size(); ++i) {
+            std::string::size_type slash = files[i].rfind('/');
+            std::string name = slash == std::string::npos ? files[i] : files[i].substr(slash + 1);
+            put_fixed32(data, static_cast<uint32_t>(name.size()));
+            data.append(name);
+            put_fixed64(data, records[i]);
+        }
+    };
+    put_files(manifest.segments, manifest.records);
+    put_files(manifest.deltas, manifest.delta_records);
+    put_fixed32(data, crc32c(0, data.data(), data.size()));
+    return replace_file(path, data);
+}
+
+/**
+ * @brief To remove the segments and deltas of the manifest old that are not in the snapshot
+ * now at its path, once a dump replaced it.
+ */
+inline void remove_stale_segments(const SnapshotManifest& old, const SnapshotManifest& now) {
+    auto kept = [&now](const std::string& file) {
+        return std::find(now.segments.begin(), now.segments.end(), file) != now.segments.end()
+            || std::find(now.deltas.begin(), now.deltas.end(), file) != now.deltas.end();
+    };
+    for (const std::string& segment : old.segments) {
+        if (!kept(segment))
+            ::unlink(segment.c_str());
+    }
+    for (const std::string& delta : old.deltas) {
+        if (!kept(delta))
+            ::unlink(delta.c_str());
+    }
+}
+
+
+#endif //SKIP_LIST_SNAPSHOT_H
@@ -0,0 +1,234 @@
+/*
+ * @file        : sstable.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the SSTable class, which reads the sorted runs an LsmStore
+ *                flushes its memtables to, see lsm.h. An SSTable is a snapshot, see snapshot.h,
+ *                written with SnapshotWriter::index_blocks, so a block index follows its footer:
+ *
+ *                index  : u32 block count | entry... | [u32 filter bytes | filter]
+ *                entry  : u32 key bytes | last key of the block | u64 offset | u32 bytes
+ *                trailer: u64 index offset | u32 index bytes | u32 crc32c | magic "KVSNIDX\0"
+ *
+ *                The offset is the one of the block head and the bytes include head and crc.
+ *                The file is mapped, a lookup binary searches the last keys for the one block
+ *                that may hold the key and only touches that block, so the page cache keeps the
+ *                blocks that are read and the rest of the run stays on disk. The filter, see
+ *                bloom.h, holds every key of the run including the tombstones, so a lookup of
+ *                a key the run does not have mostly stops before the index.
+ */
+
+#ifndef SKIP_LIST_SSTABLE_H
+#define SKIP_LIST_SSTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bloom.h"
+#include "crc32.h"
+#include "slice.h"
+#include "snapshot.h"
+
+
+/**
+ * @class SSTableBlock
+ * @brief The SSTableBlock class is used to walk the records of one block of an SSTable.
+ * The records point into the mapping of the table.
+ */
+class SSTableBlock {
+public:
+    SSTableBlock() : _p(nullptr), _end(nullptr), _left(0) {}
+
+    /**
+     * @brief To read the next record of the block.
+     * @return False at the end of the block.
+     */
+    bool next(SnapshotRecord& record) {
+        if (_left == 0 || !parse_snapshot_record(_p, _end, record))
+            return false;
+        _left--;
+        return true;
+    }
+
+    /**
+     * @return False if next stopped at a malformed record before the end of the block.
+     */
+    bool complete() const { return _left == 0; }
+
+private:
+    friend class SSTable;
+
+    const char* _p;
+    const char* _end;
+    uint32_t _left;
+};
+
+/**
+ * @class SSTable
+ * @brief The SSTable class is used to read a sorted run through its block index.
+ * open checks the header, the footer and the index, every block is checked against its crc
+ * the first time it is read. An open table is read only and may be shared by threads.
+ */
+class SSTable {
+public:
+    SSTable() : _records(0) {}
+
+    SSTable(const SSTable&) = delete;
+    SSTable& operator=(const SSTable&) = delete;
+
+    /**
+     * @brief To map the table at path and read its index.
+     * @return False if it is not an SSTable or damaged, see error().
+     */
+    bool open(const std::string& path);
+
+    const std::string& path() const { return _path; }
+    const std::string& error() const { return _error; }
+
+    /**
+     * @return The number of records, tombstones included.
+     */
+    uint64_t count() const { return _records; }
+
+    /**
+     * @return The bytes of the file.
+     */
+    size_t file_size() const { return _file.size(); }
+
+    size_t block_count() const { return _blocks.size(); }
+
+    /**
+     * @return The encoded key of the last record of block i, the blocks are in key order.
+     */
+    Slice last_key(size_t i) const { return Slice(_blocks[i].key, _blocks[i].key_size); }
+
+    /**
+     * @return False if the key whose encoding has hash is certainly not in the table, always
+     * true for a table without a filter.
+     */
+    bool may_contain(uint64_t hash) const { return _filter.may_contain(hash); }
+
+    /**
+     * @return True if the table has a Bloom filter.
+     */
+    bool has_filter() const { return !_filter.empty(); }
+
+    /**
+     * @brief To start reading the records of block i.
+     * @return False if the block does not match its crc.
+     */
+    bool read_block(size_t i, SSTableBlock& block) const;
+
+private:
+    struct BlockHandle {
+        const char* key;
+        uint32_t key_size;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    bool fail(const std::string& msg) {
+        _error = _path + ": " + msg;
+        return false;
+    }
+
+    std::string _path;
+    MappedFile _file;
+    std::vector<BlockHandle> _blocks;
+    // set once block i matched its crc, checking a block again is harmless
+    std::unique_ptr<std::atomic<bool>[]> _checked;
+    BloomFilter _filter;
+    uint64_t _records;
+    std::string _error;
+};
+
+
+inline bool SSTable::open(const std::string& path) {
+    _path = path;
+    if (!_file.open(path))
+        return fail("can not map");
+    _file.advise(MADV_RANDOM);
+    const char* data = _file.data();
+    const size_t size = _file.size();
+    if (size < kSnapshotHeaderSize + 4 + kSnapshotFooterSize + 4 + kSnapshotIndexTrailerSize
+        || memcmp(data, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0
+        || get_fixed32(data + 8) != kSnapshotVersion)
+        return fail("not a snapshot");
+
+    const char* trailer = data + size - kSnapshotIndexTrailerSize;
+    if (memcmp(trailer + 16, kSnapshotIndexMagic, sizeof(kSnapshotIndexMagic)) != 0)
+        return fail("no block index");
+    uint64_t index_offset = get_fixed64(trailer);
+    uint32_t index_size = get_fixed32(trailer + 8);
+    if (index_offset < kSnapshotHeaderSize + 4 + kSnapshotFooterSize
+        || index_offset + index_size != size - kSnapshotIndexTrailerSize || index_size < 4)
+        return fail("bad index trailer");
+    const char* index = data + index_offset;
+    if (crc32c(0, index, index_size) != get_fixed32(trailer + 12))
+        return fail("index checksum mismatch");
+
+    const char* footer = index - kSnapshotFooterSize;
+    if (crc32c(0, footer, 16) != get_fixed32(footer + 16)
+        || memcmp(footer + 20, kSnapshotEndMagic, sizeof(kSnapshotEndMagic)) != 0)
+        return fail("footer checksum mismatch");
+    _records = get_fixed64(footer);
+    uint32_t blocks = get_fixed32(footer + 12);
+    // the blocks end where the u32 0 in front of the footer starts
+    const uint64_t blocks_end = index_offset - kSnapshotFooterSize - 4;
+
+    const char* p = index + 4;
+    const char* end = index + index_size;
+    if (get_fixed32(index) != blocks)
+        return fail("index does not match the footer");
+    _blocks.reserve(blocks);
+    for (uint32_t i = 0; i < blocks; ++i) {
+        if (end - p < 4)
+            return fail("truncated index");
+        BlockHandle handle;
+        handle.key_size = get_fixed32(p);
+        p += 4;
+        if (static_cast<size_t>(end - p) < static_cast<size_t>(handle.key_size) + 12)
+            return fail("truncated index");
+        handle.key = p;
+        p += handle.key_size;
+        handle.offset = get_fixed64(p);
+        handle.size = get_fixed32(p + 8);
+        p += 12;
+        if (handle.offset < kSnapshotHeaderSize || handle.size < 12 || handle.offset + handle.size > blocks_end
+            || get_fixed32(data + handle.offset) != handle.size - 12)
+            return fail("bad block handle");
+        _blocks.push_back(handle);
+    }
+    if (p != end) {
+        if (end - p < 4 || static_cast<size_t>(end - p - 4) != get_fixed32(p) || !_filter.init(p + 4, get_fixed32(p)))
+            return fail("bad filter");
+    }
+    _checked.reset(new std::atomic<bool>[blocks]);
+    for (uint32_t i = 0; i < blocks; ++i)
+        _checked[i].store(false, std::memory_order_relaxed);
+    return true;
+}
+
+inline bool SSTable::read_block(size_t i, SSTableBlock& block) const {
+    const BlockHandle& handle = _blocks[i];
+    const char* head = _file.data() + handle.offset;
+    uint32_t payload = handle.size - 12;
+    if (!_checked[i].load(std::memory_order_acquire)) {
+        uint32_t crc = crc32c(0, head + 4, 4);
+        crc = crc32c(crc, head + 8, payload);
+        if (crc != get_fixed32(head + 8 + payload))
+            return false;
+        _checked[i].store(true, std::memory_order_release);
+    }
+    block._p = head + 8;
+    block._end = head + 8 + payload;
+    block._left = get_fixed32(head + 4);
+    return true;
+}
+
+
+#endif //SKIP_LIST_SSTABLE_H
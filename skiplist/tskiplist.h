@@ -13,62 +13,157 @@
 
 
 #include <iostream> 
+#include <algorithm>
 #include <cstdlib>
+#include <functional>
+#include <chrono>
 #include <cmath>
 #include <cstring>
+#include <condition_variable>
 #include <mutex>
+#include <shared_mutex>
 #include <fstream>
+#include <memory>
+#include <set>
+#include <vector>
 #include <atomic>
-
-#define STORE_FILE "store/dumpFile"
-
-std::string delimiter = ":";
-
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <future>
+#include <thread>
+#include <cerrno>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "allocator.h"
+#include "codec.h"
+#include "levels.h"
+#include "logging.h"
+#include "metrics.h"
+#include "epoch.h"
+#include "snapshot.h"
+#include "wal.h"
+
+
+// sequence number of a version whose write batch is not committed yet, no snapshot reads it
+static const uint64_t kSeqUncommitted = ~static_cast<uint64_t>(0);
+
+// sequence number a read of the latest versions uses, it skips the uncommitted ones only
+static const uint64_t kSeqLatest = kSeqUncommitted - 1;
 
 /**
  * @struct MutexNode
  * @brief The MutexNode struct is used to manage thread safe nodes in the skip list.
+ * Writers change forward pointers while holding mtx, readers may follow them without it.
+ * The forward array is stored right in front of the node, in the same allocation, and the
+ * fields a search reads come first, so a walk touches the pointers and the key of a node
+ * in one or two cache lines whatever the size of the value. A large value is best kept out of
+ * the node altogether, see CompactValue.
+ * The list links the newest version of every key, the versions it replaced hang off it by
+ * older while a snapshot may still read them.
  */
 template<typename K, typename V> 
 struct MutexNode {
-    std::mutex mtx;
-    int node_level;
+    std::atomic<MutexNode<K, V>*> *forward;
     K key;
+
+    // seqlock style version, odd while a writer is changing the node
+    std::atomic<uint32_t> version;
+
+    // set once the node is being unlinked
+    std::atomic<bool> marked;
+
+    int node_level;
+
+    // set if the version is a delete, older snapshots still read the version behind it
+    bool tombstone;
+
+    // sequence number of the version, 0 if every snapshot reads it, kSeqUncommitted while
+    // the write batch that made it is not committed, see tSkipList::Snapshot
+    std::atomic<uint64_t> seq;
+
+    // the version this one replaced, kept while a snapshot or an uncommitted batch reads it
+    std::atomic<MutexNode<K, V>*> older;
+
+    // wall clock milliseconds after which the element is gone, 0 if it never expires
+    std::atomic<uint64_t> expire_at;
+
+    // access bit of the CLOCK eviction, set by reads and cleared by the hand
+    std::atomic<bool> referenced;
+
+    // bytes charged to the memory budget, the node with what its key and value own
+    size_t bytes;
+
+    std::mutex mtx;
     V value;
-    MutexNode<K, V> **forward;
     
     /**
      * @brief Constructor for MutexNode.
-     * To initialze the data structures.
+     * To initialze the data structures, the node must be built at offset_of(level) of
+     * size_of(level) bytes, see create. The value is constructed from args in place.
      */
-    MutexNode(int level, K k, V v) : node_level(level), key(k), value(v) {
-        forward = new MutexNode<K, V>*[level + 1];
+    template <typename... Args>
+    MutexNode(int level, const K& k, Args&&... args) : key(k), version(0), marked(false), node_level(level), tombstone(false), seq(0), older(NULL), expire_at(0), referenced(true), bytes(0), value(std::forward<Args>(args)...) {
+        forward = reinterpret_cast<std::atomic<MutexNode<K, V>*>*>(reinterpret_cast<char*>(this) - offset_of(level));
         for (int i = 0; i <= level; ++i)
-            forward[i] = NULL;
+            new (&forward[i]) std::atomic<MutexNode<K, V>*>(NULL);
     }
 
     /**
-     * @brief Deconstructor for MutexNode.
-     * To free the array of pointers.
+     * @brief To build a node of the level in mem, which holds size_of(level) bytes.
+     */
+    template <typename... Args>
+    static MutexNode<K, V>* create(void* mem, int level, const K& k, Args&&... args) {
+        return new (static_cast<char*>(mem) + offset_of(level)) MutexNode<K, V>(level, k, std::forward<Args>(args)...);
+    }
+
+    /**
+     * @return The memory the node was built in by create.
+     */
+    void* memory() {
+        return reinterpret_cast<char*>(this) - offset_of(node_level);
+    }
+
+    /**
+     * @return The bytes in front of a node of the level, its forward array.
+     */
+    static size_t offset_of(int level) {
+        const size_t align = alignof(MutexNode<K, V>);
+        return (sizeof(std::atomic<MutexNode<K, V>*>) * (level + 1) + align - 1) / align * align;
+    }
+
+    /**
+     * @return The bytes of a node of the level together with its forward array.
      */
-    ~MutexNode() {
-        delete[] forward;  
+    static size_t size_of(int level) {
+        return offset_of(level) + sizeof(MutexNode<K, V>);
     }
 };
 
 /**
  * @class tSkipList
  * @brief The tSkipList class is used to manage the thread safe skip list.
+ * Alloc provides the memory of the nodes and must be thread safe, see allocator.h.
+ * While a Snapshot is held, writers copy the node of a key instead of changing it and keep
+ * the old one behind the copy, stamped with a sequence number, so snapshot reads find the
+ * version they see without a lock. Without snapshots a write changes the node as before and
+ * keeps nothing. A WriteBatch links all its versions uncommitted and stamps them at once.
  */
-template <typename K, typename V> 
+template <typename K, typename V, typename Compare = std::less<K>,
+          typename Serializer = RecordCodec<K, V>, typename Alloc = NodeArena<std::mutex> > 
 class tSkipList {
     using SkipNode = MutexNode<K, V>;
+    using KeyCodec = typename Serializer::Key;
+    using ValueCodec = typename Serializer::Value;
 public: 
     /**
      * @brief Constructor for SkipList.
      * To initialze the data structures.
+     * The highest level is capped at kSnapshotMaxLevel, the most a snapshot record holds.
+     * @param compare The order of the keys.
      */
-    tSkipList(int);
+    tSkipList(int, const Compare& compare = Compare());
 
     /**
      * @brief Deconstructor for MutexNode.
@@ -78,361 +173,3154 @@ public:
     
     /**
      * @return The number of elements in the skip node.
+     * Expired elements are counted until they are reclaimed.
      */
     int size();
 
     /**
-     * @brief To insert an element.
+     * @brief To take a copy of the counters of the list, see metrics.h.
+     * Nodes deleted but not reclaimed yet are still counted in level_nodes and node_bytes.
+     */
+    Stats stats();
+
+    /**
+     * @brief To choose the levels of the nodes inserted from now on, see levels.h.
+     * Call it before the list is shared by threads, the nodes already in the list keep their levels.
+     * @param branching 1/p, a node reaches the next level with probability 1/branching.
+     * @param expected_elements To cap the levels at log_branching of it, 0 for max_level.
+     */
+    void set_level_distribution(unsigned branching, size_t expected_elements = 0);
+
+    /**
+     * @brief To bound the memory of the list so it can serve as a cache.
+     * A write that takes memory_usage() above bytes evicts cold elements until it is below
+     * again, with the CLOCK policy: reads set the access bit of their element without a lock,
+     * the hand walks level 0 clearing the bits it passes and evicts the elements whose bit
+     * is clear, expired ones whatever their bit. Only one writer evicts at a time, the others
+     * go on meanwhile, so the budget may be exceeded for a moment. Evictions are logged as
+     * deletes.
+     * @param bytes The budget, 0 for none.
+     */
+    void set_memory_budget(size_t bytes);
+
+    /**
+     * @return The bytes counted against the budget, the nodes with their forward arrays and
+     * what keys and values own outside them, see HeapBytes. The arena keeps the memory of
+     * evicted nodes for new ones, it is not given back to the system.
+     */
+    size_t memory_usage();
+
+    /**
+     * @brief To insert an element, the value is copied into the node.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    int insert_element(const K&, const V&);
+
+    /**
+     * @brief To insert an element, the value is moved into the node.
      * @return 0 if succeeds, 1 if key exists.
      */
-    int insert_element(K, V);
+    int insert_element(const K&, V&&);
+
+    /**
+     * @brief To insert an element whose value is constructed in the node from args.
+     * The node is built before the path is locked, so args are consumed even if key exists.
+     * @return 0 if succeeds, 1 if key exists.
+     */
+    template <typename... Args>
+    int emplace(const K& key, Args&&... args);
+
+    /**
+     * @brief To insert an element, or to assign value to the element of key if it exists.
+     * A trivially copyable value is assigned in place under the node version, any other
+     * value goes to a copy of the node that replaces it, so lock free readers never see a
+     * value while it is written.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int insert_or_assign(const K& key, M&& value);
+
+    /**
+     * @brief To insert or assign value like insert_or_assign, the element expires ttl_ms
+     * milliseconds from now. Reads skip an expired element, it is reclaimed by the next
+     * write of its key or by the sweeper, see expire_step. insert_or_assign clears the
+     * expiry, update keeps it.
+     * @param ttl_ms Milliseconds to live, 0 for no expiry.
+     * @return 0 if inserted, 1 if assigned.
+     */
+    template <typename M>
+    int put(const K& key, M&& value, uint64_t ttl_ms);
+
+    /**
+     * @brief To change the value of key, read-modify-write without a delete and an insert.
+     * fn is called with a V& while the path is locked and must not call into the list, the
+     * value is changed in place or on a copy like insert_or_assign.
+     * @return True if found, False if not found.
+     */
+    template <typename Fn>
+    bool update(const K& key, Fn fn);
 
     /**
      * @brief To search element by its key.
+     * Walks the list without taking any mutex and validates the node version, it only
+     * falls back to the locked walk if a writer changed the node meanwhile.
      * @param value_out To retrive the value.
      * @return True if found, False if not found.
      */
-    bool search_element(K, V&);
-    
+    bool search_element(const K&, V&);
+
     /**
-     * @brief To delete element by its key.
-     * If not found, do nothing.
+     * @class Snapshot
+     * @brief The Snapshot class is used to read the list as it was when the snapshot was taken.
+     * Writers go on while it is held, but keep the versions it reads, so a long lived snapshot
+     * costs the memory of every element changed meanwhile. Those versions are reclaimed by
+     * the next write of their key or by the sweeper once no snapshot reads them, see
+     * start_expiry. The clock stops for it too: an element that expires after the snapshot
+     * was taken is still read. It must not outlive the list.
      */
-    void delete_element(K);
-    
+    class Snapshot {
+    public:
+        Snapshot() : _list(NULL), _sequence(0), _now(0) {}
+        Snapshot(Snapshot&& other) noexcept : _list(other._list), _sequence(other._sequence), _now(other._now) { other._list = NULL; }
+        Snapshot& operator=(Snapshot&& other) noexcept;
+        ~Snapshot() { release(); }
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        /**
+         * @return True until the snapshot is released.
+         */
+        bool valid() const { return _list != NULL; }
+
+        /**
+         * @return The sequence number of the snapshot, it reads the versions up to it.
+         */
+        uint64_t sequence() const { return _sequence; }
+
+        /**
+         * @return The wall clock milliseconds when the snapshot was taken, the expiries are
+         * checked against it.
+         */
+        uint64_t now() const { return _now; }
+
+        /**
+         * @brief To let the writers drop the versions only this snapshot reads.
+         */
+        void release();
+
+    private:
+        friend class tSkipList;
+        Snapshot(tSkipList* list, uint64_t sequence, uint64_t now) : _list(list), _sequence(sequence), _now(now) {}
+
+        tSkipList* _list;
+        uint64_t _sequence;
+        uint64_t _now;
+    };
+
     /**
-     * @brief To dump the skip list to the file.
+     * @brief To take a snapshot of the list.
+     * It waits for the writes in progress, the writers holding their paths and the write
+     * batches until they are durable, and holds the next ones off only until it is registered.
      */
-    void dump_file();
-    
+    Snapshot snapshot();
+
     /**
-     * @brief To load the skip list from the file.
+     * @brief To take a snapshot of every list of lists at one point in time, like snapshot.
+     * The gates of the lists are taken one after the other in the order given and held until
+     * all snapshots are registered, so two callers must pass shared lists in the same order.
+     * @return The snapshots in the order of lists, all with the same clock.
      */
-    void load_file();
+    static std::vector<Snapshot> snapshot_all(const std::vector<tSkipList*>& lists);
 
-private:    
     /**
-     * @brief To clear a node and the next nodes recursively.
+     * @brief To search element by its key in snapshot, without taking any mutex unless a
+     * writer is changing the node the version is in.
+     * @return True if found, False if not found.
      */
-    void clear(SkipNode *);
+    bool search_element(const K& key, V& value_out, const Snapshot& snapshot);
 
     /**
-     * @brief Deconstructor for MutexNode.
-     * To free the array of pointers.
+     * @class WriteBatch
+     * @brief The WriteBatch class is used to collect puts and deletes that write applies all
+     * or none. A later change of a key in the batch replaces an earlier one.
      */
-    int get_random_level();
+    class WriteBatch {
+    public:
+        /**
+         * @brief To put value to key, the element expires ttl_ms milliseconds after the put
+         * is added, 0 for no expiry.
+         */
+        void put(const K& key, const V& value, uint64_t ttl_ms = 0);
+
+        /**
+         * @brief To delete key, nothing is done if it does not exist.
+         */
+        void remove(const K& key);
+
+        /**
+         * @return The number of changes added.
+         */
+        size_t count() const { return _changes.size(); }
+
+        void clear() { _changes.clear(); }
+
+    private:
+        friend class tSkipList;
+
+        struct Change {
+            bool deleted;
+            K key;
+            V value;
+            uint64_t expire_at;
+        };
+        std::vector<Change> _changes;
+    };
 
     /**
-     * @brief To parse the str into key and value.
+     * @brief To apply batch atomically.
+     * Its keys are changed in key order, one locked path at a time, each to a version that
+     * nobody reads until all are linked and the batch is durable in the log as one record;
+     * then every version gets the same sequence number. A snapshot either sees the whole
+     * batch or none of it, and so does the log after a crash or on a replica. A read without
+     * a snapshot finds the version from before the batch until the commit, but two keys read
+     * one after the other may be on either side of it. Writers of a key in the batch wait for
+     * the commit.
+     * @return False if the log failed to make the batch durable, the versions from before the
+     * batch are linked again and nobody has read it. The log is failed from then on and may
+     * still hold the record if its write reached the disk, like any record of a failed sync.
      */
-    void string_to_kv(const std::string& str, std::string* key, std::string* value);
+    bool write(const WriteBatch& batch);
     
     /**
-     * @brief To check if the string is a k-v pair.
+     * @brief To delete element by its key.
+     * If not found, do nothing.
+     * @return 0 if succeeds, 1 if not found.
      */
-    bool is_valid_string(const std::string& str);
-  
-    // Maximum level of the skip list 
-    const int _max_level;
+    int delete_element(const K&);
 
-    // current level of skip list 
-    std::atomic<int> _skip_list_level;
+    /**
+     * @brief To search a batch of keys under one epoch guard.
+     * The keys are visited in sorted order and every walk starts from the path of the
+     * previous key, so close keys only pay for the distance between them. Keys whose node
+     * was being changed are searched again on the locked path at the end.
+     * @param values Resized to the number of keys, values[i] is set if found[i].
+     * @return The number of keys found.
+     */
+    int multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found);
 
-    // pointer to header node 
-    SkipNode * _header;
+    /**
+     * @brief To insert a batch of elements in key order.
+     * Each key still locks its own path, but neighbouring paths are hot in the cache and the
+     * write-ahead log is synced once for the whole batch.
+     * @return The number of inserted elements, keys that exist are skipped.
+     */
+    int multi_insert(const std::vector<std::pair<K, V> >& elements);
 
-    // file operator
-    std::mutex _file_mutex;
-    std::ofstream _file_writer;
-    std::ifstream _file_reader;
+    /**
+     * @brief To delete a batch of keys in key order, synced once like multi_insert.
+     * @return The number of deleted elements.
+     */
+    int multi_delete(const std::vector<K>& keys);
 
-    // skiplist current element count
-    std::atomic<int> _element_count;
-};
+    /**
+     * @brief To insert a range of key-value pairs sorted by key.
+     * An empty list is built by appending to the tail of every level while _header is held,
+     * a list with elements gets a multi_insert.
+     * @return The number of inserted elements.
+     */
+    template <typename InputIt>
+    int bulk_load(InputIt first, InputIt last);
 
+    /**
+     * @brief To reclaim the expired elements among the next max_nodes nodes of level 0.
+     * Every step goes on after the key the previous one stopped at and wraps around at the
+     * end, so the steps sweep the whole list without holding anything for long. An element
+     * that expired after a snapshot was taken stays readable to it, see Snapshot.
+     * @return The number of reclaimed elements.
+     */
+    size_t expire_step(size_t max_nodes);
 
-template<typename K, typename V> 
-tSkipList<K, V>::tSkipList(int max_level) : _max_level(max_level), _skip_list_level(0), _element_count(0) {
-    // create header node and initialize key and value to null
-    K k;
-    V v;
-    this->_header = new SkipNode(k, v, _max_level);
-};
+    /**
+     * @brief To run expire_step(max_nodes) every interval_ms on a background thread.
+     * @return False if the sweeper is running already.
+     */
+    bool start_expiry(int interval_ms = 100, size_t max_nodes = 1024);
 
-template<typename K, typename V> 
-tSkipList<K, V>::~tSkipList() {
+    /**
+     * @brief To stop the background sweeper, the destructor stops it too.
+     */
+    void stop_expiry();
 
-    this->_header->mtx.lock();
-    if (_file_writer.is_open()) {
-        _file_writer.close();
-    }
-    if (_file_reader.is_open()) {
-        _file_reader.close();
-    }
+    /**
+     * @class Iterator
+     * @brief The Iterator class is used to walk the elements in key order.
+     * It pins an epoch for its whole life, so it may only be used by the thread that made it
+     * and nodes deleted meanwhile stay readable. Key and value are copies taken when the
+     * iterator arrives on an element.
+     * By default an element inserted or deleted behind the iterator may or may not be seen.
+     * A consistent iterator reads a snapshot of its own, or the one it was made with, so it
+     * sees the list as it was when the snapshot was taken. Writers go on in both cases, the
+     * thread holding the iterator included.
+     */
+    class Iterator {
+    public:
+        Iterator(tSkipList* list, bool consistent);
+        Iterator(tSkipList* list, const Snapshot& snapshot);
+        Iterator(Iterator&&) = default;
+
+        /**
+         * @return True if the iterator is on an element.
+         */
+        bool valid() const { return _node != NULL; }
+
+        const K& key() const { return _key; }
+        const V& value() const { return _value; }
+
+        /**
+         * @brief To move to the first element.
+         */
+        void seek_to_first();
+
+        /**
+         * @brief To move to the first element whose key is not less than key.
+         */
+        void seek(const K& key);
+
+        /**
+         * @brief To move to the next element, the iterator must be valid.
+         */
+        void next();
+
+    private:
+        /**
+         * @brief To stop on the first element from node on that is not deleted.
+         */
+        void arrive(SkipNode* node);
+
+        tSkipList* _list;
+        Snapshot _snapshot;
+        uint64_t _sequence;
+        uint64_t _now;
+        EpochManager::Guard _guard;
+        SkipNode* _node;
+        K _key;
+        V _value;
+    };
 
-    //递归删除跳表链条
-    if(_header->forward[0]!=nullptr){
-        clear(_header->forward[0]);
-    }
-    delete(_header);
-}
+    /**
+     * @return An iterator that is not on any element yet, seek it first.
+     * @param consistent To read a snapshot taken now.
+     */
+    Iterator new_iterator(bool consistent = false);
 
-template<typename K, typename V> 
-int tSkipList<K, V>::size() { 
-    return _element_count;
-}
+    /**
+     * @return An iterator reading snapshot, which must outlive it.
+     */
+    Iterator new_iterator(const Snapshot& snapshot);
 
-template<typename K, typename V>
-int tSkipList<K, V>::insert_element(const K key, const V value) {        
-    // Generate a random level for node
-    int random_level = get_random_level();
+    /**
+     * @brief To collect the elements with lo <= key < hi in key order.
+     * @param limit Maximum number of elements, 0 for no limit.
+     * @param consistent To scan a snapshot taken now, see Iterator.
+     */
+    std::vector<std::pair<K, V> > range(const K& lo, const K& hi, size_t limit = 0, bool consistent = false);
 
-    this->_header->mtx.lock();
-    std::mutex * cur_mutex = &(this->_header->mtx);
+    /**
+     * @brief To collect the elements with lo <= key < hi in snapshot, like range.
+     */
+    std::vector<std::pair<K, V> > range(const K& lo, const K& hi, size_t limit, const Snapshot& snapshot);
     
-    SkipNode *current = this->_header;
-
-    // create update array and initialize it 
-    // update is array which put node that the node->forward[i] should be operated later
-    SkipNode *update[_max_level+1];
-    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));  
-
-    bool hold_lock = random_level > _skip_list_level;
-    // if random_level is bigger, the lock of _header should be hold
-    for(int i = _skip_list_level; i >= 0; i--) {
-        while(current->forward[i] != NULL && current->forward[i]->key < key) {
-            current->forward[i]->mtx.lock();
+    /**
+     * @brief To dump the skip list to the file as a binary snapshot, see snapshot.h.
+     * @param path The file, replaced atomically once the snapshot is complete.
+     * @return True if the snapshot was completely written.
+     */
+    bool dump_file(const std::string& path = STORE_FILE);
 
-            current = current->forward[i]; 
+    /**
+     * @brief To choose how many threads dump_file and load_file use.
+     * A dump with several threads splits level 0 into key ranges of about the same size at
+     * the nodes of a high level, and every thread writes its range to a segment file of its
+     * own, see SnapshotManifest. Loading such a snapshot into an empty list builds every
+     * segment on its own thread and links the sorted runs together at the end.
+     * @param threads 0 for one per core, 1 for a single snapshot file.
+     */
+    void set_snapshot_threads(unsigned threads);
 
-            std::mutex * tmp_mutex = cur_mutex;
-            cur_mutex = &(current->mtx);
-            if(!hold_lock)
-                tmp_mutex->unlock();
-            else
-                hold_lock = false;
-        }
-        update[i] = current;
-        hold_lock = true;
-    }
+    /**
+     * @brief To compress the snapshots and checkpoints written from now on block by block,
+     * and the large records of the write-ahead log if it is opened afterwards, see compress.h.
+     * Files are read whatever their compression, so it can be changed at any time.
+     */
+    void set_compression(Compression compression);
 
-    // reached level 0 and forward pointer to right node, which is desired to insert key.
-    current = current->forward[0];
+    /**
+     * @brief To dump the skip list in the background from a forked child.
+     * The child writes the point-in-time copy of the list that fork gives it, the writers of
+     * the parent only pay for the copy on write of the pages they touch. A background thread
+     * waits for the child and then drops the log segments the snapshot covers.
+     * @return False if a background dump is still running.
+     */
+    bool dump_file_async(const std::string& path = STORE_FILE);
 
-    // if current node have key equal to searched key, we get it
-    if (current != NULL && current->key == key) {
-        std::cout << "key: " << key << ", exists" << std::endl;
-        
-        // unlock ever prev node
-        update[random_level]->mtx.unlock();
-        for (int i = random_level; i > 0; i--)
-            if(update[i - 1] != update[i])
-                update[i - 1]->mtx.unlock();
-        return 1;
-    }
+    /**
+     * @brief To wait for the background dump.
+     * @return True if it wrote the snapshot, or none was started.
+     */
+    bool wait_dump();
 
-    // if current is NULL that means we have reached to end of the level 
-    // if current's key is not equal to key that means we have to insert node between update[0] and current node 
-    if (current == NULL || current->key != key ) {
+    /**
+     * @brief To checkpoint the skip list to a base snapshot and the deltas on top of it.
+     * The first checkpoint to path writes a base, a full snapshot behind a manifest, see
+     * SnapshotManifest. From then on writers record the keys they change, and a checkpoint
+     * writes only those keys to a delta, with a tombstone for every key that is gone, so it
+     * costs as much as was written since the last one and not as much as the list holds.
+     * Once the deltas reach the limits of set_checkpoint_compaction, or after a dump_file or
+     * load_file, the next checkpoint writes a new base and drops the deltas.
+     * load_file applies the deltas on top of the base in order.
+     * @return True if the checkpoint was completely written.
+     */
+    bool checkpoint(const std::string& path = STORE_FILE);
 
-        // If random level is greater thar skip list's current level, initialize update value with pointer to header
-        if (random_level > _skip_list_level) {
-            for (int i = _skip_list_level+1; i < random_level+1; i++) {
-                update[i] = _header;
-            }
-            _skip_list_level = random_level;
-        }
+    /**
+     * @brief To choose when checkpoint compacts the deltas into a new base.
+     * @param max_deltas Deltas after which the next checkpoint writes a base.
+     * @param max_percent Records of all deltas after which the next checkpoint writes a base,
+     * in percent of the records of the base.
+     */
+    void set_checkpoint_compaction(size_t max_deltas, unsigned max_percent);
+    
+    /**
+     * @brief To load the skip list from the file.
+     * A snapshot is appended in one linear pass if the list is empty, files in the old
+     * key:value text format are still read.
+     * @param use_mmap To map the snapshot instead of reading it. It is always mapped if K or
+     * V is a Slice, those keys and values then point into the mapping, which is kept until
+     * the list is destroyed.
+     * @param path The snapshot or text file.
+     * @return True if the whole file was loaded.
+     */
+    bool load_file(const std::string& path = STORE_FILE, bool use_mmap = false);
 
-        // create new node with random level generated 
-        SkipNode* inserted_node = new SkipNode(key, value, random_level);
-        
-        // insert node 
-        for (int i = 0; i <= random_level; i++) {
-            inserted_node->forward[i] = update[i]->forward[i];
-            update[i]->forward[i] = inserted_node;
-        }
-        _element_count ++;
+    /**
+     * @brief To log every insert and delete to a write-ahead log from now on.
+     * The existing segments are replayed first, so call it after load_file and before the
+     * list is shared between threads. Writers append while they hold the nodes they changed,
+     * so the log has the order of the list, and wait for the sync after unlocking, so
+     * concurrent writers share one fdatasync.
+     * @return True if the log was replayed and a new segment opened.
+     */
+    bool open_wal(const std::string& path = WAL_FILE, SyncPolicy policy = SyncPolicy::Always, int interval_ms = 100);
 
-        // unlock ever prev node
-        update[random_level]->mtx.unlock();
-        for (int i = random_level; i > 0; i--)
-            if(update[i - 1] != update[i])
-                update[i - 1]->mtx.unlock();
-    }
-    return 0;
-}
+    /**
+     * @brief To hand every batch of the log to listener once it is written, see WalListener.
+     * An empty listener stops it, see WriteAheadLog::set_listener.
+     * @return False if no log is open.
+     */
+    bool set_log_listener(WalListener listener);
 
-template<typename K, typename V> 
-bool tSkipList<K, V>::search_element(K key, V& value_out) {
-    this->_header->mtx.lock();
-    std::mutex * cur_mutex = &(this->_header->mtx);
+    /**
+     * @return The sequence number of the last logged change, 0 if no log is open.
+     */
+    uint64_t log_lsn();
 
-    SkipNode *current = _header;
+    /**
+     * @brief To write a snapshot of the list to path for a replica, see replication.h.
+     * Unlike dump_file the log is not rotated and no segment is removed.
+     * @param lsn Set to a sequence number whose changes are all in the snapshot, the changes
+     * after it may or may not be and replay on top of it.
+     * @return True if the snapshot was completely written.
+     */
+    bool export_snapshot(const std::string& path, uint64_t& lsn);
 
-    // start from highest level of skip list
-    for (int i = _skip_list_level; i >= 0; i--) {
-        while (current->forward[i] && current->forward[i]->key < key) {
-            current->forward[i]->mtx.lock();
+    /**
+     * @brief To apply the changes of a batch of another list's log, see read_wal_batch.
+     * The records up to applied_lsn are skipped, so a batch may be applied twice.
+     * The changes go to the own log if one is open. Not for zero copy types, whose keys and
+     * values would point into data.
+     * @param applied_lsn The last applied record, advanced past the applied ones.
+     * @return False if the batch is damaged.
+     */
+    bool apply_log(const char* data, size_t size, uint64_t& applied_lsn);
 
-            current = current->forward[i]; 
+private:    
+    /**
+     * @brief To order keys by Compare, equal keys are the ones neither is less than.
+     */
+    bool less(const K& a, const K& b) const { return _compare(a, b); }
+    bool equal(const K& a, const K& b) const { return !_compare(a, b) && !_compare(b, a); }
 
-            std::mutex * tmp_mutex = cur_mutex;
-            cur_mutex = &(current->mtx);
-            tmp_mutex->unlock();
-        }
-    }
-    
-    current->forward[0]->mtx.lock();
+    /**
+     * @return True if the element of node expired, the clock is only read if it has an expiry.
+     */
+    static bool expired(const SkipNode* node);
+    static bool expired(const SkipNode* node, uint64_t now);
 
-    current = current->forward[0]; 
-    
-    std::mutex * tmp_mutex = cur_mutex;
-    cur_mutex = &(current->mtx);
-    tmp_mutex->unlock();
-
-    // if current node have key equal to searched key, we get it
-    if (current and current->key == key) {
-        value_out = current->value;
-        cur_mutex->unlock();
-        return true;
+    /**
+     * @return True if the element of node expired for a read at now, the clock of a snapshot,
+     * or at the clock if now is 0.
+     */
+    static bool expired_for(const SkipNode* node, uint64_t now) {
+        return now != 0 ? expired(node, now) : expired(node);
     }
 
-    cur_mutex->unlock();
-    return false;
-}
+    /**
+     * @brief To encode the value of node for the log, with the expiry of node if it has one.
+     * @return The log operation of the record, kWalPut or kWalPutExpire.
+     */
+    static uint8_t encode_put(const SkipNode* node, std::string& log_value);
 
-template<typename K, typename V> 
-void tSkipList<K, V>::delete_element(K key) {
-    this->_header->mtx.lock();
-    std::mutex * cur_mutex = &(this->_header->mtx);
+    /**
+     * @brief To search the version of key that sequence reads, locking nodes hand-over-hand.
+     * @param now The clock of the read, see expired_for.
+     */
+    bool locked_search(const K& key, V& value_out, uint64_t sequence, uint64_t now);
 
-    SkipNode *current = this->_header; 
+    /**
+     * @brief To copy the value of node between two reads of an even version.
+     * Called inside an epoch guard.
+     * @param now The clock of the read, see expired_for.
+     * @param found Set to false if the node is deleted.
+     * @param expire_at If not NULL, set to the expiry read with the value.
+     * @return False if a writer changed the node meanwhile.
+     */
+    bool optimistic_read(SkipNode* node, uint64_t now, V& value_out, bool& found, uint64_t* expire_at = NULL);
 
-    SkipNode *update[_max_level+1];
-    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+    /**
+     * @return The newest version of node up to sequence, NULL if the key has none.
+     * Called inside an epoch guard or with the node locked.
+     */
+    static SkipNode* version_at(SkipNode* node, uint64_t sequence) {
+        while (node != NULL && node->seq.load(std::memory_order_acquire) > sequence)
+            node = node->older.load(std::memory_order_acquire);
+        return node;
+    }
 
-    bool hold_lock = false;
+    /**
+     * @brief To copy the value of the version of node that sequence reads, like
+     * optimistic_read. The versions behind node are never changed, only node itself is.
+     * @return False if a writer changed node meanwhile and node is the version.
+     */
+    bool read_version(SkipNode* node, uint64_t sequence, uint64_t now, V& value_out, bool& found);
 
-    // start from highest level of skip list
-    for (int i = _skip_list_level; i >= 0; i--) {
-        while (current->forward[i] !=NULL && current->forward[i]->key < key) {
-            current->forward[i]->mtx.lock();
+    /**
+     * @brief To copy the value of the version of node that sequence reads under the node lock.
+     * @return False if the key does not exist for sequence.
+     */
+    bool locked_read(SkipNode* node, uint64_t sequence, uint64_t now, V& value_out);
 
-            current = current->forward[i]; 
+    /**
+     * @return The sequence number of the version a write links, 0 unless a snapshot is held.
+     * Called while the gate is held shared.
+     */
+    uint64_t write_sequence() {
+        return _snapshot_count.load(std::memory_order_relaxed) != 0 ? ++_sequence : 0;
+    }
 
-            std::mutex * tmp_mutex = cur_mutex;
-            cur_mutex = &(current->mtx);
-            if(!hold_lock)
-                tmp_mutex->unlock();
-            else
-                hold_lock = false;
-        }
-        update[i] = current;
-        hold_lock = true;
+    /**
+     * @return True if node is an uncommitted version, its writers wait for the batch.
+     */
+    static bool uncommitted(const SkipNode* node) {
+        return node->seq.load(std::memory_order_acquire) == kSeqUncommitted;
     }
-    current->forward[0]->mtx.lock();
-    current = current->forward[0];
-    int update_level = _skip_list_level;
-    if (current != NULL && current->key == key) {       
-        // start for lowest level and delete the current node of each level
-        for (int i = 0; i <= _skip_list_level; i++) {
 
-            // if at level i, next node is not target node, break the loop.
-            if (update[i]->forward[i] != current) 
-                break;
+    /**
+     * @brief To register a snapshot of the current sequence number, the gate is held exclusively.
+     */
+    Snapshot register_snapshot(uint64_t now);
 
-            update[i]->forward[i] = current->forward[i];
-        }
+    /**
+     * @brief To drop the snapshot of sequence, see Snapshot::release.
+     */
+    void release_snapshot(uint64_t sequence);
 
-        // Remove levels which have no elements
-        while (_skip_list_level > 0 && _header->forward[_skip_list_level] == 0) {
-            _skip_list_level --; 
-        }
+    /**
+     * @brief To move the path of a smaller key in update to the path of key, without locks.
+     * Called inside an epoch guard, see SkipList::finger_path.
+     */
+    void finger_path(const K& key, SkipNode** update);
 
-        delete current;
-        _element_count --;
-    }
-    // unlock ever prev node
-    update[update_level]->mtx.unlock();
-    for (int i = update_level; i > 0; i--)
-        if(update[i - 1] != update[i])
-            update[i - 1]->mtx.unlock();
-    return;
-}
+    /**
+     * @brief emplace or insert_or_assign without waiting for the log.
+     * @param lsn Set to the log record of the change, if logged.
+     * @param assign To assign the value if key exists.
+     * @param expire_at The expiry of the element, 0 for none.
+     */
+    template <typename... Args>
+    int insert_logged(uint64_t& lsn, bool assign, uint64_t expire_at, const K& key, Args&&... args);
 
-template<typename K, typename V> 
-void tSkipList<K, V>::dump_file() {
-    _file_mutex.lock();
-    _file_writer.open(STORE_FILE);
-    
-    this->_header->forward[0]->mtx.lock();
-    std::mutex * cur_mutex = &(this->_header->forward[0]->mtx);
+    /**
+     * @brief To link a node that is not published yet, or to give its value to the node of
+     * its key. The node is destroyed if it is not linked. An expired element of the key is
+     * replaced as if it did not exist.
+     * @param log_key The encoded key of the log record, empty if there is no log.
+     * @param log_op The operation of the log record, see encode_put.
+     */
+    int insert_node(SkipNode* node, const std::string& log_key, uint8_t log_op, const std::string& log_value, bool assign, uint64_t& lsn);
 
-    SkipNode *node = this->_header->forward[0]; 
+    /**
+     * @brief To give the value of node to old, the path to old is locked up to its level.
+     * In place only if seq is 0 and old is not a tombstone.
+     * @param seq The sequence number of the new version, see replace_locked.
+     * @return The node that holds the value now.
+     */
+    SkipNode* assign_locked(SkipNode** update, SkipNode* old, SkipNode* node, uint64_t seq, std::true_type);
+    SkipNode* assign_locked(SkipNode** update, SkipNode* old, SkipNode* node, uint64_t seq, std::false_type);
 
-    while (node != NULL) {
-        _file_writer << node->key << ":" << node->value << "\n";
+    /**
+     * @brief To call fn on the value of old, in place or on a copy of old like assign_locked.
+     * @return The node that holds the value now.
+     */
+    template <typename Fn>
+    SkipNode* modify_locked(SkipNode** update, SkipNode* old, Fn& fn, uint64_t seq, std::true_type);
+    template <typename Fn>
+    SkipNode* modify_locked(SkipNode** update, SkipNode* old, Fn& fn, uint64_t seq, std::false_type);
 
-        node->forward[0]->mtx.lock();
+    /**
+     * @brief To link copy at every level of old instead of old.
+     * old is left with an odd version, a reader on it takes the node lock and still reads
+     * its old value. With a seq of 0 it is retired once unreachable, with the versions
+     * behind it; otherwise copy gets seq and keeps old as its older version.
+     */
+    void replace_locked(SkipNode** update, SkipNode* old, SkipNode* copy, uint64_t seq);
 
-        node = node->forward[0]; 
+    /**
+     * @brief To retire the versions behind head that no snapshot reads, the path to head is
+     * locked. A tombstone that the oldest snapshot reads is cut off too, missing versions
+     * read the same.
+     */
+    void prune_versions(SkipNode* head);
 
-        std::mutex * tmp_mutex = cur_mutex;
-        cur_mutex = &(node->mtx);
-        tmp_mutex->unlock();
-    }
-    cur_mutex->unlock();
+    /**
+     * @brief To retire node and the versions behind it, all unreachable from the list.
+     */
+    void retire_versions(SkipNode* node);
 
-    _file_writer.flush();
-    _file_writer.close();
-    _file_mutex.unlock();
-    return ;
-}
+    /**
+     * @brief To prune the versions of key, and to unlink its node if it is a tombstone that
+     * every snapshot reads.
+     */
+    void reclaim_versions(const K& key);
 
-template<typename K, typename V> 
-void tSkipList<K, V>::load_file() {
-    _file_mutex.lock();
-    _file_reader.open(STORE_FILE);
-    std::string line;
-    std::string* key = new std::string();
-    std::string* value = new std::string();
+    /**
+     * @brief To unlink node at every level, the path to node is locked up to its level.
+     * node is marked first, a reader on it finds it deleted.
+     */
+    void unlink_locked(SkipNode** update, SkipNode* node);
+
+    /**
+     * @brief To link the version of change, uncommitted, see write.
+     * @return The version, NULL if change deletes a key that does not exist.
+     */
+    SkipNode* link_uncommitted(const typename WriteBatch::Change& change);
+
+    /**
+     * @brief To put the version a batch replaced back in place of the uncommitted version,
+     * or to unlink the version if it inserted its key, see write.
+     */
+    void revert_uncommitted(SkipNode* version);
+
+    /**
+     * @brief To decode a put or delete record of a log into change.
+     * @return False if the record can not be decoded.
+     */
+    static bool decode_change(uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size,
+                              typename WriteBatch::Change& change);
+
+    /**
+     * @brief delete_element without waiting for the log.
+     * An expired element is unlinked too, without a log record: the log already has its expiry.
+     * @param lsn Set to the log record of the delete, if logged.
+     * @param only_expired To leave the element alone unless it expired.
+     * @return True if the key was found, with only_expired if the expired element was unlinked.
+     */
+    bool delete_logged(const K& key, uint64_t& lsn, bool only_expired = false);
+
+    /**
+     * @brief The loop of the background sweeper.
+     */
+    void expiry_loop(int interval_ms, size_t max_nodes);
+
+    /**
+     * @return The first node whose key is greater than key, called inside an epoch guard.
+     */
+    SkipNode* node_after(const K& key);
+
+    /**
+     * @brief To set the access bit of node, it is only written if the hand cleared it.
+     */
+    static void touch(SkipNode* node) {
+        if (!node->referenced.load(std::memory_order_relaxed))
+            node->referenced.store(true, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return True if the list is above its memory budget.
+     */
+    bool over_budget() const;
+
+    /**
+     * @brief To evict cold elements until the list is within its budget, see set_memory_budget.
+     * It returns at once if another thread is evicting, and the hand turns at most twice.
+     */
+    void evict();
+
+    /**
+     * @brief To lock the path to key hand-over-hand from _header.
+     * update[i] is kept locked for every level i <= keep_level, a keep_level above the
+     * current level also keeps _header and a negative one keeps the whole path.
+     * @return The level of the skip list the path started from.
+     */
+    int lock_path(const K& key, SkipNode** update, int keep_level);
+
+    /**
+     * @brief To unlock the distinct nodes of update[0..level].
+     */
+    void unlock_path(SkipNode** update, int level);
+
+    /**
+     * @brief To lock the mutex of node, the time spent waiting for it is counted.
+     */
+    void lock_node(SkipNode* node);
+
+    /**
+     * @brief To free a node once the epoch manager proved it unreachable.
+     */
+    static void reclaim(void* node, void* ctx);
+
+    /**
+     * @brief To hand an unlinked node to the epoch manager, its bytes leave the budget now.
+     */
+    void retire_node(SkipNode* node);
+
+    /**
+     * @brief To charge the bytes of node to the budget again after its value changed.
+     * Only for a node that is not published yet.
+     */
+    void charge_node(SkipNode* node);
+
+    /**
+     * @brief To allocate and construct a node with its forward array, the value from args.
+     */
+    template <typename... Args>
+    SkipNode* create_node(int, const K&, Args&&...);
+
+    /**
+     * @brief To destroy a node and give its memory back to the allocator.
+     */
+    void destroy_node(SkipNode *);
+
+    /**
+     * @brief destroy_node of a node whose bytes already left the budget.
+     */
+    void free_node(SkipNode *);
+
+    /**
+     * @return The sequence number a dump reads up to, see dump_version. Called after the log
+     * is rotated, once it holds the gate every batch logged before the rotation is stamped.
+     */
+    uint64_t dump_sequence();
+
+    /**
+     * @brief To copy the version of node a dump writes: the newest one up to sequence, or
+     * the newest committed one if the writers dropped those, as they do once a newer version
+     * replaced them and no snapshot reads them. Such a newer version is logged after the
+     * rotation and replays on top of the dump. The value of node itself is read between two
+     * reads of an even version, like optimistic_read.
+     * @param may_lock To wait for a writer changing node on its lock. A forked child must not,
+     * the writer never finishes there, and skips the node: the change is logged after the
+     * rotation.
+     * @return False if the key is not written.
+     */
+    bool dump_version(SkipNode* node, uint64_t sequence, uint64_t now, bool may_lock, V& value_out, uint64_t& expire_at);
+
+    /**
+     * @brief To write the nodes reachable at level 0 to the store file, or to the segments
+     * of a manifest at path if the list is big enough to be split, see set_snapshot_threads.
+     * Without may_lock neither takes a lock nor enters an epoch, so a forked child can call it.
+     * @param sequence The sequence number of the dump, see dump_version.
+     * @param base If not NULL, the snapshot is the base of a checkpoint, always behind a
+     * manifest, and its manifest is returned in base.
+     */
+    bool write_snapshot(const std::string& path, uint64_t sequence, bool may_lock, SnapshotManifest* base = NULL);
+
+    /**
+     * @brief To write the live nodes from from up to the first key not less than to->key
+     * as one snapshot file, see dump_version.
+     * @param from The first node, NULL for the first of the list.
+     * @param to The node after the range, NULL for the end of the list.
+     * @param count Set to the number of records written.
+     */
+    bool write_range(const std::string& path, SkipNode* from, const SkipNode* to, uint64_t sequence, bool may_lock, uint64_t& count);
+
+    /**
+     * @return parts - 1 nodes that split level 0 into parts ranges of about the same size, in
+     * key order, none if the list is too small for parts ranges.
+     */
+    std::vector<SkipNode*> split_points(size_t parts);
+
+    /**
+     * @return The number of threads of a dump or load, see set_snapshot_threads.
+     */
+    size_t snapshot_threads() const;
+
+    /**
+     * @struct Run
+     * @brief The nodes of one segment, linked to each other but not to the list yet.
+     */
+    struct Run {
+        std::vector<SkipNode*> head;
+        std::vector<SkipNode*> tail;
+        int level;
+        int count;
+        bool ok;
+        std::unique_ptr<MappedFile> mapping;
+    };
+
+    /**
+     * @brief To build the run of the snapshot file at path.
+     * @param zero_copy To map the file and keep the mapping in the run.
+     * @param seq The sequence number of the nodes, see write_sequence.
+     */
+    void build_run(const std::string& path, bool use_mmap, bool zero_copy, uint64_t seq, Run& run);
+
+    /**
+     * @brief To load a single snapshot file, see load_file.
+     * @param delta If the file is a delta: its records replace the elements of their keys
+     * and its tombstones delete them.
+     */
+    bool load_snapshot(const std::string& path, bool use_mmap, bool delta = false);
+
+    /**
+     * @brief To record that the element of key changed, if a checkpoint is tracking the
+     * changes. Called before the change is logged, with the path of the change locked.
+     */
+    void mark_dirty(const K& key) {
+        if (_tracking.load(std::memory_order_relaxed))
+            record_dirty(key);
+    }
+    void record_dirty(const K& key);
+
+    /**
+     * @return The keys changed since the last call in key order, the recording starts over.
+     */
+    std::vector<K> take_dirty();
+
+    /**
+     * @brief To write the elements of keys, sorted, as a delta to path, a tombstone for every
+     * key that is not in the list. Called in an epoch.
+     * @param sequence The sequence number of the delta, see dump_version.
+     * @param count Set to the records written.
+     */
+    bool write_delta(const std::string& path, const std::vector<K>& keys, uint64_t sequence, uint64_t& count);
+
+    static const size_t kDirtyStripes = 16;
+    static const size_t kMinCompact = 1024;
+
+    /**
+     * @struct DirtyKeys
+     * @brief The keys changed by the writers of one stripe, see mark_dirty.
+     * A key is appended once per change, and the keys are sorted and made unique whenever
+     * they doubled since the last time, so a key changed again and again is held only once.
+     */
+    struct DirtyKeys {
+        std::mutex mtx;
+        std::vector<K> keys;
+        size_t compact_at;
+
+        DirtyKeys() : compact_at(kMinCompact) {}
+    };
+
+    /**
+     * @brief To sort keys and drop the duplicates.
+     */
+    void sort_unique(std::vector<K>& keys) const;
+
+    /**
+     * @brief To load the segments of the manifest at path, in parallel if the list is empty.
+     */
+    bool load_segments(const std::string& path, bool use_mmap);
+
+    /**
+     * @brief The body of dump_file_async, run on the background thread.
+     */
+    bool background_dump(std::string path);
+
+    /**
+     * @brief To wait until the log record lsn is durable, 0 is no record.
+     */
+    void log_commit(uint64_t lsn);
+
+    /**
+     * @brief To apply one record of a log, a put is an upsert.
+     * @return False if the record can not be decoded.
+     */
+    bool apply_record(uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size);
+
+    /**
+     * @brief To load the old key:value text format.
+     */
+    bool load_text_file(const std::string& path);
+
+    /**
+     * @brief To clear a node and the next nodes iteratively, with their older versions.
+     * Nothing is walked if the allocator frees all nodes at once and they need no destructor.
+     */
+    void clear(SkipNode *);
+
+    /**
+     * @return The level of a new node, from 0 to _max_level.
+     */
+    int get_random_level();
+
+    /**
+     * @brief To parse the str into key and value.
+     */
+    void string_to_kv(const std::string& str, std::string* key, std::string* value);
+    
+    /**
+     * @brief To check if the string is a k-v pair.
+     */
+    bool is_valid_string(const std::string& str);
+  
+    // Maximum level of the skip list 
+    const int _max_level;
+
+    // order of the keys
+    Compare _compare;
+
+    // memory of the nodes
+    Alloc _allocator;
+
+    // levels of the new nodes
+    LevelGenerator _levels;
+
+    // current level of skip list, only grows so lock free readers never miss a level
+    std::atomic<int> _skip_list_level;
+
+    // pointer to header node 
+    SkipNode * _header;
+
+    // taken shared by every writer and exclusive to take a snapshot, so none is between
+    // the sequence number of its write and the link
+    std::shared_timed_mutex _gate;
+
+    // last sequence number of a write, and the sequence numbers of the snapshots held, with
+    // their number and the oldest, kSeqLatest if none
+    std::atomic<uint64_t> _sequence;
+    std::mutex _snapshot_mutex;
+    std::multiset<uint64_t> _snapshots;
+    std::atomic<size_t> _snapshot_count;
+    std::atomic<uint64_t> _oldest_snapshot;
+
+    // file operator
+    std::mutex _file_mutex;
+    std::ifstream _file_reader;
+
+    // threads of a dump or load, 0 for one per core
+    std::atomic<unsigned> _snapshot_threads;
+
+    // compression of the snapshots and of the log opened next
+    std::atomic<Compression> _compression;
+
+    // the checkpoint at _checkpoint_path, empty until a base was written, and the limits of
+    // its deltas, all under _file_mutex
+    std::string _checkpoint_path;
+    SnapshotManifest _checkpoint;
+    size_t _max_deltas;
+    unsigned _max_delta_percent;
+
+    // set by the first base, from then on writers record the keys they change in the stripe
+    // of their thread
+    std::atomic<bool> _tracking;
+    std::unique_ptr<DirtyKeys[]> _dirty;
+
+    // mapped snapshots that keys or values of the list point into
+    std::vector<std::unique_ptr<MappedFile> > _mappings;
+
+    // log of the changes since the last dump, NULL if not opened
+    std::unique_ptr<WriteAheadLog> _wal;
+
+    // result of the running or last background dump
+    std::future<bool> _dump_result;
+
+    // the sweeper: one expire_step at a time goes on after _sweep_key, from the first node
+    // if _sweep_from_start
+    std::mutex _sweep_mutex;
+    K _sweep_key;
+    bool _sweep_from_start;
+
+    // bytes of every node that is not retired, and the budget, 0 for none
+    std::atomic<int64_t> _memory_bytes;
+    std::atomic<size_t> _memory_budget;
+
+    // the CLOCK hand goes on after _hand_key, from the first node if _hand_from_start
+    std::mutex _clock_mutex;
+    K _hand_key;
+    bool _hand_from_start;
+    std::atomic<uint64_t> _evictions;
+
+    // background thread running expire_step, _sweeper_stop ends it
+    std::thread _sweeper;
+    std::mutex _sweeper_mutex;
+    std::condition_variable _sweeper_cond;
+    bool _sweeper_stop;
+
+    // skiplist current element count
+    std::atomic<int> _element_count;
+
+    // operation counters, nodes per level, latency and lock waits
+    Metrics _metrics;
+
+    // deferred reclamation of deleted nodes, optimistic readers may still hold them
+    EpochManager _epoch;
+};
+
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+tSkipList<K, V, Compare, Serializer, Alloc>::tSkipList(int max_level, const Compare& compare) : _max_level(snapshot_max_level(max_level)), _compare(compare), _allocator(_max_level), _levels(_max_level), _skip_list_level(0), _sequence(0), _snapshot_count(0), _oldest_snapshot(kSeqLatest), _snapshot_threads(0), _compression(Compression::None), _max_deltas(16), _max_delta_percent(50), _tracking(false), _dirty(new DirtyKeys[kDirtyStripes]), _sweep_key(), _sweep_from_start(true), _memory_bytes(0), _memory_budget(0), _hand_key(), _hand_from_start(true), _evictions(0), _sweeper_stop(false), _element_count(0) {
+    // create header node and initialize key and value to null
+    this->_header = create_node(_max_level, K());
+    // the header is not a node of the list
+    _metrics.add_nodes(_max_level, -1);
+};
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+tSkipList<K, V, Compare, Serializer, Alloc>::~tSkipList() {
+
+    stop_expiry();
+
+    if (_dump_result.valid()) {
+        _dump_result.wait();
+    }
+
+    if (_file_reader.is_open()) {
+        _file_reader.close();
+    }
+
+    //删除跳表链条
+    clear(_header->forward[0].load());
+    destroy_node(_header);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::size() {
+    return _element_count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+Stats tSkipList<K, V, Compare, Serializer, Alloc>::stats() {
+    Stats stats;
+    _metrics.collect(stats);
+    stats.level = _skip_list_level.load(std::memory_order_acquire);
+    stats.node_bytes = SkipNode::size_of(_max_level);
+    for (size_t i = 0; i < stats.level_nodes.size(); i++)
+        stats.node_bytes += stats.level_nodes[i] * SkipNode::size_of(static_cast<int>(i));
+    stats.memory_bytes = memory_usage();
+    stats.evictions = _evictions.load(std::memory_order_relaxed);
+    return stats;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::set_level_distribution(unsigned branching, size_t expected_elements) {
+    _levels.configure(branching, expected_elements);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::set_memory_budget(size_t bytes) {
+    _memory_budget.store(bytes, std::memory_order_relaxed);
+    if (over_budget())
+        evict();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+size_t tSkipList<K, V, Compare, Serializer, Alloc>::memory_usage() {
+    int64_t bytes = _memory_bytes.load(std::memory_order_relaxed);
+    return bytes < 0 ? 0 : static_cast<size_t>(bytes);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::over_budget() const {
+    size_t budget = _memory_budget.load(std::memory_order_relaxed);
+    return budget != 0 && _memory_bytes.load(std::memory_order_relaxed) > static_cast<int64_t>(budget);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::lock_path(const K& key, SkipNode** update, int keep_level) {
+    lock_node(this->_header);
+    SkipNode *current = this->_header;
+
+    int top = _skip_list_level.load(std::memory_order_acquire);
+    if (keep_level < 0)
+        keep_level = top;
+    for (int i = top; i >= 0; i--) {
+        // the node this level starts from is update[i + 1], keep it if that level is modified
+        SkipNode *start = current;
+        bool hold_lock = i + 1 <= keep_level;
+
+        SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+        while (next != NULL && less(next->key, key)) {
+            lock_node(next);
+            if (current != start || !hold_lock)
+                current->mtx.unlock();
+            current = next;
+            next = current->forward[i].load(std::memory_order_acquire);
+        }
+        update[i] = current;
+    }
+    return top;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::lock_node(SkipNode* node) {
+    if (node->mtx.try_lock())
+        return;
+    uint64_t start = Metrics::now();
+    node->mtx.lock();
+    _metrics.add_lock_wait(Metrics::now() - start);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::unlock_path(SkipNode** update, int level) {
+    // nodes of update are ordered along the path, so equal entries are adjacent
+    for (int i = level; i >= 0; i--)
+        if (i == level || update[i] != update[i + 1])
+            update[i]->mtx.unlock();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, const V& value) {
+    return emplace(key, value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::insert_element(const K& key, V&& value) {
+    return emplace(key, std::move(value));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int tSkipList<K, V, Compare, Serializer, Alloc>::emplace(const K& key, Args&&... args) {
+    uint64_t start = _metrics.start();
+    uint64_t lsn = 0;
+    int ret = insert_logged(lsn, false, 0, key, std::forward<Args>(args)...);
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+    _metrics.record(Stats::kPut, ret == 0, start);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename M>
+int tSkipList<K, V, Compare, Serializer, Alloc>::insert_or_assign(const K& key, M&& value) {
+    uint64_t start = _metrics.start();
+    uint64_t lsn = 0;
+    int ret = insert_logged(lsn, true, 0, key, std::forward<M>(value));
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+    _metrics.record(Stats::kPut, ret == 0, start);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename M>
+int tSkipList<K, V, Compare, Serializer, Alloc>::put(const K& key, M&& value, uint64_t ttl_ms) {
+    uint64_t start = _metrics.start();
+    uint64_t lsn = 0;
+    uint64_t expire_at = ttl_ms == 0 ? 0 : wall_clock_ms() + ttl_ms;
+    int ret = insert_logged(lsn, true, expire_at, key, std::forward<M>(value));
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+    _metrics.record(Stats::kPut, ret == 0, start);
+    return ret;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename Fn>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::update(const K& key, Fn fn) {
+    uint64_t start = _metrics.start();
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    uint64_t lsn = 0;
+    {
+        std::shared_lock<std::shared_timed_mutex> gate(_gate);
+
+        // a copy of the node is linked at every level of the node, so the whole path is kept
+        int top = lock_path(key, update, -1);
+
+        SkipNode *current = update[0]->forward[0].load(std::memory_order_acquire);
+        while (current != NULL && equal(current->key, key) && uncommitted(current)) {
+            // a batch is linking the key, its commit comes without any lock of the path
+            unlock_path(update, top);
+            std::this_thread::yield();
+            top = lock_path(key, update, -1);
+            current = update[0]->forward[0].load(std::memory_order_acquire);
+        }
+        if (current == NULL || !equal(current->key, key) || current->tombstone || expired(current)) {
+            unlock_path(update, top);
+            _metrics.record(Stats::kPut, false, start);
+            return false;
+        }
+
+        uint64_t seq = write_sequence();
+        current = modify_locked(update, current, fn, seq, std::is_trivially_copyable<V>());
+        if (seq != 0)
+            prune_versions(current);
+        mark_dirty(key);
+        if (_wal) {
+            std::string log_key;
+            std::string log_value;
+            KeyCodec::encode(key, log_key);
+            uint8_t op = encode_put(current, log_value);
+            lsn = _wal->append(op, log_key, log_value);
+        }
+        unlock_path(update, top);
+    }
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+    _metrics.record(Stats::kPut, true, start);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+int tSkipList<K, V, Compare, Serializer, Alloc>::insert_logged(uint64_t& lsn, bool assign, uint64_t expire_at, const K& key, Args&&... args) {
+    // build the node and encode the log record before any lock is taken
+    SkipNode* node = create_node(get_random_level(), key, std::forward<Args>(args)...);
+    node->expire_at.store(expire_at, std::memory_order_relaxed);
+    std::string log_key;
+    std::string log_value;
+    uint8_t log_op = kWalPut;
+    if (_wal) {
+        KeyCodec::encode(key, log_key);
+        log_op = encode_put(node, log_value);
+    }
+    return insert_node(node, log_key, log_op, log_value, assign, lsn);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::insert_node(SkipNode* node, const std::string& log_key, uint8_t log_op, const std::string& log_value, bool assign, uint64_t& lsn) {
+    const K& key = node->key;
+    int random_level = node->node_level;
+
+    // create update array and initialize it
+    // update is array which put node that the node->forward[i] should be operated later
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    // held until the path is unlocked, a consistent iterator waits for it
+    std::shared_lock<std::shared_timed_mutex> gate(_gate);
+
+    // set once an expired element of key was found, it is replaced like an assignment
+    bool replace = assign;
+    for (;;) {
+        // an assignment may replace the node of key, so the path is kept up to any level
+        int keep = random_level;
+        if (replace)
+            keep = std::max(random_level, _skip_list_level.load(std::memory_order_acquire));
+
+        // if keep is bigger, the lock of _header is hold
+        int top = lock_path(key, update, keep);
+
+        // If keep is greater thar skip list's current level, initialize update value with pointer to header
+        for (int i = top+1; i < keep+1; i++) {
+            update[i] = _header;
+        }
+
+        // reached level 0 and forward pointer to right node, which is desired to insert key.
+        SkipNode *current = update[0]->forward[0].load(std::memory_order_acquire);
+
+        // if current node have key equal to searched key, we get it
+        if (current != NULL && equal(current->key, key)) {
+            if (uncommitted(current)) {
+                // a batch is linking the key, its commit comes without any lock of the path
+                unlock_path(update, keep);
+                std::this_thread::yield();
+                continue;
+            }
+            bool deleted = current->tombstone;
+            bool gone = deleted || expired(current);
+            if (!assign && !gone) {
+                unlock_path(update, keep);
+                SKIPLIST_LOG(Debug, "key: " << printable(key) << ", exists");
+                destroy_node(node);
+                return 1;
+            }
+            if (!replace || current->node_level > keep) {
+                // the expired node must be replaced, or the list grew above the kept path
+                unlock_path(update, keep);
+                replace = true;
+                continue;
+            }
+            // key was the one of node, which may be gone now
+            uint64_t seq = write_sequence();
+            SkipNode *assigned = deleted ? assign_locked(update, current, node, seq, std::false_type())
+                                         : assign_locked(update, current, node, seq, std::is_trivially_copyable<V>());
+            if (seq != 0)
+                prune_versions(assigned);
+            if (deleted)
+                _element_count ++;
+            mark_dirty(assigned->key);
+            if (_wal)
+                lsn = _wal->append(log_op, log_key, log_value);
+            unlock_path(update, keep);
+            return gone ? 0 : 1;
+        }
+
+        if (random_level > top)
+            _skip_list_level.store(random_level, std::memory_order_release);
+        node->seq.store(write_sequence(), std::memory_order_relaxed);
+
+        for (int i = 0; i <= random_level; i++)
+            node->forward[i].store(update[i]->forward[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        // insert node bottom up, a reader reaching it at any level can go on down
+        for (int i = 0; i <= random_level; i++)
+            update[i]->forward[i].store(node, std::memory_order_release);
+        _element_count ++;
+        mark_dirty(key);
+        if (_wal)
+            lsn = _wal->append(log_op, log_key, log_value);
+
+        // unlock ever prev node
+        unlock_path(update, keep);
+        return 0;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::assign_locked(SkipNode** update, SkipNode* old, SkipNode* node, uint64_t seq, std::true_type) {
+    // a snapshot reads the old value, it must stay in a node of its own
+    if (seq != 0 || old->tombstone)
+        return assign_locked(update, old, node, seq, std::false_type());
+    lock_node(old);
+    uint32_t version = old->version.load(std::memory_order_relaxed);
+    old->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    old->value = node->value;
+    old->expire_at.store(node->expire_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    old->version.store(version + 2, std::memory_order_release);
+    old->mtx.unlock();
+    destroy_node(node);
+    return old;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::assign_locked(SkipNode** update, SkipNode* old, SkipNode* node, uint64_t seq, std::false_type) {
+    // the copy must have the level of old, node is used as it is if it has
+    if (node->node_level != old->node_level) {
+        SkipNode *copy = create_node(old->node_level, old->key, std::move(node->value));
+        copy->expire_at.store(node->expire_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        destroy_node(node);
+        node = copy;
+    }
+    replace_locked(update, old, node, seq);
+    return node;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename Fn>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::modify_locked(SkipNode** update, SkipNode* old, Fn& fn, uint64_t seq, std::true_type) {
+    if (seq != 0)
+        return modify_locked(update, old, fn, seq, std::false_type());
+    lock_node(old);
+    uint32_t version = old->version.load(std::memory_order_relaxed);
+    old->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    fn(old->value);
+    old->version.store(version + 2, std::memory_order_release);
+    old->mtx.unlock();
+    return old;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename Fn>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::modify_locked(SkipNode** update, SkipNode* old, Fn& fn, uint64_t seq, std::false_type) {
+    // the value of a published node is never written, readers copy it without a lock
+    SkipNode *copy = create_node(old->node_level, old->key, old->value);
+    copy->expire_at.store(old->expire_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    fn(copy->value);
+    charge_node(copy);
+    replace_locked(update, old, copy, seq);
+    return copy;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::replace_locked(SkipNode** update, SkipNode* old, SkipNode* copy, uint64_t seq) {
+    lock_node(old);
+    for (int i = 0; i <= old->node_level; i++)
+        copy->forward[i].store(old->forward[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    if (seq != 0) {
+        copy->seq.store(seq, std::memory_order_relaxed);
+        copy->older.store(old, std::memory_order_relaxed);
+    }
+
+    // readers of old wait for the node lock from now on
+    old->version.store(old->version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // link from the highest level of the node down to level 0, like an unlink
+    for (int i = old->node_level; i >= 0; i--)
+        update[i]->forward[i].store(copy, std::memory_order_release);
+    old->mtx.unlock();
+
+    // optimistic readers may still be on the node
+    if (seq == 0)
+        retire_versions(old);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::prune_versions(SkipNode* head) {
+    // a snapshot stops at the first version up to its sequence, none goes past the one of the
+    // oldest snapshot
+    uint64_t oldest = _oldest_snapshot.load(std::memory_order_acquire);
+    SkipNode *parent = NULL;
+    SkipNode *node = head;
+    while (node != NULL && node->seq.load(std::memory_order_relaxed) > oldest) {
+        parent = node;
+        node = node->older.load(std::memory_order_relaxed);
+    }
+    if (node == NULL)
+        return;
+    SkipNode *rest = parent != NULL && node->tombstone ? parent->older.exchange(NULL, std::memory_order_release)
+                                                       : node->older.exchange(NULL, std::memory_order_release);
+    if (rest != NULL)
+        retire_versions(rest);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::retire_versions(SkipNode* node) {
+    while (node != NULL) {
+        SkipNode *older = node->older.load(std::memory_order_relaxed);
+        retire_node(node);
+        node = older;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::search_element(const K& key, V& value_out) {
+    return search_element(key, value_out, Snapshot());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::search_element(const K& key, V& value_out, const Snapshot& snapshot) {
+    uint64_t start = _metrics.start();
+    const uint64_t sequence = snapshot.valid() ? snapshot.sequence() : kSeqLatest;
+    const uint64_t now = snapshot.valid() ? snapshot.now() : 0;
+    {
+        EpochManager::Guard guard(_epoch);
+
+        SkipNode *current = _header;
+
+        // start from highest level of skip list
+        for (int i = _skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+            SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+            while (next != NULL && less(next->key, key)) {
+                current = next;
+                next = current->forward[i].load(std::memory_order_acquire);
+            }
+        }
+
+        current = current->forward[0].load(std::memory_order_acquire);
+        if (current == NULL || !equal(current->key, key)) {
+            _metrics.record(Stats::kGet, false, start);
+            return false;
+        }
+
+        bool found;
+        if (read_version(current, sequence, now, value_out, found)) {
+            if (found)
+                touch(current);
+            _metrics.record(Stats::kGet, found, start);
+            return found;
+        }
+    }
+
+    // a writer is changing the node, wait for it on the locked path
+    bool found = locked_search(key, value_out, sequence, now);
+    _metrics.record(Stats::kGet, found, start);
+    return found;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::optimistic_read(SkipNode* node, uint64_t now, V& value_out, bool& found, uint64_t* expire_at) {
+    // copy the value between two reads of an even version
+    uint32_t version = node->version.load(std::memory_order_acquire);
+    if (version & 1)
+        return false;
+    if (node->marked.load(std::memory_order_acquire)) {
+        found = false;
+        return true;
+    }
+    // an assignment in place may change the expiry too, so it is read inside the version
+    found = !node->tombstone && !expired_for(node, now);
+    if (found) {
+        value_out = node->value;
+        if (expire_at != NULL)
+            *expire_at = node->expire_at.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return node->version.load(std::memory_order_relaxed) == version;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::read_version(SkipNode* node, uint64_t sequence, uint64_t now, V& value_out, bool& found) {
+    SkipNode *version = version_at(node, sequence);
+    if (version == node)
+        return optimistic_read(node, now, value_out, found);
+    found = version != NULL && !version->tombstone && !expired_for(version, now);
+    if (found)
+        value_out = version->value;
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::locked_read(SkipNode* node, uint64_t sequence, uint64_t now, V& value_out) {
+    lock_node(node);
+    SkipNode *version = version_at(node, sequence);
+    bool found = !node->marked.load(std::memory_order_relaxed) && version != NULL
+                 && !version->tombstone && !expired_for(version, now);
+    if (found)
+        value_out = version->value;
+    node->mtx.unlock();
+    return found;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::expired(const SkipNode* node) {
+    uint64_t expire_at = node->expire_at.load(std::memory_order_relaxed);
+    return expire_at != 0 && expire_at <= wall_clock_ms();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::expired(const SkipNode* node, uint64_t now) {
+    uint64_t expire_at = node->expire_at.load(std::memory_order_relaxed);
+    return expire_at != 0 && expire_at <= now;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+uint8_t tSkipList<K, V, Compare, Serializer, Alloc>::encode_put(const SkipNode* node, std::string& log_value) {
+    uint64_t expire_at = node->expire_at.load(std::memory_order_relaxed);
+    if (expire_at != 0)
+        put_fixed64(log_value, expire_at);
+    ValueCodec::encode(node->value, log_value);
+    return expire_at != 0 ? kWalPutExpire : kWalPut;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::finger_path(const K& key, SkipNode** update) {
+    int top = _skip_list_level.load(std::memory_order_acquire);
+
+    // the old path stays valid above the first level where it does not have to move
+    int level = 0;
+    while (level < top) {
+        SkipNode *next = update[level]->forward[level].load(std::memory_order_acquire);
+        if (next == NULL || !less(next->key, key))
+            break;
+        level++;
+    }
+
+    SkipNode *current = update[level];
+    for (int i = level; i >= 0; i--) {
+        // the old path may be further right than the node coming down
+        if (update[i] != _header && (current == _header || less(current->key, update[i]->key)))
+            current = update[i];
+        SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+        while (next != NULL && less(next->key, key)) {
+            current = next;
+            next = current->forward[i].load(std::memory_order_acquire);
+        }
+        update[i] = current;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::locked_search(const K& key, V& value_out, uint64_t sequence, uint64_t now) {
+    lock_node(this->_header);
+    SkipNode *current = _header;
+
+    // start from highest level of skip list
+    for (int i = _skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+        SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+        while (next != NULL && less(next->key, key)) {
+            lock_node(next);
+            current->mtx.unlock();
+            current = next;
+            next = current->forward[i].load(std::memory_order_acquire);
+        }
+    }
+
+    // while current is locked its successor can not be unlinked
+    SkipNode *next = current->forward[0].load(std::memory_order_acquire);
+    bool found = false;
+    if (next != NULL && equal(next->key, key)) {
+        found = locked_read(next, sequence, now, value_out);
+        if (found)
+            touch(next);
+    }
+    current->mtx.unlock();
+    return found;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::delete_element(const K& key) {
+    uint64_t start = _metrics.start();
+    uint64_t lsn = 0;
+    bool found = delete_logged(key, lsn);
+    log_commit(lsn);
+    _metrics.record(Stats::kDelete, found, start);
+    return found ? 0 : 1;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::delete_logged(const K& key, uint64_t& lsn, bool only_expired) {
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    std::string log_key;
+    if (_wal)
+        KeyCodec::encode(key, log_key);
+
+    std::shared_lock<std::shared_timed_mutex> gate(_gate);
+
+    // the level of the target is unknown, so every node of the path is kept
+    int top = lock_path(key, update, -1);
+
+    SkipNode *current = update[0]->forward[0].load(std::memory_order_acquire);
+    while (current != NULL && equal(current->key, key) && uncommitted(current)) {
+        // a batch is linking the key, its commit comes without any lock of the path
+        unlock_path(update, top);
+        std::this_thread::yield();
+        top = lock_path(key, update, -1);
+        current = update[0]->forward[0].load(std::memory_order_acquire);
+    }
+    if (current == NULL || !equal(current->key, key)) {
+        unlock_path(update, top);
+        return false;
+    }
+    bool deleted = current->tombstone;
+    bool gone = deleted || expired(current);
+    uint64_t seq = only_expired && !gone ? 0 : write_sequence();
+    if ((only_expired && !gone) || (deleted && seq != 0)) {
+        // a snapshot may read the versions behind the tombstone, see reclaim_versions
+        unlock_path(update, top);
+        return false;
+    }
+
+    if (seq != 0) {
+        // a snapshot may read the element, a tombstone replaces it
+        SkipNode *tombstone = create_node(current->node_level, current->key);
+        tombstone->tombstone = true;
+        replace_locked(update, current, tombstone, seq);
+        prune_versions(tombstone);
+    } else {
+        unlink_locked(update, current);
+    }
+    // a tombstone was counted and logged when it was linked
+    if (!deleted) {
+        _element_count --;
+        mark_dirty(key);
+        if (_wal && !gone)
+            lsn = _wal->append(kWalDelete, log_key, std::string());
+    }
+    unlock_path(update, top);
+
+    // optimistic readers may still be on the node
+    if (seq == 0)
+        retire_versions(current);
+    return !deleted && (only_expired || !gone);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::unlink_locked(SkipNode** update, SkipNode* node) {
+    lock_node(node);
+
+    uint32_t version = node->version.load(std::memory_order_relaxed);
+    node->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    node->marked.store(true, std::memory_order_release);
+
+    // unlink from the highest level of the node down to level 0
+    for (int i = node->node_level; i >= 0; i--) {
+        update[i]->forward[i].store(node->forward[i].load(std::memory_order_relaxed),
+                                    std::memory_order_release);
+    }
+
+    node->version.store(version + 2, std::memory_order_release);
+    node->mtx.unlock();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::reclaim_versions(const K& key) {
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    // held so no snapshot older than the one read below is taken meanwhile
+    std::shared_lock<std::shared_timed_mutex> gate(_gate);
+    int top = lock_path(key, update, -1);
+
+    SkipNode *current = update[0]->forward[0].load(std::memory_order_acquire);
+    if (current == NULL || !equal(current->key, key) || uncommitted(current)) {
+        unlock_path(update, top);
+        return;
+    }
+    if (current->tombstone && current->seq.load(std::memory_order_relaxed) <= _oldest_snapshot.load(std::memory_order_acquire)) {
+        // every snapshot reads the delete, the key is gone for all of them
+        unlink_locked(update, current);
+        unlock_path(update, top);
+        retire_versions(current);
+        return;
+    }
+    prune_versions(current);
+    unlock_path(update, top);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::WriteBatch::put(const K& key, const V& value, uint64_t ttl_ms) {
+    Change change = {false, key, value, ttl_ms == 0 ? 0 : wall_clock_ms() + ttl_ms};
+    _changes.push_back(std::move(change));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::WriteBatch::remove(const K& key) {
+    Change change = {true, key, V(), 0};
+    _changes.push_back(std::move(change));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::write(const WriteBatch& batch) {
+    typedef typename WriteBatch::Change Change;
+    const std::vector<Change>& changes = batch._changes;
+
+    // the keys are linked in order, so batches that share keys wait for each other in the
+    // same order, and only the last change of a key counts
+    std::vector<size_t> order = sorted_order(changes, [](const Change& c) -> const K& { return c.key; }, _compare);
+    std::vector<size_t> last;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i + 1 == order.size() || less(changes[order[i]].key, changes[order[i + 1]].key))
+            last.push_back(order[i]);
+    }
+
+    // batch : u32 changes | u8 op | u32 key bytes | key | u32 value bytes | value, see wal.h
+    std::string log_value;
+    if (_wal) {
+        std::string key;
+        std::string value;
+        put_fixed32(log_value, static_cast<uint32_t>(last.size()));
+        for (size_t idx : last) {
+            const Change& change = changes[idx];
+            key.clear();
+            value.clear();
+            KeyCodec::encode(change.key, key);
+            uint8_t op = kWalDelete;
+            if (!change.deleted) {
+                op = change.expire_at != 0 ? kWalPutExpire : kWalPut;
+                if (change.expire_at != 0)
+                    put_fixed64(value, change.expire_at);
+                ValueCodec::encode(change.value, value);
+            }
+            log_value.push_back(static_cast<char>(op));
+            put_fixed32(log_value, static_cast<uint32_t>(key.size()));
+            log_value.append(key);
+            put_fixed32(log_value, static_cast<uint32_t>(value.size()));
+            log_value.append(value);
+        }
+    }
+
+    // the keys whose versions replaced others, pruned once the batch committed
+    std::vector<size_t> replaced;
+    bool ok = true;
+    {
+        // held until the batch is stamped or reverted, a snapshot or a dump is taken before
+        // the batch or after it
+        std::shared_lock<std::shared_timed_mutex> gate(_gate);
+        std::vector<SkipNode*> linked;
+        for (size_t idx : last) {
+            SkipNode *version = link_uncommitted(changes[idx]);
+            if (version == NULL)
+                continue;
+            linked.push_back(version);
+            if (version->older.load(std::memory_order_relaxed) != NULL)
+                replaced.push_back(idx);
+        }
+        if (_wal && !linked.empty())
+            ok = _wal->commit(_wal->append(kWalBatch, std::string(), log_value));
+
+        if (ok) {
+            // the writers of the keys wait for this, nobody else replaces the versions
+            uint64_t seq = ++_sequence;
+            for (SkipNode* version : linked)
+                version->seq.store(seq, std::memory_order_release);
+        } else {
+            SKIPLIST_LOG(Error, "write: write-ahead log failed, the batch is reverted");
+            for (SkipNode* version : linked)
+                revert_uncommitted(version);
+            replaced.clear();
+        }
+    }
+    for (size_t idx : replaced)
+        reclaim_versions(changes[idx].key);
+    for (size_t idx : last)
+        _metrics.record(changes[idx].deleted ? Stats::kDelete : Stats::kPut, ok, 0);
+
+    if (over_budget())
+        evict();
+    return ok;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::link_uncommitted(const typename WriteBatch::Change& change) {
+    const K& key = change.key;
+    SkipNode *node = NULL;
+    if (!change.deleted) {
+        node = create_node(get_random_level(), key, change.value);
+        node->expire_at.store(change.expire_at, std::memory_order_relaxed);
+        node->seq.store(kSeqUncommitted, std::memory_order_relaxed);
+    }
+
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+    for (;;) {
+        // the version may replace the node of key, so the path is kept up to any level
+        int keep = std::max(node != NULL ? node->node_level : 0, _skip_list_level.load(std::memory_order_acquire));
+        int top = lock_path(key, update, keep);
+        for (int i = top+1; i < keep+1; i++)
+            update[i] = _header;
+
+        SkipNode *current = update[0]->forward[0].load(std::memory_order_acquire);
+        bool found = current != NULL && equal(current->key, key);
+        if (found && (uncommitted(current) || current->node_level > keep)) {
+            // another batch is linking the key, or the list grew above the kept path
+            unlock_path(update, keep);
+            std::this_thread::yield();
+            continue;
+        }
+        bool gone = !found || current->tombstone || expired(current);
+        if (change.deleted && gone) {
+            unlock_path(update, keep);
+            return NULL;
+        }
+
+        SkipNode *version = node;
+        if (found) {
+            // the version takes the place of current at every level, current stays behind it
+            if (change.deleted) {
+                version = create_node(current->node_level, key);
+                version->tombstone = true;
+                _element_count --;
+            } else {
+                if (node->node_level != current->node_level) {
+                    version = create_node(current->node_level, key, std::move(node->value));
+                    version->expire_at.store(change.expire_at, std::memory_order_relaxed);
+                    destroy_node(node);
+                }
+                if (current->tombstone)
+                    _element_count ++;
+            }
+            replace_locked(update, current, version, kSeqUncommitted);
+        } else {
+            int level = node->node_level;
+            if (level > top)
+                _skip_list_level.store(level, std::memory_order_release);
+            for (int i = 0; i <= level; i++)
+                node->forward[i].store(update[i]->forward[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            for (int i = 0; i <= level; i++)
+                update[i]->forward[i].store(node, std::memory_order_release);
+            _element_count ++;
+        }
+        mark_dirty(key);
+        unlock_path(update, keep);
+        return version;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::revert_uncommitted(SkipNode* version) {
+    SkipNode *update[_max_level+1];
+    memset(update, 0, sizeof(SkipNode*)*(_max_level+1));
+
+    // the writers of the key wait for the batch, version is still the node of its key
+    const K& key = version->key;
+    int top = lock_path(key, update, -1);
+    SkipNode *older = version->older.load(std::memory_order_relaxed);
+    if (older == NULL) {
+        unlink_locked(update, version);
+        _element_count --;
+        mark_dirty(key);
+        unlock_path(update, top);
+        retire_node(version);
+        return;
+    }
+
+    // readers may be on older as the version behind the uncommitted one, so it is never written
+    // or linked again, a copy of it is
+    SkipNode *restored = older->tombstone ? create_node(version->node_level, key)
+                                          : create_node(version->node_level, key, older->value);
+    restored->tombstone = older->tombstone;
+    restored->expire_at.store(older->expire_at.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    restored->seq.store(older->seq.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    restored->older.store(older->older.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    if (version->tombstone != older->tombstone)
+        _element_count += version->tombstone ? 1 : -1;
+
+    // like replace_locked, but the versions behind older stay behind the copy
+    lock_node(version);
+    for (int i = 0; i <= version->node_level; i++)
+        restored->forward[i].store(version->forward[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    version->version.store(version->version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = version->node_level; i >= 0; i--)
+        update[i]->forward[i].store(restored, std::memory_order_release);
+    version->mtx.unlock();
+    mark_dirty(key);
+    unlock_path(update, top);
+    retire_node(version);
+    retire_node(older);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::multi_get(const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+
+    int count = 0;
+    std::vector<size_t> retry;
+    {
+        EpochManager::Guard guard(_epoch);
+
+        SkipNode *update[_max_level+1];
+        for (int i = 0; i <= _max_level; i++)
+            update[i] = _header;
+
+        for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+            finger_path(keys[idx], update);
+            SkipNode *node = update[0]->forward[0].load(std::memory_order_acquire);
+            if (node == NULL || !equal(node->key, keys[idx]))
+                continue;
+            bool hit;
+            if (!read_version(node, kSeqLatest, 0, values[idx], hit)) {
+                retry.push_back(idx);
+            } else if (hit) {
+                touch(node);
+                found[idx] = true;
+                count++;
+            }
+        }
+    }
+
+    // a writer was changing these nodes, wait for it on the locked path
+    for (size_t idx : retry) {
+        if (locked_search(keys[idx], values[idx], kSeqLatest, 0)) {
+            found[idx] = true;
+            count++;
+        }
+    }
+    for (size_t idx = 0; idx < keys.size(); idx++)
+        _metrics.record(Stats::kGet, found[idx], 0);
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::multi_insert(const std::vector<std::pair<K, V> >& elements) {
+    int count = 0;
+    uint64_t lsn = 0;
+    for (size_t idx : sorted_order(elements, [](const std::pair<K, V>& e) -> const K& { return e.first; }, _compare)) {
+        bool inserted = insert_logged(lsn, false, 0, elements[idx].first, elements[idx].second) == 0;
+        if (inserted)
+            count++;
+        _metrics.record(Stats::kPut, inserted, 0);
+    }
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::multi_delete(const std::vector<K>& keys) {
+    int count = 0;
+    uint64_t lsn = 0;
+    for (size_t idx : sorted_order(keys, [](const K& key) -> const K& { return key; }, _compare)) {
+        bool deleted = delete_logged(keys[idx], lsn);
+        if (deleted)
+            count++;
+        _metrics.record(Stats::kDelete, deleted, 0);
+    }
+    log_commit(lsn);
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename InputIt>
+int tSkipList<K, V, Compare, Serializer, Alloc>::bulk_load(InputIt first, InputIt last) {
+    // writers all start at _header, holding it keeps them out while the list is built
+    _gate.lock_shared();
+    lock_node(this->_header);
+    if (_header->forward[0].load() != NULL) {
+        this->_header->mtx.unlock();
+        _gate.unlock_shared();
+        std::vector<std::pair<K, V> > elements(first, last);
+        return multi_insert(elements);
+    }
+
+    // tail[i] is the last node of level i
+    SkipNode *tail[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        tail[i] = _header;
+
+    // the elements are new to a snapshot taken before
+    const uint64_t seq = write_sequence();
+    int count = 0;
+    uint64_t lsn = 0;
+    std::string log_key;
+    std::string log_value;
+    for (; first != last; ++first) {
+        const K& key = first->first;
+        const V& value = first->second;
+
+        // appending is only valid while the keys keep growing
+        if (tail[0] != _header && !less(tail[0]->key, key))
+            break;
+        int level = get_random_level();
+        SkipNode *node = create_node(level, key, value);
+        node->seq.store(seq, std::memory_order_relaxed);
+        if (level > _skip_list_level.load(std::memory_order_relaxed))
+            _skip_list_level.store(level, std::memory_order_release);
+        for (int i = 0; i <= level; i++) {
+            tail[i]->forward[i].store(node, std::memory_order_release);
+            tail[i] = node;
+        }
+        _element_count ++;
+        count++;
+        if (_wal) {
+            log_key.clear();
+            log_value.clear();
+            KeyCodec::encode(key, log_key);
+            ValueCodec::encode(value, log_value);
+            lsn = _wal->append(kWalPut, log_key, log_value);
+        }
+    }
+    this->_header->mtx.unlock();
+    _gate.unlock_shared();
+    log_commit(lsn);
+    if (over_budget())
+        evict();
+
+    if (first != last) {
+        std::vector<std::pair<K, V> > rest(first, last);
+        count += multi_insert(rest);
+    }
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+size_t tSkipList<K, V, Compare, Serializer, Alloc>::expire_step(size_t max_nodes) {
+    std::lock_guard<std::mutex> lock(_sweep_mutex);
+
+    // the keys are collected without a lock and deleted afterwards, one path at a time, and
+    // so are the keys with versions a snapshot may have needed; while a snapshot is held the
+    // delete links a tombstone, and the expired version stays behind it until every snapshot
+    // reads the tombstone, see prune_versions and reclaim_versions
+    std::vector<K> keys;
+    std::vector<K> versioned;
+    {
+        EpochManager::Guard guard(_epoch);
+
+        SkipNode *node = _sweep_from_start ? _header->forward[0].load(std::memory_order_acquire)
+                                           : node_after(_sweep_key);
+
+        const uint64_t now = wall_clock_ms();
+        for (size_t n = 0; node != NULL && n < max_nodes; n++) {
+            if (!node->marked.load(std::memory_order_acquire)) {
+                if (node->tombstone || node->older.load(std::memory_order_relaxed) != NULL)
+                    versioned.push_back(node->key);
+                if (!node->tombstone && expired(node, now))
+                    keys.push_back(node->key);
+            }
+            _sweep_key = node->key;
+            node = node->forward[0].load(std::memory_order_acquire);
+        }
+        _sweep_from_start = node == NULL;
+    }
+
+    size_t count = 0;
+    uint64_t lsn = 0;
+    for (const K& key : keys) {
+        if (delete_logged(key, lsn, true))
+            count++;
+    }
+    log_commit(lsn);
+    for (const K& key : versioned)
+        reclaim_versions(key);
+    return count;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::node_after(const K& key) {
+    SkipNode *current = _header;
+    for (int i = _skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+        SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+        while (next != NULL && !less(key, next->key)) {
+            current = next;
+            next = current->forward[i].load(std::memory_order_acquire);
+        }
+    }
+    return current->forward[0].load(std::memory_order_acquire);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::evict() {
+    // the writer that finds another one evicting goes on, the budget is approximate
+    std::unique_lock<std::mutex> lock(_clock_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+
+    // a full turn clears every bit, so the second one finds victims unless all were read again
+    size_t limit = 2 * static_cast<size_t>(std::max(0, _element_count.load())) + 1;
+    size_t visited = 0;
+    uint64_t lsn = 0;
+    while (over_budget() && visited < limit) {
+        int64_t excess = _memory_bytes.load(std::memory_order_relaxed)
+                       - static_cast<int64_t>(_memory_budget.load(std::memory_order_relaxed));
+
+        // the victims are collected without a lock and deleted afterwards, like expire_step
+        std::vector<K> victims;
+        bool from_start = _hand_from_start;
+        size_t before = visited;
+        {
+            EpochManager::Guard guard(_epoch);
+            SkipNode *node = _hand_from_start ? _header->forward[0].load(std::memory_order_acquire)
+                                              : node_after(_hand_key);
+            const uint64_t now = wall_clock_ms();
+            int64_t freed = 0;
+            while (node != NULL && freed < excess && visited < limit) {
+                if (!node->marked.load(std::memory_order_acquire) && !node->tombstone && !uncommitted(node)) {
+                    if (expired(node, now) || !node->referenced.load(std::memory_order_relaxed)) {
+                        victims.push_back(node->key);
+                        freed += static_cast<int64_t>(node->bytes);
+                    } else {
+                        node->referenced.store(false, std::memory_order_relaxed);
+                    }
+                }
+                _hand_key = node->key;
+                node = node->forward[0].load(std::memory_order_acquire);
+                visited++;
+            }
+            _hand_from_start = node == NULL;
+        }
+
+        // an empty list can not get below the budget
+        if (from_start && visited == before)
+            break;
+        for (const K& key : victims) {
+            if (delete_logged(key, lsn))
+                _evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    log_commit(lsn);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::start_expiry(int interval_ms, size_t max_nodes) {
+    std::lock_guard<std::mutex> lock(_sweeper_mutex);
+    if (_sweeper.joinable())
+        return false;
+    _sweeper_stop = false;
+    _sweeper = std::thread(&tSkipList<K, V, Compare, Serializer, Alloc>::expiry_loop, this, interval_ms, max_nodes);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::stop_expiry() {
+    std::thread sweeper;
+    {
+        std::lock_guard<std::mutex> lock(_sweeper_mutex);
+        _sweeper_stop = true;
+        sweeper = std::move(_sweeper);
+    }
+    _sweeper_cond.notify_all();
+    if (sweeper.joinable())
+        sweeper.join();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::expiry_loop(int interval_ms, size_t max_nodes) {
+    std::unique_lock<std::mutex> lock(_sweeper_mutex);
+    while (!_sweeper_stop) {
+        _sweeper_cond.wait_for(lock, std::chrono::milliseconds(interval_ms));
+        if (_sweeper_stop)
+            break;
+        lock.unlock();
+        expire_step(max_nodes);
+        lock.lock();
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::reclaim(void* node, void* ctx) {
+    static_cast<tSkipList<K, V, Compare, Serializer, Alloc>*>(ctx)->free_node(static_cast<SkipNode*>(node));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::retire_node(SkipNode* node) {
+    _memory_bytes.fetch_sub(static_cast<int64_t>(node->bytes), std::memory_order_relaxed);
+    _epoch.retire(node, &tSkipList<K, V, Compare, Serializer, Alloc>::reclaim, this);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::charge_node(SkipNode* node) {
+    size_t bytes = SkipNode::size_of(node->node_level) + HeapBytes<K>::of(node->key) + HeapBytes<V>::of(node->value);
+    _memory_bytes.fetch_add(static_cast<int64_t>(bytes) - static_cast<int64_t>(node->bytes), std::memory_order_relaxed);
+    node->bytes = bytes;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot tSkipList<K, V, Compare, Serializer, Alloc>::snapshot() {
+    // once the gate is held every write numbered so far is linked and the later ones will
+    // see the snapshot and keep the versions they replace
+    std::unique_lock<std::shared_timed_mutex> gate(_gate);
+    return register_snapshot(wall_clock_ms());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<typename tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot> tSkipList<K, V, Compare, Serializer, Alloc>::snapshot_all(const std::vector<tSkipList*>& lists) {
+    // no list has a write in progress while all gates are held, so the snapshots are of one
+    // point in time
+    std::vector<std::unique_lock<std::shared_timed_mutex> > gates;
+    gates.reserve(lists.size());
+    for (tSkipList* list : lists)
+        gates.emplace_back(list->_gate);
+    const uint64_t now = wall_clock_ms();
+    std::vector<Snapshot> snapshots;
+    snapshots.reserve(lists.size());
+    for (tSkipList* list : lists)
+        snapshots.push_back(list->register_snapshot(now));
+    return snapshots;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot tSkipList<K, V, Compare, Serializer, Alloc>::register_snapshot(uint64_t now) {
+    uint64_t sequence = _sequence.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(_snapshot_mutex);
+    _snapshots.insert(sequence);
+    _snapshot_count.store(_snapshots.size(), std::memory_order_relaxed);
+    _oldest_snapshot.store(*_snapshots.begin(), std::memory_order_release);
+    return Snapshot(this, sequence, now);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::release_snapshot(uint64_t sequence) {
+    // the writers find out without the gate, one that keeps a version too many prunes it
+    std::lock_guard<std::mutex> lock(_snapshot_mutex);
+    _snapshots.erase(_snapshots.find(sequence));
+    _snapshot_count.store(_snapshots.size(), std::memory_order_relaxed);
+    _oldest_snapshot.store(_snapshots.empty() ? kSeqLatest : *_snapshots.begin(), std::memory_order_release);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot& tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot::operator=(Snapshot&& other) noexcept {
+    if (this != &other) {
+        release();
+        _list = other._list;
+        _sequence = other._sequence;
+        _now = other._now;
+        other._list = NULL;
+    }
+    return *this;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::Snapshot::release() {
+    if (_list != NULL) {
+        _list->release_snapshot(_sequence);
+        _list = NULL;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::Iterator tSkipList<K, V, Compare, Serializer, Alloc>::new_iterator(bool consistent) {
+    return Iterator(this, consistent);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::Iterator tSkipList<K, V, Compare, Serializer, Alloc>::new_iterator(const Snapshot& snapshot) {
+    return Iterator(this, snapshot);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::Iterator(tSkipList* list, bool consistent)
+    : _list(list), _snapshot(consistent ? list->snapshot() : Snapshot()),
+      _sequence(consistent ? _snapshot.sequence() : kSeqLatest), _now(_snapshot.now()), _guard(list->_epoch), _node(NULL) {}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::Iterator(tSkipList* list, const Snapshot& snapshot)
+    : _list(list), _sequence(snapshot.sequence()), _now(snapshot.now()), _guard(list->_epoch), _node(NULL) {}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek_to_first() {
+    arrive(_list->_header->forward[0].load(std::memory_order_acquire));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::seek(const K& key) {
+    SkipNode *current = _list->_header;
+    for (int i = _list->_skip_list_level.load(std::memory_order_acquire); i >= 0; i--) {
+        SkipNode *next = current->forward[i].load(std::memory_order_acquire);
+        while (next != NULL && _list->less(next->key, key)) {
+            current = next;
+            next = current->forward[i].load(std::memory_order_acquire);
+        }
+    }
+    arrive(current->forward[0].load(std::memory_order_acquire));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::next() {
+    arrive(_node->forward[0].load(std::memory_order_acquire));
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::Iterator::arrive(SkipNode* node) {
+    while (node != NULL) {
+        bool found;
+        if (!_list->read_version(node, _sequence, _now, _value, found)) {
+            // a writer is changing the node, read it under the node lock
+            found = _list->locked_read(node, _sequence, _now, _value);
+        }
+        if (found) {
+            _key = node->key;
+            break;
+        }
+        // a deleted or replaced node still points into the list
+        node = node->forward[0].load(std::memory_order_acquire);
+    }
+    _node = node;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<std::pair<K, V> > tSkipList<K, V, Compare, Serializer, Alloc>::range(const K& lo, const K& hi, size_t limit, bool consistent) {
+    if (consistent)
+        return range(lo, hi, limit, snapshot());
+    uint64_t start = _metrics.start();
+    std::vector<std::pair<K, V> > out;
+    {
+        Iterator it(this, false);
+        for (it.seek(lo); it.valid() && less(it.key(), hi); it.next()) {
+            if (limit != 0 && out.size() >= limit)
+                break;
+            out.emplace_back(it.key(), it.value());
+        }
+    }
+    _metrics.record(Stats::kScan, !out.empty(), start);
+    return out;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<std::pair<K, V> > tSkipList<K, V, Compare, Serializer, Alloc>::range(const K& lo, const K& hi, size_t limit, const Snapshot& snapshot) {
+    uint64_t start = _metrics.start();
+    std::vector<std::pair<K, V> > out;
+    {
+        Iterator it(this, snapshot);
+        for (it.seek(lo); it.valid() && less(it.key(), hi); it.next()) {
+            if (limit != 0 && out.size() >= limit)
+                break;
+            out.emplace_back(it.key(), it.value());
+        }
+    }
+    _metrics.record(Stats::kScan, !out.empty(), start);
+    return out;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::dump_file(const std::string& path) {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    EpochManager::Guard guard(_epoch);
+
+    // a change logged before the rotation was applied before it, so the walk below sees it;
+    // changes logged after it are in the new segment and replay on top of the snapshot
+    uint64_t segment = _wal ? _wal->rotate() : 0;
+    uint64_t sequence = dump_sequence();
+
+    // the snapshot replaces the checkpoint at path, with its deltas
+    if (path == _checkpoint_path)
+        _checkpoint_path.clear();
+    if (!write_snapshot(path, sequence, true))
+        return false;
+    if (_wal)
+        _wal->remove_segments_before(segment);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::dump_file_async(const std::string& path) {
+    if (_dump_result.valid()
+        && _dump_result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+    _dump_result = std::async(std::launch::async, &tSkipList<K, V, Compare, Serializer, Alloc>::background_dump, this, path);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::wait_dump() {
+    if (!_dump_result.valid())
+        return true;
+    return _dump_result.get();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::background_dump(std::string path) {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+
+    // rotate before the fork for the same reason as in dump_file
+    uint64_t segment = _wal ? _wal->rotate() : 0;
+    uint64_t sequence = dump_sequence();
+    if (path == _checkpoint_path)
+        _checkpoint_path.clear();
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        // only this thread exists in the child, any mutex held by another one stays locked,
+        // and nothing is freed: destructors and exit handlers are skipped
+        _exit(write_snapshot(path, sequence, false) ? 0 : 1);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return false;
+    if (_wal)
+        _wal->remove_segments_before(segment);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::checkpoint(const std::string& path) {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    EpochManager::Guard guard(_epoch);
+
+    uint64_t base_records = 0;
+    uint64_t delta_records = 0;
+    for (uint64_t records : _checkpoint.records)
+        base_records += records;
+    for (uint64_t records : _checkpoint.delta_records)
+        delta_records += records;
+    bool base = path != _checkpoint_path || _checkpoint.deltas.size() >= _max_deltas
+                || delta_records * 100 > base_records * _max_delta_percent;
+    if (base && !_tracking.load()) {
+        // no writer is between its change and its log record once it holds the gate, every
+        // change logged after the rotation below is recorded
+        std::unique_lock<std::shared_timed_mutex> gate(_gate);
+        _tracking.store(true);
+    }
+
+    // a key changed before the rotation was recorded before it, so it is in the keys taken
+    // below or was in the base; later changes are in the new segment and replay on top
+    uint64_t segment = _wal ? _wal->rotate() : 0;
+    std::vector<K> keys = take_dirty();
+    uint64_t sequence = dump_sequence();
+    // a failed checkpoint lost the keys it took, the next one must be a base
+    _checkpoint_path.clear();
+
+    SnapshotManifest manifest;
+    if (base) {
+        if (!write_snapshot(path, sequence, true, &manifest))
+            return false;
+    } else {
+        manifest = _checkpoint;
+        std::string delta = snapshot_delta_path(path, manifest.generation, manifest.deltas.size());
+        uint64_t count = 0;
+        if (!write_delta(delta, keys, sequence, count))
+            return false;
+        manifest.deltas.push_back(delta);
+        manifest.delta_records.push_back(count);
+        if (!write_manifest(path, manifest)) {
+            ::unlink(delta.c_str());
+            return false;
+        }
+    }
+    _checkpoint_path = path;
+    _checkpoint = manifest;
+    if (_wal)
+        _wal->remove_segments_before(segment);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::set_checkpoint_compaction(size_t max_deltas, unsigned max_percent) {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    _max_deltas = max_deltas;
+    _max_delta_percent = max_percent;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::record_dirty(const K& key) {
+    DirtyKeys& dirty = _dirty[std::hash<std::thread::id>()(std::this_thread::get_id()) % kDirtyStripes];
+    std::lock_guard<std::mutex> lock(dirty.mtx);
+    dirty.keys.push_back(key);
+    if (dirty.keys.size() >= dirty.compact_at) {
+        sort_unique(dirty.keys);
+        size_t twice = 2 * dirty.keys.size();
+        dirty.compact_at = twice > kMinCompact ? twice : kMinCompact;
+    }
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<K> tSkipList<K, V, Compare, Serializer, Alloc>::take_dirty() {
+    std::vector<K> keys;
+    for (size_t i = 0; i < kDirtyStripes; ++i) {
+        std::vector<K> stripe;
+        {
+            std::lock_guard<std::mutex> lock(_dirty[i].mtx);
+            stripe.swap(_dirty[i].keys);
+            _dirty[i].compact_at = kMinCompact;
+        }
+        keys.insert(keys.end(), stripe.begin(), stripe.end());
+    }
+    // a key changed on several threads is in several stripes
+    sort_unique(keys);
+    return keys;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::sort_unique(std::vector<K>& keys) const {
+    std::sort(keys.begin(), keys.end(), _compare);
+    keys.erase(std::unique(keys.begin(), keys.end(), [this](const K& a, const K& b) { return equal(a, b); }),
+               keys.end());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::write_delta(const std::string& path, const std::vector<K>& keys, uint64_t sequence, uint64_t& count) {
+    SnapshotWriter writer;
+    writer.set_compression(_compression.load(std::memory_order_relaxed));
+    if (!writer.open(path))
+        return false;
+
+    std::string key;
+    std::string value;
+    V element;
+    count = 0;
+    const uint64_t now = wall_clock_ms();
+    SkipNode *update[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        update[i] = _header;
+    for (const K& k : keys) {
+        // the keys are sorted, the search goes on from the path of the one before
+        finger_path(k, update);
+        SkipNode *node = update[0]->forward[0].load(std::memory_order_acquire);
+        uint64_t expire_at = 0;
+        bool found = node != NULL && equal(node->key, k)
+                     && dump_version(node, sequence, now, true, element, expire_at);
+
+        key.clear();
+        KeyCodec::encode(k, key);
+        bool ok;
+        if (found) {
+            value.clear();
+            ValueCodec::encode(element, value);
+            ok = writer.add(node->node_level, key, value, expire_at);
+        } else {
+            ok = writer.add_deleted(key);
+        }
+        if (!ok)
+            return false;
+        count++;
+    }
+    return writer.finish(count, _skip_list_level.load());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::set_snapshot_threads(unsigned threads) {
+    _snapshot_threads.store(threads, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::set_compression(Compression compression) {
+    _compression.store(compression, std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+size_t tSkipList<K, V, Compare, Serializer, Alloc>::snapshot_threads() const {
+    unsigned threads = _snapshot_threads.load(std::memory_order_relaxed);
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::write_snapshot(const std::string& path, uint64_t sequence, bool may_lock, SnapshotManifest* base) {
+    // a segment of fewer elements costs more in files and threads than it saves
+    const size_t kMinSegmentElements = 64 * 1024;
+    size_t parts = std::min(snapshot_threads(), static_cast<size_t>(_element_count.load()) / kMinSegmentElements);
+    std::vector<SkipNode*> bounds = split_points(parts);
+
+    SnapshotManifest old;
+    bool replaces_manifest = read_manifest(path, old);
+    SnapshotManifest manifest;
+    if (bounds.empty() && base == NULL) {
+        uint64_t count = 0;
+        if (!write_range(path, NULL, NULL, sequence, may_lock, count))
+            return false;
+    } else {
+        // the nodes stay readable for the workers while the caller holds its epoch, and a
+        // forked child frees nothing
+        parts = bounds.size() + 1;
+        manifest.generation = old.generation + 1;
+        manifest.records.resize(parts);
+        for (size_t i = 0; i < parts; ++i)
+            manifest.segments.push_back(snapshot_segment_path(path, manifest.generation, i));
+        std::vector<char> done(parts, 0);
+        auto work = [&](size_t i) {
+            done[i] = write_range(manifest.segments[i], i == 0 ? NULL : bounds[i - 1],
+                                  i + 1 < parts ? bounds[i] : NULL, sequence, may_lock, manifest.records[i]);
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < parts; ++i)
+            workers.emplace_back(work, i);
+        work(0);
+        for (auto& worker : workers)
+            worker.join();
+        if (std::find(done.begin(), done.end(), 0) != done.end() || !write_manifest(path, manifest))
+            return false;
+    }
+    if (replaces_manifest)
+        remove_stale_segments(old, manifest);
+    if (base != NULL)
+        *base = manifest;
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::write_range(const std::string& path, SkipNode* from, const SkipNode* to, uint64_t sequence, bool may_lock, uint64_t& count) {
+    SnapshotWriter writer;
+    writer.set_compression(_compression.load(std::memory_order_relaxed));
+    if (!writer.open(path))
+        return false;
+
+    std::string key;
+    std::string value;
+    V element;
+    uint64_t expire_at = 0;
+    count = 0;
+    const uint64_t now = wall_clock_ms();
+    SkipNode *node = from != NULL ? from : this->_header->forward[0].load(std::memory_order_acquire);
+
+    // a bound that was deleted meanwhile still has its key, the ranges neither overlap nor miss
+    while (node != NULL && (to == NULL || less(node->key, to->key))) {
+        if (dump_version(node, sequence, now, may_lock, element, expire_at)) {
+            key.clear();
+            value.clear();
+            KeyCodec::encode(node->key, key);
+            ValueCodec::encode(element, value);
+            if (!writer.add(node->node_level, key, value, expire_at))
+                return false;
+            count++;
+        }
+        node = node->forward[0].load(std::memory_order_acquire);
+    }
+    return writer.finish(count, _skip_list_level.load());
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+uint64_t tSkipList<K, V, Compare, Serializer, Alloc>::dump_sequence() {
+    // a batch holds the gate from its first link until it is stamped or reverted
+    std::unique_lock<std::shared_timed_mutex> gate(_gate);
+    return _sequence.load(std::memory_order_relaxed);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::dump_version(SkipNode* node, uint64_t sequence, uint64_t now, bool may_lock, V& value_out, uint64_t& expire_at) {
+    if (node->marked.load(std::memory_order_acquire))
+        return false;
+    SkipNode *version = version_at(node, sequence);
+    if (version == NULL)
+        version = version_at(node, kSeqLatest);
+    if (version == NULL)
+        return false;
+    if (version != node) {
+        // the versions behind node are never changed
+        if (version->tombstone || expired(version, now))
+            return false;
+        value_out = version->value;
+        expire_at = version->expire_at.load(std::memory_order_relaxed);
+        return true;
+    }
+
+    bool found;
+    if (optimistic_read(node, now, value_out, found, &expire_at))
+        return found;
+    if (!may_lock)
+        return false;
+    lock_node(node);
+    found = !node->marked.load(std::memory_order_relaxed) && !node->tombstone && !expired(node, now);
+    if (found) {
+        value_out = node->value;
+        expire_at = node->expire_at.load(std::memory_order_relaxed);
+    }
+    node->mtx.unlock();
+    return found;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+std::vector<typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode*> tSkipList<K, V, Compare, Serializer, Alloc>::split_points(size_t parts) {
+    std::vector<SkipNode*> bounds;
+    if (parts <= 1)
+        return bounds;
+    // the highest level with enough nodes, a node of level i stands for about branching^i
+    // nodes of level 0, so the ranges between its nodes are of about the same size
+    std::vector<SkipNode*> nodes;
+    for (int level = _skip_list_level.load(std::memory_order_acquire); level > 0; level--) {
+        nodes.clear();
+        for (SkipNode* node = _header->forward[level].load(std::memory_order_acquire); node != NULL;
+             node = node->forward[level].load(std::memory_order_acquire)) {
+            if (!node->marked.load(std::memory_order_acquire))
+                nodes.push_back(node);
+        }
+        if (nodes.size() >= parts) {
+            for (size_t i = 1; i < parts; ++i)
+                bounds.push_back(nodes[nodes.size() * i / parts]);
+            break;
+        }
+    }
+    return bounds;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::load_file(const std::string& path, bool use_mmap) {
+    std::lock_guard<std::mutex> lock(_file_mutex);
+    // the list is no longer what the checkpoint and its recorded keys describe
+    _checkpoint_path.clear();
+    if (is_manifest_file(path))
+        return load_segments(path, use_mmap);
+    if (!is_snapshot_file(path))
+        return load_text_file(path);
+    return load_snapshot(path, use_mmap);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::load_snapshot(const std::string& path, bool use_mmap, bool delta) {
+    // zero copy types must reference the mapping, there is no buffer that outlives the load
+    const bool zero_copy = KeyCodec::kZeroCopy || ValueCodec::kZeroCopy;
+    SnapshotReader reader;
+    if (!reader.open(path, use_mmap || zero_copy, zero_copy))
+        return false;
+
+    // writers all start at _header, holding it keeps them out while the list is built
+    _gate.lock_shared();
+    lock_node(this->_header);
+
+    // tail[i] is the last node of level i, records arrive in key order
+    SkipNode *tail[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        tail[i] = _header;
+    bool append = _header->forward[0].load() == NULL;
+    const uint64_t seq = append ? write_sequence() : 0;
+    if (!append) {
+        this->_header->mtx.unlock();
+        _gate.unlock_shared();
+    }
+
+    SnapshotRecord record;
+    K key;
+    V value;
+    bool ok = true;
+    const uint64_t now = wall_clock_ms();
+    uint64_t lsn = 0;
+    while (reader.next(record)) {
+        // in a delta, an element that expired meanwhile still deletes the one of the base
+        bool gone = record.deleted || (record.expire_at != 0 && record.expire_at <= now);
+        if (gone && !delta)
+            continue;
+        if (!KeyCodec::decode(record.key, record.key_size, key)
+            || (!gone && !ValueCodec::decode(record.value, record.value_size, value))) {
+            ok = false;
+            break;
+        }
+
+        // appending is only valid while the keys keep growing, then a tombstone has no key
+        // to delete
+        if (append && (tail[0] == _header || less(tail[0]->key, key))) {
+            if (gone)
+                continue;
+            int level = record.level > _max_level ? _max_level : record.level;
+            SkipNode *node = create_node(level, key, value);
+            node->expire_at.store(record.expire_at, std::memory_order_relaxed);
+            node->seq.store(seq, std::memory_order_relaxed);
+            if (level > _skip_list_level.load(std::memory_order_relaxed))
+                _skip_list_level.store(level, std::memory_order_release);
+            for (int i = 0; i <= level; i++) {
+                tail[i]->forward[i].store(node, std::memory_order_release);
+                tail[i] = node;
+            }
+            _element_count ++;
+        } else {
+            if (append) {
+                append = false;
+                this->_header->mtx.unlock();
+                _gate.unlock_shared();
+            }
+            if (gone)
+                delete_logged(key, lsn);
+            else
+                insert_logged(lsn, delta, record.expire_at, key, value);
+        }
+    }
+    if (append) {
+        this->_header->mtx.unlock();
+        _gate.unlock_shared();
+    }
+    log_commit(lsn);
+    if (zero_copy)
+        _mappings.push_back(reader.release_mapping());
+    return ok && reader.ok();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::load_segments(const std::string& path, bool use_mmap) {
+    SnapshotManifest manifest;
+    if (!read_manifest(path, manifest)) {
+        SKIPLIST_LOG(Error, "load_file: bad manifest " << path);
+        return false;
+    }
+
+    _gate.lock_shared();
+    lock_node(this->_header);
+    if (_header->forward[0].load() != NULL) {
+        // the runs can only be linked into an empty list, the others insert segment by segment
+        this->_header->mtx.unlock();
+        _gate.unlock_shared();
+        for (const std::string& segment : manifest.segments) {
+            if (!load_snapshot(segment, use_mmap))
+                return false;
+        }
+        for (const std::string& delta : manifest.deltas) {
+            if (!load_snapshot(delta, use_mmap, true))
+                return false;
+        }
+        return true;
+    }
+
+    const bool zero_copy = KeyCodec::kZeroCopy || ValueCodec::kZeroCopy;
+    const uint64_t seq = write_sequence();
+    size_t count = manifest.segments.size();
+    std::vector<Run> runs(count);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+            build_run(manifest.segments[i], use_mmap, zero_copy, seq, runs[i]);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(snapshot_threads(), count); ++i)
+        workers.emplace_back(work);
+    work();
+    for (auto& worker : workers)
+        worker.join();
+
+    // every run is sorted, the segments must be too
+    bool ok = true;
+    SkipNode* last = NULL;
+    for (Run& run : runs) {
+        ok = ok && run.ok;
+        if (ok && run.head[0] != NULL) {
+            ok = last == NULL || less(last->key, run.head[0]->key);
+            last = run.tail[0];
+        }
+    }
+
+    SkipNode *tail[_max_level+1];
+    for (int i = 0; i <= _max_level; i++)
+        tail[i] = _header;
+    for (Run& run : runs) {
+        if (!ok) {
+            for (SkipNode* node = run.head[0]; node != NULL; ) {
+                SkipNode* next_node = node->forward[0].load(std::memory_order_relaxed);
+                destroy_node(node);
+                node = next_node;
+            }
+            continue;
+        }
+        for (int i = 0; i <= run.level; i++) {
+            tail[i]->forward[i].store(run.head[i], std::memory_order_release);
+            tail[i] = run.tail[i];
+        }
+        if (run.level > _skip_list_level.load(std::memory_order_relaxed))
+            _skip_list_level.store(run.level, std::memory_order_release);
+        _element_count += run.count;
+        if (run.mapping)
+            _mappings.push_back(std::move(run.mapping));
+    }
+    this->_header->mtx.unlock();
+    _gate.unlock_shared();
+
+    // the deltas change the base in the order they were written
+    for (size_t i = 0; ok && i < manifest.deltas.size(); ++i)
+        ok = load_snapshot(manifest.deltas[i], use_mmap, true);
+    return ok;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::build_run(const std::string& path, bool use_mmap, bool zero_copy, uint64_t seq, Run& run) {
+    run.head.assign(_max_level + 1, NULL);
+    run.tail.assign(_max_level + 1, NULL);
+    run.level = -1;
+    run.count = 0;
+    run.ok = false;
+
+    SnapshotReader reader;
+    if (!reader.open(path, use_mmap || zero_copy, zero_copy)) {
+        SKIPLIST_LOG(Error, "load_file: " << path << ": " << reader.error());
+        return;
+    }
+    SnapshotRecord record;
+    K key;
+    V value;
+    bool ok = true;
+    const uint64_t now = wall_clock_ms();
+    while (reader.next(record)) {
+        if (record.expire_at != 0 && record.expire_at <= now)
+            continue;
+        if (record.deleted || !KeyCodec::decode(record.key, record.key_size, key)
+            || !ValueCodec::decode(record.value, record.value_size, value)
+            || (run.tail[0] != NULL && !less(run.tail[0]->key, key))) {
+            ok = false;
+            break;
+        }
+        int level = record.level > _max_level ? _max_level : record.level;
+        SkipNode *node = create_node(level, key, value);
+        node->expire_at.store(record.expire_at, std::memory_order_relaxed);
+        node->seq.store(seq, std::memory_order_relaxed);
+        for (int i = 0; i <= level; i++) {
+            if (run.tail[i] != NULL)
+                run.tail[i]->forward[i].store(node, std::memory_order_relaxed);
+            else
+                run.head[i] = node;
+            run.tail[i] = node;
+        }
+        if (level > run.level)
+            run.level = level;
+        run.count++;
+    }
+    if (!ok || !reader.ok())
+        SKIPLIST_LOG(Error, "load_file: " << path << ": " << (ok ? reader.error() : "bad record"));
+    run.ok = ok && reader.ok();
+    if (zero_copy)
+        run.mapping = reader.release_mapping();
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::open_wal(const std::string& path, SyncPolicy policy, int interval_ms) {
+    std::unique_ptr<WriteAheadLog> wal(new WriteAheadLog(path, policy, interval_ms));
+    wal->set_compression(_compression.load(std::memory_order_relaxed));
+    // _wal is still NULL, the replayed changes are not logged again
+    bool ok = wal->replay([this](uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size) {
+        return apply_record(op, k, k_size, v, v_size);
+    }, KeyCodec::kZeroCopy || ValueCodec::kZeroCopy);
+    if (KeyCodec::kZeroCopy || ValueCodec::kZeroCopy) {
+        std::vector<std::unique_ptr<MappedFile> > mappings = wal->release_mappings();
+        for (auto& mapping : mappings)
+            _mappings.push_back(std::move(mapping));
+    }
+    if (!ok || !wal->open())
+        return false;
+    _wal = std::move(wal);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::set_log_listener(WalListener listener) {
+    if (!_wal)
+        return false;
+    _wal->set_listener(std::move(listener));
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+uint64_t tSkipList<K, V, Compare, Serializer, Alloc>::log_lsn() {
+    return _wal ? _wal->last_lsn() : 0;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::export_snapshot(const std::string& path, uint64_t& lsn) {
+    EpochManager::Guard guard(_epoch);
+    // a change is applied before it is logged and a batch is stamped once the gate is free,
+    // the walk below sees every change up to lsn
+    lsn = log_lsn();
+    uint64_t sequence = dump_sequence();
+    uint64_t count = 0;
+    return write_range(path, NULL, NULL, sequence, true, count);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::apply_log(const char* data, size_t size, uint64_t& applied_lsn) {
+    static_assert(!KeyCodec::kZeroCopy && !ValueCodec::kZeroCopy, "apply_log copies keys and values out of the batch");
+    return read_wal_batch(data, size, [&](uint64_t lsn, uint8_t op, const char* k, size_t k_size,
+                                          const char* v, size_t v_size) {
+        if (lsn <= applied_lsn)
+            return true;
+        if (!apply_record(op, k, k_size, v, v_size))
+            return false;
+        applied_lsn = lsn;
+        return true;
+    });
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::log_commit(uint64_t lsn) {
+    if (lsn != 0 && !_wal->commit(lsn))
+        SKIPLIST_LOG(Error, "log_commit: write-ahead log failed");
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::apply_record(uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size) {
+    if (op == kWalBatch) {
+        // the changes are applied together again, see write
+        WriteBatch batch;
+        const char* end = v + v_size;
+        if (v_size < 4)
+            return false;
+        uint32_t count = get_fixed32(v);
+        const char* p = v + 4;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (end - p < 9)
+                return false;
+            uint8_t change_op = static_cast<uint8_t>(p[0]);
+            uint32_t key_size = get_fixed32(p + 1);
+            p += 5;
+            if (static_cast<size_t>(end - p) < static_cast<size_t>(key_size) + 4)
+                return false;
+            const char* key = p;
+            p += key_size;
+            uint32_t value_size = get_fixed32(p);
+            p += 4;
+            if (static_cast<size_t>(end - p) < value_size)
+                return false;
+            typename WriteBatch::Change change;
+            if (!decode_change(change_op, key, key_size, p, value_size, change))
+                return false;
+            p += value_size;
+            batch._changes.push_back(std::move(change));
+        }
+        write(batch);
+        return true;
+    }
+
+    typename WriteBatch::Change change;
+    if (!decode_change(op, k, k_size, v, v_size, change))
+        return false;
+    if (change.deleted) {
+        delete_element(change.key);
+        return true;
+    }
+    // a put of a key that exists is an assignment
+    uint64_t lsn = 0;
+    insert_logged(lsn, true, change.expire_at, change.key, std::move(change.value));
+    log_commit(lsn);
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::decode_change(uint8_t op, const char* k, size_t k_size, const char* v, size_t v_size,
+                                                                typename WriteBatch::Change& change) {
+    if (!KeyCodec::decode(k, k_size, change.key))
+        return false;
+    change.deleted = op == kWalDelete;
+    change.expire_at = 0;
+    if (change.deleted)
+        return true;
+    if (op == kWalPutExpire && v_size >= 8) {
+        change.expire_at = get_fixed64(v);
+        v += 8;
+        v_size -= 8;
+    } else if (op != kWalPut) {
+        return false;
+    }
+    return ValueCodec::decode(v, v_size, change.value);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::load_text_file(const std::string& path) {
+    _file_reader.open(path);
+    std::string line;
+    std::string* key = new std::string();
+    std::string* value = new std::string();
     while (getline(_file_reader, line)) {
         string_to_kv(line, key, value);
         if (key->empty() || value->empty()) {
             continue;
         }
-        // Define key as int type
-        insert_element(stoi(*key), *value);
+        K k;
+        V v;
+        if (!parse_text(*key, k) || !parse_text(*value, v)) {
+            SKIPLIST_LOG(Error, "load_file: bad line " << line);
+            continue;
+        }
+        insert_element(k, v);
     }
     delete key;
     delete value;
     _file_reader.close();
-    _file_mutex.unlock();
-    return;
+    return true;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+template <typename... Args>
+typename tSkipList<K, V, Compare, Serializer, Alloc>::SkipNode* tSkipList<K, V, Compare, Serializer, Alloc>::create_node(int level, const K& k, Args&&... args) {
+    void *mem = _allocator.allocate(level, SkipNode::size_of(level));
+    _metrics.add_nodes(level, 1);
+    SkipNode *node = SkipNode::create(mem, level, k, std::forward<Args>(args)...);
+    charge_node(node);
+    return node;
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::destroy_node(SkipNode * node) {
+    _memory_bytes.fetch_sub(static_cast<int64_t>(node->bytes), std::memory_order_relaxed);
+    free_node(node);
+}
+
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::free_node(SkipNode * node) {
+    int level = node->node_level;
+    void *mem = node->memory();
+    node->~SkipNode();
+    _allocator.deallocate(mem, level, SkipNode::size_of(level));
+    _metrics.add_nodes(level, -1);
 }
 
-template <typename K, typename V>
-void tSkipList<K, V>::clear(SkipNode * cur)
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::clear(SkipNode * cur)
 {
-    if(cur->forward[0]!=nullptr){
-        clear(cur->forward[0]);
+    if (Alloc::kBulkRelease && std::is_trivially_destructible<SkipNode>::value)
+        return;
+    while (cur != NULL) {
+        SkipNode *next = cur->forward[0].load(std::memory_order_relaxed);
+        for (SkipNode *version = cur; version != NULL; ) {
+            SkipNode *older = version->older.load(std::memory_order_relaxed);
+            destroy_node(version);
+            version = older;
+        }
+        cur = next;
     }
-    delete(cur);
 }
 
-template<typename K, typename V>
-int tSkipList<K, V>::get_random_level(){
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+int tSkipList<K, V, Compare, Serializer, Alloc>::get_random_level(){
 
-    int k = 1;
-    while (rand() % 2) {
-        k++;
-    }
-    k = (k < _max_level) ? k : _max_level;
-    return k;
+    return _levels.level();
 };
 
-template<typename K, typename V>
-void tSkipList<K, V>::string_to_kv(const std::string& str, std::string* key, std::string* value) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+void tSkipList<K, V, Compare, Serializer, Alloc>::string_to_kv(const std::string& str, std::string* key, std::string* value) {
 
     if(!is_valid_string(str)) {
         return;
@@ -441,8 +3329,8 @@ void tSkipList<K, V>::string_to_kv(const std::string& str, std::string* key, std
     *value = str.substr(str.find(delimiter)+1, str.length());
 }
 
-template<typename K, typename V>
-bool tSkipList<K, V>::is_valid_string(const std::string& str) {
+template<typename K, typename V, typename Compare, typename Serializer, typename Alloc>
+bool tSkipList<K, V, Compare, Serializer, Alloc>::is_valid_string(const std::string& str) {
 
     if (str.empty()) {
         return false;
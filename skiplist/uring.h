@@ -0,0 +1,514 @@
+/*
+ * @file        : uring.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains IoRing, a minimal io_uring on the raw system calls, and
+ *                AsyncFile, the writer of the snapshots and the write-ahead log on top of it.
+ *
+ *                AsyncFile copies what it is given into a few buffers registered with the ring
+ *                and submits every full buffer as a write at its offset, so the caller goes on
+ *                serializing while up to depth writes are in flight. sync() submits the last
+ *                buffer and an fsync that drains them in one io_uring_enter.
+ *
+ *                Without io_uring, on other systems, kernels older than 5.1, sandboxes that
+ *                forbid it, or with -DSKIPLIST_NO_URING, the same buffers are written with
+ *                pwrite and synced with fsync in the calling thread.
+ */
+
+#ifndef SKIP_LIST_URING_H
+#define SKIP_LIST_URING_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if !defined(SKIPLIST_NO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SKIPLIST_HAS_URING 1
+#endif
+#endif
+
+#ifdef SKIPLIST_HAS_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+
+/**
+ * @brief To write n bytes to fd at offset, retrying short writes.
+ */
+inline bool pwrite_fully(int fd, const char* data, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t written = ::pwrite(fd, data, n, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        offset += written;
+        n -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+#ifdef SKIPLIST_HAS_URING
+
+/**
+ * @class IoRing
+ * @brief The IoRing class is used to submit requests to the kernel and reap their completions.
+ * It is not thread safe, one thread at a time uses it.
+ */
+class IoRing {
+public:
+    /**
+     * @param entries Size of the submission queue, the completion queue is twice as big.
+     */
+    explicit IoRing(unsigned entries) : _fd(-1), _sq(MAP_FAILED), _cq(MAP_FAILED),
+                                        _sqes(MAP_FAILED), _sq_bytes(0), _cq_bytes(0),
+                                        _sqe_bytes(0), _queued(0) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        _fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+        if (_fd < 0)
+            return;
+        _sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        _cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            _sq_bytes = _cq_bytes = _sq_bytes > _cq_bytes ? _sq_bytes : _cq_bytes;
+        _sq = ::mmap(NULL, _sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                     IORING_OFF_SQ_RING);
+        _cq = single ? _sq : ::mmap(NULL, _cq_bytes, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        _sqe_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+        _sqes = ::mmap(NULL, _sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+                       IORING_OFF_SQES);
+        if (_sq == MAP_FAILED || _cq == MAP_FAILED || _sqes == MAP_FAILED) {
+            release();
+            return;
+        }
+        char* sq = static_cast<char*>(_sq);
+        char* cq = static_cast<char*>(_cq);
+        _sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        _sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        _sq_entries = p.sq_entries;
+        _sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        _cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    }
+
+    ~IoRing() { release(); }
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    /**
+     * @return True if the ring was set up.
+     */
+    bool ok() const { return _fd >= 0; }
+
+    /**
+     * @brief To register buffers so fixed writes skip mapping them on every request.
+     * @return False if the kernel refused, e.g. over RLIMIT_MEMLOCK, plain writes still work.
+     */
+    bool register_buffers(const struct iovec* iov, unsigned n) {
+        return ::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+    }
+
+    /**
+     * @return A cleared submission entry, NULL if the queue is full.
+     */
+    struct io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *_sq_tail + _queued;
+        if (tail - head >= _sq_entries)
+            return NULL;
+        unsigned index = tail & _sq_mask;
+        struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(_sqes) + index;
+        memset(sqe, 0, sizeof(*sqe));
+        _sq_array[index] = index;
+        _queued++;
+        return sqe;
+    }
+
+    /**
+     * @brief To submit the queued entries and wait for wait_nr completions.
+     * @return False if io_uring_enter failed.
+     */
+    bool submit(unsigned wait_nr = 0) {
+        __atomic_store_n(_sq_tail, *_sq_tail + _queued, __ATOMIC_RELEASE);
+        _queued = 0;
+        for (;;) {
+            // whatever the kernel has not consumed yet, an earlier failed call leaves some
+            unsigned count = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+            long r = ::syscall(__NR_io_uring_enter, _fd, count, wait_nr,
+                               wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (r >= 0 && static_cast<unsigned>(r) >= count)
+                return true;
+            if (r < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+    /**
+     * @brief To take the oldest completion.
+     * @return False if there is none yet.
+     */
+    bool reap(uint64_t& user_data, int& result) {
+        unsigned head = *_cq_head;
+        if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        const struct io_uring_cqe& cqe = _cqes[head & _cq_mask];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    void release() {
+        if (_sqes != MAP_FAILED)
+            ::munmap(_sqes, _sqe_bytes);
+        if (_cq != MAP_FAILED && _cq != _sq)
+            ::munmap(_cq, _cq_bytes);
+        if (_sq != MAP_FAILED)
+            ::munmap(_sq, _sq_bytes);
+        _sq = _cq = _sqes = MAP_FAILED;
+        if (_fd >= 0)
+            ::close(_fd);
+        _fd = -1;
+    }
+
+    int _fd;
+    void* _sq;
+    void* _cq;
+    void* _sqes;
+    size_t _sq_bytes;
+    size_t _cq_bytes;
+    size_t _sqe_bytes;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe* _cqes;
+    // entries filled since the last submit, the tail is only published by submit
+    unsigned _queued;
+};
+
+#endif
+
+/**
+ * @class AsyncFile
+ * @brief The AsyncFile class is used to write a file front to back with the writes in flight
+ * while the caller prepares the next bytes.
+ * Like IoRing it is used by one thread at a time. A failed write makes every later call fail.
+ */
+class AsyncFile {
+public:
+    /**
+     * @param buffer_size Bytes per write.
+     * @param depth Number of buffers, the writes that may be in flight at once.
+     */
+    explicit AsyncFile(size_t buffer_size = 256 * 1024, unsigned depth = 8)
+        : _fd(-1), _offset(0), _current(-1), _in_flight(0), _failed(false), _fixed(false),
+          _repaired(false), _sync_result(0) {
+        _buffers.resize(depth);
+        for (Buffer& b : _buffers) {
+            // 4 KB aligned, so the file may also be opened with O_DIRECT
+            if (::posix_memalign(reinterpret_cast<void**>(&b.data), 4096, buffer_size) != 0)
+                b.data = NULL;
+            b.capacity = b.data ? buffer_size : 0;
+        }
+#ifdef SKIPLIST_HAS_URING
+        _ring.reset(new IoRing(depth + 1));
+        if (!_ring->ok()) {
+            _ring.reset();
+            return;
+        }
+        std::vector<struct iovec> iov(depth);
+        for (unsigned i = 0; i < depth; ++i) {
+            iov[i].iov_base = _buffers[i].data;
+            iov[i].iov_len = _buffers[i].capacity;
+        }
+        _fixed = _ring->register_buffers(iov.data(), depth);
+#endif
+    }
+
+    ~AsyncFile() {
+        wait_all();
+        for (Buffer& b : _buffers)
+            free(b.data);
+    }
+
+    AsyncFile(const AsyncFile&) = delete;
+    AsyncFile& operator=(const AsyncFile&) = delete;
+
+    /**
+     * @brief To write to fd from offset on, what was written before must be synced or drained.
+     */
+    void attach(int fd, off_t offset = 0) {
+        _fd = fd;
+        _offset = offset;
+        _failed = false;
+    }
+
+    /**
+     * @return True if the writes go through io_uring.
+     */
+    bool uses_uring() const {
+#ifdef SKIPLIST_HAS_URING
+        return _ring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief To append n bytes, a full buffer is submitted and the call only waits when every
+     * buffer is in flight.
+     */
+    bool write(const char* data, size_t n) {
+        while (n > 0 && !_failed) {
+            if (_current < 0 && !acquire())
+                return false;
+            Buffer& b = _buffers[_current];
+            size_t take = n < b.capacity - b.size ? n : b.capacity - b.size;
+            memcpy(b.data + b.size, data, take);
+            b.size += take;
+            data += take;
+            n -= take;
+            if (b.size == b.capacity)
+                submit_current();
+        }
+        return !_failed;
+    }
+
+    /**
+     * @brief To wait until every byte given to write is in the file.
+     */
+    bool drain() {
+        // a write that is waited for at once has nothing to overlap with, pwrite is cheaper
+        // than handing it to the kernel's workers
+        if (_in_flight == 0)
+            submit_current(true, true);
+        else
+            submit_current();
+        wait_all();
+        return !_failed;
+    }
+
+    /**
+     * @brief To write everything and force it to disk.
+     * @param data_only fdatasync instead of fsync.
+     */
+    bool sync(bool data_only = true) {
+        if (_failed)
+            return false;
+#ifdef SKIPLIST_HAS_URING
+        if (_ring) {
+            bool queued = submit_current(false);
+            struct io_uring_sqe* sqe = _ring->get_sqe();
+            if (sqe == NULL) {
+                if (queued)
+                    _ring->submit();
+                wait_all();
+                return !_failed && sync_now(data_only);
+            }
+            // the fsync starts once every earlier write is complete
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = _fd;
+            sqe->flags = IOSQE_IO_DRAIN;
+            sqe->fsync_flags = data_only ? IORING_FSYNC_DATASYNC : 0;
+            sqe->user_data = kSyncTag;
+            _sync_result = 1;
+            _repaired = false;
+            if (!_ring->submit(_in_flight + 1)) {
+                _failed = true;
+                return false;
+            }
+            while (_in_flight > 0 || _sync_result == 1)
+                wait_one();
+            // bytes a short write left over were written after the fsync was queued
+            if (_sync_result < 0 || _repaired)
+                return !_failed && sync_now(data_only);
+            return !_failed;
+        }
+#endif
+        submit_current();
+        return !_failed && sync_now(data_only);
+    }
+
+private:
+    static const uint64_t kSyncTag = ~0ULL;
+
+    struct Buffer {
+        char* data;
+        size_t capacity;
+        size_t size;
+        off_t offset;
+        bool busy;
+        struct iovec iov;
+        Buffer() : data(NULL), capacity(0), size(0), offset(0), busy(false) {}
+    };
+
+    bool sync_now(bool data_only) {
+        if ((data_only ? ::fdatasync(_fd) : ::fsync(_fd)) != 0)
+            _failed = true;
+        return !_failed;
+    }
+
+    /**
+     * @brief To make a buffer that is not in flight the current one.
+     */
+    bool acquire() {
+        for (;;) {
+            for (size_t i = 0; i < _buffers.size(); ++i) {
+                if (!_buffers[i].busy && _buffers[i].capacity > 0) {
+                    _current = static_cast<int>(i);
+                    _buffers[i].size = 0;
+                    return true;
+                }
+            }
+            if (_in_flight == 0 || _failed) {
+                _failed = true;
+                return false;
+            }
+            wait_one();
+        }
+    }
+
+    /**
+     * @brief To write the current buffer at the next offset.
+     * @param enter False to only queue the write, the caller submits it.
+     * @param now To write it with pwrite in this thread.
+     * @return True if a write was queued and not submitted.
+     */
+    bool submit_current(bool enter = true, bool now = false) {
+        if (_current < 0)
+            return false;
+        Buffer& b = _buffers[_current];
+#ifdef SKIPLIST_HAS_URING
+        int index = _current;
+#endif
+        _current = -1;
+        if (b.size == 0 || _failed)
+            return false;
+        b.offset = _offset;
+        _offset += static_cast<off_t>(b.size);
+#ifdef SKIPLIST_HAS_URING
+        if (_ring && !now) {
+            struct io_uring_sqe* sqe = _ring->get_sqe();
+            while (sqe == NULL && _in_flight > 0) {
+                wait_one();
+                sqe = _ring->get_sqe();
+            }
+            if (sqe != NULL) {
+                sqe->fd = _fd;
+                sqe->off = static_cast<uint64_t>(b.offset);
+                if (_fixed) {
+                    sqe->opcode = IORING_OP_WRITE_FIXED;
+                    sqe->addr = reinterpret_cast<uint64_t>(b.data);
+                    sqe->len = static_cast<uint32_t>(b.size);
+                    sqe->buf_index = static_cast<uint16_t>(index);
+                } else {
+                    // IORING_OP_WRITE needs 5.6, writev is there since 5.1 like the rest
+                    b.iov.iov_base = b.data;
+                    b.iov.iov_len = b.size;
+                    sqe->opcode = IORING_OP_WRITEV;
+                    sqe->addr = reinterpret_cast<uint64_t>(&b.iov);
+                    sqe->len = 1;
+                }
+                sqe->user_data = static_cast<uint64_t>(index);
+                b.busy = true;
+                _in_flight++;
+                if (!enter)
+                    return true;
+                if (!_ring->submit())
+                    _failed = true;
+                return false;
+            }
+        }
+#endif
+        if (!pwrite_fully(_fd, b.data, b.size, b.offset))
+            _failed = true;
+        b.size = 0;
+        return false;
+    }
+
+    void wait_all() {
+        while (_in_flight > 0)
+            wait_one();
+    }
+
+    /**
+     * @brief To wait for at least one completion and handle every completion there is.
+     */
+    void wait_one() {
+#ifdef SKIPLIST_HAS_URING
+        uint64_t tag;
+        int result;
+        while (!_ring->reap(tag, result)) {
+            if (!_ring->submit(1)) {
+                // nothing completes any more, give the buffers up
+                _failed = true;
+                for (Buffer& b : _buffers)
+                    b.busy = false;
+                _in_flight = 0;
+                _sync_result = -1;
+                return;
+            }
+        }
+        do {
+            if (tag == kSyncTag) {
+                _sync_result = result;
+                continue;
+            }
+            Buffer& b = _buffers[tag];
+            if (result < 0) {
+                _failed = true;
+            } else if (static_cast<size_t>(result) < b.size) {
+                // a short write, the rest goes in this thread
+                if (!pwrite_fully(_fd, b.data + result, b.size - result, b.offset + result))
+                    _failed = true;
+                _repaired = true;
+            }
+            b.busy = false;
+            b.size = 0;
+            _in_flight--;
+        } while (_ring->reap(tag, result));
+#endif
+    }
+
+    int _fd;
+    off_t _offset;
+    std::vector<Buffer> _buffers;
+    int _current;
+    unsigned _in_flight;
+    bool _failed;
+    // the buffers are registered, writes use IORING_OP_WRITE_FIXED
+    bool _fixed;
+    bool _repaired;
+    int _sync_result;
+#ifdef SKIPLIST_HAS_URING
+    std::unique_ptr<IoRing> _ring;
+#endif
+};
+
+
+#endif //SKIP_LIST_URING_H
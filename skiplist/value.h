@@ -0,0 +1,231 @@
+/*
+ * @file        : value.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the CompactValue class, a byte string value for the skip
+ *                lists that takes N + 1 bytes in the node. Up to N bytes are stored inline, a
+ *                longer value is kept in a separate block that the node only holds a handle to,
+ *                so large values do not spread the nodes of a list over more cache lines and
+ *                small ones do not pay for the 32 bytes of a std::string.
+ *
+ *                The blocks are immutable and reference counted: a copy of a large value, such
+ *                as the one search_element hands out, is a counter increment instead of a copy
+ *                of its bytes, and the node may be replaced or reclaimed while the copy lives.
+ */
+
+#ifndef SKIP_LIST_VALUE_H
+#define SKIP_LIST_VALUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <string>
+#include "allocator.h"
+#include "codec.h"
+#include "slice.h"
+
+
+/**
+ * @class CompactValue
+ * @brief The CompactValue class is used to store byte strings of any size in N + 1 bytes.
+ * The last byte is the length of an inline value or kHeap, a separated value keeps the
+ * pointer to its block in the first bytes. The alignment is 1, so it packs behind the other
+ * fields of a node without padding.
+ */
+template <size_t N = 15>
+class CompactValue {
+    static_assert(N >= sizeof(void*) && N < 255, "CompactValue needs room for a pointer and a length byte");
+public:
+    // longest value stored in the node
+    static const size_t kInlineBytes = N;
+
+    CompactValue() { _buf[N] = 0; }
+    CompactValue(const char* data, size_t size) { memcpy(reserve(size), data, size); }
+    CompactValue(const char* str) : CompactValue(str, strlen(str)) {}
+    CompactValue(const std::string& str) : CompactValue(str.data(), str.size()) {}
+    CompactValue(const Slice& s) : CompactValue(s.data(), s.size()) {}
+
+    /**
+     * @brief To build a value of n copies of c, like std::string.
+     */
+    CompactValue(size_t n, char c);
+
+    CompactValue(const CompactValue& other) {
+        memcpy(_buf, other._buf, sizeof(_buf));
+        if (separated())
+            block()->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    CompactValue(CompactValue&& other) noexcept {
+        memcpy(_buf, other._buf, sizeof(_buf));
+        other._buf[N] = 0;
+    }
+
+    ~CompactValue() { release(); }
+
+    CompactValue& operator=(const CompactValue& other) {
+        if (this != &other) {
+            CompactValue copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    CompactValue& operator=(CompactValue&& other) noexcept {
+        if (this != &other) {
+            release();
+            memcpy(_buf, other._buf, sizeof(_buf));
+            other._buf[N] = 0;
+        }
+        return *this;
+    }
+
+    void swap(CompactValue& other) noexcept {
+        char tmp[N + 1];
+        memcpy(tmp, _buf, sizeof(_buf));
+        memcpy(_buf, other._buf, sizeof(_buf));
+        memcpy(other._buf, tmp, sizeof(_buf));
+    }
+
+    /**
+     * @brief To replace the bytes of the value, a separated value gets a new block.
+     */
+    void assign(const char* data, size_t size);
+
+    const char* data() const { return separated() ? block()->data() : _buf; }
+    size_t size() const { return separated() ? block()->size : static_cast<unsigned char>(_buf[N]); }
+    bool empty() const { return size() == 0; }
+
+    /**
+     * @return True if the bytes are in a block outside the value.
+     */
+    bool separated() const { return static_cast<unsigned char>(_buf[N]) == kHeap; }
+
+    /**
+     * @return The bytes of the block of a separated value, 0 for an inline one.
+     */
+    size_t heap_bytes() const { return separated() ? sizeof(Block) + block()->size : 0; }
+
+    std::string to_string() const { return std::string(data(), size()); }
+    Slice slice() const { return Slice(data(), size()); }
+
+    int compare(const CompactValue& other) const { return slice().compare(other.slice()); }
+
+private:
+    static const unsigned char kHeap = 0xFF;
+
+    /**
+     * @struct Block
+     * @brief The bytes of a separated value follow the header in the same allocation.
+     */
+    struct Block {
+        std::atomic<uint32_t> refs;
+        size_t size;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    Block* block() const {
+        Block* b;
+        memcpy(&b, _buf, sizeof(b));
+        return b;
+    }
+
+    /**
+     * @brief To make room for size bytes of a value under construction, inline or in a new
+     * block of one reference.
+     * @return Where the bytes go.
+     */
+    char* reserve(size_t size);
+
+    void release() {
+        if (separated()) {
+            Block* b = block();
+            if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                b->~Block();
+                ::operator delete(b);
+            }
+            _buf[N] = 0;
+        }
+    }
+
+    char _buf[N + 1];
+};
+
+
+template <size_t N>
+CompactValue<N>::CompactValue(size_t n, char c) {
+    memset(reserve(n), c, n);
+}
+
+template <size_t N>
+void CompactValue<N>::assign(const char* data, size_t size) {
+    // data may point into this value
+    CompactValue copy(data, size);
+    *this = std::move(copy);
+}
+
+template <size_t N>
+char* CompactValue<N>::reserve(size_t size) {
+    if (size <= N) {
+        _buf[N] = static_cast<char>(size);
+        return _buf;
+    }
+    Block* b = new (::operator new(sizeof(Block) + size)) Block();
+    b->refs.store(1, std::memory_order_relaxed);
+    b->size = size;
+    memcpy(_buf, &b, sizeof(b));
+    _buf[N] = static_cast<char>(kHeap);
+    return b->data();
+}
+
+template <size_t N>
+inline bool operator==(const CompactValue<N>& a, const CompactValue<N>& b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+template <size_t N>
+inline bool operator!=(const CompactValue<N>& a, const CompactValue<N>& b) { return !(a == b); }
+
+template <size_t N>
+inline bool operator<(const CompactValue<N>& a, const CompactValue<N>& b) { return a.compare(b) < 0; }
+
+template <size_t N>
+inline std::ostream& operator<<(std::ostream& os, const CompactValue<N>& v) {
+    return os.write(v.data(), static_cast<std::streamsize>(v.size()));
+}
+
+template <size_t N>
+struct Codec<CompactValue<N> > {
+    static const bool kZeroCopy = false;
+
+    static void encode(const CompactValue<N>& v, std::string& out) {
+        out.append(v.data(), v.size());
+    }
+
+    static bool decode(const char* p, size_t n, CompactValue<N>& out) {
+        out.assign(p, n);
+        return true;
+    }
+};
+
+/**
+ * @brief A separated value is charged its whole block even if copies share it.
+ */
+template <size_t N>
+struct HeapBytes<CompactValue<N> > {
+    static size_t of(const CompactValue<N>& v) { return v.heap_bytes(); }
+};
+
+template <size_t N>
+inline bool parse_text(const std::string& text, CompactValue<N>& out) {
+    out.assign(text.data(), text.size());
+    return true;
+}
+
+
+#endif //SKIP_LIST_VALUE_H
@@ -0,0 +1,533 @@
+/*
+ * @file        : wal.h
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : This file contains the WriteAheadLog class, an append only log of the inserts
+ *                and deletes applied since the last snapshot. Concurrent writers are batched
+ *                into one write and one fdatasync (group commit), submitted together to
+ *                io_uring where there is one, see uring.h.
+ *
+ *                The log is a sequence of segments <path>.000001, <path>.000002, ... A dump
+ *                starts a new segment and removes the older ones once the snapshot is durable.
+ *
+ *                record : u32 crc32c | u32 payload bytes | payload
+ *                payload: u64 lsn | u8 op | u32 key bytes | key | value
+ *
+ *                The value of a kWalPutExpire record starts with the u64 wall clock
+ *                milliseconds after which the element is gone.
+ *
+ *                A kWalBatch record has an empty key and holds the changes of a write batch,
+ *                applied all or none, see tSkipList::write:
+ *
+ *                batch  : u32 changes | change...
+ *                change : u8 kWalPut, kWalDelete or kWalPutExpire | u32 key bytes | key | u32 value bytes | value
+ *
+ *                A log with a Compression, see compress.h, compresses every batch of the group
+ *                commit of at least kWalCompressBytes that shrinks into one kWalBlock record:
+ *
+ *                block  : u64 lsn of the last record | u8 kWalBlock | u32 raw bytes | compressed records
+ *
+ *                A batch is written as a whole and none of its records is acknowledged before
+ *                the write is, so a torn block only loses records that were never durable. A
+ *                reader that does not know kWalBlock rejects the log instead of misreading it.
+ *
+ *                A listener, see set_listener, is handed every batch as it was written, so a
+ *                replica can apply the same bytes, see replication.h and read_wal_batch.
+ */
+
+#ifndef SKIP_LIST_WAL_H
+#define SKIP_LIST_WAL_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compress.h"
+#include "crc32.h"
+#include "snapshot.h"
+#include "uring.h"
+
+
+/**
+ * @brief When the log is forced to disk.
+ * Always: every write waits for fdatasync, concurrent writers share one.
+ * Interval: written at once, fdatasync by a background thread every interval_ms.
+ * Never: written at once, the kernel decides when it reaches the disk.
+ */
+enum class SyncPolicy { Always, Interval, Never };
+
+// a batch of the group commit is written in up to kWalDepth writes of kWalBufferSize
+static const size_t kWalBufferSize = 64 * 1024;
+static const unsigned kWalDepth = 4;
+
+enum WalOp : uint8_t {
+    kWalPut = 1,
+    kWalDelete = 2,
+    kWalPutExpire = 3,
+    kWalBlock = 4,
+    kWalBatch = 5
+};
+
+// smaller batches are written as they are
+static const size_t kWalCompressBytes = 256;
+
+/**
+ * @brief Called with the bytes of every batch once they are written, in the order of the log,
+ * and the lsn of its last record.
+ */
+typedef std::function<void(const char* data, size_t size, uint64_t last_lsn)> WalListener;
+
+/**
+ * @class WriteAheadLog
+ * @brief The WriteAheadLog class is used to make changes durable between dumps.
+ */
+class WriteAheadLog {
+public:
+    /**
+     * @brief Constructor for WriteAheadLog.
+     * @param path Base path of the segments.
+     */
+    WriteAheadLog(const std::string& path, SyncPolicy policy = SyncPolicy::Always, int interval_ms = 100)
+        : _path(path), _policy(policy), _interval_ms(interval_ms), _compression(Compression::None), _fd(-1),
+          _file(kWalBufferSize, kWalDepth), _segment(0), _last_lsn(0), _written_lsn(0),
+          _synced_lsn(0), _flushing(false), _failed(false), _stop(false) {}
+
+    /**
+     * @brief Deconstructor for WriteAheadLog.
+     * To stop the sync thread and force what is left to disk.
+     */
+    ~WriteAheadLog() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        if (_syncer.joinable())
+            _syncer.join();
+        std::unique_lock<std::mutex> lock(_mutex);
+        flush_to(_last_lsn, true, lock);
+        if (_fd >= 0)
+            ::close(_fd);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    /**
+     * @brief To compress the batches of the group commit, call it before open.
+     */
+    void set_compression(Compression compression) {
+        _compression = compression;
+    }
+
+    /**
+     * @brief To hand every batch written from now on to listener, see WalListener.
+     * The leader of the group commit calls it outside the lock, one batch at a time, so it
+     * must be quick and must not write to the log. It waits for a batch the old listener is
+     * handed, so an empty listener can be set before the old one is destroyed.
+     */
+    void set_listener(WalListener listener) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_flushing)
+            _cond.wait(lock);
+        _listener = std::move(listener);
+    }
+
+    /**
+     * @brief To replay every existing segment in order.
+     * apply(op, key, key_size, value, value_size) returns false to stop the replay. The bytes
+     * point into mappings of the segments, see release_mappings, those of a compressed block
+     * into a buffer that is reused by the next block, unless keep_records is set.
+     * A partial record at the end of the newest segment with records is a write cut off by
+     * a crash, it is dropped and the segment truncated; any empty segments after it were
+     * opened since. Every older segment is strict: it was complete before the next one was
+     * started, so damage in it fails the replay.
+     * @param keep_records To inflate compressed blocks into memory held by the mappings, so
+     * all bytes stay valid as long as them.
+     * @return False if a segment other than the newest one with records is damaged or apply
+     * failed.
+     */
+    template <typename Apply>
+    bool replay(Apply apply, bool keep_records = false);
+
+    /**
+     * @brief To take over the mappings of the replayed segments.
+     */
+    std::vector<std::unique_ptr<MappedFile> > release_mappings() {
+        return std::move(_mappings);
+    }
+
+    /**
+     * @brief To start appending to a new segment after the existing ones.
+     */
+    bool open() {
+        std::vector<uint64_t> ids = segments();
+        _segment = ids.empty() ? 1 : ids.back() + 1;
+        _fd = ::open(segment_path(_segment).c_str(), O_WRONLY | O_CREAT, 0644);
+        if (_fd < 0)
+            return false;
+        _file.attach(_fd, ::lseek(_fd, 0, SEEK_END));
+        sync_parent_dir(_path);
+        if (_policy == SyncPolicy::Interval)
+            _syncer = std::thread(&WriteAheadLog::sync_loop, this);
+        return true;
+    }
+
+    /**
+     * @brief To buffer a record, it is written by the next commit.
+     * @return The log sequence number of the record.
+     */
+    uint64_t append(uint8_t op, const std::string& key, const std::string& value) {
+        std::string payload;
+        payload.reserve(13 + key.size() + value.size());
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t lsn = ++_last_lsn;
+        put_fixed64(payload, lsn);
+        payload.push_back(static_cast<char>(op));
+        put_fixed32(payload, static_cast<uint32_t>(key.size()));
+        payload.append(key);
+        payload.append(value);
+        put_fixed32(_pending, crc32c(0, payload.data(), payload.size()));
+        put_fixed32(_pending, static_cast<uint32_t>(payload.size()));
+        _pending.append(payload);
+        return lsn;
+    }
+
+    /**
+     * @brief To wait until the record lsn is as durable as the policy requires.
+     * One of the waiting writers writes the records of all of them.
+     */
+    bool commit(uint64_t lsn) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return flush_to(lsn, _policy == SyncPolicy::Always, lock);
+    }
+
+    /**
+     * @brief To close the current segment and start the next one.
+     * @return The id of the new segment, every earlier segment is sealed.
+     */
+    uint64_t rotate() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        flush_to(_last_lsn, _policy != SyncPolicy::Never, lock);
+        while (_flushing)
+            _cond.wait(lock);
+        int fd = ::open(segment_path(_segment + 1).c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            _failed = true;
+            return _segment;
+        }
+        ::close(_fd);
+        _fd = fd;
+        _file.attach(_fd, ::lseek(_fd, 0, SEEK_END));
+        _segment++;
+        sync_parent_dir(_path);
+        return _segment;
+    }
+
+    /**
+     * @brief To remove the segments older than id, once a snapshot covers them.
+     */
+    void remove_segments_before(uint64_t id) {
+        for (uint64_t segment : segments()) {
+            if (segment < id)
+                ::unlink(segment_path(segment).c_str());
+        }
+    }
+
+    /**
+     * @return The ids of the segments on disk in increasing order.
+     */
+    std::vector<uint64_t> segments() const {
+        std::vector<uint64_t> ids;
+        std::string::size_type slash = _path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : _path.substr(0, slash);
+        std::string prefix = (slash == std::string::npos ? _path : _path.substr(slash + 1)) + ".";
+        DIR* d = ::opendir(dir.c_str());
+        if (d == nullptr)
+            return ids;
+        while (struct dirent* entry = ::readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0
+                && name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+                ids.push_back(strtoull(name.c_str() + prefix.size(), nullptr, 10));
+            }
+        }
+        ::closedir(d);
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    /**
+     * @return The path of segment id.
+     */
+    std::string segment_path(uint64_t id) const {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%06llu", static_cast<unsigned long long>(id));
+        return _path + suffix;
+    }
+
+    /**
+     * @return The sequence number of the last appended record.
+     */
+    uint64_t last_lsn() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _last_lsn;
+    }
+
+    /**
+     * @return False once a write or sync failed, the log is no longer durable.
+     */
+    bool ok() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return !_failed;
+    }
+
+private:
+    /**
+     * @brief To replace the records of batch, the last of them lsn, by one compressed block
+     * if the batch is large enough and shrinks.
+     */
+    void pack(std::string& batch, uint64_t lsn) const {
+        if (_compression == Compression::None || batch.size() < kWalCompressBytes)
+            return;
+        std::string payload;
+        put_fixed64(payload, lsn);
+        payload.push_back(static_cast<char>(kWalBlock));
+        put_fixed32(payload, static_cast<uint32_t>(batch.size()));
+        if (!compress_block(_compression, batch.data(), batch.size(), payload))
+            return;
+        batch.clear();
+        put_fixed32(batch, crc32c(0, payload.data(), payload.size()));
+        put_fixed32(batch, static_cast<uint32_t>(payload.size()));
+        batch.append(payload);
+    }
+
+    /**
+     * @brief To write, and sync if asked, every record up to lsn. Called with lock held.
+     * The first waiter becomes the leader and writes the whole pending buffer, the others
+     * wait for it.
+     */
+    bool flush_to(uint64_t lsn, bool sync, std::unique_lock<std::mutex>& lock) {
+        while ((sync ? _synced_lsn : _written_lsn) < lsn) {
+            if (_failed || _fd < 0)
+                return false;
+            if (_flushing) {
+                _cond.wait(lock);
+                continue;
+            }
+            _flushing = true;
+            std::string batch;
+            batch.swap(_pending);
+            uint64_t upto = _last_lsn;
+            lock.unlock();
+            pack(batch, upto);
+
+            // with io_uring the write and the fdatasync behind it are one submission
+            bool ok = _file.write(batch.data(), batch.size())
+                      && (sync ? _file.sync(true) : _file.drain());
+            // the next leader waits for _flushing, so the listener sees the batches in order
+            if (ok && _listener && !batch.empty())
+                _listener(batch.data(), batch.size(), upto);
+
+            lock.lock();
+            _flushing = false;
+            if (ok) {
+                _written_lsn = upto;
+                if (sync)
+                    _synced_lsn = upto;
+            } else {
+                _failed = true;
+            }
+            _cond.notify_all();
+        }
+        return !_failed;
+    }
+
+    /**
+     * @brief Background sync of SyncPolicy::Interval.
+     */
+    void sync_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_stop) {
+            _cond.wait_for(lock, std::chrono::milliseconds(_interval_ms));
+            if (!_stop)
+                flush_to(_last_lsn, true, lock);
+        }
+    }
+
+    /**
+     * @brief To replay the records of one segment up to the first damaged one.
+     * @param valid Set to the bytes of intact records.
+     * @return False if apply failed.
+     */
+    template <typename Apply>
+    bool replay_segment(MappedFile& mapping, bool keep_records, Apply& apply, size_t& valid);
+
+    /**
+     * @brief To replay the records in size bytes at data, those of a segment or of a block.
+     */
+    template <typename Apply>
+    bool replay_records(const char* data, size_t size, MappedFile& mapping, bool keep_records,
+                        Apply& apply, size_t& valid);
+
+    const std::string _path;
+    const SyncPolicy _policy;
+    const int _interval_ms;
+    Compression _compression;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    int _fd;
+    // written by the leader of a flush outside _mutex, attached to a segment under it
+    AsyncFile _file;
+    uint64_t _segment;
+    std::string _pending;
+    uint64_t _last_lsn;
+    uint64_t _written_lsn;
+    uint64_t _synced_lsn;
+    bool _flushing;
+    bool _failed;
+    bool _stop;
+    std::thread _syncer;
+    // called by the leader outside _mutex, replaced under it while no one flushes
+    WalListener _listener;
+
+    std::vector<std::unique_ptr<MappedFile> > _mappings;
+};
+
+
+template <typename Apply>
+bool WriteAheadLog::replay(Apply apply, bool keep_records) {
+    std::vector<uint64_t> ids = segments();
+    // an empty segment can not be mapped and has nothing to replay, the segments opened after
+    // the one written last before a crash are empty
+    size_t newest = ids.size();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        struct stat st;
+        if (::stat(segment_path(ids[i]).c_str(), &st) == 0 && st.st_size > 0)
+            newest = i;
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        std::string path = segment_path(ids[i]);
+        std::unique_ptr<MappedFile> mapping(new MappedFile());
+        if (!mapping->open(path))
+            continue;
+        mapping->advise(MADV_SEQUENTIAL);
+        size_t valid = 0;
+        if (!replay_segment(*mapping, keep_records, apply, valid))
+            return false;
+        bool torn = valid != mapping->size();
+        _mappings.push_back(std::move(mapping));
+        if (torn) {
+            // only the newest segment with records may end in a partial record, cut it off so
+            // that it is not in the middle of the log once newer segments follow
+            if (i != newest || ::truncate(path.c_str(), static_cast<off_t>(valid)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+template <typename Apply>
+bool WriteAheadLog::replay_segment(MappedFile& mapping, bool keep_records, Apply& apply, size_t& valid) {
+    return replay_records(mapping.data(), mapping.size(), mapping, keep_records, apply, valid);
+}
+
+template <typename Apply>
+bool WriteAheadLog::replay_records(const char* data, size_t size, MappedFile& mapping, bool keep_records,
+                                   Apply& apply, size_t& valid) {
+    std::string inflated;
+    size_t pos = 0;
+    while (size - pos >= 8) {
+        uint32_t crc = get_fixed32(data + pos);
+        uint32_t length = get_fixed32(data + pos + 4);
+        const char* payload = data + pos + 8;
+        if (size - pos - 8 < length || length < 13 || crc32c(0, payload, length) != crc)
+            break;
+        uint64_t lsn = get_fixed64(payload);
+        uint8_t op = static_cast<uint8_t>(payload[8]);
+        if (op == kWalBlock) {
+            uint32_t raw = get_fixed32(payload + 9);
+            char* out;
+            if (keep_records) {
+                out = mapping.hold(raw);
+            } else {
+                inflated.resize(raw);
+                out = &inflated[0];
+            }
+            if (!lz4_decompress(payload + 13, length - 13, out, raw))
+                break;
+            size_t inner = 0;
+            if (!replay_records(out, raw, mapping, keep_records, apply, inner))
+                return false;
+            // the crc matched, a block whose records do not is not a torn write
+            if (inner != raw)
+                return false;
+        } else {
+            uint32_t key_size = get_fixed32(payload + 9);
+            if (key_size > length - 13)
+                break;
+            const char* key = payload + 13;
+            if (!apply(op, key, key_size, key + key_size, length - 13 - key_size))
+                return false;
+        }
+        if (lsn > _last_lsn)
+            _last_lsn = _written_lsn = _synced_lsn = lsn;
+        pos += 8 + length;
+    }
+    valid = pos;
+    return true;
+}
+
+/**
+ * @brief To read the records of a batch a WalListener was handed, compressed blocks included.
+ * apply(lsn, op, key, key_size, value, value_size) returns false to stop, the bytes are only
+ * valid during the call.
+ * @return False if the batch is damaged or apply failed.
+ */
+template <typename Apply>
+bool read_wal_batch(const char* data, size_t size, Apply apply) {
+    size_t pos = 0;
+    while (pos < size) {
+        if (size - pos < 8)
+            return false;
+        uint32_t crc = get_fixed32(data + pos);
+        uint32_t length = get_fixed32(data + pos + 4);
+        const char* payload = data + pos + 8;
+        if (size - pos - 8 < length || length < 13 || crc32c(0, payload, length) != crc)
+            return false;
+        uint64_t lsn = get_fixed64(payload);
+        uint8_t op = static_cast<uint8_t>(payload[8]);
+        if (op == kWalBlock) {
+            std::string inflated(get_fixed32(payload + 9), '\0');
+            if (!lz4_decompress(payload + 13, length - 13, &inflated[0], inflated.size())
+                || !read_wal_batch(inflated.data(), inflated.size(), apply))
+                return false;
+        } else {
+            uint32_t key_size = get_fixed32(payload + 9);
+            if (key_size > length - 13)
+                return false;
+            const char* key = payload + 13;
+            if (!apply(lsn, op, key, key_size, key + key_size, length - 13 - key_size))
+                return false;
+        }
+        pos += 8 + length;
+    }
+    return true;
+}
+
+
+#endif //SKIP_LIST_WAL_H
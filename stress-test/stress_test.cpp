@@ -1,101 +1,537 @@
-#include <iostream>
+/*
+ * @file        : stress_test.cpp
+ * @Author      : zhenxi
+ * @Date        : 2024-04-18
+ * @copyleft    : Apache 2.0
+ * Description  : Benchmark of the skip list engines. Every engine is loaded and then runs the
+ *                YCSB core workloads for each key distribution, value size and thread count,
+ *                reporting throughput and p50/p99/p999 latency. The geometric mean of all
+ *                throughputs is printed last as the score to track regressions with.
+ *
+ *                make bench
+ *                ./bin/bench --engines=tskiplist --workloads=A,C --threads=1,4 --records=1000000
+ *
+ *                load: insert the records          A: 50% read, 50% update
+ *                B: 95% read, 5% update            C: 100% read
+ *                D: 95% read latest, 5% insert     E: 95% scan, 5% insert
+ *                F: 50% read, 50% read-modify-write
+ */
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
-#include <pthread.h>
-#include <time.h>
-#include "../skiplist.h"
-
-#define NUM_THREADS 1
-#define TEST_COUNT 100000
-SkipList<int, std::string> skipList(18);
-
-void *insertElement(void* threadid) {
-    long tid; 
-    tid = (long)threadid;
-    std::cout << tid << std::endl;  
-    int tmp = TEST_COUNT/NUM_THREADS; 
-	for (int i=tid*tmp, count=0; count<tmp; i++) {
-        count++;
-		skipList.insert_element(rand() % TEST_COUNT, "a"); 
-	}
-    pthread_exit(NULL);
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../skiplist/skiplist.h"
+#include "../skiplist/tskiplist.h"
+#include "../skiplist/lfskiplist.h"
+#include "../skiplist/fatskiplist.h"
+
+#define MAX_LEVEL 18
+#define SCAN_LENGTH 100
+
+typedef long long Key;
+typedef std::string Value;
+
+
+/**
+ * @brief 64 bit FNV-1a of v, used to scatter record ids over the key space.
+ */
+static uint64_t fnv_hash(uint64_t v) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 8; ++i) {
+        h ^= v & 0xFF;
+        h *= 1099511628211ull;
+        v >>= 8;
+    }
+    return h;
+}
+
+/**
+ * @brief The key of record id. Keys are scattered, so loading does not append in order.
+ */
+static Key record_key(uint64_t id) {
+    return static_cast<Key>(fnv_hash(id) >> 1);
 }
 
-void *getElement(void* threadid) {
-    long tid; 
-    tid = (long)threadid;
-    std::cout << tid << std::endl;  
-    int tmp = TEST_COUNT/NUM_THREADS; 
-	for (int i=tid*tmp, count=0; count<tmp; i++) {
-        count++;
-		skipList.search_element(rand() % TEST_COUNT); 
-	}
-    pthread_exit(NULL);
+/**
+ * @class Random
+ * @brief xorshift64*, one per thread.
+ */
+class Random {
+public:
+    explicit Random(uint64_t seed) : _state(seed * 2654435761u + 1) {}
+
+    uint64_t next() {
+        _state ^= _state >> 12;
+        _state ^= _state << 25;
+        _state ^= _state >> 27;
+        return _state * 2685821657736338717ull;
+    }
+
+    /**
+     * @return A double in [0, 1).
+     */
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t _state;
+};
+
+enum Distribution { kUniform, kZipfian, kSequential };
+
+#define ZIPFIAN_THETA 0.99
+
+/**
+ * @return The sum of 1 / i^theta for i in [1, n], the normalization of the zipfian.
+ */
+static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+        sum += 1.0 / std::pow(static_cast<double>(i), theta);
+    return sum;
 }
 
-int main() {
-    srand (time(NULL));  
-    {
+/**
+ * @class KeyChooser
+ * @brief Picks record ids in [0, n) like the YCSB generators.
+ * Zipfian uses the Gray et al. generator with theta 0.99, the popular ids are scattered by
+ * a hash. Sequential walks the ids from a different start in every thread.
+ */
+class KeyChooser {
+public:
+    /**
+     * @param zetan zeta(n, ZIPFIAN_THETA), it takes n steps so it is computed once per run.
+     */
+    KeyChooser(Distribution dist, uint64_t n, uint64_t start, double zetan)
+        : _dist(dist), _n(n), _next(start), _theta(ZIPFIAN_THETA), _zetan(zetan) {
+        _alpha = 1.0 / (1.0 - _theta);
+        _eta = (1.0 - std::pow(2.0 / n, 1.0 - _theta)) / (1.0 - zeta(2, _theta) / _zetan);
+    }
+
+    uint64_t next(Random& rnd) {
+        switch (_dist) {
+        case kUniform:
+            return rnd.next() % _n;
+        case kSequential:
+            return _next++ % _n;
+        case kZipfian:
+        default: {
+            double u = rnd.uniform();
+            double uz = u * _zetan;
+            uint64_t rank;
+            if (uz < 1.0)
+                rank = 0;
+            else if (uz < 1.0 + std::pow(0.5, _theta))
+                rank = 1;
+            else
+                rank = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1, _alpha));
+            return fnv_hash(rank) % _n;
+        }
+        }
+    }
+
+private:
+    Distribution _dist;
+    uint64_t _n;
+    uint64_t _next;
+    double _theta;
+    double _zetan;
+    double _alpha;
+    double _eta;
+};
+
+/**
+ * @class Histogram
+ * @brief Latencies in nanoseconds, 16 linear buckets per power of two (about 6% error).
+ */
+class Histogram {
+public:
+    Histogram() : _buckets(kBuckets, 0), _count(0) {}
+
+    void add(uint64_t ns) {
+        _buckets[index(ns)]++;
+        _count++;
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < kBuckets; ++i)
+            _buckets[i] += other._buckets[i];
+        _count += other._count;
+    }
+
+    /**
+     * @return The latency below which the fraction q of the samples lies.
+     */
+    uint64_t percentile(double q) const {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * _count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += _buckets[i];
+            if (seen >= rank && seen > 0)
+                return upper(i);
+        }
+        return 0;
+    }
+
+private:
+    static const size_t kBuckets = 64 * 16;
+
+    static size_t index(uint64_t ns) {
+        if (ns < 16)
+            return static_cast<size_t>(ns);
+        int e = 63 - __builtin_clzll(ns);
+        return static_cast<size_t>((e - 3) * 16 + ((ns >> (e - 4)) & 15));
+    }
+
+    static uint64_t upper(size_t i) {
+        if (i < 16)
+            return i;
+        int e = static_cast<int>(i / 16) + 3;
+        uint64_t sub = i % 16;
+        return ((16 + sub + 1) << (e - 4)) - 1;
+    }
+
+    std::vector<uint64_t> _buckets;
+    uint64_t _count;
+};
+
+/**
+ * @brief The calls of an engine the workloads need, one overload set per engine.
+ * Updates assign the value in place, lfSkipList has no in-place update and deletes and inserts.
+ */
+template <typename List>
+struct Engine;
+
+template <>
+struct Engine<SkipList<Key, Value> > {
+    typedef SkipList<Key, Value> List;
+    static const char* name() { return "SkipList"; }
+    static bool concurrent() { return false; }
+    static bool scans() { return true; }
+    static bool read(List& l, Key k, Value&) { return l.search_element(k); }
+    static void insert(List& l, Key k, const Value& v) { l.insert_element(k, v); }
+    static void update(List& l, Key k, const Value& v) { l.insert_or_assign(k, v); }
+    static size_t scan(List& l, Key k, size_t n) { return l.range(k, std::numeric_limits<Key>::max(), n).size(); }
+};
+
+template <>
+struct Engine<tSkipList<Key, Value> > {
+    typedef tSkipList<Key, Value> List;
+    static const char* name() { return "tSkipList"; }
+    static bool concurrent() { return true; }
+    static bool scans() { return true; }
+    static bool read(List& l, Key k, Value& v) { return l.search_element(k, v); }
+    static void insert(List& l, Key k, const Value& v) { l.insert_element(k, v); }
+    static void update(List& l, Key k, const Value& v) { l.insert_or_assign(k, v); }
+    static size_t scan(List& l, Key k, size_t n) { return l.range(k, std::numeric_limits<Key>::max(), n).size(); }
+};
+
+template <>
+struct Engine<lfSkipList<Key, Value> > {
+    typedef lfSkipList<Key, Value> List;
+    static const char* name() { return "lfSkipList"; }
+    static bool concurrent() { return true; }
+    static bool scans() { return false; }
+    static bool read(List& l, Key k, Value& v) { return l.search_element(k, v); }
+    static void insert(List& l, Key k, const Value& v) { l.insert_element(k, v); }
+    static void update(List& l, Key k, const Value& v) { l.delete_element(k); l.insert_element(k, v); }
+    static size_t scan(List&, Key, size_t) { return 0; }
+};
+
+template <>
+struct Engine<FatSkipList<Key, Value> > {
+    typedef FatSkipList<Key, Value> List;
+    static const char* name() { return "FatSkipList"; }
+    static bool concurrent() { return false; }
+    static bool scans() { return true; }
+    static bool read(List& l, Key k, Value& v) { return l.search_element(k, v); }
+    static void insert(List& l, Key k, const Value& v) { l.insert_element(k, v); }
+    static void update(List& l, Key k, const Value& v) { l.insert_or_assign(k, v); }
+    static size_t scan(List& l, Key k, size_t n) { return l.range(k, std::numeric_limits<Key>::max(), n).size(); }
+};
+
+/**
+ * @struct Options
+ * @brief The command line, every list option is a comma separated list.
+ */
+struct Options {
+    std::vector<std::string> engines;
+    std::vector<std::string> workloads;
+    std::vector<std::string> dists;
+    std::vector<int> threads;
+    std::vector<int> values;
+    uint64_t records;
+    uint64_t ops;
+    unsigned branching;
+
+    Options() : engines({"skiplist", "tskiplist", "lfskiplist", "fatskiplist"}),
+                workloads({"load", "A", "B", "C", "F", "D", "E"}),
+                dists({"uniform", "zipfian", "sequential"}),
+                values({100}), records(100000), ops(100000), branching(4) {
+        int hw = static_cast<int>(std::thread::hardware_concurrency());
+        threads.push_back(1);
+        if (hw > 1)
+            threads.push_back(hw);
+    }
+};
+
+/**
+ * @struct Result
+ * @brief Throughput and latency of one run.
+ */
+struct Result {
+    double ops_per_sec;
+    Histogram latency;
+};
 
-        pthread_t threads[NUM_THREADS];
-        int rc;
-        int i;
+/**
+ * @brief To run body(thread, rnd, histogram) on threads threads started together.
+ */
+template <typename Body>
+Result run_threads(int threads, uint64_t total_ops, Body body) {
+    std::vector<Histogram> histograms(threads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            Random rnd(t + 1);
+            ready++;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            body(t, rnd, histograms[t]);
+        });
+    }
+    while (ready.load() != threads)
+        std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& w : workers)
+        w.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-        auto start = std::chrono::high_resolution_clock::now();
+    Result result;
+    result.ops_per_sec = total_ops / seconds;
+    for (auto& h : histograms)
+        result.latency.merge(h);
+    return result;
+}
 
-        for( i = 0; i < NUM_THREADS; i++ ) {
-            std::cout << "main() : creating thread, " << i << std::endl;
-            rc = pthread_create(&threads[i], NULL, insertElement, (void *)i);
+/**
+ * @brief To time one call into h.
+ */
+template <typename Fn>
+inline void timed(Histogram& h, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    h.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
 
-            if (rc) {
-                std::cout << "Error:unable to create thread," << rc << std::endl;
-                exit(-1);
+/**
+ * @brief To insert the records 0..records-1 from threads threads.
+ */
+template <typename List>
+Result load(List& list, const Options& opt, int threads, const Value& value) {
+    typedef Engine<List> E;
+    return run_threads(threads, opt.records, [&](int t, Random&, Histogram& h) {
+        for (uint64_t id = t; id < opt.records; id += threads)
+            timed(h, [&] { E::insert(list, record_key(id), value); });
+    });
+}
+
+/**
+ * @brief To run one YCSB workload. Inserts of D and E add new records after the loaded ones.
+ */
+template <typename List>
+Result run_workload(List& list, const Options& opt, char workload, Distribution dist,
+                    int threads, const Value& value, std::atomic<uint64_t>& inserted) {
+    typedef Engine<List> E;
+    uint64_t per_thread = opt.ops / threads;
+    double zetan = dist == kZipfian ? zeta(opt.records, ZIPFIAN_THETA) : 1.0;
+    return run_threads(threads, per_thread * threads, [&](int t, Random& rnd, Histogram& h) {
+        KeyChooser chooser(dist, opt.records, opt.records / threads * t, zetan);
+        Value out;
+        for (uint64_t i = 0; i < per_thread; ++i) {
+            uint64_t dice = rnd.next() % 100;
+            uint64_t id = chooser.next(rnd);
+            switch (workload) {
+            case 'A':
+            case 'B': {
+                int reads = workload == 'A' ? 50 : 95;
+                if (dice < static_cast<uint64_t>(reads))
+                    timed(h, [&] { E::read(list, record_key(id), out); });
+                else
+                    timed(h, [&] { E::update(list, record_key(id), value); });
+                break;
+            }
+            case 'C':
+                timed(h, [&] { E::read(list, record_key(id), out); });
+                break;
+            case 'D':
+                if (dice < 95) {
+                    // the latest records are the popular ones
+                    uint64_t last = inserted.load(std::memory_order_relaxed);
+                    uint64_t latest = last - 1 - (id % last);
+                    timed(h, [&] { E::read(list, record_key(latest), out); });
+                } else {
+                    uint64_t fresh = inserted.fetch_add(1);
+                    timed(h, [&] { E::insert(list, record_key(fresh), value); });
+                }
+                break;
+            case 'E':
+                if (dice < 95) {
+                    size_t length = 1 + rnd.next() % SCAN_LENGTH;
+                    timed(h, [&] { E::scan(list, record_key(id), length); });
+                } else {
+                    uint64_t fresh = inserted.fetch_add(1);
+                    timed(h, [&] { E::insert(list, record_key(fresh), value); });
+                }
+                break;
+            case 'F':
+            default:
+                if (dice < 50) {
+                    timed(h, [&] { E::read(list, record_key(id), out); });
+                } else {
+                    timed(h, [&] {
+                        E::read(list, record_key(id), out);
+                        E::update(list, record_key(id), value);
+                    });
+                }
+                break;
             }
         }
+    });
+}
+
+static void report(const char* engine, const std::string& workload, const std::string& dist,
+                   int value_size, int threads, const Result& r, std::vector<double>& scores) {
+    std::ostringstream name;
+    name << engine << "/" << workload << "/" << dist << "/value:" << value_size << "/threads:" << threads;
+    fprintf(stdout, "%-48s %14.0f %10llu %10llu %10llu\n", name.str().c_str(), r.ops_per_sec,
+            static_cast<unsigned long long>(r.latency.percentile(0.50)),
+            static_cast<unsigned long long>(r.latency.percentile(0.99)),
+            static_cast<unsigned long long>(r.latency.percentile(0.999)));
+    fflush(stdout);
+    scores.push_back(r.ops_per_sec);
+}
+
+static Distribution parse_dist(const std::string& s) {
+    if (s == "zipfian")
+        return kZipfian;
+    if (s == "sequential")
+        return kSequential;
+    return kUniform;
+}
+
+/**
+ * @brief To benchmark the engine List with every configuration of opt.
+ */
+template <typename List>
+void bench(const Options& opt, std::vector<double>& scores) {
+    typedef Engine<List> E;
+    for (int value_size : opt.values) {
+        Value value(value_size, 'v');
+        for (int threads : opt.threads) {
+            if (threads > 1 && !E::concurrent())
+                continue;
+
+            // on the stack, the epoch slots of the lists are over-aligned for a C++14 new
+            List list(MAX_LEVEL);
+            list.set_level_distribution(opt.branching, opt.records);
+            Result loaded = load(list, opt, threads, value);
+            if (std::find(opt.workloads.begin(), opt.workloads.end(), "load") != opt.workloads.end())
+                report(E::name(), "load", "-", value_size, threads, loaded, scores);
 
-        void *ret;
-        for( i = 0; i < NUM_THREADS; i++ ) {
-            if (pthread_join(threads[i], &ret) !=0 )  {
-                perror("pthread_create() error"); 
-                exit(3);
+            std::atomic<uint64_t> inserted(opt.records);
+            for (const std::string& dist : opt.dists) {
+                for (const std::string& workload : opt.workloads) {
+                    if (workload == "load" || (workload == "E" && !E::scans()))
+                        continue;
+                    Result r = run_workload(list, opt, workload[0], parse_dist(dist), threads, value, inserted);
+                    report(E::name(), workload, dist, value_size, threads, r, scores);
+                }
             }
         }
-        auto finish = std::chrono::high_resolution_clock::now(); 
-        std::chrono::duration<double> elapsed = finish - start;
-        std::cout << "insert elapsed:" << elapsed.count() << std::endl;
-    }
-    // skipList.displayList();
-
-    // {
-    //     pthread_t threads[NUM_THREADS];
-    //     int rc;
-    //     int i;
-    //     auto start = std::chrono::high_resolution_clock::now();
-
-    //     for( i = 0; i < NUM_THREADS; i++ ) {
-    //         std::cout << "main() : creating thread, " << i << std::endl;
-    //         rc = pthread_create(&threads[i], NULL, getElement, (void *)i);
-
-    //         if (rc) {
-    //             std::cout << "Error:unable to create thread," << rc << std::endl;
-    //             exit(-1);
-    //         }
-    //     }
-
-    //     void *ret;
-    //     for( i = 0; i < NUM_THREADS; i++ ) {
-    //         if (pthread_join(threads[i], &ret) !=0 )  {
-    //             perror("pthread_create() error"); 
-    //             exit(3);
-    //         }
-    //     }
-
-    //     auto finish = std::chrono::high_resolution_clock::now(); 
-    //     std::chrono::duration<double> elapsed = finish - start;
-    //     std::cout << "get elapsed:" << elapsed.count() << std::endl;
-    // }
-
-	pthread_exit(NULL);
-    return 0;
+    }
+}
+
+template <typename T>
+static std::vector<T> parse_list(const std::string& s) {
+    std::vector<T> out;
+    std::istringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        std::istringstream conv(item);
+        T v;
+        if (conv >> v)
+            out.push_back(v);
+    }
+    return out;
+}
 
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string::size_type eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string val = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--engines")
+            opt.engines = parse_list<std::string>(val);
+        else if (name == "--workloads")
+            opt.workloads = parse_list<std::string>(val);
+        else if (name == "--dists")
+            opt.dists = parse_list<std::string>(val);
+        else if (name == "--threads")
+            opt.threads = parse_list<int>(val);
+        else if (name == "--values")
+            opt.values = parse_list<int>(val);
+        else if (name == "--records")
+            opt.records = strtoull(val.c_str(), nullptr, 10);
+        else if (name == "--ops")
+            opt.ops = strtoull(val.c_str(), nullptr, 10);
+        else if (name == "--branching")
+            opt.branching = static_cast<unsigned>(strtoul(val.c_str(), nullptr, 10));
+        else {
+            fprintf(stderr, "usage: %s [--engines=skiplist,tskiplist,lfskiplist,fatskiplist] [--workloads=load,A,B,C,D,E,F]\n"
+                            "       [--dists=uniform,zipfian,sequential] [--threads=1,4] [--values=100]\n"
+                            "       [--records=N] [--ops=N] [--branching=4]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (opt.records == 0 || opt.ops == 0) {
+        fprintf(stderr, "records and ops must be positive\n");
+        return 1;
+    }
+
+    fprintf(stdout, "%-48s %14s %10s %10s %10s\n", "Benchmark", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+    std::vector<double> scores;
+    for (const std::string& engine : opt.engines) {
+        if (engine == "skiplist")
+            bench<SkipList<Key, Value> >(opt, scores);
+        else if (engine == "tskiplist")
+            bench<tSkipList<Key, Value> >(opt, scores);
+        else if (engine == "lfskiplist")
+            bench<lfSkipList<Key, Value> >(opt, scores);
+        else if (engine == "fatskiplist")
+            bench<FatSkipList<Key, Value> >(opt, scores);
+    }
+
+    if (scores.empty())
+        return 1;
+    double log_sum = 0;
+    for (double s : scores)
+        log_sum += std::log(s);
+    fprintf(stdout, "score (geometric mean ops/s): %.0f\n", std::exp(log_sum / scores.size()));
+    return 0;
 }
@@ -1,9 +1,26 @@
 #include "skiplist/tskiplist.h"
+#include "skiplist/fatskiplist.h"
+#include "skiplist/lfskiplist.h"
+#include "skiplist/lsm.h"
+#include "skiplist/replication.h"
+#include "skiplist/resp.h"
+#include "skiplist/value.h"
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <vector>
 #include <thread>
 #include <random>
 #include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 constexpr int NUM_THREADS = 10;
 constexpr int INITIAL_INSERTS_PER_THREAD = 10;
@@ -17,6 +34,839 @@ enum class Operation {
     Search
 };
 
+// Behaviour tests, each one works in its own directory below a scratch directory
+static std::string scratch_root;
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char* what, int line) {
+    if (!ok) {
+        std::cerr << "test.cpp:" << line << ": check failed: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::string scratch_dir(const std::string& name) {
+    if (scratch_root.empty()) {
+        char tmpl[] = "/tmp/skiplist-test-XXXXXX";
+        if (mkdtemp(tmpl) != NULL)
+            scratch_root = tmpl;
+    }
+    std::string dir = scratch_root + "/" + name;
+    mkdir(dir.c_str(), 0755);
+    return dir;
+}
+
+static std::string test_key(int i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key%08d", i);
+    return buf;
+}
+
+static void append_bytes(const std::string& path, const std::string& bytes) {
+    FILE* f = fopen(path.c_str(), "ab");
+    if (f != NULL) {
+        fwrite(bytes.data(), 1, bytes.size(), f);
+        fclose(f);
+    }
+}
+
+static long file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? static_cast<long>(st.st_size) : -1;
+}
+
+static void flip_byte(const std::string& path, long offset) {
+    FILE* f = fopen(path.c_str(), "r+b");
+    if (f == NULL)
+        return;
+    fseek(f, offset, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, offset, SEEK_SET);
+    fputc(c ^ 0x5a, f);
+    fclose(f);
+}
+
+// A torn record at the end of the newest segment with records is cut off, also when empty
+// segments were opened after it; damage in an older segment fails the replay
+static void test_wal_torn_tail() {
+    std::string wal = scratch_dir("wal_torn_tail") + "/wal";
+    {
+        tSkipList<std::string, std::string> list(12);
+        CHECK(list.open_wal(wal, SyncPolicy::Always));
+        for (int i = 0; i < 100; ++i)
+            list.insert_element(test_key(i), "value");
+    }
+    append_bytes(wal + ".000001", "torn record");
+    append_bytes(wal + ".000002", "");
+    append_bytes(wal + ".000003", "");
+    {
+        tSkipList<std::string, std::string> list(12);
+        CHECK(list.open_wal(wal, SyncPolicy::Always));
+        CHECK(list.size() == 100);
+        list.insert_element(test_key(100), "value");
+    }
+    {
+        tSkipList<std::string, std::string> list(12);
+        CHECK(list.open_wal(wal, SyncPolicy::Always));
+        CHECK(list.size() == 101);
+    }
+    append_bytes(wal + ".000001", "torn record");
+    {
+        tSkipList<std::string, std::string> list(12);
+        CHECK(!list.open_wal(wal, SyncPolicy::Always));
+    }
+}
+
+// Writes of odd sizes through a few small buffers reach the file in order, with or without
+// io_uring, and a second file continues at its offset
+static void test_async_file() {
+    std::string path = scratch_dir("async_file") + "/data";
+    std::string data;
+    std::mt19937 gen(22);
+    for (int i = 0; i < 3 * 1024 * 1024; ++i)
+        data.push_back(static_cast<char>(gen()));
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    {
+        AsyncFile file(64 * 1024, 4);
+        file.attach(fd);
+        size_t half = data.size() / 2;
+        for (size_t pos = 0, n = 1; pos < half; pos += n, n = n * 7 % 100003 + 1)
+            CHECK(file.write(data.data() + pos, std::min(n, half - pos)));
+        CHECK(file.sync());
+        file.attach(fd, static_cast<off_t>(half));
+        CHECK(file.write(data.data() + half, data.size() - half));
+        CHECK(file.sync());
+    }
+    ::close(fd);
+
+    std::string read(data.size() + 1, '\0');
+    fd = ::open(path.c_str(), O_RDONLY);
+    ssize_t n = fd >= 0 ? ::read(fd, &read[0], read.size()) : -1;
+    ::close(fd);
+    CHECK(n == static_cast<ssize_t>(data.size()) && read.compare(0, data.size(), data) == 0);
+}
+
+static std::vector<std::pair<std::string, std::string> > contents(tSkipList<std::string, std::string>& list) {
+    return list.range(std::string(), std::string(1, '\x7f'));
+}
+
+static int delta_files(const std::string& dir) {
+    int count = 0;
+    DIR* d = opendir(dir.c_str());
+    while (struct dirent* entry = d != NULL ? readdir(d) : NULL) {
+        if (strstr(entry->d_name, ".delta") != NULL)
+            count++;
+    }
+    if (d != NULL)
+        closedir(d);
+    return count;
+}
+
+// Deltas on top of a base, and the base they are compacted into, load to the same contents
+// as a full snapshot of the list
+static void test_delta_checkpoint() {
+    std::string dir = scratch_dir("delta_checkpoint");
+    std::string path = dir + "/checkpoint";
+    tSkipList<std::string, std::string> list(12);
+    list.set_checkpoint_compaction(3, 1000);
+    for (int i = 0; i < 2000; ++i)
+        list.insert_element(test_key(i), "base");
+    CHECK(list.checkpoint(path));
+    CHECK(delta_files(dir) == 0);
+
+    for (int round = 0; round < 6; ++round) {
+        for (int i = round; i < 2000; i += 7)
+            list.insert_or_assign(test_key(i), "round" + std::to_string(round));
+        for (int i = round * 3; i < 2000; i += 11)
+            list.delete_element(test_key(i));
+        for (int i = 0; i < 50; ++i)
+            list.insert_element(test_key(2000 + round * 50 + i), "new");
+        list.put(test_key(5), std::string("expires"), 3600 * 1000);
+        CHECK(list.checkpoint(path));
+        // the fourth checkpoint finds three deltas and writes a new base
+        CHECK(delta_files(dir) == (round < 3 ? round + 1 : round - 3));
+
+        tSkipList<std::string, std::string> loaded(12);
+        CHECK(loaded.load_file(path));
+        CHECK(contents(loaded) == contents(list));
+    }
+
+    tSkipList<std::string, std::string> from_checkpoint(12);
+    CHECK(from_checkpoint.load_file(path));
+    CHECK(list.dump_file(dir + "/full"));
+    tSkipList<std::string, std::string> from_full(12);
+    CHECK(from_full.load_file(dir + "/full"));
+    CHECK(contents(from_checkpoint) == contents(from_full));
+    CHECK(from_checkpoint.size() == list.size());
+}
+
+typedef std::map<std::string, std::string> Model;
+
+static Model lsm_range(LsmStore<std::string, std::string>& db, const std::string& lo, const std::string& hi) {
+    Model found;
+    LsmStore<std::string, std::string>::Iterator it = db.new_iterator();
+    for (it.seek(lo); it.valid() && it.key() < hi; it.next())
+        found[it.key()] = it.value();
+    return found;
+}
+
+static void check_lsm(LsmStore<std::string, std::string>& db, const Model& model, int keys) {
+    for (int i = 0; i < keys; ++i) {
+        std::string value;
+        Model::const_iterator it = model.find(test_key(i));
+        bool found = db.search_element(test_key(i), value);
+        CHECK(found == (it != model.end()));
+        if (found && it != model.end())
+            CHECK(value == it->second);
+    }
+    // windows that start and end on keys from different runs and the memtable
+    for (int lo = 0; lo < keys; lo += 613) {
+        std::string from = test_key(lo);
+        std::string to = test_key(lo + 977);
+        CHECK(lsm_range(db, from, to) == Model(model.lower_bound(from), model.lower_bound(to)));
+    }
+    CHECK(lsm_range(db, std::string(), std::string(1, '\x7f')) == model);
+}
+
+// Reads merge the memtable and the runs: a newer version or tombstone hides the older ones
+// below it, also after a reopen of the runs alone
+static void test_lsm_boundaries() {
+    std::string dir = scratch_dir("lsm_boundaries");
+    const int keys = 3000;
+    Model model;
+    {
+        LsmStore<std::string, std::string> db(dir);
+        CHECK(db.open());
+        for (int i = 0; i < keys; i += 2) {
+            db.insert_or_assign(test_key(i), std::string("run0"));
+            model[test_key(i)] = "run0";
+        }
+        CHECK(db.flush());
+        for (int i = 0; i < keys; i += 3) {
+            db.insert_or_assign(test_key(i), std::string("run1"));
+            model[test_key(i)] = "run1";
+        }
+        for (int i = 0; i < keys; i += 5) {
+            CHECK(db.delete_element(test_key(i)) == (model.erase(test_key(i)) ? 0 : 1));
+        }
+        CHECK(db.flush());
+        CHECK(db.table_count() >= 1);
+        // the memtable on top: overwrites, tombstones over both runs, keys deleted and back
+        for (int i = 0; i < keys; i += 7) {
+            db.insert_or_assign(test_key(i), std::string("memtable"));
+            model[test_key(i)] = "memtable";
+        }
+        for (int i = 1; i < keys; i += 4) {
+            CHECK(db.delete_element(test_key(i)) == (model.erase(test_key(i)) ? 0 : 1));
+        }
+        for (int i = 0; i < keys; i += 10) {
+            CHECK(db.insert_element(test_key(i), "back") == (model.count(test_key(i)) ? 1 : 0));
+            model.insert(std::make_pair(test_key(i), std::string("back")));
+        }
+        check_lsm(db, model, keys);
+        CHECK(db.flush());
+    }
+    LsmStore<std::string, std::string> db(dir);
+    CHECK(db.open());
+    check_lsm(db, model, keys);
+}
+
+static std::vector<std::string> run_files(const std::string& dir) {
+    std::vector<std::string> runs;
+    DIR* d = opendir(dir.c_str());
+    while (struct dirent* entry = d != NULL ? readdir(d) : NULL) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".sst") == 0)
+            runs.push_back(dir + "/" + name);
+    }
+    if (d != NULL)
+        closedir(d);
+    std::sort(runs.begin(), runs.end());
+    return runs;
+}
+
+// A merge that meets a damaged block of a source keeps the sources, only that block is lost
+static void test_lsm_damaged_merge() {
+    std::string dir = scratch_dir("lsm_damaged_merge");
+    const int keys = 4000;
+    {
+        LsmStore<std::string, std::string> db(dir);
+        CHECK(db.open());
+        for (int i = 0; i < keys; ++i)
+            db.insert_or_assign(test_key(i), std::string(40, 'a'));
+        CHECK(db.flush());
+    }
+    std::vector<std::string> runs = run_files(dir);
+    CHECK(runs.size() == 1);
+    if (runs.size() != 1)
+        return;
+    flip_byte(runs[0], file_size(runs[0]) / 3);
+
+    LsmStore<std::string, std::string> db(dir);
+    db.set_tier_runs(2);
+    CHECK(db.open());
+    for (int i = 0; i < keys; i += 2)
+        db.insert_or_assign(test_key(keys + i), std::string(40, 'b'));
+    CHECK(db.flush());
+    // give the merge of the two runs time to fail
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CHECK(db.table_count() == 2);
+    CHECK(file_size(runs[0]) > 0);
+    int found = 0;
+    for (int i = 0; i < keys; ++i) {
+        std::string value;
+        found += db.search_element(test_key(i), value) ? 1 : 0;
+    }
+    CHECK(found > keys - 200 && found < keys);
+}
+
+// A filter never misses a key it was built with and passes about 1% of the others at 10 bits
+// per key; an LsmStore with filters answers like one without
+static void test_bloom_filters() {
+    const int keys = 20000;
+    std::vector<uint64_t> hashes;
+    AtomicBloomFilter memtable_filter(keys, 10);
+    for (int i = 0; i < keys; ++i) {
+        std::string key = test_key(i);
+        hashes.push_back(hash_bytes(key.data(), key.size()));
+        memtable_filter.add(hashes.back());
+    }
+    std::string bytes;
+    build_bloom_filter(hashes, 10, bytes);
+    BloomFilter run_filter;
+    CHECK(run_filter.init(bytes.data(), bytes.size()));
+    CHECK(!BloomFilter().init(bytes.data(), bytes.size() - 1));
+
+    int run_misses = 0;
+    int memtable_misses = 0;
+    int run_passes = 0;
+    int memtable_passes = 0;
+    for (int i = 0; i < keys; ++i) {
+        run_misses += run_filter.may_contain(hashes[i]) ? 0 : 1;
+        memtable_misses += memtable_filter.may_contain(hashes[i]) ? 0 : 1;
+        std::string absent = test_key(keys + i);
+        uint64_t hash = hash_bytes(absent.data(), absent.size());
+        run_passes += run_filter.may_contain(hash) ? 1 : 0;
+        memtable_passes += memtable_filter.may_contain(hash) ? 1 : 0;
+    }
+    CHECK(run_misses == 0 && memtable_misses == 0);
+    CHECK(run_passes < keys * 3 / 100 && memtable_passes < keys * 3 / 100);
+
+    std::string dir = scratch_dir("bloom_filters");
+    LsmStore<std::string, std::string> filtered(dir + "/filtered");
+    LsmStore<std::string, std::string> plain(dir + "/plain");
+    plain.set_bloom_bits(0);
+    CHECK(filtered.open() && plain.open());
+    for (int run = 0; run < 3; ++run) {
+        for (int i = run; i < 3000; i += 3) {
+            filtered.insert_or_assign(test_key(i * 2), std::to_string(run));
+            plain.insert_or_assign(test_key(i * 2), std::to_string(run));
+        }
+        CHECK(filtered.flush() && plain.flush());
+    }
+    for (int i = 0; i < 6000; ++i) {
+        std::string a;
+        std::string b;
+        bool found = filtered.search_element(test_key(i), a);
+        CHECK(found == (i % 2 == 0));
+        CHECK(found == plain.search_element(test_key(i), b) && a == b);
+    }
+}
+
+static std::string mixed_value(int i) {
+    // the first keys get random bytes, whole blocks of them do not compress
+    std::string value;
+    if (i < 1000) {
+        std::mt19937 gen(i);
+        for (int j = 0; j < 3000; ++j)
+            value.push_back(static_cast<char>(gen()));
+    } else {
+        for (int j = 0; j < 40; ++j)
+            value += "{\"id\":" + std::to_string(i) + ",\"tags\":[\"alpha\",\"beta\"]}";
+    }
+    return value;
+}
+
+// LZ4 snapshots and logs with blocks that shrink and blocks stored as they are load back to
+// the same contents, a flipped byte fails the crc of its block
+static void test_lz4_roundtrip() {
+    std::string dir = scratch_dir("lz4_roundtrip");
+    const int keys = 2000;
+    tSkipList<std::string, std::string> list(12);
+    list.set_compression(Compression::Lz4);
+    list.set_snapshot_threads(1);
+    for (int i = 0; i < keys; ++i)
+        list.insert_element(test_key(i), mixed_value(i));
+    std::string snapshot = dir + "/snapshot";
+    CHECK(list.dump_file(snapshot));
+    for (int use_mmap = 0; use_mmap < 2; ++use_mmap) {
+        tSkipList<std::string, std::string> loaded(12);
+        CHECK(loaded.load_file(snapshot, use_mmap != 0));
+        CHECK(contents(loaded) == contents(list));
+    }
+    flip_byte(snapshot, file_size(snapshot) / 2);
+    {
+        tSkipList<std::string, std::string> loaded(12);
+        CHECK(!loaded.load_file(snapshot));
+    }
+
+    std::string wal = dir + "/wal";
+    {
+        tSkipList<std::string, std::string> logged(12);
+        logged.set_compression(Compression::Lz4);
+        CHECK(logged.open_wal(wal, SyncPolicy::Always));
+        long raw = 0;
+        for (int i = 0; i < keys; ++i) {
+            logged.insert_element(test_key(i), mixed_value(i));
+            raw += static_cast<long>(mixed_value(i).size());
+        }
+        // the records of the later keys shrink, an uncompressed log is larger than its values
+        CHECK(file_size(wal + ".000001") < raw);
+    }
+    {
+        tSkipList<std::string, std::string> replayed(12);
+        CHECK(replayed.open_wal(wal, SyncPolicy::Always));
+        CHECK(contents(replayed) == contents(list));
+    }
+    // damage in the newest segment cuts the log there, what stays is the prefix before it
+    flip_byte(wal + ".000001", file_size(wal + ".000001") / 2);
+    {
+        tSkipList<std::string, std::string> replayed(12);
+        CHECK(replayed.open_wal(wal, SyncPolicy::Always));
+        int size = replayed.size();
+        CHECK(size > 0 && size < keys);
+        for (int i = 0; i < keys; ++i) {
+            std::string value;
+            bool found = replayed.search_element(test_key(i), value);
+            CHECK(found == (i < size));
+            if (found)
+                CHECK(value == mixed_value(i));
+        }
+    }
+}
+
+typedef tSkipList<std::string, std::string> StringList;
+
+static bool caught_up(StringList& primary, Replica<StringList>& replica) {
+    for (int i = 0; i < 1000; ++i) {
+        if (replica.connected() && replica.applied_lsn() == primary.log_lsn())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// A new replica bootstraps from a snapshot, one that reconnects sends the lsn it stopped at
+// and gets only the batches after it from the backlog
+static void test_replica_catch_up() {
+    std::string dir = scratch_dir("replica_catch_up");
+    StringList primary(12);
+    CHECK(primary.open_wal(dir + "/wal", SyncPolicy::Never));
+    for (int i = 0; i < 500; ++i)
+        primary.insert_element(test_key(i), "before");
+
+    // a port of its own for every run of the test
+    std::unique_ptr<ReplicationServer<StringList> > server;
+    int port = 0;
+    for (int attempt = 0; attempt < 20 && !server; ++attempt) {
+        port = 20000 + static_cast<int>((getpid() * 7 + attempt * 131) % 20000);
+        server.reset(new ReplicationServer<StringList>(primary, port, "127.0.0.1", 1024 * 1024, dir + "/export"));
+        if (!server->start())
+            server.reset();
+    }
+    CHECK(server != nullptr);
+    if (!server)
+        return;
+
+    StringList copy(12);
+    copy.insert_element("stale", "dropped by the bootstrap");
+    Replica<StringList> replica(copy, "127.0.0.1", port, dir + "/received");
+    replica.start();
+    for (int i = 500; i < 800; ++i)
+        primary.insert_element(test_key(i), "streamed");
+    CHECK(caught_up(primary, replica));
+    CHECK(replica.full_syncs() == 1);
+    CHECK(contents(copy) == contents(primary));
+
+    replica.stop();
+    uint64_t stopped_at = replica.applied_lsn();
+    for (int i = 0; i < 800; i += 3)
+        primary.delete_element(test_key(i));
+    for (int i = 0; i < 800; i += 5)
+        primary.insert_or_assign(test_key(i), std::string("while away"));
+    CHECK(primary.log_lsn() > stopped_at);
+    replica.start();
+    CHECK(caught_up(primary, replica));
+    CHECK(replica.full_syncs() == 1);
+    CHECK(contents(copy) == contents(primary));
+    replica.stop();
+    server->stop();
+}
+
+// A snapshot sees every write batch whole or not at all, and reads the same each time while
+// batches go on
+static void test_snapshot_isolation() {
+    const int keys = 64;
+    StringList list(12);
+    for (int i = 0; i < keys; ++i)
+        list.insert_element(test_key(i), "0");
+
+    // batch g puts g to every key, and "extra" exists while g is odd
+    std::atomic<bool> stop(false);
+    std::thread writer([&list, &stop, keys] {
+        for (int g = 1; !stop.load(); ++g) {
+            StringList::WriteBatch batch;
+            for (int i = keys - 1; i >= 0; --i)
+                batch.put(test_key(i), std::to_string(g));
+            if (g % 2 == 1)
+                batch.put("extra", std::to_string(g));
+            else
+                batch.remove("extra");
+            list.write(batch);
+        }
+    });
+
+    for (int round = 0; round < 300; ++round) {
+        StringList::Snapshot snapshot = list.snapshot();
+        std::string generation;
+        CHECK(list.search_element(test_key(0), generation, snapshot));
+        bool odd = std::stoi(generation) % 2 == 1;
+        for (int look = 0; look < 2; ++look) {
+            for (int i = 0; i < keys; ++i) {
+                std::string value;
+                CHECK(list.search_element(test_key(i), value, snapshot) && value == generation);
+            }
+            std::string extra;
+            CHECK(list.search_element("extra", extra, snapshot) == odd);
+            if (odd)
+                CHECK(extra == generation);
+            std::vector<std::pair<std::string, std::string> > all = list.range(std::string(), std::string(1, '\x7f'), 0, snapshot);
+            CHECK(static_cast<int>(all.size()) == keys + (odd ? 1 : 0));
+            int seen = 0;
+            StringList::Iterator it = list.new_iterator(snapshot);
+            for (it.seek_to_first(); it.valid(); it.next())
+                seen += it.value() == generation ? 1 : 0;
+            CHECK(seen == keys + (odd ? 1 : 0));
+        }
+    }
+    stop.store(true);
+    writer.join();
+}
+
+// Threads insert, delete and search their own keys against a model of their own, and race
+// on a few shared keys whose presence must match the inserts and deletes that won; readers
+// on the shared keys run into nodes the deleters retire while they are still on them
+static void test_lockfree_list() {
+    const int threads = 4;
+    const int owned = 2000;
+    const int shared = 32;
+    lfSkipList<int, int> list(12);
+
+    std::atomic<int> shared_net[shared];
+    for (int k = 0; k < shared; ++k)
+        shared_net[k].store(0);
+    std::atomic<int> mismatches(0);
+    std::atomic<int> owned_total(0);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(t + 1);
+            std::map<int, int> model;
+            for (int n = 0; n < 20000; ++n) {
+                int op = rng() % 3;
+                if (n % 2 == 0) {
+                    int key = shared + (rng() % owned) * threads + t;
+                    int value = n;
+                    int found;
+                    if (op == 0) {
+                        bool fresh = model.find(key) == model.end();
+                        if ((list.insert_element(key, value) == 0) != fresh)
+                            mismatches++;
+                        if (fresh)
+                            model[key] = value;
+                    } else if (op == 1) {
+                        bool present = model.erase(key) == 1;
+                        if ((list.delete_element(key) == 0) != present)
+                            mismatches++;
+                    } else {
+                        std::map<int, int>::iterator it = model.find(key);
+                        bool present = list.search_element(key, found);
+                        if (present != (it != model.end()) || (present && found != it->second))
+                            mismatches++;
+                    }
+                } else {
+                    int key = rng() % shared;
+                    int found;
+                    if (op == 0) {
+                        if (list.insert_element(key, key * 100 + t) == 0)
+                            shared_net[key]++;
+                    } else if (op == 1) {
+                        if (list.delete_element(key) == 0)
+                            shared_net[key]--;
+                    } else if (list.search_element(key, found) && found / 100 != key) {
+                        mismatches++;
+                    }
+                }
+            }
+            // the model is checked again once every thread is done with its keys
+            owned_total += static_cast<int>(model.size());
+            for (std::map<int, int>::iterator it = model.begin(); it != model.end(); ++it) {
+                int found;
+                if (!list.search_element(it->first, found) || found != it->second)
+                    mismatches++;
+            }
+        });
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    CHECK(mismatches.load() == 0);
+    int shared_total = 0;
+    for (int k = 0; k < shared; ++k) {
+        int net = shared_net[k].load();
+        int found;
+        CHECK(net == 0 || net == 1);
+        CHECK(list.search_element(k, found) == (net == 1));
+        shared_total += net;
+    }
+    CHECK(list.size() == owned_total.load() + shared_total);
+}
+
+// FatSkipList matches a std::map through inserts, deletes, searches, seeks and a walk in
+// key order, with enough keys to split the nodes many times
+template <typename K>
+static void check_fat_list() {
+    FatSkipList<K, int> list(12);
+    std::map<K, int> model;
+    std::mt19937 rng(7);
+    for (int n = 0; n < 20000; ++n) {
+        K key = static_cast<K>(static_cast<int>(rng() % 4000) - 2000);
+        int op = rng() % 4;
+        if (op == 0 || op == 1) {
+            bool fresh = model.insert(std::make_pair(key, n)).second;
+            CHECK((list.insert_element(key, n) == 0) == fresh);
+        } else if (op == 2) {
+            bool present = model.erase(key) == 1;
+            CHECK((list.delete_element(key) == 0) == present);
+        } else {
+            int value = 0;
+            typename std::map<K, int>::iterator it = model.find(key);
+            bool found = list.search_element(key, value);
+            CHECK(found == (it != model.end()));
+            if (found && it != model.end())
+                CHECK(value == it->second);
+        }
+    }
+
+    CHECK(list.size() == static_cast<int>(model.size()));
+    typename FatSkipList<K, int>::Iterator it = list.new_iterator();
+    typename std::map<K, int>::iterator expected = model.begin();
+    for (it.seek_to_first(); it.valid() && expected != model.end(); it.next(), ++expected)
+        CHECK(it.key() == expected->first && it.value() == expected->second);
+    CHECK(!it.valid() && expected == model.end());
+    for (int probe = -2002; probe <= 2002; probe += 7) {
+        K key = static_cast<K>(probe);
+        it.seek(key);
+        typename std::map<K, int>::iterator bound = model.lower_bound(key);
+        CHECK(it.valid() == (bound != model.end()));
+        if (it.valid() && bound != model.end())
+            CHECK(it.key() == bound->first);
+    }
+    std::vector<std::pair<K, int> > part = list.range(static_cast<K>(-500), static_cast<K>(500));
+    std::vector<std::pair<K, int> > wanted(model.lower_bound(static_cast<K>(-500)), model.lower_bound(static_cast<K>(500)));
+    CHECK(part == wanted);
+}
+
+// KeySearch matches std::lower_bound for every length up to a full node, so each vector
+// width meets a partial tail, with keys between, on and around the sorted keys
+template <typename K>
+static void check_key_search() {
+    const int capacity = FatNode<K, int>::kCapacity;
+    std::vector<K> keys;
+    for (int count = 0; count <= capacity; ++count) {
+        keys.clear();
+        for (int i = 0; i < count; ++i)
+            keys.push_back(static_cast<K>(2 * i - count));
+        for (int probe = -count - 2; probe <= count + 2; ++probe) {
+            K key = static_cast<K>(probe);
+            int expected = static_cast<int>(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+            CHECK(KeySearch<K>::lower_bound(keys.data(), count, key) == expected);
+        }
+    }
+    check_fat_list<K>();
+}
+
+// every key type with a vector routine, see keysearch.h; build with -march=native for AVX2
+static void test_fat_skip_list() {
+    check_key_search<int32_t>();
+    check_key_search<int64_t>();
+    check_key_search<long long>();
+    check_key_search<float>();
+    check_key_search<double>();
+}
+
+// CompactValue keeps N bytes inline and N + 1 in a shared block, copies share the block and
+// outlive the original, assign may take the bytes of the value itself, and a list of them
+// comes back the same from a snapshot
+static void test_compact_value() {
+    typedef CompactValue<> Value;
+    const size_t n = Value::kInlineBytes;
+    std::string fits(n, 'a');
+    std::string spills(n + 1, 'b');
+    Value small(fits);
+    Value large(spills);
+    CHECK(!small.separated() && small.heap_bytes() == 0 && small.to_string() == fits);
+    CHECK(large.separated() && large.heap_bytes() > n + 1 && large.to_string() == spills);
+    CHECK(Value(n + 1, 'b') == large && Value(n, 'a') == small);
+
+    Value moved;
+    {
+        Value original(spills);
+        Value copy(original);
+        CHECK(copy.data() == original.data());
+        Value assigned;
+        assigned = original;
+        CHECK(assigned.data() == original.data());
+        const char* bytes = original.data();
+        moved = std::move(original);
+        CHECK(moved.data() == bytes && original.empty() && !original.separated());
+        Value built(std::move(copy));
+        CHECK(built.data() == bytes && copy.empty());
+    }
+    CHECK(moved.to_string() == spills);
+
+    Value self(spills);
+    Value sharer(self);
+    self.assign(self.data() + 1, self.size() - 1);
+    CHECK(!self.separated() && self.to_string() == spills.substr(1));
+    CHECK(sharer.to_string() == spills);
+    self.assign(self.data() + 2, self.size() - 2);
+    CHECK(self.to_string() == spills.substr(3));
+    std::string longer = spills + spills;
+    Value grown(longer);
+    grown.assign(grown.data() + n, grown.size() - n);
+    CHECK(grown.separated() && grown.to_string() == longer.substr(n));
+
+    std::string dir = scratch_dir("compact_value");
+    tSkipList<std::string, Value> list(12);
+    for (int i = 0; i < 1000; ++i)
+        list.insert_element(test_key(i), Value(static_cast<size_t>(i % 40), static_cast<char>('a' + i % 26)));
+    CHECK(list.dump_file(dir + "/snapshot"));
+    tSkipList<std::string, Value> loaded(12);
+    CHECK(loaded.load_file(dir + "/snapshot"));
+    CHECK(loaded.size() == 1000);
+    for (int i = 0; i < 1000; ++i) {
+        Value value;
+        CHECK(loaded.search_element(test_key(i), value));
+        CHECK(value == Value(static_cast<size_t>(i % 40), static_cast<char>('a' + i % 26)));
+    }
+}
+
+// A batch the log fails to make durable is undone: puts, deletes and new keys are back to
+// what they were, for reads with and without a snapshot
+static void test_batch_rollback() {
+    std::string dir = scratch_dir("batch_rollback");
+    StringList list(12);
+    CHECK(list.open_wal(dir + "/wal", SyncPolicy::Always));
+    for (int i = 0; i < 50; ++i)
+        list.insert_element(test_key(i), "before");
+    StringList::Snapshot snapshot = list.snapshot();
+    int size = list.size();
+
+    // a write past the file size limit fails with EFBIG instead of a signal
+    struct rlimit old_limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = 1 << 16;
+    void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    StringList::WriteBatch batch;
+    batch.put(test_key(1), std::string(200000, 'x'));
+    batch.remove(test_key(2));
+    batch.put("new", "never");
+    bool written = list.write(batch);
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+
+    CHECK(!written);
+    std::string value;
+    CHECK(list.search_element(test_key(1), value) && value == "before");
+    CHECK(list.search_element(test_key(2), value) && value == "before");
+    CHECK(!list.search_element("new", value));
+    CHECK(list.search_element(test_key(1), value, snapshot) && value == "before");
+    CHECK(list.size() == size);
+    list.insert_or_assign(test_key(1), std::string("after"));
+    CHECK(list.search_element(test_key(1), value) && value == "after");
+    CHECK(list.search_element(test_key(1), value, snapshot) && value == "before");
+}
+
+static std::vector<std::string> arguments(const std::vector<Slice>& args) {
+    std::vector<std::string> strings;
+    for (const Slice& arg : args)
+        strings.push_back(arg.to_string());
+    return strings;
+}
+
+// Empty arrays and blank lines are skipped however many arrive, and a request split over many
+// reads is parsed once its last byte is in
+static void test_resp_parser() {
+    std::vector<Slice> args;
+    {
+        RespParser parser;
+        std::string input = "*0\r\n*-1\r\n\r\n\n   \r\n\t\nPING\r\n*0\r\n";
+        parser.feed(input.data(), input.size());
+        CHECK(parser.next(args) == RespParser::kRequest);
+        CHECK(arguments(args) == std::vector<std::string>(1, "PING"));
+        CHECK(parser.next(args) == RespParser::kIncomplete);
+    }
+    {
+        // more empty requests than a stack holds frames
+        RespParser parser;
+        std::string blank(4 * 1024 * 1024, '\n');
+        parser.feed(blank.data(), blank.size());
+        std::string empty;
+        for (int i = 0; i < 100000; ++i)
+            empty += "*0\r\n";
+        parser.feed(empty.data(), empty.size());
+        CHECK(parser.next(args) == RespParser::kIncomplete);
+        parser.consume();
+        CHECK(parser.buffered() == 0);
+    }
+    {
+        RespParser parser;
+        std::string input = "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$5\r\nva\r\nl\r\nGET key\r\n";
+        size_t request_end = input.find("GET");
+        for (size_t i = 0; i < input.size(); ++i) {
+            parser.feed(input.data() + i, 1);
+            RespParser::Result result = parser.next(args);
+            if (i + 1 == request_end) {
+                CHECK(result == RespParser::kRequest);
+                std::vector<std::string> expected = {"SET", "key", "va\r\nl"};
+                CHECK(arguments(args) == expected);
+                parser.consume();
+            } else if (i + 1 == input.size()) {
+                CHECK(result == RespParser::kRequest);
+                std::vector<std::string> expected = {"GET", "key"};
+                CHECK(arguments(args) == expected);
+            } else {
+                CHECK(result == RespParser::kIncomplete);
+            }
+        }
+        CHECK(parser.next(args) == RespParser::kIncomplete);
+    }
+    {
+        RespParser parser;
+        std::string input = "*1\r\n+PING\r\n";
+        parser.feed(input.data(), input.size());
+        CHECK(parser.next(args) == RespParser::kError);
+    }
+}
+
 // Function to perform initial insertions to populate the skip list
 template<typename K, typename V>
 void initial_insertions(tSkipList<K, V>& skip_list, int thread_id) {
@@ -97,5 +947,23 @@ int main() {
         t.join();
     }
 
-    return 0;
+    test_wal_torn_tail();
+    test_async_file();
+    test_delta_checkpoint();
+    test_lsm_boundaries();
+    test_lsm_damaged_merge();
+    test_bloom_filters();
+    test_lz4_roundtrip();
+    test_replica_catch_up();
+    test_snapshot_isolation();
+    test_lockfree_list();
+    test_fat_skip_list();
+    test_compact_value();
+    test_resp_parser();
+    test_batch_rollback();
+
+    if (!scratch_root.empty())
+        (void)system(("rm -rf " + scratch_root).c_str());
+    std::cout << (failures == 0 ? "behaviour tests passed" : "behaviour tests failed") << std::endl;
+    return failures == 0 ? 0 : 1;
 }